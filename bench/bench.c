@@ -0,0 +1,411 @@
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bencode.h"
+#include "metadata.h"
+#include "peer.h"
+#include "picker.h"
+#include "types.h"
+#include "utils/url.h"
+
+/*
+ * microbenchmarks for the parse, hash and wire hot paths. every benchmark runs until it
+ * took at least BENCH_TIME_TARGET_NS and prints one json object per line:
+ * {"benchmark":..,"iterations":..,"ns_per_op":..,"allocs_per_op":..,"bytes_per_op":..}
+ * plus "mb_per_s" for benchmarks that process a known amount of data
+ */
+
+#define BENCH_TIME_TARGET_NS 200000000ULL
+#define BENCH_ITERATIONS_MAX 100000000ULL
+
+#define BENCH_SMALL_FILES 1
+#define BENCH_SMALL_PIECES 64
+#define BENCH_HUGE_FILES 2000
+#define BENCH_HUGE_PIECES 40000
+#define BENCH_PIECE_LENGTH (256 * 1024)
+#define BENCH_BITFIELD_PIECES 20000
+
+typedef struct BenchTorrent {
+    u8* data;
+    usize length;
+    char path[64];
+} BenchTorrent;
+
+void* __real_malloc(usize size);
+void* __real_calloc(usize count, usize size);
+void* __real_realloc(void* pointer, usize size);
+void __real_free(void* pointer);
+
+static bool bench_counting = false;
+static u64 bench_allocations = 0;
+static u64 bench_allocated_bytes = 0;
+
+// results are written here so the compiler can't drop the work
+static volatile u64 bench_sink = 0;
+
+static BenchTorrent bench_torrent_small;
+static BenchTorrent bench_torrent_huge;
+static u8* bench_piece;
+static TorrentPicker* bench_picker;
+static u8* bench_bitfield;
+static usize bench_bitfield_length;
+static TorrentPeer* bench_peer;
+static i32 bench_peer_remote;
+
+static u64 bench_now_ns();
+static void bench_run(const char* name, const char* filter, void (*function)(u64 iterations), usize bytes_per_op);
+static bool bench_torrent_create(BenchTorrent* torrent, u32 files_length, u32 pieces_length);
+static usize bench_append(u8** buffer, usize* capacity, usize length, const void* data, usize data_length);
+static TorrentPeer* bench_peer_create(i32* remote);
+static void bench_peer_drain();
+
+static void bench_bencode_parse_small(u64 iterations);
+static void bench_bencode_parse_huge(u64 iterations);
+static void bench_metadata_create_small(u64 iterations);
+static void bench_metadata_create_huge(u64 iterations);
+static void bench_url_encode(u64 iterations);
+static void bench_sha1_piece(u64 iterations);
+static void bench_bitfield_is_interesting(u64 iterations);
+static void bench_bitfield_availability(u64 iterations);
+static void bench_bitfield_has_piece(u64 iterations);
+static void bench_peer_message_next(u64 iterations);
+static void bench_peer_send_request(u64 iterations);
+static void bench_peer_send_piece(u64 iterations);
+
+int main(int argc, char** argv) {
+    const char* filter = (argc > 1) ? argv[1] : NULL;
+
+    // fixed seed so every build benchmarks the same data
+    srand(1);
+
+    if (!bench_torrent_create(&bench_torrent_small, BENCH_SMALL_FILES, BENCH_SMALL_PIECES)
+        || !bench_torrent_create(&bench_torrent_huge, BENCH_HUGE_FILES, BENCH_HUGE_PIECES)) {
+        fprintf(stderr, "[ERROR] [BENCH] Failed to create synthetic torrents!\n");
+        return -1;
+    }
+
+    bench_piece = (u8*) malloc(sizeof(u8) * BENCH_PIECE_LENGTH);
+    bench_picker = torrent_picker_create(BENCH_BITFIELD_PIECES, BENCH_PIECE_LENGTH, (u64) BENCH_BITFIELD_PIECES * BENCH_PIECE_LENGTH);
+    bench_bitfield_length = (BENCH_BITFIELD_PIECES + 7) / 8;
+    bench_bitfield = (u8*) malloc(sizeof(u8) * bench_bitfield_length);
+    bench_peer = bench_peer_create(&bench_peer_remote);
+    if (!bench_piece || !bench_picker || !bench_bitfield || !bench_peer) {
+        fprintf(stderr, "[ERROR] [BENCH] Failed to set up benchmarks!\n");
+        return -1;
+    }
+
+    for (usize i = 0; i < BENCH_PIECE_LENGTH; i++) {
+        bench_piece[i] = rand();
+    }
+
+    // we have every piece but the last few, the peer has a random half
+    for (u32 i = 0; i < BENCH_BITFIELD_PIECES - 8; i++) {
+        torrent_picker_piece_complete(bench_picker, i);
+    }
+    for (usize i = 0; i < bench_bitfield_length; i++) {
+        bench_bitfield[i] = rand();
+    }
+    bench_bitfield[bench_bitfield_length - 1] = 0;
+
+    bench_run("bencode_parse_small", filter, bench_bencode_parse_small, bench_torrent_small.length);
+    bench_run("bencode_parse_huge", filter, bench_bencode_parse_huge, bench_torrent_huge.length);
+    bench_run("metadata_create_small", filter, bench_metadata_create_small, bench_torrent_small.length);
+    bench_run("metadata_create_huge", filter, bench_metadata_create_huge, bench_torrent_huge.length);
+    bench_run("url_encode_info_hash", filter, bench_url_encode, 20);
+    bench_run("sha1_piece_256k", filter, bench_sha1_piece, BENCH_PIECE_LENGTH);
+    bench_run("bitfield_is_interesting", filter, bench_bitfield_is_interesting, bench_bitfield_length);
+    bench_run("bitfield_availability_add_remove", filter, bench_bitfield_availability, bench_bitfield_length);
+    bench_run("bitfield_has_piece", filter, bench_bitfield_has_piece, 0);
+    bench_run("peer_message_next", filter, bench_peer_message_next, 0);
+    bench_run("peer_send_request", filter, bench_peer_send_request, 0);
+    bench_run("peer_send_piece_16k", filter, bench_peer_send_piece, TORRENT_PEER_BLOCK_LENGTH);
+
+    unlink(bench_torrent_small.path);
+    unlink(bench_torrent_huge.path);
+    free(bench_torrent_small.data);
+    free(bench_torrent_huge.data);
+    free(bench_piece);
+    free(bench_bitfield);
+    torrent_picker_destroy(bench_picker);
+    torrent_peer_destroy(bench_peer);
+    close(bench_peer_remote);
+
+    return 0;
+}
+
+void* __wrap_malloc(usize size) {
+    if (bench_counting) {
+        bench_allocations++;
+        bench_allocated_bytes += size;
+    }
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(usize count, usize size) {
+    if (bench_counting) {
+        bench_allocations++;
+        bench_allocated_bytes += count * size;
+    }
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pointer, usize size) {
+    if (bench_counting) {
+        bench_allocations++;
+        bench_allocated_bytes += size;
+    }
+    return __real_realloc(pointer, size);
+}
+
+void __wrap_free(void* pointer) {
+    __real_free(pointer);
+}
+
+static u64 bench_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((u64) now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+/* grows the iteration count until a run takes BENCH_TIME_TARGET_NS, then reports that run */
+static void bench_run(const char* name, const char* filter, void (*function)(u64 iterations), usize bytes_per_op) {
+    if (filter && !strstr(name, filter)) { return; }
+
+    u64 iterations = 1;
+    u64 elapsed = 0;
+    while (true) {
+        bench_allocations = 0;
+        bench_allocated_bytes = 0;
+        bench_counting = true;
+
+        u64 start = bench_now_ns();
+        function(iterations);
+        elapsed = bench_now_ns() - start;
+
+        bench_counting = false;
+
+        if (elapsed >= BENCH_TIME_TARGET_NS || iterations >= BENCH_ITERATIONS_MAX) { break; }
+
+        // aim a little past the target, but never grow more than 100x at once
+        u64 next = (elapsed > 0) ? (iterations * BENCH_TIME_TARGET_NS * 6) / (elapsed * 5) : iterations * 100;
+        if (next > iterations * 100) { next = iterations * 100; }
+        if (next <= iterations) { next = iterations + 1; }
+        if (next > BENCH_ITERATIONS_MAX) { next = BENCH_ITERATIONS_MAX; }
+        iterations = next;
+    }
+
+    double ns_per_op = (double) elapsed / iterations;
+    printf("{\"benchmark\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.2f,\"allocs_per_op\":%.2f,\"bytes_per_op\":%.2f",
+        name, (unsigned long long) iterations, ns_per_op, (double) bench_allocations / iterations, (double) bench_allocated_bytes / iterations);
+    if (bytes_per_op > 0) {
+        printf(",\"mb_per_s\":%.2f", (bytes_per_op / (1024.0 * 1024.0)) / (ns_per_op / 1e9));
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+/* a multi-file torrent with random piece hashes, also written to a temporary file for torrent_metadata_create() */
+static bool bench_torrent_create(BenchTorrent* torrent, u32 files_length, u32 pieces_length) {
+    u8* buffer = NULL;
+    usize capacity = 0;
+    usize length = 0;
+    char number[64];
+
+    const char* header = "d8:announce30:http://127.0.0.1:6969/announce4:infod5:filesl";
+    length = bench_append(&buffer, &capacity, length, header, strlen(header));
+    for (u32 i = 0; i < files_length; i++) {
+        u32 file_length = ((u64) BENCH_PIECE_LENGTH * pieces_length) / files_length;
+        i32 number_length = snprintf(number, sizeof(number), "d6:lengthi%ue4:pathl5:bench%i:", file_length, snprintf(NULL, 0, "file-%u", i));
+        length = bench_append(&buffer, &capacity, length, number, number_length);
+        number_length = snprintf(number, sizeof(number), "file-%uee", i);
+        length = bench_append(&buffer, &capacity, length, number, number_length);
+    }
+
+    i32 number_length = snprintf(number, sizeof(number), "e4:name5:bench12:piece lengthi%ue6:pieces%u:", BENCH_PIECE_LENGTH, pieces_length * 20);
+    length = bench_append(&buffer, &capacity, length, number, number_length);
+    for (u32 i = 0; i < pieces_length * 20; i++) {
+        u8 byte = rand();
+        length = bench_append(&buffer, &capacity, length, &byte, 1);
+    }
+    length = bench_append(&buffer, &capacity, length, "ee", 2);
+
+    if (!buffer) { return false; }
+
+    torrent->data = buffer;
+    torrent->length = length;
+
+    snprintf(torrent->path, sizeof(torrent->path), "/tmp/bench-XXXXXX");
+    i32 descriptor = mkstemp(torrent->path);
+    if (descriptor == -1) { return false; }
+
+    bool success = write(descriptor, buffer, length) == (ssize_t) length;
+    close(descriptor);
+    return success;
+}
+
+static usize bench_append(u8** buffer, usize* capacity, usize length, const void* data, usize data_length) {
+    if (length + data_length > *capacity) {
+        usize new_capacity = (*capacity == 0) ? 4096 : *capacity;
+        while (length + data_length > new_capacity) { new_capacity *= 2; }
+
+        u8* temp = (u8*) realloc(*buffer, new_capacity);
+        if (!temp) {
+            fprintf(stderr, "[ERROR] [BENCH] Failed to reallocate memory for torrent!\n");
+            exit(-1);
+        }
+        *buffer = temp;
+        *capacity = new_capacity;
+    }
+
+    memcpy(*buffer + length, data, data_length);
+    return length + data_length;
+}
+
+/* a connected peer over a socketpair, the other end is drained by bench_peer_drain() */
+static TorrentPeer* bench_peer_create(i32* remote) {
+    i32 sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) { return NULL; }
+
+    TorrentPeer* peer = (TorrentPeer*) calloc(1, sizeof(TorrentPeer));
+    if (!peer) { return NULL; }
+
+    peer->state = TORRENT_PEER_CONNECTED;
+    peer->socket = sockets[0];
+    snprintf(peer->ip, sizeof(peer->ip), "127.0.0.1");
+    snprintf(peer->port, sizeof(peer->port), "6881");
+
+    *remote = sockets[1];
+    return peer;
+}
+
+static void bench_peer_drain() {
+    u8 buffer[65536];
+    while (bench_peer->output.length > 0) {
+        if (recv(bench_peer_remote, buffer, sizeof(buffer), MSG_DONTWAIT) <= 0) { break; }
+        torrent_peer_flush(bench_peer);
+    }
+    while (recv(bench_peer_remote, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {}
+}
+
+static void bench_bencode_parse_small(u64 iterations) {
+    for (u64 i = 0; i < iterations; i++) {
+        usize index = 0;
+        BencodeObject* object = bencode_object_parse(bench_torrent_small.data, bench_torrent_small.length, &index);
+        bench_sink += object->dictionary_length;
+        bencode_object_destroy(object);
+    }
+}
+
+static void bench_bencode_parse_huge(u64 iterations) {
+    for (u64 i = 0; i < iterations; i++) {
+        usize index = 0;
+        BencodeObject* object = bencode_object_parse(bench_torrent_huge.data, bench_torrent_huge.length, &index);
+        bench_sink += object->dictionary_length;
+        bencode_object_destroy(object);
+    }
+}
+
+static void bench_metadata_create_small(u64 iterations) {
+    for (u64 i = 0; i < iterations; i++) {
+        TorrentMetadata* metadata = torrent_metadata_create(bench_torrent_small.path);
+        bench_sink += metadata->info.piece_count;
+        torrent_metadata_destroy(metadata);
+    }
+}
+
+static void bench_metadata_create_huge(u64 iterations) {
+    for (u64 i = 0; i < iterations; i++) {
+        TorrentMetadata* metadata = torrent_metadata_create(bench_torrent_huge.path);
+        bench_sink += metadata->info.piece_count;
+        torrent_metadata_destroy(metadata);
+    }
+}
+
+static void bench_url_encode(u64 iterations) {
+    for (u64 i = 0; i < iterations; i++) {
+        char* encoded = url_encode(bench_piece + (i % 64), 20);
+        bench_sink += encoded[1];
+        free(encoded);
+    }
+}
+
+static void bench_sha1_piece(u64 iterations) {
+    u8 hash[SHA_DIGEST_LENGTH];
+    for (u64 i = 0; i < iterations; i++) {
+        SHA1(bench_piece, BENCH_PIECE_LENGTH, hash);
+        bench_sink += hash[0];
+    }
+}
+
+static void bench_bitfield_is_interesting(u64 iterations) {
+    for (u64 i = 0; i < iterations; i++) {
+        bench_sink += torrent_picker_is_interesting(bench_picker, bench_bitfield, bench_bitfield_length);
+    }
+}
+
+static void bench_bitfield_availability(u64 iterations) {
+    for (u64 i = 0; i < iterations; i++) {
+        torrent_picker_availability_add(bench_picker, bench_bitfield, bench_bitfield_length);
+        torrent_picker_availability_remove(bench_picker, bench_bitfield, bench_bitfield_length);
+    }
+    bench_sink += bench_picker->pieces[0].availability;
+}
+
+static void bench_bitfield_has_piece(u64 iterations) {
+    bench_peer->bitfield = bench_bitfield;
+    bench_peer->bitfield_length = bench_bitfield_length;
+
+    for (u64 i = 0; i < iterations; i++) {
+        bench_sink += torrent_peer_has_piece(bench_peer, i % BENCH_BITFIELD_PIECES);
+    }
+
+    bench_peer->bitfield = NULL;
+    bench_peer->bitfield_length = 0;
+}
+
+/* frames a have, a request and a 16 KiB piece out of an already filled receive buffer */
+static void bench_peer_message_next(u64 iterations) {
+    static u8 messages[9 + 17 + 13 + TORRENT_PEER_BLOCK_LENGTH] = {
+        0, 0, 0, 5, TORRENT_PEER_MESSAGE_HAVE, 0, 0, 0, 1,
+        0, 0, 0, 13, TORRENT_PEER_MESSAGE_REQUEST, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0x40, 0,
+        0, 0, 0x40, 9, TORRENT_PEER_MESSAGE_PIECE, 0, 0, 0, 1, 0, 0, 0, 0,
+    };
+
+    TorrentPeerBuffer saved = bench_peer->input;
+    bench_peer->input = (TorrentPeerBuffer) { messages, 0, sizeof(messages), sizeof(messages) };
+
+    u64 operations = 0;
+    while (operations < iterations) {
+        TorrentPeerMessage message;
+        bool failed;
+        if (!torrent_peer_message_next(bench_peer, &message, &failed)) {
+            bench_peer->input.offset = 0;
+            continue;
+        }
+
+        bench_sink += message.payload_length;
+        operations++;
+    }
+
+    bench_peer->input = saved;
+}
+
+static void bench_peer_send_request(u64 iterations) {
+    for (u64 i = 0; i < iterations; i++) {
+        torrent_peer_send_request(bench_peer, i, 0, TORRENT_PEER_BLOCK_LENGTH);
+        if (i % 64 == 63) { bench_peer_drain(); }
+    }
+    bench_peer_drain();
+}
+
+static void bench_peer_send_piece(u64 iterations) {
+    for (u64 i = 0; i < iterations; i++) {
+        torrent_peer_send_piece(bench_peer, i, 0, bench_piece, TORRENT_PEER_BLOCK_LENGTH);
+        bench_peer_drain();
+    }
+}
@@ -0,0 +1,1051 @@
+#define _GNU_SOURCE // memmem
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <openssl/sha.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "downloader.h"
+#include "merkle.h"
+#include "peer.h"
+#include "types.h"
+#include "utils/buffer.h"
+
+/*
+ * loopback swarm: a synthetic torrent, an http tracker, n seeders and w http web seeds on
+ * 127.0.0.1, all in this process, with the real downloader run against them. seeders can
+ * be slowed down with a bandwidth cap, a round trip latency, loss and periodic choking,
+ * web seeds by the same bandwidth cap and latency. with -d there is no tracker: the seeders
+ * announce to a loopback dht instead and the downloader has to find them there. -v makes a
+ * v2 torrent without its piece layer, the seeders send the layer only after the given delay
+ * so pieces finish before they can be verified.
+ * the result is printed as one json object:
+ * {"seeders":..,"size_bytes":..,"ttfb_ms":..,"steady_mb_per_s":..,"completion_ms":..,"verified":..}
+ *
+ * usage: swarm [-n seeders] [-s size MiB] [-p piece KiB] [-b bandwidth KiB/s per seeder]
+ *              [-l latency ms] [-x loss %] [-c choke period ms] [-w web seeds] [-t network threads] [-d]
+ *              [-v v2 piece layer delay ms]
+ */
+
+#define SWARM_SEEDERS_MAX 32
+#define SWARM_WEB_SEEDS_MAX 8
+#define SWARM_WEB_SEED_HEADERS_MAX 4096
+#define SWARM_QUEUE_LENGTH 1024
+#define SWARM_LOSS_PENALTY_MS 200 // what a lost segment costs tcp, roughly one retransmission timeout
+#define SWARM_TORRENT_NAME "swarm.bin"
+#define SWARM_TORRENT_FILE "swarm.torrent"
+#define SWARM_DHT_ANNOUNCE_TIMEOUT_MS 10000
+
+typedef struct SwarmConfig {
+    u32 seeders;
+    u64 size;
+    u32 piece_length;
+    u64 bandwidth; // bytes per second per connection, 0 is unlimited
+    u32 latency_ms;
+    u32 loss_percent;
+    u32 choke_period_ms; // 0 never chokes
+    u32 web_seeds;
+    u32 network_threads; // 0 runs the downloader's connections on its own thread
+    bool dht; // peers come from the loopback dht rather than the tracker
+    bool v2;
+    u32 layer_delay_ms; // v2 only, how long a piece layer request waits for its answer
+} SwarmConfig;
+
+typedef struct SwarmStats {
+    pthread_mutex_t mutex;
+    u64 bytes_sent;
+
+    u64 start_ns;
+    u64 first_byte_ns;
+    u64 low_mark_ns; // 10% sent
+    u64 high_mark_ns; // 90% sent
+} SwarmStats;
+
+typedef struct SwarmRequest {
+    u32 index;
+    u32 begin;
+    u32 length;
+    u64 due_ns;
+} SwarmRequest;
+
+/* one downloader connection to one seeder */
+typedef struct SwarmConnection {
+    i32 socket;
+    u32 seeder;
+
+    u8 input[65536];
+    usize input_length;
+
+    bool choked;
+    bool interested;
+    u64 next_toggle_ns;
+
+    SwarmRequest queue[SWARM_QUEUE_LENGTH];
+    usize queue_start;
+    usize queue_length;
+
+    u8* layer; // a v2 piece layer answer held back until layer_due_ns
+    usize layer_length;
+    u64 layer_due_ns;
+
+    double tokens;
+    u64 tokens_refilled_ns;
+} SwarmConnection;
+
+typedef struct SwarmListener {
+    i32 socket;
+    u16 port;
+    u32 seeder; // only used by seeders
+} SwarmListener;
+
+/* one downloader connection to one web seed, keep-alive with pipelined ranged GETs */
+typedef struct SwarmWebSeedConnection {
+    i32 socket;
+
+    char input[SWARM_WEB_SEED_HEADERS_MAX];
+    usize input_length;
+    u64 received_ns; // when the buffered requests arrived, as far as latency is concerned
+
+    u64 next_send_ns; // paces the bandwidth cap
+} SwarmWebSeedConnection;
+
+static SwarmConfig swarm_config = {
+    .seeders = 4,
+    .size = 64 * 1024 * 1024,
+    .piece_length = 256 * 1024,
+    .bandwidth = 0,
+    .latency_ms = 20,
+    .loss_percent = 0,
+    .choke_period_ms = 0,
+    .web_seeds = 0,
+};
+
+static SwarmStats swarm_stats = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+static u8* swarm_payload;
+static u8 swarm_info_hash[20];
+static u8* swarm_block_hashes; // v2 only, every piece's leaves padded to a full piece
+static u8* swarm_piece_layer; // v2 only, padded to a power of two
+static u32 swarm_piece_layer_width;
+static u8 swarm_pieces_root[TORRENT_MERKLE_HASH_LENGTH];
+static SwarmListener swarm_tracker;
+static SwarmListener swarm_seeders[SWARM_SEEDERS_MAX];
+static SwarmListener swarm_web_seeds[SWARM_WEB_SEEDS_MAX];
+static DHT* swarm_dht_nodes[SWARM_SEEDERS_MAX + 1]; // the router first, then one per seeder
+static char swarm_dht_router_port[8];
+
+static u64 swarm_now_ns();
+static bool swarm_arguments_parse(i32 argc, char** argv);
+static bool swarm_torrent_create(const char* path, u16 tracker_port);
+static bool swarm_tree_create();
+static bool swarm_listen(SwarmListener* listener);
+static bool swarm_verify(const char* path);
+static void swarm_directory_remove(const char* path);
+
+static void* swarm_tracker_run(void* argument);
+static void* swarm_seeder_run(void* argument);
+static void* swarm_connection_run(void* argument);
+static bool swarm_connection_handshake(SwarmConnection* connection);
+static bool swarm_connection_receive(SwarmConnection* connection);
+static bool swarm_connection_message_handle(SwarmConnection* connection, u8 id, const u8* payload, u32 payload_length);
+static bool swarm_connection_hash_request_handle(SwarmConnection* connection, const u8* payload, u32 payload_length);
+static bool swarm_connection_choke_update(SwarmConnection* connection, u64 now);
+static bool swarm_connection_queue_send(SwarmConnection* connection, u64 now, u64* wake_ns);
+static bool swarm_connection_send(SwarmConnection* connection, const u8* data, usize length);
+static void swarm_stats_sent(u32 length);
+
+static bool swarm_dht_start();
+static void swarm_dht_process(u32 timeout_ms);
+static void* swarm_dht_run(void* argument);
+
+static void* swarm_web_seed_run(void* argument);
+static void* swarm_web_seed_connection_run(void* argument);
+static bool swarm_web_seed_request_handle(SwarmWebSeedConnection* connection, const char* request);
+
+int main(int argc, char** argv) {
+    if (!swarm_arguments_parse(argc, argv)) { return -1; }
+
+    char directory[] = "/tmp/swarm-XXXXXX";
+    if (!mkdtemp(directory) || chdir(directory) == -1) {
+        fprintf(stderr, "[ERROR] [SWARM] Failed to create working directory!\n");
+        return -1;
+    }
+
+    if (!swarm_listen(&swarm_tracker)) { return -1; }
+    for (u32 i = 0; i < swarm_config.seeders; i++) {
+        swarm_seeders[i].seeder = i;
+        if (!swarm_listen(&swarm_seeders[i])) { return -1; }
+    }
+    for (u32 i = 0; i < swarm_config.web_seeds; i++) {
+        if (!swarm_listen(&swarm_web_seeds[i])) { return -1; }
+    }
+
+    if (!swarm_torrent_create(SWARM_TORRENT_FILE, swarm_config.dht ? 0 : swarm_tracker.port)) {
+        swarm_directory_remove(directory);
+        return -1;
+    }
+
+    if (swarm_config.dht && !swarm_dht_start()) {
+        swarm_directory_remove(directory);
+        return -1;
+    }
+
+    pthread_t thread;
+    if (!swarm_config.dht) {
+        pthread_create(&thread, NULL, swarm_tracker_run, &swarm_tracker);
+        pthread_detach(thread);
+    }
+    for (u32 i = 0; i < swarm_config.seeders; i++) {
+        pthread_create(&thread, NULL, swarm_seeder_run, &swarm_seeders[i]);
+        pthread_detach(thread);
+    }
+    for (u32 i = 0; i < swarm_config.web_seeds; i++) {
+        pthread_create(&thread, NULL, swarm_web_seed_run, &swarm_web_seeds[i]);
+        pthread_detach(thread);
+    }
+
+    swarm_stats.start_ns = swarm_now_ns();
+
+    TorrentDownloader* downloader = torrent_downloader_create(SWARM_TORRENT_FILE);
+    if (!downloader) {
+        fprintf(stderr, "[ERROR] [SWARM] Failed to create torrent downloader!\n");
+        swarm_directory_remove(directory);
+        return -1;
+    }
+
+    // only the loopback tracker or dht and seeders, nothing from the outside
+    downloader->dht_enabled = swarm_config.dht;
+    downloader->dht_router[0] = "127.0.0.1";
+    downloader->dht_router[1] = swarm_dht_router_port;
+    downloader->shards_length = swarm_config.network_threads;
+
+    bool success = torrent_downloader_run(downloader);
+    u64 end_ns = swarm_now_ns();
+    torrent_downloader_destroy(downloader);
+
+    bool verified = success && swarm_verify(SWARM_TORRENT_NAME);
+
+    pthread_mutex_lock(&swarm_stats.mutex);
+    double ttfb_ms = swarm_stats.first_byte_ns ? (swarm_stats.first_byte_ns - swarm_stats.start_ns) / 1e6 : -1;
+    double steady_mb_per_s = 0;
+    if (swarm_stats.high_mark_ns > swarm_stats.low_mark_ns && swarm_stats.low_mark_ns != 0) {
+        double steady_bytes = swarm_config.size * 0.8;
+        steady_mb_per_s = (steady_bytes / (1024.0 * 1024.0)) / ((swarm_stats.high_mark_ns - swarm_stats.low_mark_ns) / 1e9);
+    }
+    pthread_mutex_unlock(&swarm_stats.mutex);
+
+    printf("{\"seeders\":%u,\"web_seeds\":%u,\"network_threads\":%u,\"size_bytes\":%llu,\"piece_length\":%u,\"bandwidth_bytes_per_s\":%llu,\"latency_ms\":%u,\"loss_percent\":%u,\"choke_period_ms\":%u,\"dht\":%s,\"v2\":%s,"
+        "\"ttfb_ms\":%.2f,\"steady_mb_per_s\":%.2f,\"completion_ms\":%.2f,\"verified\":%s}\n",
+        swarm_config.seeders, swarm_config.web_seeds, swarm_config.network_threads, (unsigned long long) swarm_config.size, swarm_config.piece_length, (unsigned long long) swarm_config.bandwidth,
+        swarm_config.latency_ms, swarm_config.loss_percent, swarm_config.choke_period_ms, swarm_config.dht ? "true" : "false", swarm_config.v2 ? "true" : "false",
+        ttfb_ms, steady_mb_per_s, (end_ns - swarm_stats.start_ns) / 1e6, verified ? "true" : "false");
+    fflush(stdout);
+
+    swarm_directory_remove(directory);
+    free(swarm_payload);
+    if (swarm_block_hashes) { free(swarm_block_hashes); }
+    if (swarm_piece_layer) { free(swarm_piece_layer); }
+
+    return verified ? 0 : -1;
+}
+
+static u64 swarm_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((u64) now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+static bool swarm_arguments_parse(i32 argc, char** argv) {
+    i32 option;
+    while ((option = getopt(argc, argv, "n:s:p:b:l:x:c:w:t:dv:")) != -1) {
+        u64 value = optarg ? strtoull(optarg, NULL, 10) : 0;
+        switch (option) {
+            case 'n': swarm_config.seeders = value; break;
+            case 's': swarm_config.size = value * 1024 * 1024; break;
+            case 'p': swarm_config.piece_length = value * 1024; break;
+            case 'b': swarm_config.bandwidth = value * 1024; break;
+            case 'l': swarm_config.latency_ms = value; break;
+            case 'x': swarm_config.loss_percent = value; break;
+            case 'c': swarm_config.choke_period_ms = value; break;
+            case 'w': swarm_config.web_seeds = value; break;
+            case 't': swarm_config.network_threads = value; break;
+            case 'd': swarm_config.dht = true; break;
+            case 'v':
+                swarm_config.v2 = true;
+                swarm_config.layer_delay_ms = value;
+                break;
+            default: return false;
+        }
+    }
+
+    // the tracker response has to fit what the client parses and the payload is held in memory
+    // web seeds alone are enough to finish
+    if (swarm_config.seeders > SWARM_SEEDERS_MAX || (swarm_config.seeders == 0 && swarm_config.web_seeds == 0)) {
+        fprintf(stderr, "[ERROR] [SWARM] Seeders must be between 1 and %u, or 0 with web seeds!\n", SWARM_SEEDERS_MAX);
+        return false;
+    }
+    if (swarm_config.web_seeds > SWARM_WEB_SEEDS_MAX) {
+        fprintf(stderr, "[ERROR] [SWARM] Web seeds must be at most %u!\n", SWARM_WEB_SEEDS_MAX);
+        return false;
+    }
+    if (swarm_config.size == 0 || swarm_config.size > 1024ULL * 1024 * 1024) {
+        fprintf(stderr, "[ERROR] [SWARM] Size must be between 1 and 1024 MiB!\n");
+        return false;
+    }
+    if (swarm_config.piece_length < TORRENT_PEER_BLOCK_LENGTH || swarm_config.piece_length % TORRENT_PEER_BLOCK_LENGTH != 0) {
+        fprintf(stderr, "[ERROR] [SWARM] Piece length must be a multiple of 16 KiB!\n");
+        return false;
+    }
+    u32 pieces_length = (swarm_config.size + swarm_config.piece_length - 1) / swarm_config.piece_length;
+    if (swarm_config.v2 && ((swarm_config.piece_length & (swarm_config.piece_length - 1)) != 0 || pieces_length < 2 || pieces_length > TORRENT_HASH_EXCHANGE_LAYER_CHUNK)) {
+        fprintf(stderr, "[ERROR] [SWARM] A v2 torrent needs a power of two piece length and 2 to %u pieces!\n", TORRENT_HASH_EXCHANGE_LAYER_CHUNK);
+        return false;
+    }
+    if (swarm_config.loss_percent > 100) {
+        fprintf(stderr, "[ERROR] [SWARM] Loss must be a percentage!\n");
+        return false;
+    }
+
+    return true;
+}
+
+/* random payload from a fixed seed, a single-file torrent announcing to our tracker, if any, and listing our web seeds */
+static bool swarm_torrent_create(const char* path, u16 tracker_port) {
+    swarm_payload = (u8*) malloc(sizeof(u8) * swarm_config.size);
+    if (!swarm_payload) {
+        fprintf(stderr, "[ERROR] [SWARM] Failed to allocate memory for payload!\n");
+        return false;
+    }
+
+    srand(1);
+    for (u64 i = 0; i < swarm_config.size; i++) {
+        swarm_payload[i] = rand();
+    }
+
+    u32 pieces_length = (swarm_config.size + swarm_config.piece_length - 1) / swarm_config.piece_length;
+    usize info_capacity = 256 + ((usize) pieces_length * 20);
+    u8* info = (u8*) malloc(sizeof(u8) * info_capacity);
+    if (!info) {
+        fprintf(stderr, "[ERROR] [SWARM] Failed to allocate memory for info dictionary!\n");
+        return false;
+    }
+
+    usize info_length;
+    if (swarm_config.v2) {
+        if (!swarm_tree_create()) {
+            free(info);
+            return false;
+        }
+
+        // a single file tree, the piece layer is left out for the seeders to hand out
+        info_length = snprintf((char*) info, info_capacity, "d9:file treed%zu:%sd0:d6:lengthi%llue11:pieces root32:",
+            strlen(SWARM_TORRENT_NAME), SWARM_TORRENT_NAME, (unsigned long long) swarm_config.size);
+        memcpy(info + info_length, swarm_pieces_root, TORRENT_MERKLE_HASH_LENGTH);
+        info_length += TORRENT_MERKLE_HASH_LENGTH;
+        info_length += snprintf((char*) info + info_length, info_capacity - info_length, "eee12:meta versioni2e4:name%zu:%s12:piece lengthi%uee",
+            strlen(SWARM_TORRENT_NAME), SWARM_TORRENT_NAME, swarm_config.piece_length);
+
+        u8 hash[SHA256_DIGEST_LENGTH];
+        SHA256(info, info_length, hash);
+        memcpy(swarm_info_hash, hash, 20);
+    } else {
+        info_length = snprintf((char*) info, info_capacity, "d6:lengthi%llue4:name%zu:%s12:piece lengthi%ue6:pieces%u:",
+            (unsigned long long) swarm_config.size, strlen(SWARM_TORRENT_NAME), SWARM_TORRENT_NAME, swarm_config.piece_length, pieces_length * 20);
+        for (u32 i = 0; i < pieces_length; i++) {
+            u64 begin = (u64) i * swarm_config.piece_length;
+            u64 length = (swarm_config.size - begin < swarm_config.piece_length) ? swarm_config.size - begin : swarm_config.piece_length;
+            SHA1(swarm_payload + begin, length, info + info_length);
+            info_length += 20;
+        }
+        info[info_length] = 'e';
+        info_length++;
+
+        SHA1(info, info_length, swarm_info_hash);
+    }
+
+    char announce[64] = {0};
+    i32 announce_length = (tracker_port != 0) ? snprintf(announce, sizeof(announce), "http://127.0.0.1:%u/announce", tracker_port) : 0;
+
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "[ERROR] [SWARM] Failed to open torrent file for writing: %s\n", path);
+        free(info);
+        return false;
+    }
+
+    bool success = (announce_length == 0 || fprintf(file, "d8:announce%i:%s", announce_length, announce) > 0)
+        && fprintf(file, "%s4:info", (announce_length == 0) ? "d" : "") > 0
+        && fwrite(info, 1, info_length, file) == info_length;
+    if (success && swarm_config.web_seeds > 0) {
+        success = fprintf(file, "8:url-listl") > 0;
+        for (u32 i = 0; success && i < swarm_config.web_seeds; i++) {
+            char url[64];
+            i32 url_length = snprintf(url, sizeof(url), "http://127.0.0.1:%u/%s", swarm_web_seeds[i].port, SWARM_TORRENT_NAME);
+            success = fprintf(file, "%i:%s", url_length, url) > 0;
+        }
+        success = success && fputc('e', file) != EOF;
+    }
+    success = success && fputc('e', file) != EOF;
+    fclose(file);
+    free(info);
+
+    if (!success) {
+        fprintf(stderr, "[ERROR] [SWARM] Failed to write torrent file: %s\n", path);
+    }
+    return success;
+}
+
+/* the v2 hashes of the payload (BEP 52): 16 KiB leaves, a hash per piece and the file's root */
+static bool swarm_tree_create() {
+    u32 piece_blocks = swarm_config.piece_length / TORRENT_MERKLE_BLOCK_LENGTH;
+    u32 pieces_length = (swarm_config.size + swarm_config.piece_length - 1) / swarm_config.piece_length;
+    swarm_piece_layer_width = (u32) 1 << torrent_merkle_layers(pieces_length);
+
+    swarm_block_hashes = (u8*) calloc((usize) pieces_length * piece_blocks, TORRENT_MERKLE_HASH_LENGTH);
+    swarm_piece_layer = (u8*) malloc(sizeof(u8) * TORRENT_MERKLE_HASH_LENGTH * swarm_piece_layer_width);
+    if (!swarm_block_hashes || !swarm_piece_layer) {
+        fprintf(stderr, "[ERROR] [SWARM] Failed to allocate memory for the merkle tree!\n");
+        return false;
+    }
+
+    // the last piece's missing leaves stay zero, the layer past the last piece is a zero subtree's hash
+    u8 zero[TORRENT_MERKLE_HASH_LENGTH] = {0};
+    for (u32 i = 0; i < pieces_length; i++) {
+        u8* leaves = swarm_block_hashes + ((usize) i * piece_blocks * TORRENT_MERKLE_HASH_LENGTH);
+        u32 count = 0;
+        for (u64 begin = (u64) i * swarm_config.piece_length; begin < swarm_config.size && count < piece_blocks; begin += TORRENT_MERKLE_BLOCK_LENGTH, count++) {
+            u64 length = (swarm_config.size - begin < TORRENT_MERKLE_BLOCK_LENGTH) ? swarm_config.size - begin : TORRENT_MERKLE_BLOCK_LENGTH;
+            torrent_merkle_block_hash(swarm_payload + begin, length, leaves + ((usize) count * TORRENT_MERKLE_HASH_LENGTH));
+        }
+        if (!torrent_merkle_root(leaves, count, piece_blocks, zero, swarm_piece_layer + ((usize) i * TORRENT_MERKLE_HASH_LENGTH))) { return false; }
+    }
+
+    u8 pad[TORRENT_MERKLE_HASH_LENGTH];
+    torrent_merkle_pad_hash(torrent_merkle_layers(piece_blocks), pad);
+    for (u32 i = pieces_length; i < swarm_piece_layer_width; i++) {
+        memcpy(swarm_piece_layer + ((usize) i * TORRENT_MERKLE_HASH_LENGTH), pad, TORRENT_MERKLE_HASH_LENGTH);
+    }
+
+    return torrent_merkle_root(swarm_piece_layer, pieces_length, swarm_piece_layer_width, pad, swarm_pieces_root);
+}
+
+static bool swarm_listen(SwarmListener* listener) {
+    listener->socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener->socket == -1) {
+        fprintf(stderr, "[ERROR] [SWARM] Failed to create socket!\n");
+        return false;
+    }
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    socklen_t address_length = sizeof(address);
+    if (bind(listener->socket, (struct sockaddr*) &address, sizeof(address)) == -1 || listen(listener->socket, 64) == -1
+        || getsockname(listener->socket, (struct sockaddr*) &address, &address_length) == -1) {
+        fprintf(stderr, "[ERROR] [SWARM] Failed to listen on 127.0.0.1!\n");
+        close(listener->socket);
+        return false;
+    }
+
+    listener->port = ntohs(address.sin_port);
+    return true;
+}
+
+static bool swarm_verify(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "[ERROR] [SWARM] Failed to open downloaded file: %s\n", path);
+        return false;
+    }
+
+    u8 buffer[65536];
+    u64 offset = 0;
+    bool matches = true;
+    usize bytes_read;
+    while (matches && (bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        matches = offset + bytes_read <= swarm_config.size && memcmp(buffer, swarm_payload + offset, bytes_read) == 0;
+        offset += bytes_read;
+    }
+    fclose(file);
+
+    return matches && offset == swarm_config.size;
+}
+
+/* the downloader leaves the payload and its peer store behind, nothing else lives here */
+static void swarm_directory_remove(const char* path) {
+    DIR* directory = opendir(path);
+    if (directory) {
+        struct dirent* entry;
+        while ((entry = readdir(directory))) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) { continue; }
+            unlinkat(dirfd(directory), entry->d_name, 0);
+        }
+        closedir(directory);
+    }
+    rmdir(path);
+}
+
+/* answers every announce with the full list of seeders, in the non-compact form the client expects */
+/*
+ * a router node and a node per seeder that bootstraps from it and announces the seeder's port.
+ * returns once every announce is out, the nodes keep answering on a thread of their own
+ */
+static bool swarm_dht_start() {
+    swarm_dht_nodes[0] = dht_create(0, NULL);
+    if (!swarm_dht_nodes[0]) { return false; }
+    snprintf(swarm_dht_router_port, sizeof(swarm_dht_router_port), "%u", swarm_dht_nodes[0]->port);
+
+    for (u32 i = 0; i < swarm_config.seeders; i++) {
+        DHT* node = dht_create(0, NULL);
+        if (!node) { return false; }
+        swarm_dht_nodes[i + 1] = node;
+
+        if (!dht_bootstrap(node, "127.0.0.1", swarm_dht_router_port) || !dht_get_peers(node, swarm_info_hash, swarm_seeders[i].port)) {
+            fprintf(stderr, "[ERROR] [SWARM] Failed to start the dht lookups!\n");
+            return false;
+        }
+    }
+
+    u64 deadline_ns = swarm_now_ns() + (u64) SWARM_DHT_ANNOUNCE_TIMEOUT_MS * 1000000;
+    bool active = true;
+    while (active) {
+        if (swarm_now_ns() > deadline_ns) {
+            fprintf(stderr, "[ERROR] [SWARM] The seeders didn't finish announcing to the dht!\n");
+            return false;
+        }
+        swarm_dht_process(50);
+
+        active = false;
+        for (u32 i = 1; i <= swarm_config.seeders; i++) {
+            active = active || dht_lookups_active(swarm_dht_nodes[i]);
+        }
+    }
+
+    // nobody has announced to the seeders' own lookups, whatever they found is unused
+    for (u32 i = 0; i <= swarm_config.seeders; i++) {
+        usize peers_length;
+        TorrentTrackerPeer* peers = dht_peers_take(swarm_dht_nodes[i], &peers_length);
+        if (peers) { free(peers); }
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, swarm_dht_run, NULL);
+    pthread_detach(thread);
+    return true;
+}
+
+/* one round of every node answering what came in */
+static void swarm_dht_process(u32 timeout_ms) {
+    struct pollfd poll_sockets[SWARM_SEEDERS_MAX + 1];
+    for (u32 i = 0; i <= swarm_config.seeders; i++) {
+        poll_sockets[i] = (struct pollfd) { .fd = swarm_dht_nodes[i]->socket, .events = POLLIN };
+    }
+    poll(poll_sockets, swarm_config.seeders + 1, timeout_ms);
+
+    for (u32 i = 0; i <= swarm_config.seeders; i++) {
+        dht_process(swarm_dht_nodes[i]);
+    }
+}
+
+static void* swarm_dht_run(void* argument) {
+    (void) argument;
+    while (true) {
+        swarm_dht_process(250);
+    }
+    return NULL;
+}
+
+static void* swarm_tracker_run(void* argument) {
+    SwarmListener* listener = (SwarmListener*) argument;
+
+    char body[2048];
+    usize body_length = snprintf(body, sizeof(body), "d8:intervali60e5:peersl");
+    for (u32 i = 0; i < swarm_config.seeders; i++) {
+        body_length += snprintf(body + body_length, sizeof(body) - body_length, "d2:ip9:127.0.0.14:porti%uee", swarm_seeders[i].port);
+    }
+    body_length += snprintf(body + body_length, sizeof(body) - body_length, "ee");
+
+    while (true) {
+        i32 client = accept(listener->socket, NULL, NULL);
+        if (client == -1) {
+            if (errno == EINTR) { continue; }
+            break;
+        }
+
+        char request[2048];
+        usize request_length = 0;
+        while (request_length < sizeof(request) - 1) {
+            ssize_t bytes_received = recv(client, request + request_length, sizeof(request) - 1 - request_length, 0);
+            if (bytes_received <= 0) { break; }
+
+            request_length += bytes_received;
+            request[request_length] = '\0';
+            if (strstr(request, "\r\n\r\n")) { break; }
+        }
+
+        char response[4096];
+        i32 response_length = snprintf(response, sizeof(response), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n%.*s", body_length, (int) body_length, body);
+        send(client, response, response_length, MSG_NOSIGNAL);
+        close(client);
+    }
+
+    return NULL;
+}
+
+static void* swarm_seeder_run(void* argument) {
+    SwarmListener* listener = (SwarmListener*) argument;
+
+    while (true) {
+        i32 client = accept(listener->socket, NULL, NULL);
+        if (client == -1) {
+            if (errno == EINTR) { continue; }
+            break;
+        }
+
+        SwarmConnection* connection = (SwarmConnection*) calloc(1, sizeof(SwarmConnection));
+        if (!connection) {
+            close(client);
+            continue;
+        }
+
+        connection->socket = client;
+        connection->seeder = listener->seeder;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, swarm_connection_run, connection) != 0) {
+            close(client);
+            free(connection);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+/*
+ * a plain BEP 3 seed. requests are answered in order once their due time (arrival plus
+ * the round trip latency, plus a retransmission timeout if "lost") has passed and the
+ * bandwidth bucket has room, so a lost response holds up the ones behind it like tcp would
+ */
+static void* swarm_connection_run(void* argument) {
+    SwarmConnection* connection = (SwarmConnection*) argument;
+
+    if (swarm_connection_handshake(connection)) {
+        u64 now = swarm_now_ns();
+        connection->choked = true;
+        connection->tokens_refilled_ns = now;
+        if (swarm_config.choke_period_ms > 0) {
+            // spread the seeders out so they don't all choke at once
+            connection->next_toggle_ns = now + ((u64) (rand() % swarm_config.choke_period_ms) * 1000000ULL);
+        }
+
+        while (true) {
+            now = swarm_now_ns();
+
+            u64 wake_ns = now + 1000000000ULL;
+            if (!swarm_connection_choke_update(connection, now)) { break; }
+            if (!swarm_connection_queue_send(connection, now, &wake_ns)) { break; }
+            if (connection->next_toggle_ns != 0 && connection->next_toggle_ns < wake_ns) { wake_ns = connection->next_toggle_ns; }
+            if (connection->layer && connection->layer_due_ns <= now) {
+                bool sent = swarm_connection_send(connection, connection->layer, connection->layer_length);
+                free(connection->layer);
+                connection->layer = NULL;
+                if (!sent) { break; }
+            }
+            if (connection->layer && connection->layer_due_ns < wake_ns) { wake_ns = connection->layer_due_ns; }
+
+            now = swarm_now_ns();
+            i32 timeout_ms = (wake_ns > now) ? (i32) ((wake_ns - now + 999999) / 1000000) : 0;
+
+            struct pollfd poll_socket = { .fd = connection->socket, .events = POLLIN };
+            if (poll(&poll_socket, 1, timeout_ms) == -1 && errno != EINTR) { break; }
+            if ((poll_socket.revents & (POLLIN | POLLHUP | POLLERR)) && !swarm_connection_receive(connection)) { break; }
+        }
+    }
+
+    close(connection->socket);
+    if (connection->layer) { free(connection->layer); }
+    free(connection);
+    return NULL;
+}
+
+static bool swarm_connection_handshake(SwarmConnection* connection) {
+    u8 handshake[68];
+    usize received = 0;
+    while (received < sizeof(handshake)) {
+        ssize_t bytes_received = recv(connection->socket, handshake + received, sizeof(handshake) - received, 0);
+        if (bytes_received <= 0) { return false; }
+        received += bytes_received;
+    }
+
+    if (handshake[0] != 19 || memcmp(handshake + 28, swarm_info_hash, 20) != 0) { return false; }
+
+    // no reserved bits, every seeder speaks the base protocol only, and BEP 52 for a v2 torrent
+    memset(handshake + 20, 0, 8);
+    if (swarm_config.v2) { handshake[27] = TORRENT_MERKLE_RESERVED_BIT; }
+    char peer_id[21]; // the id is the last 20 bytes, no room for snprintf's terminator
+    snprintf(peer_id, sizeof(peer_id), "-SW0001-%012u", connection->seeder);
+    memcpy(handshake + 48, peer_id, 20);
+
+    u32 pieces_length = (swarm_config.size + swarm_config.piece_length - 1) / swarm_config.piece_length;
+    usize bitfield_length = (pieces_length + 7) / 8;
+    u8* bitfield = (u8*) malloc(sizeof(u8) * (5 + bitfield_length));
+    if (!bitfield) { return false; }
+
+    buffer_write_big_endian(bitfield, 1 + bitfield_length);
+    bitfield[4] = TORRENT_PEER_MESSAGE_BITFIELD;
+    memset(bitfield + 5, 0xFF, bitfield_length);
+    if (pieces_length % 8 != 0) { bitfield[5 + bitfield_length - 1] = (u8) (0xFF << (8 - (pieces_length % 8))); }
+
+    bool success = swarm_connection_send(connection, handshake, sizeof(handshake)) && swarm_connection_send(connection, bitfield, 5 + bitfield_length);
+    free(bitfield);
+
+    return success;
+}
+
+static bool swarm_connection_receive(SwarmConnection* connection) {
+    ssize_t bytes_received = recv(connection->socket, connection->input + connection->input_length, sizeof(connection->input) - connection->input_length, 0);
+    if (bytes_received <= 0) { return false; }
+    connection->input_length += bytes_received;
+
+    usize offset = 0;
+    while (connection->input_length - offset >= 4) {
+        u32 message_length = buffer_read_big_endian(connection->input + offset);
+        if (message_length > sizeof(connection->input) - 4) { return false; }
+        if (connection->input_length - offset < 4 + message_length) { break; }
+
+        if (message_length > 0) {
+            u8* message = connection->input + offset + 4;
+            if (!swarm_connection_message_handle(connection, message[0], message + 1, message_length - 1)) { return false; }
+        }
+        offset += 4 + message_length;
+    }
+
+    memmove(connection->input, connection->input + offset, connection->input_length - offset);
+    connection->input_length -= offset;
+    return true;
+}
+
+static bool swarm_connection_message_handle(SwarmConnection* connection, u8 id, const u8* payload, u32 payload_length) {
+    switch (id) {
+        case TORRENT_PEER_MESSAGE_INTERESTED: {
+            connection->interested = true;
+
+            // a choking phase in progress keeps the peer waiting until the next toggle
+            bool choke_phase = swarm_config.choke_period_ms > 0 && connection->next_toggle_ns == 0;
+            if (connection->choked && !choke_phase) {
+                u8 unchoke[5] = { 0, 0, 0, 1, TORRENT_PEER_MESSAGE_UNCHOKE };
+                connection->choked = false;
+                return swarm_connection_send(connection, unchoke, sizeof(unchoke));
+            }
+        } break;
+        case TORRENT_PEER_MESSAGE_NOT_INTERESTED: connection->interested = false; break;
+        case TORRENT_PEER_MESSAGE_REQUEST: {
+            if (payload_length != 12) { return false; }
+            if (connection->choked || connection->queue_length == SWARM_QUEUE_LENGTH) { break; } // dropped, as BEP 3 allows
+
+            SwarmRequest* request = &connection->queue[(connection->queue_start + connection->queue_length) % SWARM_QUEUE_LENGTH];
+            request->index = buffer_read_big_endian(payload);
+            request->begin = buffer_read_big_endian(payload + 4);
+            request->length = buffer_read_big_endian(payload + 8);
+
+            u64 delay_ms = swarm_config.latency_ms;
+            if (swarm_config.loss_percent > 0 && (u32) (rand() % 100) < swarm_config.loss_percent) { delay_ms += SWARM_LOSS_PENALTY_MS; }
+            request->due_ns = swarm_now_ns() + (delay_ms * 1000000ULL);
+
+            // nothing may overtake a delayed response on the same connection
+            if (connection->queue_length > 0) {
+                SwarmRequest* previous = &connection->queue[(connection->queue_start + connection->queue_length - 1) % SWARM_QUEUE_LENGTH];
+                if (request->due_ns < previous->due_ns) { request->due_ns = previous->due_ns; }
+            }
+
+            u64 begin = ((u64) request->index * swarm_config.piece_length) + request->begin;
+            if (request->length == 0 || request->length > TORRENT_PEER_BLOCK_LENGTH || begin + request->length > swarm_config.size) { return false; }
+
+            connection->queue_length++;
+        } break;
+        case TORRENT_PEER_MESSAGE_CANCEL: {
+            if (payload_length != 12) { return false; }
+
+            u32 index = buffer_read_big_endian(payload);
+            u32 begin = buffer_read_big_endian(payload + 4);
+            for (usize i = 0; i < connection->queue_length; i++) {
+                SwarmRequest* request = &connection->queue[(connection->queue_start + i) % SWARM_QUEUE_LENGTH];
+                if (request->index == index && request->begin == begin) { request->length = 0; } // skipped when due
+            }
+        } break;
+        case TORRENT_PEER_MESSAGE_HASH_REQUEST: return swarm_connection_hash_request_handle(connection, payload, payload_length);
+        default: break;
+    }
+
+    return true;
+}
+
+/*
+ * a piece's block hashes are sent right away, the whole piece layer after the layer delay.
+ * those are the only requests the downloader makes of a single file that fits one layer chunk
+ */
+static bool swarm_connection_hash_request_handle(SwarmConnection* connection, const u8* payload, u32 payload_length) {
+    TorrentMerkleRequest request;
+    if (!swarm_config.v2 || !torrent_merkle_request_parse(payload, payload_length, &request)) { return false; }
+
+    u32 piece_blocks = swarm_config.piece_length / TORRENT_MERKLE_BLOCK_LENGTH;
+    u32 pieces_length = (swarm_config.size + swarm_config.piece_length - 1) / swarm_config.piece_length;
+
+    const u8* hashes = NULL;
+    if (memcmp(request.pieces_root, swarm_pieces_root, TORRENT_MERKLE_HASH_LENGTH) != 0 || request.proof_layers != 0) {
+        hashes = NULL;
+    } else if (request.base_layer == 0 && request.length == piece_blocks && request.index % piece_blocks == 0 && request.index / piece_blocks < pieces_length) {
+        hashes = swarm_block_hashes + ((usize) request.index * TORRENT_MERKLE_HASH_LENGTH);
+    } else if (request.base_layer == torrent_merkle_layers(piece_blocks) && request.index == 0 && request.length == swarm_piece_layer_width) {
+        hashes = swarm_piece_layer;
+    }
+
+    usize hashes_length = hashes ? (usize) request.length * TORRENT_MERKLE_HASH_LENGTH : 0;
+    usize message_length = 5 + TORRENT_MERKLE_REQUEST_LENGTH + hashes_length;
+    u8* message = (u8*) malloc(sizeof(u8) * message_length);
+    if (!message) { return false; }
+
+    buffer_write_big_endian(message, message_length - 4);
+    message[4] = hashes ? TORRENT_PEER_MESSAGE_HASHES : TORRENT_PEER_MESSAGE_HASH_REJECT;
+    torrent_merkle_request_write(message + 5, &request);
+    if (hashes) { memcpy(message + 5 + TORRENT_MERKLE_REQUEST_LENGTH, hashes, hashes_length); }
+
+    // one layer answer is held at a time, a repeated request while it waits is dropped
+    if (hashes == swarm_piece_layer && swarm_config.layer_delay_ms > 0) {
+        if (connection->layer) {
+            free(message);
+            return true;
+        }
+        connection->layer = message;
+        connection->layer_length = message_length;
+        connection->layer_due_ns = swarm_now_ns() + ((u64) swarm_config.layer_delay_ms * 1000000ULL);
+        return true;
+    }
+
+    bool success = swarm_connection_send(connection, message, message_length);
+    free(message);
+    return success;
+}
+
+/* alternates between choking and unchoking every choke period, choking drops the queue */
+static bool swarm_connection_choke_update(SwarmConnection* connection, u64 now) {
+    if (swarm_config.choke_period_ms == 0 || now < connection->next_toggle_ns) { return true; }
+
+    u64 period_ns = (u64) swarm_config.choke_period_ms * 1000000ULL;
+    connection->next_toggle_ns = now + period_ns;
+
+    if (!connection->choked) {
+        u8 choke[5] = { 0, 0, 0, 1, TORRENT_PEER_MESSAGE_CHOKE };
+        connection->choked = true;
+        connection->queue_length = 0;
+        return swarm_connection_send(connection, choke, sizeof(choke));
+    }
+
+    if (connection->interested) {
+        u8 unchoke[5] = { 0, 0, 0, 1, TORRENT_PEER_MESSAGE_UNCHOKE };
+        connection->choked = false;
+        return swarm_connection_send(connection, unchoke, sizeof(unchoke));
+    }
+    return true;
+}
+
+/* sends every response that is due and fits the bandwidth bucket, *wake_ns is when to try again */
+static bool swarm_connection_queue_send(SwarmConnection* connection, u64 now, u64* wake_ns) {
+    if (swarm_config.bandwidth > 0) {
+        // at most 100ms worth of burst, but always room for one block
+        double capacity = swarm_config.bandwidth / 10.0;
+        if (capacity < TORRENT_PEER_BLOCK_LENGTH) { capacity = TORRENT_PEER_BLOCK_LENGTH; }
+
+        connection->tokens += (now - connection->tokens_refilled_ns) * (swarm_config.bandwidth / 1e9);
+        if (connection->tokens > capacity) { connection->tokens = capacity; }
+        connection->tokens_refilled_ns = now;
+    }
+
+    static __thread u8 message[13 + TORRENT_PEER_BLOCK_LENGTH];
+    while (connection->queue_length > 0) {
+        SwarmRequest* request = &connection->queue[connection->queue_start];
+        if (request->length > 0) {
+            if (request->due_ns > now) {
+                *wake_ns = request->due_ns;
+                return true;
+            }
+
+            if (swarm_config.bandwidth > 0 && connection->tokens < request->length) {
+                *wake_ns = now + (u64) (((request->length - connection->tokens) / swarm_config.bandwidth) * 1e9) + 1;
+                return true;
+            }
+
+            buffer_write_big_endian(message, 9 + request->length);
+            message[4] = TORRENT_PEER_MESSAGE_PIECE;
+            buffer_write_big_endian(message + 5, request->index);
+            buffer_write_big_endian(message + 9, request->begin);
+            memcpy(message + 13, swarm_payload + ((u64) request->index * swarm_config.piece_length) + request->begin, request->length);
+
+            if (!swarm_connection_send(connection, message, 13 + request->length)) { return false; }
+
+            connection->tokens -= request->length;
+            swarm_stats_sent(request->length);
+        }
+
+        connection->queue_start = (connection->queue_start + 1) % SWARM_QUEUE_LENGTH;
+        connection->queue_length--;
+    }
+
+    return true;
+}
+
+static bool swarm_connection_send(SwarmConnection* connection, const u8* data, usize length) {
+    usize sent = 0;
+    while (sent < length) {
+        ssize_t bytes_sent = send(connection->socket, data + sent, length - sent, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            if (errno == EINTR) { continue; }
+            return false;
+        }
+        sent += bytes_sent;
+    }
+    return true;
+}
+
+static void swarm_stats_sent(u32 length) {
+    u64 now = swarm_now_ns();
+
+    pthread_mutex_lock(&swarm_stats.mutex);
+    if (swarm_stats.first_byte_ns == 0) { swarm_stats.first_byte_ns = now; }
+
+    u64 low_mark = swarm_config.size / 10;
+    u64 high_mark = swarm_config.size - low_mark;
+    if (swarm_stats.bytes_sent < low_mark && swarm_stats.bytes_sent + length >= low_mark) { swarm_stats.low_mark_ns = now; }
+    if (swarm_stats.bytes_sent < high_mark && swarm_stats.bytes_sent + length >= high_mark) { swarm_stats.high_mark_ns = now; }
+
+    swarm_stats.bytes_sent += length;
+    pthread_mutex_unlock(&swarm_stats.mutex);
+}
+
+static void* swarm_web_seed_run(void* argument) {
+    SwarmListener* listener = (SwarmListener*) argument;
+
+    while (true) {
+        i32 client = accept(listener->socket, NULL, NULL);
+        if (client == -1) {
+            if (errno == EINTR) { continue; }
+            break;
+        }
+
+        SwarmWebSeedConnection* connection = (SwarmWebSeedConnection*) calloc(1, sizeof(SwarmWebSeedConnection));
+        if (!connection) {
+            close(client);
+            continue;
+        }
+
+        connection->socket = client;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, swarm_web_seed_connection_run, connection) != 0) {
+            close(client);
+            free(connection);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+/* answers pipelined requests in order, each one no earlier than a round trip after it arrived */
+static void* swarm_web_seed_connection_run(void* argument) {
+    SwarmWebSeedConnection* connection = (SwarmWebSeedConnection*) argument;
+
+    while (true) {
+        char* end = memmem(connection->input, connection->input_length, "\r\n\r\n", 4);
+        if (!end) {
+            if (connection->input_length == sizeof(connection->input) - 1) { break; }
+
+            ssize_t bytes_received = recv(connection->socket, connection->input + connection->input_length, sizeof(connection->input) - 1 - connection->input_length, 0);
+            if (bytes_received <= 0) { break; }
+
+            connection->input_length += bytes_received;
+            connection->input[connection->input_length] = '\0';
+            connection->received_ns = swarm_now_ns();
+            continue;
+        }
+
+        *end = '\0';
+        if (!swarm_web_seed_request_handle(connection, connection->input)) { break; }
+
+        usize request_length = (end + 4) - connection->input;
+        memmove(connection->input, connection->input + request_length, connection->input_length - request_length);
+        connection->input_length -= request_length;
+        connection->input[connection->input_length] = '\0';
+    }
+
+    close(connection->socket);
+    free(connection);
+    return NULL;
+}
+
+static bool swarm_web_seed_request_handle(SwarmWebSeedConnection* connection, const char* request) {
+    char path[256];
+    unsigned long long first;
+    unsigned long long last;
+    const char* range = strstr(request, "\r\nRange: bytes=");
+    if (sscanf(request, "GET %255s HTTP/1.1", path) != 1 || strcmp(path, "/" SWARM_TORRENT_NAME) != 0
+        || !range || sscanf(range, "\r\nRange: bytes=%llu-%llu", &first, &last) != 2 || first > last || last >= swarm_config.size) {
+        const char* response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send(connection->socket, response, strlen(response), MSG_NOSIGNAL);
+        return false;
+    }
+
+    u64 due_ns = connection->received_ns + ((u64) swarm_config.latency_ms * 1000000ULL);
+    u64 now = swarm_now_ns();
+    if (due_ns > now) {
+        struct timespec delay = { (due_ns - now) / 1000000000ULL, (due_ns - now) % 1000000000ULL };
+        nanosleep(&delay, NULL);
+    }
+
+    char headers[256];
+    i32 headers_length = snprintf(headers, sizeof(headers), "HTTP/1.1 206 Partial Content\r\nContent-Length: %llu\r\nContent-Range: bytes %llu-%llu/%llu\r\n\r\n",
+        last - first + 1, first, last, (unsigned long long) swarm_config.size);
+    if (send(connection->socket, headers, headers_length, MSG_NOSIGNAL) != headers_length) { return false; }
+
+    // sent a block at a time so the bandwidth cap applies like it does to seeders
+    for (u64 offset = first; offset <= last;) {
+        u32 length = (last + 1 - offset < TORRENT_PEER_BLOCK_LENGTH) ? last + 1 - offset : TORRENT_PEER_BLOCK_LENGTH;
+
+        if (swarm_config.bandwidth > 0) {
+            now = swarm_now_ns();
+            if (connection->next_send_ns < now) { connection->next_send_ns = now; }
+            if (connection->next_send_ns > now) {
+                struct timespec delay = { (connection->next_send_ns - now) / 1000000000ULL, (connection->next_send_ns - now) % 1000000000ULL };
+                nanosleep(&delay, NULL);
+            }
+            connection->next_send_ns += (u64) ((length * 1e9) / swarm_config.bandwidth);
+        }
+
+        usize sent = 0;
+        while (sent < length) {
+            ssize_t bytes_sent = send(connection->socket, swarm_payload + offset + sent, length - sent, MSG_NOSIGNAL);
+            if (bytes_sent == -1) {
+                if (errno == EINTR) { continue; }
+                return false;
+            }
+            sent += bytes_sent;
+        }
+
+        swarm_stats_sent(length);
+        offset += length;
+    }
+
+    return true;
+}
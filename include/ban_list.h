@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "types.h"
+
+#define TORRENT_BAN_LIST_MAX 4096
+
+/*
+ * addresses caught sending corrupt data. the list belongs to the process, not a torrent,
+ * so a peer banned by one download is never dialed by another. safe from any thread
+ */
+bool torrent_ban_list_add(const char* ip);
+bool torrent_ban_list_contains(const char* ip);
+usize torrent_ban_list_length();
@@ -1,7 +1,12 @@
 #pragma once
 
+#include <stdbool.h>
+
 #include "types.h"
 
+#define BENCODE_PARSER_DEPTH_MAX 64 // lists and dictionaries inside each other, deeper input is rejected
+#define BENCODE_WRITER_DEPTH_MAX 16
+
 typedef enum BencodeObjectType {
 	STRING,
 	INTEGER,
@@ -16,19 +21,58 @@ typedef struct BencodeObjectKeyValue {
 
 typedef struct BencodeObject {
 	BencodeObjectType type;
-	u8* bencode_data;
-	usize bencode_data_length;
+	// where the object was in the parsed input, e.g. to hash an info dictionary as it came
+	usize bencode_offset;
+	usize bencode_length;
 
 	u8* string;
 	usize string_length;
-	i32 number;
+	i64 number;
 	struct BencodeObject** list;
 	usize list_length;
 	BencodeObjectKeyValue* dictionary;
 	usize dictionary_length;
 } BencodeObject;
 
+typedef struct BencodeWriterLevel {
+	bool dictionary;
+	bool value_next; // a dictionary has its key and is waiting for the value
+	const u8* last_key;
+	usize last_key_length;
+} BencodeWriterLevel;
+
+/*
+ * writes bencode into one caller-owned buffer and never allocates. with data NULL nothing
+ * is written and length ends up as the exact encoded size, so a message can be measured
+ * first and then written into a buffer of exactly that size
+ */
+typedef struct BencodeWriter {
+	u8* data;
+	usize capacity;
+	usize length;
+	bool failed; // out of space, unbalanced, or dictionary keys out of order
+
+	BencodeWriterLevel levels[BENCODE_WRITER_DEPTH_MAX];
+	usize depth;
+} BencodeWriter;
+
 BencodeObject* bencode_object_parse(u8* bencoded_string, usize bencoded_string_length, usize* bencoded_string_index);
 BencodeObject* bencode_object_dictionary_get(BencodeObject* dictionary, const char* key);
 void bencode_object_print(BencodeObject* object);
 void bencode_object_destroy(BencodeObject* object);
+
+void bencode_object_write(BencodeWriter* writer, BencodeObject* object);
+usize bencode_object_encoded_length(BencodeObject* object);
+u8* bencode_object_encode(BencodeObject* object, usize* length);
+
+void bencode_writer_init(BencodeWriter* writer, u8* data, usize capacity);
+void bencode_writer_integer(BencodeWriter* writer, i64 number);
+void bencode_writer_string(BencodeWriter* writer, const void* string, usize string_length);
+void bencode_writer_text(BencodeWriter* writer, const char* text);
+u8* bencode_writer_string_reserve(BencodeWriter* writer, usize string_length);
+void bencode_writer_raw(BencodeWriter* writer, const void* data, usize length);
+void bencode_writer_key(BencodeWriter* writer, const char* key);
+void bencode_writer_list_begin(BencodeWriter* writer);
+void bencode_writer_dictionary_begin(BencodeWriter* writer);
+void bencode_writer_end(BencodeWriter* writer);
+bool bencode_writer_finish(BencodeWriter* writer);
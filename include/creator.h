@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "metadata.h"
+#include "types.h"
+
+#define TORRENT_CREATOR_PIECE_LENGTH_MIN (16 * 1024)
+#define TORRENT_CREATOR_PIECE_LENGTH_MAX (16 * 1024 * 1024)
+#define TORRENT_CREATOR_PIECES_TARGET 2048 // the picked piece length is the smallest that stays under this
+#define TORRENT_CREATOR_THREADS_MAX 64
+#define TORRENT_CREATOR_NAME "bittorrent-client"
+
+typedef struct TorrentCreatorOptions {
+    const char* path; // a file or a directory, directories are walked recursively
+
+    // every tracker gets a tier of its own, the first one is also the announce
+    const char** announce_list;
+    usize announce_list_length;
+
+    usize piece_length; // 0 picks one from the total size
+    u32 threads; // 0 uses every online core
+} TorrentCreatorOptions;
+
+TorrentMetadata* torrent_creator_create(const TorrentCreatorOptions* options);
+usize torrent_creator_piece_length(u64 length);
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+#include <netinet/in.h>
+#include <time.h>
+
+#include "tracker.h"
+#include "types.h"
+
+#define DHT_K 8
+#define DHT_ALPHA 3
+#define DHT_BUCKET_COUNT 160
+#define DHT_TOKEN_LENGTH 8
+#define DHT_STORED_PEERS_MAX 1024
+#define DHT_LOOKUPS_MAX 4
+
+struct DHTLookup;
+
+typedef struct DHTNode {
+    u8 id[20];
+    struct sockaddr_in address;
+    time_t last_seen;
+    u8 failed_queries;
+} DHTNode;
+
+typedef struct DHTBucket {
+    DHTNode nodes[DHT_K];
+    usize nodes_length;
+} DHTBucket;
+
+/* peers other nodes announced to us, handed out in get_peers responses */
+typedef struct DHTStoredPeer {
+    u8 info_hash[20];
+    struct sockaddr_in address;
+    time_t announced;
+} DHTStoredPeer;
+
+typedef struct DHT {
+    i32 socket;
+    u16 port;
+    u8 id[20];
+
+    DHTBucket buckets[DHT_BUCKET_COUNT];
+
+    u8 token_secret[20];
+    u8 previous_token_secret[20];
+    time_t token_secret_changed;
+
+    DHTStoredPeer* stored_peers;
+    usize stored_peers_length;
+
+    // lookups never block, dht_process moves them along as answers come in and queries time out
+    struct DHTLookup* lookups[DHT_LOOKUPS_MAX];
+    usize lookups_length;
+
+    u16 transaction_counter;
+    char* routing_table_path;
+} DHT;
+
+DHT* dht_create(u16 port, const char* routing_table_path);
+bool dht_bootstrap(DHT* dht, const char* host, const char* port);
+usize dht_nodes_count(DHT* dht);
+bool dht_get_peers(DHT* dht, const u8 info_hash[20], u16 announce_port);
+bool dht_lookups_active(DHT* dht);
+void dht_process(DHT* dht);
+TorrentTrackerPeer* dht_peers_take(DHT* dht, usize* peers_length);
+bool dht_routing_table_save(DHT* dht, const char* path);
+void dht_destroy(DHT* dht);
@@ -1,16 +1,120 @@
 #pragma once
 
+#include <stdbool.h>
+
+#include "dht.h"
+#include "hash_exchange.h"
 #include "metadata.h"
+#include "metadata_exchange.h"
+#include "metrics.h"
 #include "peer.h"
+#include "peer_store.h"
+#include "picker.h"
+#include "replay.h"
+#include "shard.h"
+#include "smart_ban.h"
+#include "storage.h"
+#include "stream.h"
+#include "super_seed.h"
+#include "trace.h"
+#include "tracker.h"
 #include "types.h"
+#include "web_seed.h"
+
+#define TORRENT_DOWNLOADER_DHT_PORT 6881
+#define TORRENT_DOWNLOADER_DHT_ROUTING_TABLE "dht.dat"
+#define TORRENT_DOWNLOADER_LISTEN_PORT 6881
+
+#define TORRENT_DOWNLOADER_PEERS_MAX 50
+#define TORRENT_DOWNLOADER_WEB_SEEDS_MAX 8
+#define TORRENT_DOWNLOADER_CONNECTING_MAX 10
+#define TORRENT_DOWNLOADER_UNCHOKE_SLOTS 8 // peers we upload to at once
+#define TORRENT_DOWNLOADER_UNCHOKE_ROTATE_MS 30000 // after this long a slot goes to a peer still waiting for one
+#define TORRENT_DOWNLOADER_CONNECT_TIMEOUT_MS 10000
+#define TORRENT_DOWNLOADER_HANDSHAKE_TIMEOUT_MS 10000
+#define TORRENT_DOWNLOADER_REQUEST_TIMEOUT_MS 60000
+#define TORRENT_DOWNLOADER_INACTIVITY_TIMEOUT_MS 180000
+#define TORRENT_DOWNLOADER_KEEP_ALIVE_MS 90000
+#define TORRENT_DOWNLOADER_DISCOVER_INTERVAL_MS 30000
+#define TORRENT_DOWNLOADER_PEER_STORE_SAVE_INTERVAL_MS 60000
+#define TORRENT_DOWNLOADER_METRICS_SNAPSHOT_INTERVAL_MS 10000
+#define TORRENT_DOWNLOADER_DUPLICATES_MAX 64 // identical v2 files completed along with a verified piece
+#define TORRENT_DOWNLOADER_CULPRITS_MAX 16 // senders of bad blocks banned when a failed piece finally passes
 
 typedef struct TorrentDownloader {
     char peer_id[20];
+    u8 info_hash[20];
+    char info_hash_hex[41];
+
+    // may be turned off between create and run, e.g. to keep a test swarm off the network. a
+    // router set then, host and port, is bootstrapped from instead of the public ones
+    bool dht_enabled;
+    const char* dht_router[2];
+    DHT* dht;
+
+    char** trackers;
+    usize trackers_length;
+
+    // metadata, picker, storage and smart ban stay NULL until a magnet link's info dictionary arrives
     TorrentMetadata* metadata;
+    TorrentMetadataExchange* metadata_exchange;
+    TorrentHashExchange* hash_exchange; // v2 and hybrid torrents only
+    TorrentPicker* picker;
+    TorrentStorage* storage;
+    TorrentSmartBan* smart_ban;
 
     TorrentPeer** peers;
     usize peers_length;
+
+    // set between create and run, 0 keeps every connection's socket on the run thread. otherwise
+    // connections are spread over that many network threads and stay on theirs until they close
+    u32 shards_length;
+    TorrentShard** shards;
+    TorrentShardMailbox shard_events;
+    u64 connections_next;
+
+    // the torrent's http mirrors, fetching long runs of pieces while peers fill the gaps
+    TorrentWebSeed** web_seeds;
+    usize web_seeds_length;
+
+    // every address we ever heard of, including the ones saved by earlier runs
+    TorrentPeerStore* peer_store;
+
+    // set between create and run. port 0 never accepts peers, keep seeding serves the torrent
+    // after the last piece until the process is stopped
+    u16 listen_port;
+    i32 listen_socket;
+    bool keep_seeding;
+    bool seeding; // every piece is verified and we stayed to serve them
+    bool copy_distributed; // the connected peers held a full copy between them at some point
+    u64 bytes_uploaded;
+
+    // set between create and run, only a seed with every piece when run starts super seeds
+    bool super_seeding;
+    TorrentSuperSeed* super_seed;
+
+    // set between create and run, port 0 and a NULL path leave them off. the path isn't owned
+    u16 metrics_port;
+    const char* metrics_snapshot_path;
+    TorrentMetricsServer* metrics_server;
+
+    // set between create and run, not owned. a trace records every connection, a replay
+    // stands in for the network and plays one back, with no dht, web seeds or listen socket
+    TorrentTrace* trace;
+    TorrentReplay* replay;
+
+    // set between create and run to download in reading order, not owned
+    TorrentStream* stream;
+    u32 race_rate_min; // peers at least this fast race late window blocks
+
+    i64 last_discover;
+    i64 last_peer_store_save;
+    i64 last_metrics_snapshot;
 } TorrentDownloader;
 
 TorrentDownloader* torrent_downloader_create(const char* torrent_file);
+TorrentDownloader* torrent_downloader_create_from_magnet(const char* magnet_uri);
+bool torrent_downloader_recheck(TorrentDownloader* downloader);
+bool torrent_downloader_run(TorrentDownloader* downloader);
+bool torrent_downloader_candidate_add(TorrentDownloader* downloader, const char* ip, const char* port);
 void torrent_downloader_destroy(TorrentDownloader* downloader);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "types.h"
+
+#define TORRENT_EXTENSION_RESERVED_BIT 0x10
+#define TORRENT_EXTENSION_HANDSHAKE_ID 0
+#define TORRENT_EXTENSION_REQUEST_QUEUE_LENGTH 250
+#define TORRENT_EXTENSION_MESSAGE_MAX 8192 // handshakes and pex are parsed only up to this, ut_metadata bounds its own
+
+// the ids we hand out in our extended handshake, peers use them when messaging us
+#define TORRENT_EXTENSION_UT_PEX_ID 1
+#define TORRENT_EXTENSION_UT_METADATA_ID 2
+
+typedef struct TorrentExtensions {
+    bool handshake_received;
+
+    // the peer's own message ids, 0 when it doesn't support the extension
+    u8 ut_pex;
+    u8 ut_metadata;
+
+    u16 listen_port;
+    u32 metadata_size;
+    u32 request_queue_length;
+    char client[64];
+} TorrentExtensions;
+
+struct TorrentPeer;
+struct BencodeWriter;
+
+// writes one message dictionary, called once to measure and once to encode
+typedef void (*TorrentExtensionWrite)(struct BencodeWriter* writer, const void* context);
+
+bool torrent_extension_handshake_send(struct TorrentPeer* peer, u16 listen_port, u32 metadata_size);
+bool torrent_extension_handshake_handle(struct TorrentPeer* peer, const u8* payload, usize payload_length);
+bool torrent_extension_message_send(struct TorrentPeer* peer, u8 extension_id, const u8* payload, usize payload_length);
+u8* torrent_extension_message_reserve(struct TorrentPeer* peer, u8 extension_id, usize payload_length);
+bool torrent_extension_message_encode(struct TorrentPeer* peer, u8 extension_id, TorrentExtensionWrite write, const void* context, const u8* trailer, usize trailer_length);
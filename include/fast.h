@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "types.h"
+
+#define TORRENT_FAST_RESERVED_BIT 0x04 // reserved[7], BEP 6
+#define TORRENT_FAST_ALLOWED_SET_LENGTH 10
+#define TORRENT_FAST_ALLOWED_MAX 32
+#define TORRENT_FAST_SUGGESTED_MAX 16
+
+typedef struct TorrentFastState {
+    // pieces the peer lets us request while it chokes us
+    u32 allowed[TORRENT_FAST_ALLOWED_MAX];
+    usize allowed_length;
+
+    // pieces the peer would like us to request, usually because they are in its cache
+    u32 suggested[TORRENT_FAST_SUGGESTED_MAX];
+    usize suggested_length;
+
+    // the set we computed for the peer, served even while we choke it
+    u32 granted[TORRENT_FAST_ALLOWED_SET_LENGTH];
+    usize granted_length;
+
+    // have all arrived before we knew how many pieces there are
+    bool have_all;
+} TorrentFastState;
+
+usize torrent_fast_allowed_set(const char* ip, const u8 info_hash[20], u32 pieces_length, u32* set, usize set_length);
+void torrent_fast_allowed_add(TorrentFastState* state, u32 index);
+void torrent_fast_suggested_add(TorrentFastState* state, u32 index);
+bool torrent_fast_is_allowed(TorrentFastState* state, u32 index);
+bool torrent_fast_is_granted(TorrentFastState* state, u32 index);
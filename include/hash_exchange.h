@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "merkle.h"
+#include "metadata.h"
+#include "picker.h"
+#include "storage.h"
+#include "types.h"
+
+#define TORRENT_HASH_EXCHANGE_REQUEST_TIMEOUT_MS 30000 // before the same hashes are asked for again
+#define TORRENT_HASH_EXCHANGE_LAYER_CHUNK 512 // piece layer hashes asked for in one request
+
+/*
+ * the hashes of a v2 or hybrid torrent (BEP 52). block hashes are fetched for the pieces
+ * being downloaded so every 16 KiB block is checked on its own, piece layers missing from
+ * the metadata (magnet links) are fetched with proofs up to the file's root, and peers are
+ * served both. hashes from peers are only kept once they prove out against one we trust
+ */
+typedef struct TorrentHashExchange {
+    // not owned
+    TorrentMetadata* metadata;
+    TorrentPicker* picker;
+    TorrentStorage* storage;
+
+    u32 piece_blocks; // leaves below a piece layer hash
+    u32 piece_layer; // how far above the leaves piece hashes sit
+    u8 piece_pad[TORRENT_MERKLE_HASH_LENGTH]; // a piece layer hash past the end of a file
+
+    // indexed by piece
+    TorrentMetadataInfoFile** piece_files; // NULL where no v2 file has data, e.g. padding
+    u8** block_hashes; // proven hashes of the blocks of a piece still downloading
+    i64* hashes_requested;
+    i64* layers_requested; // by the first piece of a piece layer chunk
+} TorrentHashExchange;
+
+struct TorrentPeer;
+
+TorrentHashExchange* torrent_hash_exchange_create(TorrentMetadata* metadata, TorrentPicker* picker, TorrentStorage* storage);
+bool torrent_hash_exchange_piece_request(TorrentHashExchange* exchange, struct TorrentPeer* peer, u32 index);
+bool torrent_hash_exchange_layers_request(TorrentHashExchange* exchange, struct TorrentPeer* peer);
+
+bool torrent_hash_exchange_block_verify(TorrentHashExchange* exchange, u32 index, u32 begin, const u8* data, u32 length);
+bool torrent_hash_exchange_piece_verify(TorrentHashExchange* exchange, u32 index, const u8* data, bool* valid);
+void torrent_hash_exchange_piece_done(TorrentHashExchange* exchange, u32 index);
+usize torrent_hash_exchange_duplicates(TorrentHashExchange* exchange, u32 index, u32* duplicates, usize duplicates_max);
+
+bool torrent_hash_exchange_request_handle(TorrentHashExchange* exchange, struct TorrentPeer* peer, const u8* payload, usize payload_length);
+bool torrent_hash_exchange_hashes_handle(TorrentHashExchange* exchange, struct TorrentPeer* peer, const u8* payload, usize payload_length);
+bool torrent_hash_exchange_reject_handle(TorrentHashExchange* exchange, const u8* payload, usize payload_length);
+void torrent_hash_exchange_destroy(TorrentHashExchange* exchange);
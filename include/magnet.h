@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "tracker.h"
+#include "types.h"
+
+/* magnet:?xt=urn:btih:<info hash>&dn=<name>&tr=<tracker>&x.pe=<host:port> */
+typedef struct TorrentMagnet {
+    u8 info_hash[20];
+    char* name;
+
+    char** trackers;
+    usize trackers_length;
+
+    // peers given directly in the link, usually by a client sharing it
+    TorrentTrackerPeer* peers;
+    usize peers_length;
+} TorrentMagnet;
+
+TorrentMagnet* torrent_magnet_parse(const char* uri);
+void torrent_magnet_destroy(TorrentMagnet* magnet);
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "types.h"
+
+#define TORRENT_MERKLE_RESERVED_BIT 0x10 // reserved[7], BEP 52
+#define TORRENT_MERKLE_HASH_LENGTH 32
+#define TORRENT_MERKLE_BLOCK_LENGTH 16384 // every leaf covers 16 KiB, whatever the piece length
+#define TORRENT_MERKLE_HASHES_MAX 8192 // the most base layer hashes sent or accepted in one message
+#define TORRENT_MERKLE_REQUEST_LENGTH 48
+
+/* the fields shared by the hash request, hashes and hash reject messages (BEP 52) */
+typedef struct TorrentMerkleRequest {
+    u8 pieces_root[TORRENT_MERKLE_HASH_LENGTH];
+    u32 base_layer; // 0 is the block layer
+    u32 index; // of the first hash in the base layer, a multiple of length
+    u32 length; // a power of two
+    u32 proof_layers; // counted from the base layer, the ones covered by the requested hashes carry no uncles
+} TorrentMerkleRequest;
+
+bool torrent_merkle_request_parse(const u8* data, usize data_length, TorrentMerkleRequest* request);
+void torrent_merkle_request_write(u8* data, const TorrentMerkleRequest* request);
+u32 torrent_merkle_request_uncles(const TorrentMerkleRequest* request);
+
+u32 torrent_merkle_layers(u64 count);
+void torrent_merkle_block_hash(const u8* data, usize length, u8 hash[TORRENT_MERKLE_HASH_LENGTH]);
+void torrent_merkle_pad_hash(u32 layer, u8 hash[TORRENT_MERKLE_HASH_LENGTH]);
+
+bool torrent_merkle_root(const u8* hashes, usize count, usize width, const u8 pad[TORRENT_MERKLE_HASH_LENGTH], u8 root[TORRENT_MERKLE_HASH_LENGTH]);
+bool torrent_merkle_uncles(const u8* hashes, usize count, usize width, const u8 pad[TORRENT_MERKLE_HASH_LENGTH], usize index, u32 skip, u32 layers, u8* uncles);
+bool torrent_merkle_verify(const u8* hashes, usize length, usize index, const u8* uncles, u32 uncles_length, const u8 root[TORRENT_MERKLE_HASH_LENGTH]);
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+
 #include "types.h"
 
 typedef enum TorrentMetadataInfoType {
@@ -8,8 +10,16 @@ typedef enum TorrentMetadataInfoType {
 } TorrentMetadataInfoType;
 
 typedef struct TorrentMetadataInfoFile {
-    u32 length;
-    char* path;
+    u64 length;
+    char* path; // NULL for padding and for the file of a single file v2 torrent
+    bool padding; // only there to align the next file to a piece (BEP 47), never stored
+
+    // v2 (BEP 52): the root of the file's tree of 16 KiB block hashes, empty files have none
+    bool has_pieces_root;
+    u8 pieces_root[32];
+    u32 first_piece;
+    u32 pieces_length;
+    u8* piece_layer; // a hash per piece, all zero until known. NULL when the file fits in one piece
 } TorrentMetadataInfoFile;
 
 typedef struct TorrentMetadataInfo {
@@ -20,10 +30,14 @@ typedef struct TorrentMetadataInfo {
 	u32 piece_count;
 
     char* name;
-	u32 length;
+	u64 length;
 
 	TorrentMetadataInfoFile* files;
 	usize files_length;
+
+	// v1 hashes pieces with SHA-1, v2 hashes files with SHA-256 merkle trees, hybrid torrents carry both
+	bool v1;
+	bool v2;
 } TorrentMetadataInfo;
 
 typedef struct TorrentMetadata {
@@ -32,14 +46,27 @@ typedef struct TorrentMetadata {
 	char** announce_list;
 	usize announce_list_length;
 
+	// http mirrors of the content (BEP 19 web seeds)
+	char** url_list;
+	usize url_list_length;
+
 	u32 creation_date;
 	char* created_by;
 	char* encoding;
 
 	TorrentMetadataInfo info;
 	u8 info_sha1[20];
+	u8 info_sha256[32];
+
+	// the bencoded info dictionary exactly as hashed, served to peers over ut_metadata
+	u8* info_data;
+	usize info_data_length;
 } TorrentMetadata;
 
 TorrentMetadata* torrent_metadata_create(const char* filename);
+TorrentMetadata* torrent_metadata_create_from_info(u8* info, usize info_length, const u8 info_sha1[20], const char* announce);
+bool torrent_metadata_save(TorrentMetadata* metadata, const char* filename);
+const u8* torrent_metadata_info_hash(TorrentMetadata* metadata);
+TorrentMetadataInfoFile* torrent_metadata_file_find(TorrentMetadata* metadata, const u8 pieces_root[32]);
 void torrent_metadata_print(TorrentMetadata* metadata);
 void torrent_metadata_destroy(TorrentMetadata* metadata);
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "types.h"
+
+#define TORRENT_METADATA_EXCHANGE_PIECE_LENGTH 16384
+#define TORRENT_METADATA_EXCHANGE_DICTIONARY_MAX 512 // a message's dictionary, the piece data after it doesn't count
+#define TORRENT_METADATA_EXCHANGE_SIZE_MAX (8 * 1024 * 1024)
+#define TORRENT_METADATA_EXCHANGE_PEER_REQUESTS_MAX 2
+#define TORRENT_METADATA_EXCHANGE_REQUEST_TIMEOUT_MS 15000
+
+typedef enum TorrentMetadataExchangeMessageType {
+    TORRENT_METADATA_EXCHANGE_REQUEST = 0,
+    TORRENT_METADATA_EXCHANGE_DATA = 1,
+    TORRENT_METADATA_EXCHANGE_REJECT = 2,
+} TorrentMetadataExchangeMessageType;
+
+typedef enum TorrentMetadataExchangePieceState {
+    TORRENT_METADATA_PIECE_MISSING,
+    TORRENT_METADATA_PIECE_REQUESTED,
+    TORRENT_METADATA_PIECE_RECEIVED,
+} TorrentMetadataExchangePieceState;
+
+typedef struct TorrentMetadataExchangePiece {
+    TorrentMetadataExchangePieceState state;
+
+    // only compared against, the peer releases its pieces before it is destroyed
+    struct TorrentPeer* peer;
+    i64 requested_at;
+} TorrentMetadataExchangePiece;
+
+/*
+ * the bencoded info dictionary (BEP 9), either fetched from peers in 16 KiB pieces
+ * or, once complete, served to them. data is only trusted after the caller checked
+ * it against the info hash
+ */
+typedef struct TorrentMetadataExchange {
+    u8* data;
+    usize length; // 0 until a peer tells us the metadata_size
+
+    TorrentMetadataExchangePiece* pieces;
+    u32 pieces_length;
+    u32 pieces_received;
+} TorrentMetadataExchange;
+
+struct TorrentPeer;
+
+TorrentMetadataExchange* torrent_metadata_exchange_create(const u8* info, usize info_length);
+bool torrent_metadata_exchange_request(TorrentMetadataExchange* exchange, struct TorrentPeer* peer);
+bool torrent_metadata_exchange_handle(TorrentMetadataExchange* exchange, struct TorrentPeer* peer, const u8* payload, usize payload_length);
+void torrent_metadata_exchange_maintain(TorrentMetadataExchange* exchange);
+void torrent_metadata_exchange_peer_release(TorrentMetadataExchange* exchange, struct TorrentPeer* peer);
+bool torrent_metadata_exchange_complete(TorrentMetadataExchange* exchange);
+void torrent_metadata_exchange_reset(TorrentMetadataExchange* exchange);
+void torrent_metadata_exchange_destroy(TorrentMetadataExchange* exchange);
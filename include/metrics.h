@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "types.h"
+
+// threads past this many share slots, which only costs contention
+#define TORRENT_METRICS_SLOTS 16
+
+// 8 buckets per power of two keeps every recorded value within 12.5%, microseconds up to ~12 days
+#define TORRENT_METRICS_HISTOGRAM_SUB_BUCKETS 8
+#define TORRENT_METRICS_HISTOGRAM_BUCKETS 304
+
+typedef enum TorrentMetricsCounter {
+    TORRENT_METRICS_PEERS_DIALED,
+    TORRENT_METRICS_PEERS_CONNECTED,
+    TORRENT_METRICS_PEERS_HANDSHAKED,
+    TORRENT_METRICS_PEERS_DISCONNECTED,
+    TORRENT_METRICS_BYTES_DOWNLOADED,
+    TORRENT_METRICS_BYTES_UPLOADED,
+    TORRENT_METRICS_BLOCKS_REQUESTED,
+    TORRENT_METRICS_BLOCKS_RECEIVED,
+    TORRENT_METRICS_BLOCKS_REJECTED,
+    TORRENT_METRICS_REQUESTS_TIMED_OUT,
+    TORRENT_METRICS_PIECES_VERIFIED,
+    TORRENT_METRICS_PIECES_FAILED,
+    TORRENT_METRICS_BLOCKS_FAILED,
+    TORRENT_METRICS_WEB_SEED_BYTES,
+    TORRENT_METRICS_PEERS_BANNED,
+    TORRENT_METRICS_COUNTERS_LENGTH,
+} TorrentMetricsCounter;
+
+typedef enum TorrentMetricsHistogram {
+    TORRENT_METRICS_CONNECT_TIME,
+    TORRENT_METRICS_HANDSHAKE_TIME,
+    TORRENT_METRICS_BLOCK_LATENCY,
+    TORRENT_METRICS_HASH_TIME,
+    TORRENT_METRICS_DISK_WRITE_TIME,
+    TORRENT_METRICS_STREAM_STALL_TIME,
+    TORRENT_METRICS_HISTOGRAMS_LENGTH,
+} TorrentMetricsHistogram;
+
+/* a growing text buffer the exporters write into */
+typedef struct TorrentMetricsText {
+    char* data;
+    usize length;
+    usize capacity;
+} TorrentMetricsText;
+
+typedef struct TorrentMetricsServer {
+    i32 socket;
+    u16 port;
+} TorrentMetricsServer;
+
+void torrent_metrics_count(TorrentMetricsCounter counter, u64 value);
+void torrent_metrics_record(TorrentMetricsHistogram histogram, i64 value_us);
+u64 torrent_metrics_counter_read(TorrentMetricsCounter counter);
+u64 torrent_metrics_histogram_percentile(TorrentMetricsHistogram histogram, double percentile);
+
+bool torrent_metrics_text_append(TorrentMetricsText* text, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void torrent_metrics_text_destroy(TorrentMetricsText* text);
+bool torrent_metrics_prometheus_write(TorrentMetricsText* text);
+bool torrent_metrics_json_write(TorrentMetricsText* text);
+bool torrent_metrics_snapshot_save(const char* path, TorrentMetricsText* text);
+
+TorrentMetricsServer* torrent_metrics_server_create(u16 port);
+i32 torrent_metrics_server_accept(TorrentMetricsServer* server, char* path, usize path_length);
+bool torrent_metrics_server_respond(i32 client, const char* status, const char* content_type, TorrentMetricsText* body);
+void torrent_metrics_server_destroy(TorrentMetricsServer* server);
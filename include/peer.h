@@ -3,16 +3,161 @@
 #include <stdbool.h>
 
 #include "types.h"
-#include "metadata.h"
+#include "extension.h"
+#include "fast.h"
+#include "merkle.h"
+#include "pex.h"
+#include "super_seed.h"
+
+#define TORRENT_PEER_HANDSHAKE_LENGTH 68
+#define TORRENT_PEER_BLOCK_LENGTH 16384
+#define TORRENT_PEER_REQUESTS_MAX 32
+#define TORRENT_PEER_UPLOADS_MAX TORRENT_EXTENSION_REQUEST_QUEUE_LENGTH // requests queued from a peer, the reqq we advertise
+#define TORRENT_PEER_OUTPUT_MAX (256 * 1024) // unsent bytes past which queued requests wait
+#define TORRENT_PEER_MESSAGE_MAX (2 * 1024 * 1024)
+
+typedef enum TorrentPeerState {
+    TORRENT_PEER_CONNECTING,
+    TORRENT_PEER_HANDSHAKING,
+    TORRENT_PEER_CONNECTED,
+    TORRENT_PEER_DISCONNECTED,
+} TorrentPeerState;
+
+typedef enum TorrentPeerMessageType {
+    TORRENT_PEER_MESSAGE_CHOKE = 0,
+    TORRENT_PEER_MESSAGE_UNCHOKE = 1,
+    TORRENT_PEER_MESSAGE_INTERESTED = 2,
+    TORRENT_PEER_MESSAGE_NOT_INTERESTED = 3,
+    TORRENT_PEER_MESSAGE_HAVE = 4,
+    TORRENT_PEER_MESSAGE_BITFIELD = 5,
+    TORRENT_PEER_MESSAGE_REQUEST = 6,
+    TORRENT_PEER_MESSAGE_PIECE = 7,
+    TORRENT_PEER_MESSAGE_CANCEL = 8,
+    TORRENT_PEER_MESSAGE_PORT = 9,
+    TORRENT_PEER_MESSAGE_SUGGEST_PIECE = 13,
+    TORRENT_PEER_MESSAGE_HAVE_ALL = 14,
+    TORRENT_PEER_MESSAGE_HAVE_NONE = 15,
+    TORRENT_PEER_MESSAGE_REJECT_REQUEST = 16,
+    TORRENT_PEER_MESSAGE_ALLOWED_FAST = 17,
+    TORRENT_PEER_MESSAGE_EXTENDED = 20,
+    TORRENT_PEER_MESSAGE_HASH_REQUEST = 21,
+    TORRENT_PEER_MESSAGE_HASHES = 22,
+    TORRENT_PEER_MESSAGE_HASH_REJECT = 23,
+} TorrentPeerMessageType;
+
+/* payload points into the peer's receive buffer and is only valid until the next torrent_peer_receive() */
+typedef struct TorrentPeerMessage {
+    bool keep_alive;
+    u8 id;
+    u8* payload;
+    u32 payload_length;
+} TorrentPeerMessage;
+
+typedef struct TorrentPeerRequest {
+    u32 index;
+    u32 begin;
+    u32 length;
+    i64 sent_at;
+    i64 sent_at_us; // for the block latency histogram
+} TorrentPeerRequest;
+
+typedef struct TorrentPeerBuffer {
+    u8* data;
+    usize offset;
+    usize length;
+    usize capacity;
+} TorrentPeerBuffer;
+
+struct TorrentShard;
+struct TorrentTrace;
 
 typedef struct TorrentPeer {
-    bool connected;
+    TorrentPeerState state;
 
-    i32 socket;
+    i32 socket; // -1 once a shard owns it
+    struct TorrentShard* shard; // the network thread the connection is pinned to, NULL on the downloader's
+    u64 connection; // the downloader's id for it, the shard and the trace know it by this
+    struct TorrentTrace* trace; // records what goes over the wire, NULL unless the session is traced
+    bool incoming; // the peer dialed us
     char ip[32];
     char port[16];
+    u8 id[20];
+
+    bool am_choking;
+    bool am_interested;
+    bool peer_choking;
+    bool peer_interested;
+    i64 unchoked_at; // when we last unchoked the peer, upload slots rotate
+
+    u8* bitfield;
+    usize bitfield_length;
+
+    TorrentPeerRequest requests[TORRENT_PEER_REQUESTS_MAX]; // in the order they were sent, the first is the oldest
+    usize requests_length;
+
+    // blocks the peer asked us for, oldest first, read and sent while little output is unsent
+    TorrentPeerRequest uploads[TORRENT_PEER_UPLOADS_MAX];
+    usize uploads_length;
+
+    bool supports_extensions;
+    TorrentExtensions extensions;
+    TorrentPexState pex;
+
+    bool supports_fast;
+    TorrentFastState fast;
+
+    bool supports_v2;
+
+    TorrentSuperSeedPeer super_seed;
+
+    TorrentPeerBuffer input;
+    TorrentPeerBuffer output;
+    usize output_traced; // how much of output the trace has
+    usize output_pending; // handed to the shard and not on the socket yet
+
+    i64 connect_started;
+    i64 stage_started_us; // when the connect or the handshake began, for the metrics
+    i64 last_received;
+    i64 last_sent;
+    u64 bytes_downloaded;
+    u64 bytes_uploaded;
+    u32 smart_ban_source; // who the picker records as the sender of our blocks, 0 until the first one
+
+    // bytes per second, smoothed by the downloader once a second
+    u32 download_rate;
+    u64 download_rate_mark;
 } TorrentPeer;
 
-TorrentPeer* torrent_peer_connect(char ip[32], char port[16], char peer_id[20], TorrentMetadata* metadata);
-void torrent_peer_send_request(TorrentPeer* peer, TorrentMetadata* metadata, usize index, usize begin, usize length);
+TorrentPeer* torrent_peer_connect(const char* ip, const char* port);
+i32 torrent_peer_listen(u16 port);
+TorrentPeer* torrent_peer_accept(i32 listen_socket);
+TorrentPeer* torrent_peer_adopt(i32 socket, const char* ip, const char* port, bool incoming);
+bool torrent_peer_connect_finish(TorrentPeer* peer);
+bool torrent_peer_handshake_send(TorrentPeer* peer, const u8 info_hash[20], const char peer_id[20]);
+bool torrent_peer_handshake_receive(TorrentPeer* peer, const u8 info_hash[20], bool* complete);
+
+bool torrent_peer_receive(TorrentPeer* peer);
+bool torrent_peer_input_append(TorrentPeer* peer, const u8* data, usize length);
+bool torrent_peer_message_next(TorrentPeer* peer, TorrentPeerMessage* message, bool* failed);
+bool torrent_peer_message_send(TorrentPeer* peer, u8 id, const u8* payload, usize payload_length);
+u8* torrent_peer_message_reserve(TorrentPeer* peer, u8 id, usize payload_length);
+bool torrent_peer_flush(TorrentPeer* peer);
+usize torrent_peer_output_unsent(TorrentPeer* peer);
+
+bool torrent_peer_send_keep_alive(TorrentPeer* peer);
+bool torrent_peer_send_choke(TorrentPeer* peer, bool choke);
+bool torrent_peer_send_interested(TorrentPeer* peer, bool interested);
+bool torrent_peer_send_have(TorrentPeer* peer, u32 index);
+bool torrent_peer_send_request(TorrentPeer* peer, u32 index, u32 begin, u32 length);
+bool torrent_peer_send_cancel(TorrentPeer* peer, u32 index, u32 begin, u32 length);
+bool torrent_peer_send_piece(TorrentPeer* peer, u32 index, u32 begin, const u8* block, u32 block_length);
+bool torrent_peer_send_reject(TorrentPeer* peer, u32 index, u32 begin, u32 length);
+bool torrent_peer_send_allowed_fast(TorrentPeer* peer, u32 index);
+bool torrent_peer_send_hash_request(TorrentPeer* peer, const TorrentMerkleRequest* request);
+bool torrent_peer_send_hashes(TorrentPeer* peer, const TorrentMerkleRequest* request, const u8* hashes, usize hashes_length);
+bool torrent_peer_send_hash_reject(TorrentPeer* peer, const TorrentMerkleRequest* request);
+
+bool torrent_peer_bitfield_create(TorrentPeer* peer, u32 pieces_length);
+bool torrent_peer_bitfield_resize(TorrentPeer* peer, u32 pieces_length);
+bool torrent_peer_has_piece(TorrentPeer* peer, u32 index);
 void torrent_peer_destroy(TorrentPeer* peer);
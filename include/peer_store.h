@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "types.h"
+
+#define TORRENT_PEER_STORE_BACKOFF_MS 30000
+#define TORRENT_PEER_STORE_BACKOFF_MAX_MS (30 * 60 * 1000)
+#define TORRENT_PEER_STORE_FAILURES_MAX 8
+#define TORRENT_PEER_STORE_SAVED_MAX 200
+
+/* everything we learned about one address, kept across runs */
+typedef struct TorrentPeerStoreEntry {
+    char ip[32];
+    char port[16];
+
+    bool in_use; // dialed and not closed yet
+
+    u32 connect_latency_ms; // smoothed over every successful connect
+    u32 handshakes;
+    u32 failures; // consecutive, reset by a successful handshake
+
+    // throughput is bytes_downloaded / download_ms over every session with the peer
+    u64 bytes_downloaded;
+    u64 download_ms;
+
+    i64 next_attempt; // not saved, rebuilt from failures on load
+} TorrentPeerStoreEntry;
+
+typedef struct TorrentPeerStore {
+    char* path;
+
+    TorrentPeerStoreEntry* entries;
+    usize entries_length;
+    usize entries_capacity;
+} TorrentPeerStore;
+
+TorrentPeerStore* torrent_peer_store_create(const u8 info_hash[20], const char* directory);
+bool torrent_peer_store_add(TorrentPeerStore* store, const char* ip, const char* port);
+TorrentPeerStoreEntry* torrent_peer_store_find(TorrentPeerStore* store, const char* ip, const char* port);
+TorrentPeerStoreEntry* torrent_peer_store_best(TorrentPeerStore* store, i64 now);
+
+void torrent_peer_store_connected(TorrentPeerStoreEntry* entry, u32 latency_ms);
+void torrent_peer_store_handshaked(TorrentPeerStoreEntry* entry);
+void torrent_peer_store_closed(TorrentPeerStoreEntry* entry, bool handshaked, u64 bytes_downloaded, i64 duration_ms, i64 now);
+
+bool torrent_peer_store_save(TorrentPeerStore* store);
+void torrent_peer_store_destroy(TorrentPeerStore* store);
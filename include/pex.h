@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "tracker.h"
+#include "types.h"
+
+#define TORRENT_PEX_INTERVAL_MS 60000
+#define TORRENT_PEX_ADDED_MAX 50
+#define TORRENT_PEX_DROPPED_MAX 50
+
+#define TORRENT_PEX_FLAG_SEED 0x02
+#define TORRENT_PEX_FLAG_REACHABLE 0x10
+
+/* what we have told one peer about so far, so later messages only carry the difference */
+typedef struct TorrentPexState {
+    u8 (*advertised)[6];
+    usize advertised_length;
+
+    i64 last_sent;
+    i64 last_received;
+} TorrentPexState;
+
+struct TorrentPeer;
+
+bool torrent_pex_send(struct TorrentPeer* peer, struct TorrentPeer** peers, usize peers_length, u32 pieces_length);
+usize torrent_pex_parse(struct TorrentPeer* peer, const u8* payload, usize payload_length, TorrentTrackerPeer* peers, usize peers_max);
+void torrent_pex_state_destroy(TorrentPexState* state);
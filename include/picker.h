@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "types.h"
+
+struct TorrentPeerRequest;
+
+typedef enum TorrentPieceState {
+    TORRENT_PIECE_MISSING,
+    TORRENT_PIECE_PARTIAL,
+    TORRENT_PIECE_COMPLETE,
+} TorrentPieceState;
+
+typedef enum TorrentBlockState {
+    TORRENT_BLOCK_MISSING,
+    TORRENT_BLOCK_REQUESTED,
+    TORRENT_BLOCK_RECEIVED,
+} TorrentBlockState;
+
+typedef struct TorrentPiece {
+    TorrentPieceState state;
+    u32 length;
+    u32 availability;
+    i64 deadline; // when a streaming reader needs the piece, 0 while nobody is waiting for it
+
+    // only allocated while the piece is partial
+    u8* blocks;
+    u32 blocks_length;
+    u32 blocks_received;
+    u8* data;
+    u32* sources; // who sent each received block, 0 when nobody we can blame
+} TorrentPiece;
+
+typedef struct TorrentPickerBlock {
+    u32 index;
+    u32 begin;
+    u32 length;
+} TorrentPickerBlock;
+
+typedef struct TorrentPicker {
+    TorrentPiece* pieces;
+    u32 pieces_length;
+    usize piece_length;
+    u64 length;
+
+    u8* bitfield;
+    usize bitfield_length;
+    u32 pieces_completed;
+
+    // indices of the partial pieces, so picking doesn't scan every piece
+    u32* partial;
+    u32 partial_length;
+
+    // the pieces a streaming reader needs next, picked in order before anything else
+    u32 window_begin;
+    u32 window_length;
+} TorrentPicker;
+
+TorrentPicker* torrent_picker_create(u32 pieces_length, usize piece_length, u64 length);
+
+void torrent_picker_availability_add(TorrentPicker* picker, const u8* bitfield, usize bitfield_length);
+void torrent_picker_availability_remove(TorrentPicker* picker, const u8* bitfield, usize bitfield_length);
+void torrent_picker_availability_have(TorrentPicker* picker, u32 index);
+
+bool torrent_picker_block_pick(TorrentPicker* picker, const u8* bitfield, usize bitfield_length, TorrentPickerBlock* block);
+bool torrent_picker_block_pick_piece(TorrentPicker* picker, u32 index, TorrentPickerBlock* block);
+bool torrent_picker_block_pick_critical(TorrentPicker* picker, const u8* bitfield, usize bitfield_length, TorrentPickerBlock* block);
+bool torrent_picker_block_pick_late(TorrentPicker* picker, const u8* bitfield, usize bitfield_length, const struct TorrentPeerRequest* requests, usize requests_length, i64 now, TorrentPickerBlock* block);
+void torrent_picker_block_release(TorrentPicker* picker, u32 index, u32 begin);
+void torrent_picker_block_reset(TorrentPicker* picker, u32 index, u32 begin);
+bool torrent_picker_block_receive(TorrentPicker* picker, u32 index, u32 begin, const u8* data, u32 length, u32 source, bool* piece_finished);
+
+bool torrent_picker_span_pick(TorrentPicker* picker, u32* begin);
+bool torrent_picker_piece_claim(TorrentPicker* picker, u32 index);
+
+void torrent_picker_window_set(TorrentPicker* picker, u32 begin, u32 length, i64 deadline, i64 deadline_step);
+
+void torrent_picker_piece_complete(TorrentPicker* picker, u32 index);
+void torrent_picker_piece_reset(TorrentPicker* picker, u32 index);
+bool torrent_picker_has(TorrentPicker* picker, u32 index);
+bool torrent_picker_is_interesting(TorrentPicker* picker, const u8* bitfield, usize bitfield_length);
+bool torrent_picker_finished(TorrentPicker* picker);
+
+void torrent_picker_destroy(TorrentPicker* picker);
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "trace.h"
+#include "tracker.h"
+#include "types.h"
+
+#define TORRENT_REPLAY_IDLE_MS 5000 // how long the downloader may go without asking a peer for blocks, or without any peer once the trace is over
+#define TORRENT_REPLAY_PEERS_MAX 512
+#define TORRENT_REPLAY_OUTPUT_MAX (256 * 1024) // queued for the downloader before we wait for it to read
+
+typedef struct TorrentReplayBuffer {
+    u8* data;
+    usize offset;
+    usize length;
+    usize capacity;
+} TorrentReplayBuffer;
+
+typedef struct TorrentReplayRequest {
+    u32 index;
+    u32 begin;
+    u32 length;
+} TorrentReplayRequest;
+
+/* a block some peer sent in the trace, sorted so a request finds its data */
+typedef struct TorrentReplayBlock {
+    u32 index;
+    u32 begin;
+    const TorrentTraceEvent* event;
+} TorrentReplayBlock;
+
+/* where a trace's connection id ended up in the connections, sorted by id */
+typedef struct TorrentReplayConnectionIndex {
+    u64 id;
+    usize connection;
+} TorrentReplayConnectionIndex;
+
+/* one connection of the trace, played back over a socketpair */
+typedef struct TorrentReplayConnection {
+    u64 id;
+    char ip[32];
+    char port[16];
+    bool incoming;
+    bool connected; // the trace got through, a dial that was refused is refused again
+
+    // what the peer sent besides blocks, at their recorded times
+    usize* events; // indices into the trace's events
+    usize events_length;
+    usize next;
+    i64 closed_us; // when the trace last saw it
+
+    // when the peer sent each of its blocks, the pace requested blocks are answered at
+    i64* blocks;
+    usize blocks_length;
+    usize blocks_next;
+
+    TorrentReplayRequest* requests; // what the downloader asked for and hasn't got, oldest first
+    usize requests_length;
+    usize requests_capacity;
+    i64 last_request_us;
+
+    TorrentReplayBuffer input; // the downloader's side, parsed for requests
+    bool handshake_received;
+    bool fast; // the recorded peer's handshake offered the fast extension
+    bool fast_received; // and the downloader's did too
+    TorrentReplayBuffer output;
+
+    bool opened;
+    bool done;
+    i32 socket; // our end, -1 until opened and once done
+    i32 client_socket; // an incoming connection's other end, until the downloader takes it
+    i64 opened_us;
+    i64 recorded_us; // when the trace opened it, event times are relative to this
+} TorrentReplayConnection;
+
+/*
+ * feeds a trace back into the downloader. every recorded connection is a socketpair: a dialed
+ * one opens when the downloader dials its address, an incoming one when the trace says.
+ * the peer's messages go out at their recorded times divided by speed, except its blocks:
+ * the downloader's own requests are answered from the blocks in the trace, the nth one no
+ * sooner than the peer sent its nth block. so a different pick order still completes the
+ * download, at the pace each peer had. the recorded tracker and dht answers come out of
+ * torrent_replay_peers at their times too
+ */
+typedef struct TorrentReplay {
+    TorrentTraceFile* trace;
+    double speed; // 1 is the recorded pace, 0 sends everything as fast as the downloader takes it
+
+    TorrentReplayConnection* connections;
+    usize connections_length;
+    TorrentReplayBlock* blocks;
+    usize blocks_length;
+    i64 blocks_end_us; // when the last block came, what closed after it closed because the session was over
+    usize peers_next; // the next trace event torrent_replay_peers looks at
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    bool running;
+    bool finished;
+    i32 wake[2]; // dials wake the replay thread
+    i32 incoming[2]; // a byte per incoming connection waiting, the downloader polls the read end
+
+    i64 started_us;
+    i64 last_active_us;
+    u64 bytes_replayed;
+    u64 bytes_received;
+    u64 requests_missed; // asked for blocks the trace doesn't have
+} TorrentReplay;
+
+TorrentReplay* torrent_replay_create(const char* path, double speed);
+bool torrent_replay_start(TorrentReplay* replay);
+i32 torrent_replay_connect(TorrentReplay* replay, const char* ip, const char* port);
+i32 torrent_replay_accept(TorrentReplay* replay, char ip[32], char port[16]);
+TorrentTrackerPeer* torrent_replay_peers(TorrentReplay* replay, usize* peers_length);
+bool torrent_replay_finished(TorrentReplay* replay);
+void torrent_replay_destroy(TorrentReplay* replay);
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "types.h"
+#include "utils/mpsc.h"
+
+#define TORRENT_SHARDS_MAX 64
+#define TORRENT_SHARD_RECEIVE_CHUNK 65536
+#define TORRENT_SHARD_RECEIVE_MAX_PER_CALL (4 * TORRENT_SHARD_RECEIVE_CHUNK)
+
+typedef enum TorrentShardMessageType {
+    // from the downloader to a shard
+    TORRENT_SHARD_ADD, // the socket belongs to the shard from now on, it is still connecting
+    TORRENT_SHARD_SEND,
+    TORRENT_SHARD_CLOSE,
+    TORRENT_SHARD_STOP,
+
+    // from a shard to the downloader
+    TORRENT_SHARD_CONNECTED,
+    TORRENT_SHARD_RECEIVED, // whole messages only, the handshake counts as one
+    TORRENT_SHARD_CLOSED, // the connection failed or the peer hung up
+    TORRENT_SHARD_SENT, // length bytes of what the downloader sent went out on the socket
+} TorrentShardMessageType;
+
+typedef struct TorrentShardMessage {
+    MPSCNode node;
+    TorrentShardMessageType type;
+    u64 connection;
+    i32 socket; // TORRENT_SHARD_ADD only
+    u8* data;
+    usize length;
+} TorrentShardMessage;
+
+/* an MPSC queue and a pipe that wakes its consumer out of poll */
+typedef struct TorrentShardMailbox {
+    MPSCQueue queue;
+    i32 wake[2];
+    bool wake_pending; // a wake byte was written and the consumer hasn't looked yet
+} TorrentShardMailbox;
+
+typedef struct TorrentShardBuffer {
+    u8* data;
+    usize offset;
+    usize length;
+    usize capacity;
+} TorrentShardBuffer;
+
+typedef struct TorrentShardConnection {
+    u64 id;
+    i32 socket;
+    bool connecting;
+    bool handshaked; // the 68 byte handshake came in, length prefixed messages follow
+    bool closed;
+    TorrentShardBuffer input;
+    TorrentShardBuffer output;
+} TorrentShardConnection;
+
+/*
+ * an event loop thread that owns the sockets of the peer connections pinned to it. it
+ * connects, reads, cuts the stream into whole messages and writes, the downloader's
+ * thread keeps every piece of protocol state. the two only talk through mailboxes
+ */
+typedef struct TorrentShard {
+    u32 index;
+    pthread_t thread;
+    char torrent[41]; // tags the thread's log messages
+
+    TorrentShardMailbox commands;
+    TorrentShardMailbox* events; // not owned, shared by every shard of a downloader
+
+    // only touched by the shard's thread
+    bool running;
+    TorrentShardConnection* connections;
+    usize connections_length;
+    usize connections_capacity;
+} TorrentShard;
+
+bool torrent_shard_mailbox_init(TorrentShardMailbox* mailbox);
+void torrent_shard_mailbox_post(TorrentShardMailbox* mailbox, TorrentShardMessage* message);
+TorrentShardMessage* torrent_shard_mailbox_take(TorrentShardMailbox* mailbox);
+void torrent_shard_mailbox_destroy(TorrentShardMailbox* mailbox);
+
+TorrentShard* torrent_shard_create(u32 index, TorrentShardMailbox* events, const char* torrent);
+bool torrent_shard_add(TorrentShard* shard, u64 connection, i32 socket);
+bool torrent_shard_send(TorrentShard* shard, u64 connection, const u8* data, usize length);
+bool torrent_shard_close(TorrentShard* shard, u64 connection);
+void torrent_shard_message_destroy(TorrentShardMessage* message);
+void torrent_shard_destroy(TorrentShard* shard);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "types.h"
+
+#define TORRENT_SMART_BAN_RECORDS_MAX 65536 // blocks of failed pieces waiting for a good copy, ~2 MiB
+#define TORRENT_SMART_BAN_COPIES_MAX 4 // failed copies of one piece remembered, older ones are forgotten
+
+/* a block of a piece that failed its hash, remembered until the piece passes */
+typedef struct TorrentSmartBanRecord {
+    u32 index;
+    u32 begin;
+    u32 source;
+    u8 hash[20];
+} TorrentSmartBanRecord;
+
+/*
+ * works out who sent the bad data in a piece that failed its hash. every block of the
+ * failed copy is remembered by its SHA-1 and sender, and once a copy of the piece passes,
+ * senders whose blocks differ from it are the culprits. pieces keep the source of each
+ * block, sources are ids handed out here for peer addresses, 0 is nobody
+ */
+typedef struct TorrentSmartBan {
+    char (*sources)[32]; // the address of source i + 1
+    usize sources_length;
+    usize sources_capacity;
+
+    TorrentSmartBanRecord* records;
+    usize records_length;
+    usize records_capacity;
+} TorrentSmartBan;
+
+TorrentSmartBan* torrent_smart_ban_create();
+u32 torrent_smart_ban_source(TorrentSmartBan* ban, const char* ip);
+const char* torrent_smart_ban_source_ip(TorrentSmartBan* ban, u32 source);
+u32 torrent_smart_ban_piece_failed(TorrentSmartBan* ban, u32 index, const u8* data, u32 length, const u32* sources, u32 blocks_length);
+usize torrent_smart_ban_piece_passed(TorrentSmartBan* ban, u32 index, const u8* data, u32 length, u32* culprits, usize culprits_max);
+void torrent_smart_ban_destroy(TorrentSmartBan* ban);
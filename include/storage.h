@@ -0,0 +1,45 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "metadata.h"
+#include "types.h"
+
+// descriptors a read only storage keeps open at once, more than the creator has hashing threads
+#define TORRENT_STORAGE_OPEN_MAX 128
+
+typedef struct TorrentStorageFile {
+    char* path;
+    i32 descriptor;
+    bool padding; // reads as zeros, writes are dropped, nothing on disk
+
+    // read only storage, a file isn't closed while a read is using it
+    u32 users;
+    u64 last_used;
+
+    // where the file starts in the torrent's concatenated byte stream
+    u64 offset;
+    u64 length;
+} TorrentStorageFile;
+
+typedef struct TorrentStorage {
+    TorrentStorageFile* files;
+    usize files_length;
+    usize piece_length;
+
+    // a read only storage opens its files as they are read and closes the least recently used
+    // past TORRENT_STORAGE_OPEN_MAX, so a tree with more files than descriptors can be hashed
+    bool read_only;
+    pthread_mutex_t mutex;
+    usize open[TORRENT_STORAGE_OPEN_MAX]; // indices into files
+    usize open_length;
+    u64 clock;
+} TorrentStorage;
+
+TorrentStorage* torrent_storage_create(TorrentMetadata* metadata, const char* directory);
+TorrentStorage* torrent_storage_open(TorrentMetadata* metadata, const char* directory);
+bool torrent_storage_write(TorrentStorage* storage, u32 index, u32 begin, const u8* data, usize length);
+bool torrent_storage_read(TorrentStorage* storage, u32 index, u32 begin, u8* data, usize length);
+bool torrent_storage_has(TorrentStorage* storage, u32 index, u32 begin, usize length);
+void torrent_storage_destroy(TorrentStorage* storage);
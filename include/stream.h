@@ -0,0 +1,46 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "storage.h"
+#include "types.h"
+
+#define TORRENT_STREAM_WINDOW_PIECES 8
+#define TORRENT_STREAM_DEADLINE_MS 1000 // for the piece under the cursor
+#define TORRENT_STREAM_DEADLINE_STEP_MS 500 // added for every piece after it
+#define TORRENT_STREAM_RACE_PEERS 3 // late blocks are raced across this many of the fastest peers
+
+/*
+ * verified bytes of a torrent in order, for a reader on another thread. the downloader
+ * fills it in and moves the picker's window along behind the cursor
+ */
+typedef struct TorrentStream {
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+
+    // set by torrent_stream_start() once the metadata is known
+    bool started;
+    TorrentStorage* storage;
+    usize piece_length;
+    u64 length;
+    u8* verified; // one bit per piece, like the picker's bitfield
+
+    bool closed; // no more pieces are coming, reads past what was verified fail
+    u64 cursor;
+
+    i64 opened_at;
+    bool first_byte_read;
+} TorrentStream;
+
+TorrentStream* torrent_stream_create();
+bool torrent_stream_start(TorrentStream* stream, TorrentStorage* storage, usize piece_length, u64 length, const u8* bitfield, usize bitfield_length);
+void torrent_stream_piece_verified(TorrentStream* stream, u32 index);
+bool torrent_stream_cursor_piece(TorrentStream* stream, u32* index);
+
+ssize_t torrent_stream_read(TorrentStream* stream, u8* data, usize length);
+bool torrent_stream_seek(TorrentStream* stream, u64 offset);
+
+void torrent_stream_close(TorrentStream* stream);
+void torrent_stream_destroy(TorrentStream* stream);
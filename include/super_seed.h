@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "picker.h"
+#include "types.h"
+
+#define TORRENT_SUPER_SEED_WAIT_MS 30000 // how long a peer's piece may take to spread before it gets another anyway
+
+/* the one piece a peer was told we have */
+typedef struct TorrentSuperSeedPeer {
+    bool offered;
+    u32 piece;
+    bool spread; // another peer announced the piece since it was offered
+    i64 held_at; // when the peer turned out to have the piece, 0 until then
+} TorrentSuperSeedPeer;
+
+/*
+ * super seeding (BEP 16) for a torrent's initial seed. peers are never told what we have,
+ * each is offered one piece with a have and only gets another once that piece shows up at
+ * some other peer, so every piece we upload is passed on by the swarm instead of being asked
+ * for again. pieces are offered rarest first, spread over as many peers as possible
+ */
+typedef struct TorrentSuperSeed {
+    u32* offers; // peers each piece is offered to right now
+    u32 pieces_length;
+} TorrentSuperSeed;
+
+TorrentSuperSeed* torrent_super_seed_create(u32 pieces_length);
+bool torrent_super_seed_offer(TorrentSuperSeed* seed, TorrentSuperSeedPeer* state, TorrentPicker* picker, const u8* bitfield, usize bitfield_length);
+void torrent_super_seed_release(TorrentSuperSeed* seed, TorrentSuperSeedPeer* state);
+void torrent_super_seed_destroy(TorrentSuperSeed* seed);
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "tracker.h"
+#include "types.h"
+
+#define TORRENT_TRACE_MAGIC "BTT1"
+#define TORRENT_TRACE_HEADER_LENGTH 24 // magic and info hash
+#define TORRENT_TRACE_RECORD_LENGTH 21 // type, time, connection and length, the data follows
+
+/*
+ * a trace is every peer connection of one session as it went over the wire, so a slow
+ * download can be captured once and replayed offline against other builds. after the
+ * header each event is a record, big endian:
+ * u8 type, u64 microseconds since the trace started, u64 connection, u32 length, data
+ */
+typedef enum TorrentTraceEventType {
+    TORRENT_TRACE_CONNECT = 0, // u8 incoming, then the ip and the port, each NUL-terminated
+    TORRENT_TRACE_CONNECTED = 1,
+    TORRENT_TRACE_INBOUND = 2, // one whole message, or the handshake
+    TORRENT_TRACE_OUTBOUND = 3, // whatever was queued since the last flush, always whole messages
+    TORRENT_TRACE_CLOSE = 4,
+    TORRENT_TRACE_PEERS = 5, // connection 0, ip and port pairs NUL-terminated, one tracker or dht answer
+} TorrentTraceEventType;
+
+typedef struct TorrentTraceEvent {
+    TorrentTraceEventType type;
+    i64 time_us;
+    u64 connection;
+    const u8* data;
+    u32 length;
+} TorrentTraceEvent;
+
+/* a trace being written, only ever from the downloader's thread */
+typedef struct TorrentTrace {
+    FILE* file;
+    i64 started_us;
+    bool failed; // a write failed, the rest of the session isn't recorded
+} TorrentTrace;
+
+/* a trace read back, the events point into data */
+typedef struct TorrentTraceFile {
+    u8 info_hash[20];
+    u8* data; // the whole file, mapped
+    usize data_length;
+    TorrentTraceEvent* events;
+    usize events_length;
+} TorrentTraceFile;
+
+TorrentTrace* torrent_trace_create(const char* path, const u8 info_hash[20]);
+void torrent_trace_record(TorrentTrace* trace, TorrentTraceEventType type, u64 connection, const u8* data, usize length);
+void torrent_trace_connect(TorrentTrace* trace, u64 connection, const char* ip, const char* port, bool incoming);
+void torrent_trace_peers(TorrentTrace* trace, const TorrentTrackerPeer* peers, usize peers_length);
+void torrent_trace_destroy(TorrentTrace* trace);
+
+TorrentTraceFile* torrent_trace_load(const char* path);
+usize torrent_trace_peers_parse(const TorrentTraceEvent* event, TorrentTrackerPeer* peers, usize peers_max);
+void torrent_trace_file_destroy(TorrentTraceFile* file);
@@ -2,7 +2,6 @@
 
 #include <stdbool.h>
 
-#include "metadata.h"
 #include "types.h"
 
 typedef struct TorrentTrackerPeer {
@@ -20,6 +19,6 @@ typedef struct TorrentTrackerResult {
     usize peers_length;
 } TorrentTrackerResult;
 
-TorrentTrackerResult torrent_tracker_get(TorrentMetadata* metadata, const char* peer_id);
+TorrentTrackerResult torrent_tracker_get(const char* announce, const u8 info_hash[20], const char* peer_id, u16 port);
 void torrent_tracker_result_print(TorrentTrackerResult* result);
 void torrent_tracker_result_destroy(TorrentTrackerResult* result);
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "types.h"
+
+void buffer_write_big_endian(u8* buffer, u32 value);
+u32 buffer_read_big_endian(const u8* buffer);
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "types.h"
+
+typedef enum LogLevel {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_OFF,
+} LogLevel;
+
+// anything below this is compiled out, set from cmake with -DLOG_LEVEL_MIN=<0-4>
+#ifndef LOG_LEVEL_MIN
+#define LOG_LEVEL_MIN LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_MESSAGE_MAX 256
+#define LOG_RING_LENGTH 256 // per thread, messages past this are dropped until the writer catches up
+#define LOG_SITE_BURST 10 // per call site per second, the rest are counted and reported with the next one
+
+/* one per call site, for rate limiting */
+typedef struct LogSite {
+    i64 window_start;
+    u32 count;
+    u32 suppressed;
+} LogSite;
+
+extern LogLevel log_level;
+
+/*
+ * a disabled level costs one comparison, and nothing at all below LOG_LEVEL_MIN. ip and
+ * port are the peer the message is about and may be NULL
+ */
+#define log_at(level, module, ip, port, ...) \
+    do { \
+        if ((level) >= LOG_LEVEL_MIN && (level) >= log_level) { \
+            static LogSite log_site; \
+            log_write(&log_site, (level), (module), (ip), (port), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define log_debug(module, ...) log_at(LOG_LEVEL_DEBUG, module, NULL, NULL, __VA_ARGS__)
+#define log_info(module, ...) log_at(LOG_LEVEL_INFO, module, NULL, NULL, __VA_ARGS__)
+#define log_warn(module, ...) log_at(LOG_LEVEL_WARN, module, NULL, NULL, __VA_ARGS__)
+#define log_error(module, ...) log_at(LOG_LEVEL_ERROR, module, NULL, NULL, __VA_ARGS__)
+
+#define log_peer_debug(module, ip, port, ...) log_at(LOG_LEVEL_DEBUG, module, ip, port, __VA_ARGS__)
+#define log_peer_info(module, ip, port, ...) log_at(LOG_LEVEL_INFO, module, ip, port, __VA_ARGS__)
+#define log_peer_warn(module, ip, port, ...) log_at(LOG_LEVEL_WARN, module, ip, port, __VA_ARGS__)
+#define log_peer_error(module, ip, port, ...) log_at(LOG_LEVEL_ERROR, module, ip, port, __VA_ARGS__)
+
+void log_write(LogSite* site, LogLevel level, const char* module, const char* ip, const char* port, const char* format, ...) __attribute__((format(printf, 6, 7)));
+void log_level_set(LogLevel level);
+bool log_level_parse(const char* name, LogLevel* level);
+void log_torrent_set(const char* torrent);
+void log_flush();
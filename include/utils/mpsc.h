@@ -0,0 +1,23 @@
+#pragma once
+
+#include "types.h"
+
+/* embedded as the first member of whatever is queued */
+typedef struct MPSCNode {
+    struct MPSCNode* next;
+} MPSCNode;
+
+/*
+ * lock-free queue with any number of producers and a single consumer (Vyukov's intrusive
+ * design). a push is one atomic exchange. a pop can come back empty while a push is halfway
+ * done, the producer's wake-up makes the consumer look again
+ */
+typedef struct MPSCQueue {
+    MPSCNode* head; // producers push here
+    MPSCNode* tail; // only touched by the consumer
+    MPSCNode stub;
+} MPSCQueue;
+
+void mpsc_queue_init(MPSCQueue* queue);
+void mpsc_queue_push(MPSCQueue* queue, MPSCNode* node);
+MPSCNode* mpsc_queue_pop(MPSCQueue* queue);
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "types.h"
+
+i64 time_now_ms();
+i64 time_now_us();
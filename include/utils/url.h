@@ -10,3 +10,5 @@ typedef struct URLSplitResult {
 
 URLSplitResult url_split(const char* url);
 char* url_encode(u8* bytes, usize bytes_length);
+char* url_decode(const char* string, usize string_length);
+char* url_path_encode(const char* path);
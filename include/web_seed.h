@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "metadata.h"
+#include "picker.h"
+#include "types.h"
+#include "utils/url.h"
+
+#define TORRENT_WEB_SEED_BLOCK_LENGTH 16384
+#define TORRENT_WEB_SEED_REQUEST_LENGTH (1024 * 1024) // asked for by one GET at most
+#define TORRENT_WEB_SEED_PIPELINE_LENGTH (4 * 1024 * 1024) // asked for but not received yet
+#define TORRENT_WEB_SEED_REQUESTS_MAX 64 // GETs in flight, a span over many small files needs one per file
+#define TORRENT_WEB_SEED_HEADERS_MAX 8192
+#define TORRENT_WEB_SEED_RETRY_MS 15000 // after the first failure, doubled for every one after that
+#define TORRENT_WEB_SEED_RETRY_MAX_MS 600000
+
+typedef enum TorrentWebSeedState {
+    TORRENT_WEB_SEED_IDLE, // no connection, nothing to fetch or waiting out a failure
+    TORRENT_WEB_SEED_CONNECTING,
+    TORRENT_WEB_SEED_CONNECTED,
+} TorrentWebSeedState;
+
+/* one ranged GET, or a stretch of padding that is never asked for */
+typedef struct TorrentWebSeedRequest {
+    u64 offset; // in the torrent's byte stream
+    u64 length;
+    usize file;
+} TorrentWebSeedRequest;
+
+typedef struct TorrentWebSeedBuffer {
+    u8* data;
+    usize offset;
+    usize length;
+    usize capacity;
+} TorrentWebSeedBuffer;
+
+/*
+ * an http mirror of the torrent (BEP 19). it fetches runs of pieces in order with ranged
+ * GETs pipelined over one keep-alive connection, split wherever a file ends. pieces are
+ * claimed from the picker only as they are asked for, so the run stops wherever a peer got
+ * there first. what arrives is handed out in 16 KiB blocks, like a peer's
+ */
+typedef struct TorrentWebSeed {
+    TorrentWebSeedState state;
+    char* url;
+    URLSplitResult address;
+    char** file_paths; // escaped request path of every file, NULL for padding
+    u64* file_offsets; // where every file starts in the torrent's byte stream, then where the last one ends
+    usize files_length;
+
+    // not owned
+    TorrentMetadata* metadata;
+    TorrentPicker* picker;
+
+    i32 socket;
+    bool closed; // the server hung up, whatever it sent before is still parsed
+    TorrentWebSeedBuffer input;
+    TorrentWebSeedBuffer output;
+
+    // the run of pieces being fetched: bytes up to claimed are ours, up to queued asked for and up to received here
+    bool span_open;
+    u32 span_next;
+    u64 claimed;
+    u64 queued;
+    u64 received;
+
+    // the pieces claimed whose last block hasn't been handed out yet, oldest first. only
+    // these are given back to the picker when the seed fails
+    u32* pieces;
+    usize pieces_length;
+    usize pieces_capacity;
+
+    TorrentWebSeedRequest requests[TORRENT_WEB_SEED_REQUESTS_MAX];
+    usize requests_start;
+    usize requests_length;
+    bool headers_parsed; // for the oldest request
+
+    u8 block[TORRENT_WEB_SEED_BLOCK_LENGTH];
+    u32 block_length; // received so far, the block starts at received - block_length
+
+    u64 bytes_downloaded;
+    u64 bytes_connected; // bytes_downloaded when the connection was made
+    u32 failures;
+    i64 retry_at; // also when to look for a new run again after finding none
+} TorrentWebSeed;
+
+TorrentWebSeed* torrent_web_seed_create(const char* url, TorrentMetadata* metadata, TorrentPicker* picker);
+bool torrent_web_seed_update(TorrentWebSeed* seed, i64 now);
+bool torrent_web_seed_connect_finish(TorrentWebSeed* seed);
+bool torrent_web_seed_flush(TorrentWebSeed* seed);
+bool torrent_web_seed_receive(TorrentWebSeed* seed);
+bool torrent_web_seed_block_next(TorrentWebSeed* seed, TorrentPickerBlock* block, const u8** data, bool* failed);
+void torrent_web_seed_fail(TorrentWebSeed* seed, i64 now);
+void torrent_web_seed_piece_forget(TorrentWebSeed* seed, u32 index);
+void torrent_web_seed_destroy(TorrentWebSeed* seed);
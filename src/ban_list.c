@@ -0,0 +1,54 @@
+#include "ban_list.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "types.h"
+#include "utils/log.h"
+
+static char torrent_ban_list[TORRENT_BAN_LIST_MAX][32];
+static usize torrent_ban_list_used;
+static pthread_mutex_t torrent_ban_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool torrent_ban_list_find(const char* ip);
+
+/* false if the address was banned already or the list is full */
+bool torrent_ban_list_add(const char* ip) {
+    pthread_mutex_lock(&torrent_ban_list_mutex);
+
+    bool added = false;
+    if (!torrent_ban_list_find(ip)) {
+        if (torrent_ban_list_used < TORRENT_BAN_LIST_MAX) {
+            snprintf(torrent_ban_list[torrent_ban_list_used], sizeof(torrent_ban_list[0]), "%s", ip);
+            torrent_ban_list_used++;
+            added = true;
+        } else {
+            log_warn("BAN LIST", "Ban list is full, not banning %s!", ip);
+        }
+    }
+
+    pthread_mutex_unlock(&torrent_ban_list_mutex);
+    return added;
+}
+
+bool torrent_ban_list_contains(const char* ip) {
+    pthread_mutex_lock(&torrent_ban_list_mutex);
+    bool found = torrent_ban_list_find(ip);
+    pthread_mutex_unlock(&torrent_ban_list_mutex);
+    return found;
+}
+
+usize torrent_ban_list_length() {
+    pthread_mutex_lock(&torrent_ban_list_mutex);
+    usize length = torrent_ban_list_used;
+    pthread_mutex_unlock(&torrent_ban_list_mutex);
+    return length;
+}
+
+static bool torrent_ban_list_find(const char* ip) {
+    for (usize i = 0; i < torrent_ban_list_used; i++) {
+        if (strcmp(torrent_ban_list[i], ip) == 0) { return true; }
+    }
+    return false;
+}
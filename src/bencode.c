@@ -4,37 +4,41 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "utils/log.h"
+
+static BencodeObject* bencode_object_value_parse(u8* bencoded_string, usize bencoded_string_length, usize* bencoded_string_index, usize depth);
 static BencodeObject* bencode_object_integer_parse(u8* bencoded_string, usize bencoded_string_length, usize* bencoded_string_index);
 static BencodeObject* bencode_object_string_parse(u8* bencoded_string, usize bencoded_string_length, usize* bencoded_string_index);
-static BencodeObject* bencode_object_list_parse(u8* bencoded_string, usize bencoded_string_length, usize* bencoded_string_index);
-static BencodeObject* bencode_object_dictionary_parse(u8* bencoded_string, usize bencoded_string_length, usize* bencoded_string_index);
+static BencodeObject* bencode_object_list_parse(u8* bencoded_string, usize bencoded_string_length, usize* bencoded_string_index, usize depth);
+static BencodeObject* bencode_object_dictionary_parse(u8* bencoded_string, usize bencoded_string_length, usize* bencoded_string_index, usize depth);
 
 static void bencode_object_integer_destroy(BencodeObject* object);
 static void bencode_object_string_destroy(BencodeObject* object);
 static void bencode_object_list_destroy(BencodeObject* object);
 static void bencode_object_dictionary_destroy(BencodeObject* object);
 
+static void bencode_writer_bytes(BencodeWriter* writer, const void* data, usize length);
+static bool bencode_writer_value_begin(BencodeWriter* writer);
+static void bencode_writer_length_prefix(BencodeWriter* writer, usize length);
+static void bencode_writer_key_bytes(BencodeWriter* writer, const u8* key, usize key_length);
+static void bencode_writer_container_begin(BencodeWriter* writer, bool dictionary);
+static i32 bencode_key_compare(const u8* a, usize a_length, const u8* b, usize b_length);
+
+/*
+ * returns NULL if the data is malformed, truncated or nested deeper than BENCODE_PARSER_DEPTH_MAX.
+ * memory grows with the input, so callers cap what a peer can hand in before parsing it
+ */
 BencodeObject* bencode_object_parse(u8* bencoded_string, usize bencoded_string_length, usize* bencoded_string_index) {
-	usize start_index = *bencoded_string_index;
-
-    BencodeObject* object = NULL;
-	switch (bencoded_string[*bencoded_string_index]) {
-		case 'i': object = bencode_object_integer_parse(bencoded_string, bencoded_string_length, bencoded_string_index); break; // integer
-		case 'l': object = bencode_object_list_parse(bencoded_string, bencoded_string_length, bencoded_string_index); break; // list
-		case 'd': object = bencode_object_dictionary_parse(bencoded_string, bencoded_string_length, bencoded_string_index); break; // dictionary
-		default: object = bencode_object_string_parse(bencoded_string, bencoded_string_length, bencoded_string_index); break; // string
-	}
-
-	object->bencode_data_length = (*bencoded_string_index - start_index);
-	object->bencode_data = (u8*) malloc(sizeof(u8) * object->bencode_data_length);
-	memcpy(object->bencode_data, bencoded_string + start_index, object->bencode_data_length);
-
-	return object;
+	return bencode_object_value_parse(bencoded_string, bencoded_string_length, bencoded_string_index, 0);
 }
 
 BencodeObject* bencode_object_dictionary_get(BencodeObject* dictionary, const char* key) {
+	if (!dictionary || dictionary->type != DICTIONARY) { return NULL; }
+
+	usize key_length = strlen(key);
     for (usize i = 0; i < dictionary->dictionary_length; i++) {
-		if (strncmp(dictionary->dictionary[i].key->string, key, dictionary->dictionary[i].key->string_length) == 0) {
+		BencodeObject* dictionary_key = dictionary->dictionary[i].key;
+		if (dictionary_key->string_length == key_length && memcmp(dictionary_key->string, key, key_length) == 0) {
 			return dictionary->dictionary[i].value;
 		}
 	}
@@ -55,7 +59,7 @@ void bencode_object_print(BencodeObject* object) {
 			}
 			printf("\"");
 		} break;
-		case INTEGER: printf("%d", object->number); break;
+		case INTEGER: printf("%lld", (long long) object->number); break;
 		case LIST: {
 			printf("[");
 			for (usize i = 0; i < object->list_length; i++) {
@@ -82,8 +86,6 @@ void bencode_object_print(BencodeObject* object) {
 }
 
 void bencode_object_destroy(BencodeObject* object) {
-	free(object->bencode_data);
-
     switch (object->type) {
 		case STRING: bencode_object_string_destroy(object); break;
 		case INTEGER: bencode_object_integer_destroy(object); break;
@@ -92,10 +94,40 @@ void bencode_object_destroy(BencodeObject* object) {
 	}
 }
 
+/* depth is how many lists and dictionaries the value sits in */
+static BencodeObject* bencode_object_value_parse(u8* bencoded_string, usize bencoded_string_length, usize* bencoded_string_index, usize depth) {
+	usize start_index = *bencoded_string_index;
+	if (start_index >= bencoded_string_length) {
+		log_warn("BENCODE", "Unexpected end of bencoded data!");
+		return NULL;
+	}
+
+	u8 type = bencoded_string[start_index];
+	if ((type == 'l' || type == 'd') && depth == BENCODE_PARSER_DEPTH_MAX) {
+		log_warn("BENCODE", "Bencoded data is nested too deep!");
+		return NULL;
+	}
+
+    BencodeObject* object = NULL;
+	switch (type) {
+		case 'i': object = bencode_object_integer_parse(bencoded_string, bencoded_string_length, bencoded_string_index); break; // integer
+		case 'l': object = bencode_object_list_parse(bencoded_string, bencoded_string_length, bencoded_string_index, depth); break; // list
+		case 'd': object = bencode_object_dictionary_parse(bencoded_string, bencoded_string_length, bencoded_string_index, depth); break; // dictionary
+		default: object = bencode_object_string_parse(bencoded_string, bencoded_string_length, bencoded_string_index); break; // string
+	}
+
+	if (!object) { return NULL; }
+
+	object->bencode_offset = start_index;
+	object->bencode_length = *bencoded_string_index - start_index;
+
+	return object;
+}
+
 static BencodeObject* bencode_object_integer_parse(u8* bencoded_string, usize bencoded_string_length, usize* bencoded_string_index) {
 	BencodeObject* object = (BencodeObject*) malloc(sizeof(BencodeObject));
 	if (!object) {
-		fprintf(stderr, "[ERROR] [BENCODE] [INTEGER] Failed to allocate memory for bencode object!\n");
+		log_error("BENCODE", "[INTEGER] Failed to allocate memory for bencode object!");
 		return NULL;
 	}
 
@@ -103,13 +135,19 @@ static BencodeObject* bencode_object_integer_parse(u8* bencoded_string, usize be
 
 	// find end of number
 	usize number_length = 0;
-	while (bencoded_string[*bencoded_string_index + number_length] != 'e') {
+	while (*bencoded_string_index + number_length < bencoded_string_length && bencoded_string[*bencoded_string_index + number_length] != 'e') {
 		number_length++;
 	}
 
+	if (*bencoded_string_index + number_length >= bencoded_string_length) {
+		log_warn("BENCODE", "[INTEGER] Integer is not terminated!");
+		free(object);
+		return NULL;
+	}
+
 	char* number_string = (char*) malloc(sizeof(char) * (number_length + 1));
 	if (!number_string) {
-		fprintf(stderr, "[ERROR] [BENCODE] [INTEGER] Failed to allocate memory for bencode integer!\n");
+		log_error("BENCODE", "[INTEGER] Failed to allocate memory for bencode integer!");
 		free(object);
 		return NULL;
 	}
@@ -120,9 +158,9 @@ static BencodeObject* bencode_object_integer_parse(u8* bencoded_string, usize be
 	object->type = INTEGER;
 
 	char* end;
-	object->number = strtol(number_string, &end, 10);
+	object->number = strtoll(number_string, &end, 10);
 	if (*end != '\0') {
-		fprintf(stderr, "[ERROR] [BENCODE] [INTEGER] Failed to convert string into integer!\n");
+		log_warn("BENCODE", "[INTEGER] Failed to convert string into integer!");
 		free(number_string);
 		free(object);
 		return NULL;
@@ -138,19 +176,25 @@ static BencodeObject* bencode_object_integer_parse(u8* bencoded_string, usize be
 static BencodeObject* bencode_object_string_parse(u8* bencoded_string, usize bencoded_string_length, usize* bencoded_string_index) {
 	BencodeObject* object = (BencodeObject*) malloc(sizeof(BencodeObject));
 	if (!object) {
-		fprintf(stderr, "[ERROR] [BENCODE] [STRING] Failed to allocate memory for bencode object!\n");
+		log_error("BENCODE", "[STRING] Failed to allocate memory for bencode object!");
 		return NULL;
 	}
 
 	// find end of number
 	usize number_length = 0;
-	while (bencoded_string[*bencoded_string_index + number_length] != ':') {
+	while (*bencoded_string_index + number_length < bencoded_string_length && bencoded_string[*bencoded_string_index + number_length] != ':') {
 		number_length++;
 	}
 
+	if (number_length == 0 || *bencoded_string_index + number_length >= bencoded_string_length) {
+		log_warn("BENCODE", "[STRING] String length is not terminated!");
+		free(object);
+		return NULL;
+	}
+
 	char* number_string = (char*) malloc(sizeof(char) * (number_length + 1));
 	if (!number_string) {
-		fprintf(stderr, "[ERROR] [BENCODE] [STRING] Failed to allocate memory for bencode integer!\n");
+		log_error("BENCODE", "[STRING] Failed to allocate memory for bencode integer!");
 		free(object);
 		return NULL;
 	}
@@ -161,9 +205,9 @@ static BencodeObject* bencode_object_string_parse(u8* bencoded_string, usize ben
 	*bencoded_string_index += number_length + 1; // + 1 for ':'
 
 	char* end;
-	usize string_length = strtol(number_string, &end, 10);
-	if (*end != '\0') {
-		fprintf(stderr, "[ERROR] [BENCODE] [STRING] Failed to convert string into integer!\n");
+	i64 string_length = strtoll(number_string, &end, 10);
+	if (*end != '\0' || string_length < 0) {
+		log_warn("BENCODE", "[STRING] Failed to convert string into integer!");
 		free(number_string);
 		free(object);
 		return NULL;
@@ -171,25 +215,32 @@ static BencodeObject* bencode_object_string_parse(u8* bencoded_string, usize ben
 
 	free(number_string);
 
+	if ((usize) string_length > bencoded_string_length - *bencoded_string_index) {
+		log_warn("BENCODE", "[STRING] String is longer than the remaining data!");
+		free(object);
+		return NULL;
+	}
+
 	object->type = STRING;
 	object->string_length = string_length;
-	object->string = (u8*) malloc(sizeof(u8) * string_length);
+	object->string = (u8*) malloc(sizeof(u8) * (string_length + 1)); // + 1 so empty strings still allocate
 	if (!object->string) {
-		fprintf(stderr, "[ERROR] [BENCODE] [STRING] Failed to allocate memory for string!\n");
+		log_error("BENCODE", "[STRING] Failed to allocate memory for string!");
 		free(object);
 		return NULL;
 	}
 
 	memcpy(object->string, bencoded_string + *bencoded_string_index, string_length);
+	object->string[string_length] = '\0';
 	*bencoded_string_index += string_length;
 
 	return object;
 }
 
-static BencodeObject* bencode_object_list_parse(u8* bencoded_string, usize bencoded_string_length, usize* bencoded_string_index) {
+static BencodeObject* bencode_object_list_parse(u8* bencoded_string, usize bencoded_string_length, usize* bencoded_string_index, usize depth) {
 	BencodeObject* object = (BencodeObject*) malloc(sizeof(BencodeObject));
 	if (!object) {
-		fprintf(stderr, "[ERROR] [BENCODE] [LIST] Failed to allocate memory for bencode object!\n");
+		log_error("BENCODE", "[LIST] Failed to allocate memory for bencode object!");
 		return NULL;
 	}
 
@@ -200,29 +251,39 @@ static BencodeObject* bencode_object_list_parse(u8* bencoded_string, usize benco
 	object->list = NULL;
 
 	// realloc is kinda slow sooooo maybe do this another way
-	while (bencoded_string[*bencoded_string_index] != 'e') {
+	while (*bencoded_string_index < bencoded_string_length && bencoded_string[*bencoded_string_index] != 'e') {
 		BencodeObject** temp = (BencodeObject**) realloc(object->list, sizeof(BencodeObject*) * (object->list_length + 1));
 		if (!temp) {
-			fprintf(stderr, "[ERROR] [BENCODE] [LIST] Failed to reallocate memory for list elements!\n");
-			free(object);
+			log_error("BENCODE", "[LIST] Failed to reallocate memory for list elements!");
+			bencode_object_destroy(object);
 			return NULL;
 		}
 
 		object->list = temp;
 
-		object->list[object->list_length] = bencode_object_parse(bencoded_string, bencoded_string_length, bencoded_string_index);
+		object->list[object->list_length] = bencode_object_value_parse(bencoded_string, bencoded_string_length, bencoded_string_index, depth + 1);
+		if (!object->list[object->list_length]) {
+			bencode_object_destroy(object);
+			return NULL;
+		}
 		object->list_length++;
 	}
 
+	if (*bencoded_string_index >= bencoded_string_length) {
+		log_warn("BENCODE", "[LIST] List is not terminated!");
+		bencode_object_destroy(object);
+		return NULL;
+	}
+
 	*bencoded_string_index += 1; // for 'e'
 
 	return object;
 }
 
-static BencodeObject* bencode_object_dictionary_parse(u8* bencoded_string, usize bencoded_string_length, usize* bencoded_string_index) {
+static BencodeObject* bencode_object_dictionary_parse(u8* bencoded_string, usize bencoded_string_length, usize* bencoded_string_index, usize depth) {
 	BencodeObject* object = (BencodeObject*) malloc(sizeof(BencodeObject));
 	if (!object) {
-		fprintf(stderr, "[ERROR] [BENCODE] [DICTIONARY] Failed to allocate memory for bencode object!\n");
+		log_error("BENCODE", "[DICTIONARY] Failed to allocate memory for bencode object!");
 		return NULL;
 	}
 
@@ -232,21 +293,42 @@ static BencodeObject* bencode_object_dictionary_parse(u8* bencoded_string, usize
 	object->dictionary_length = 0;
 	object->dictionary = NULL;
 
-	while (bencoded_string[*bencoded_string_index] != 'e') {
+	while (*bencoded_string_index < bencoded_string_length && bencoded_string[*bencoded_string_index] != 'e') {
 		BencodeObjectKeyValue* temp = (BencodeObjectKeyValue*) realloc(object->dictionary, sizeof(BencodeObjectKeyValue) * (object->dictionary_length + 1));
 		if (!temp) {
-			fprintf(stderr, "[ERROR] [BENCODE] [DICTIONARY] Failed to reallocate memory for dictionary elements!\n");
-			free(object);
+			log_error("BENCODE", "[DICTIONARY] Failed to reallocate memory for dictionary elements!");
+			bencode_object_destroy(object);
 			return NULL;
 		}
 
 		object->dictionary = temp;
 
-		object->dictionary[object->dictionary_length].key = bencode_object_parse(bencoded_string, bencoded_string_length, bencoded_string_index);
-		object->dictionary[object->dictionary_length].value = bencode_object_parse(bencoded_string, bencoded_string_length, bencoded_string_index);
+		BencodeObject* key = bencode_object_value_parse(bencoded_string, bencoded_string_length, bencoded_string_index, depth + 1);
+		if (!key || key->type != STRING) {
+			log_warn("BENCODE", "[DICTIONARY] Dictionary key is not a string!");
+			if (key) { bencode_object_destroy(key); }
+			bencode_object_destroy(object);
+			return NULL;
+		}
+
+		BencodeObject* value = bencode_object_value_parse(bencoded_string, bencoded_string_length, bencoded_string_index, depth + 1);
+		if (!value) {
+			bencode_object_destroy(key);
+			bencode_object_destroy(object);
+			return NULL;
+		}
+
+		object->dictionary[object->dictionary_length].key = key;
+		object->dictionary[object->dictionary_length].value = value;
 		object->dictionary_length++;
 	}
 
+	if (*bencoded_string_index >= bencoded_string_length) {
+		log_warn("BENCODE", "[DICTIONARY] Dictionary is not terminated!");
+		bencode_object_destroy(object);
+		return NULL;
+	}
+
 	*bencoded_string_index += 1; // for 'e'
 
 	return object;
@@ -277,3 +359,254 @@ static void bencode_object_dictionary_destroy(BencodeObject* object) {
 	free(object->dictionary);
 	free(object);
 }
+
+/* dictionaries come out with their keys sorted whatever order they were parsed in */
+void bencode_object_write(BencodeWriter* writer, BencodeObject* object) {
+	switch (object->type) {
+		case STRING: bencode_writer_string(writer, object->string, object->string_length); break;
+		case INTEGER: bencode_writer_integer(writer, object->number); break;
+		case LIST: {
+			bencode_writer_list_begin(writer);
+			for (usize i = 0; i < object->list_length; i++) {
+				bencode_object_write(writer, object->list[i]);
+			}
+			bencode_writer_end(writer);
+		} break;
+		case DICTIONARY: {
+			// picks the next smallest key each time, dictionaries are small and this needs no memory
+			bencode_writer_dictionary_begin(writer);
+			BencodeObject* previous = NULL;
+			for (usize i = 0; i < object->dictionary_length; i++) {
+				BencodeObjectKeyValue* next = NULL;
+				for (usize j = 0; j < object->dictionary_length; j++) {
+					BencodeObject* key = object->dictionary[j].key;
+					if (previous && bencode_key_compare(key->string, key->string_length, previous->string, previous->string_length) <= 0) { continue; }
+					if (!next || bencode_key_compare(key->string, key->string_length, next->key->string, next->key->string_length) < 0) { next = &object->dictionary[j]; }
+				}
+				if (!next) { break; } // only duplicates left
+
+				bencode_writer_key_bytes(writer, next->key->string, next->key->string_length);
+				bencode_object_write(writer, next->value);
+				previous = next->key;
+			}
+			bencode_writer_end(writer);
+		} break;
+	}
+}
+
+/* the exact number of bytes bencode_object_write() will produce, 0 if the object can't be encoded */
+usize bencode_object_encoded_length(BencodeObject* object) {
+	BencodeWriter writer;
+	bencode_writer_init(&writer, NULL, 0);
+	bencode_object_write(&writer, object);
+
+	return bencode_writer_finish(&writer) ? writer.length : 0;
+}
+
+/* MUST BE FREED, allocated once at the exact size */
+u8* bencode_object_encode(BencodeObject* object, usize* length) {
+	*length = bencode_object_encoded_length(object);
+	if (*length == 0) {
+		log_error("BENCODE", "Object can't be encoded!");
+		return NULL;
+	}
+
+	u8* data = (u8*) malloc(sizeof(u8) * *length);
+	if (!data) {
+		log_error("BENCODE", "Failed to allocate memory for encoded object!");
+		return NULL;
+	}
+
+	BencodeWriter writer;
+	bencode_writer_init(&writer, data, *length);
+	bencode_object_write(&writer, object);
+
+	return data;
+}
+
+/* data NULL only measures */
+void bencode_writer_init(BencodeWriter* writer, u8* data, usize capacity) {
+	writer->data = data;
+	writer->capacity = capacity;
+	writer->length = 0;
+	writer->failed = false;
+	writer->depth = 0;
+}
+
+void bencode_writer_integer(BencodeWriter* writer, i64 number) {
+	if (!bencode_writer_value_begin(writer)) { return; }
+
+	// the magnitude as unsigned so the most negative number doesn't overflow
+	u64 magnitude = (number < 0) ? (u64) -(number + 1) + 1 : (u64) number;
+
+	char digits[24];
+	usize position = sizeof(digits);
+	position--;
+	digits[position] = 'e';
+	do {
+		position--;
+		digits[position] = '0' + (magnitude % 10);
+		magnitude /= 10;
+	} while (magnitude > 0);
+	if (number < 0) {
+		position--;
+		digits[position] = '-';
+	}
+	position--;
+	digits[position] = 'i';
+
+	bencode_writer_bytes(writer, digits + position, sizeof(digits) - position);
+}
+
+void bencode_writer_string(BencodeWriter* writer, const void* string, usize string_length) {
+	if (!bencode_writer_value_begin(writer)) { return; }
+
+	bencode_writer_length_prefix(writer, string_length);
+	bencode_writer_bytes(writer, string, string_length);
+}
+
+void bencode_writer_text(BencodeWriter* writer, const char* text) {
+	bencode_writer_string(writer, text, strlen(text));
+}
+
+/*
+ * writes a string's length prefix and returns where its string_length bytes go, for
+ * values assembled in place (compact peers and nodes). NULL while measuring or on failure
+ */
+u8* bencode_writer_string_reserve(BencodeWriter* writer, usize string_length) {
+	if (!bencode_writer_value_begin(writer)) { return NULL; }
+
+	bencode_writer_length_prefix(writer, string_length);
+	if (writer->failed) { return NULL; }
+
+	if (!writer->data) {
+		writer->length += string_length;
+		return NULL;
+	}
+	if (writer->length + string_length > writer->capacity) {
+		writer->failed = true;
+		return NULL;
+	}
+
+	u8* string = writer->data + writer->length;
+	writer->length += string_length;
+	return string;
+}
+
+/* an already encoded value, e.g. an info dictionary kept as it came */
+void bencode_writer_raw(BencodeWriter* writer, const void* data, usize length) {
+	if (!bencode_writer_value_begin(writer)) { return; }
+
+	bencode_writer_bytes(writer, data, length);
+}
+
+/* keys have to come in sorted order, anything else fails the writer. key must stay valid until the dictionary ends */
+void bencode_writer_key(BencodeWriter* writer, const char* key) {
+	bencode_writer_key_bytes(writer, (const u8*) key, strlen(key));
+}
+
+void bencode_writer_list_begin(BencodeWriter* writer) {
+	bencode_writer_container_begin(writer, false);
+}
+
+void bencode_writer_dictionary_begin(BencodeWriter* writer) {
+	bencode_writer_container_begin(writer, true);
+}
+
+void bencode_writer_end(BencodeWriter* writer) {
+	if (writer->failed) { return; }
+
+	if (writer->depth == 0 || writer->levels[writer->depth - 1].value_next) {
+		writer->failed = true;
+		return;
+	}
+
+	writer->depth--;
+	bencode_writer_bytes(writer, "e", 1);
+}
+
+/* true if everything fit and every list and dictionary was closed */
+bool bencode_writer_finish(BencodeWriter* writer) {
+	return !writer->failed && writer->depth == 0;
+}
+
+static void bencode_writer_bytes(BencodeWriter* writer, const void* data, usize length) {
+	if (writer->failed) { return; }
+
+	if (writer->data) {
+		if (writer->length + length > writer->capacity) {
+			writer->failed = true;
+			return;
+		}
+		memcpy(writer->data + writer->length, data, length);
+	}
+	writer->length += length;
+}
+
+/* a value inside a dictionary has to follow its key */
+static bool bencode_writer_value_begin(BencodeWriter* writer) {
+	if (writer->failed) { return false; }
+	if (writer->depth == 0) { return true; }
+
+	BencodeWriterLevel* level = &writer->levels[writer->depth - 1];
+	if (level->dictionary) {
+		if (!level->value_next) {
+			writer->failed = true;
+			return false;
+		}
+		level->value_next = false;
+	}
+	return true;
+}
+
+static void bencode_writer_length_prefix(BencodeWriter* writer, usize length) {
+	char digits[24];
+	usize position = sizeof(digits);
+	position--;
+	digits[position] = ':';
+	do {
+		position--;
+		digits[position] = '0' + (length % 10);
+		length /= 10;
+	} while (length > 0);
+
+	bencode_writer_bytes(writer, digits + position, sizeof(digits) - position);
+}
+
+static void bencode_writer_key_bytes(BencodeWriter* writer, const u8* key, usize key_length) {
+	if (writer->failed) { return; }
+
+	BencodeWriterLevel* level = (writer->depth > 0) ? &writer->levels[writer->depth - 1] : NULL;
+	if (!level || !level->dictionary || level->value_next
+		|| (level->last_key && bencode_key_compare(key, key_length, level->last_key, level->last_key_length) <= 0)) {
+		writer->failed = true;
+		return;
+	}
+
+	bencode_writer_length_prefix(writer, key_length);
+	bencode_writer_bytes(writer, key, key_length);
+
+	level->last_key = key;
+	level->last_key_length = key_length;
+	level->value_next = true;
+}
+
+static void bencode_writer_container_begin(BencodeWriter* writer, bool dictionary) {
+	if (!bencode_writer_value_begin(writer)) { return; }
+
+	if (writer->depth == BENCODE_WRITER_DEPTH_MAX) {
+		writer->failed = true;
+		return;
+	}
+
+	writer->levels[writer->depth] = (BencodeWriterLevel) { dictionary, false, NULL, 0 };
+	writer->depth++;
+	bencode_writer_bytes(writer, dictionary ? "d" : "l", 1);
+}
+
+/* raw byte order, a key that is a prefix of another sorts first */
+static i32 bencode_key_compare(const u8* a, usize a_length, const u8* b, usize b_length) {
+	i32 result = memcmp(a, b, (a_length < b_length) ? a_length : b_length);
+	if (result != 0) { return result; }
+	return (a_length > b_length) - (a_length < b_length);
+}
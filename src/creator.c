@@ -0,0 +1,395 @@
+#include "creator.h"
+
+#include <dirent.h>
+#include <limits.h>
+#include <openssl/sha.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bencode.h"
+#include "metadata.h"
+#include "storage.h"
+#include "types.h"
+#include "utils/log.h"
+
+/* shared by every hashing thread, pieces are handed out one at a time */
+typedef struct TorrentCreatorHasher {
+    TorrentMetadataInfo* info;
+    TorrentStorage* storage;
+
+    u32 next_piece;
+    u32 pieces_hashed;
+    bool failed;
+} TorrentCreatorHasher;
+
+static bool torrent_creator_files_walk(TorrentMetadataInfo* info, usize* files_capacity, const char* root, const char* relative);
+static bool torrent_creator_file_add(TorrentMetadataInfo* info, usize* files_capacity, const char* path, u64 length);
+static i32 torrent_creator_file_compare(const void* a, const void* b);
+static bool torrent_creator_pieces_hash(TorrentMetadata* metadata, const char* directory, u32 threads);
+static void* torrent_creator_hash_run(void* argument);
+static bool torrent_creator_info_encode(TorrentMetadata* metadata);
+static void torrent_creator_info_write(BencodeWriter* writer, TorrentMetadataInfo* info);
+static bool torrent_creator_announce_set(TorrentMetadata* metadata, const TorrentCreatorOptions* options);
+
+/*
+ * walks options->path, hashes it on every core and returns metadata ready for
+ * torrent_metadata_save(). files are read through the storage layer, never modified
+ */
+TorrentMetadata* torrent_creator_create(const TorrentCreatorOptions* options) {
+    char root[PATH_MAX];
+    struct stat status;
+    if (!realpath(options->path, root) || stat(root, &status) != 0) {
+        log_error("CREATOR", "Failed to resolve path: %s", options->path);
+        return NULL;
+    }
+
+    // the torrent is named after the last component, the files are opened relative to its parent
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s", root);
+    char* separator = strrchr(directory, '/');
+    if (!separator || separator[1] == '\0') {
+        log_error("CREATOR", "Refusing to share the root directory!");
+        return NULL;
+    }
+    *separator = '\0';
+    const char* name = separator + 1;
+    if (directory[0] == '\0') { snprintf(directory, sizeof(directory), "/"); name = root + 1; }
+
+    TorrentMetadata* metadata = (TorrentMetadata*) calloc(1, sizeof(TorrentMetadata));
+    if (!metadata) {
+        log_error("CREATOR", "Failed to allocate memory for torrent metadata!");
+        return NULL;
+    }
+
+    TorrentMetadataInfo* info = &metadata->info;
+    info->name = strdup(name);
+    if (!info->name) {
+        log_error("CREATOR", "Failed to allocate memory for name string!");
+        torrent_metadata_destroy(metadata);
+        return NULL;
+    }
+
+    if (S_ISDIR(status.st_mode)) {
+        info->type = MULTIPLE_FILES;
+
+        usize files_capacity = 0;
+        if (!torrent_creator_files_walk(info, &files_capacity, root, NULL)) {
+            torrent_metadata_destroy(metadata);
+            return NULL;
+        }
+
+        // the order is part of the info hash, sorting makes it the same on every machine
+        qsort(info->files, info->files_length, sizeof(TorrentMetadataInfoFile), torrent_creator_file_compare);
+    } else if (S_ISREG(status.st_mode)) {
+        info->type = SINGLE_FILE;
+        info->length = status.st_size;
+    } else {
+        log_error("CREATOR", "Path is neither a file nor a directory: %s", options->path);
+        torrent_metadata_destroy(metadata);
+        return NULL;
+    }
+
+    if (info->length == 0) {
+        log_error("CREATOR", "Nothing to share, %s is empty!", options->path);
+        torrent_metadata_destroy(metadata);
+        return NULL;
+    }
+
+    info->piece_length = (options->piece_length != 0) ? options->piece_length : torrent_creator_piece_length(info->length);
+    if (info->piece_length < TORRENT_CREATOR_PIECE_LENGTH_MIN || info->piece_length > TORRENT_CREATOR_PIECE_LENGTH_MAX
+        || (info->piece_length & (info->piece_length - 1)) != 0) {
+        log_error("CREATOR", "Piece length must be a power of two between 16 KiB and 16 MiB!");
+        torrent_metadata_destroy(metadata);
+        return NULL;
+    }
+
+    u32 threads = options->threads;
+    if (threads == 0) {
+        i64 cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cores > 0) ? cores : 1;
+    }
+    if (threads > TORRENT_CREATOR_THREADS_MAX) { threads = TORRENT_CREATOR_THREADS_MAX; }
+
+    if (!torrent_creator_pieces_hash(metadata, directory, threads)
+        || !torrent_creator_info_encode(metadata)
+        || !torrent_creator_announce_set(metadata, options)) {
+        torrent_metadata_destroy(metadata);
+        return NULL;
+    }
+
+    metadata->created_by = strdup(TORRENT_CREATOR_NAME);
+    if (!metadata->created_by) {
+        log_error("CREATOR", "Failed to allocate memory for created by!");
+        torrent_metadata_destroy(metadata);
+        return NULL;
+    }
+    metadata->creation_date = time(NULL);
+
+    return metadata;
+}
+
+/* the smallest power of two that keeps the piece count under TORRENT_CREATOR_PIECES_TARGET */
+usize torrent_creator_piece_length(u64 length) {
+    usize piece_length = TORRENT_CREATOR_PIECE_LENGTH_MIN;
+    while (piece_length < TORRENT_CREATOR_PIECE_LENGTH_MAX && (length + piece_length - 1) / piece_length > TORRENT_CREATOR_PIECES_TARGET) {
+        piece_length *= 2;
+    }
+    return piece_length;
+}
+
+/* relative is NULL for the top directory, symlinks and special files are skipped */
+static bool torrent_creator_files_walk(TorrentMetadataInfo* info, usize* files_capacity, const char* root, const char* relative) {
+    char path[PATH_MAX];
+    if (relative) {
+        snprintf(path, sizeof(path), "%s/%s", root, relative);
+    } else {
+        snprintf(path, sizeof(path), "%s", root);
+    }
+
+    DIR* directory = opendir(path);
+    if (!directory) {
+        log_error("CREATOR", "Failed to open directory: %s", path);
+        return false;
+    }
+
+    bool success = true;
+    struct dirent* entry;
+    while (success && (entry = readdir(directory))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) { continue; }
+
+        char entry_relative[PATH_MAX];
+        char entry_path[PATH_MAX];
+        i32 relative_length = relative
+            ? snprintf(entry_relative, sizeof(entry_relative), "%s/%s", relative, entry->d_name)
+            : snprintf(entry_relative, sizeof(entry_relative), "%s", entry->d_name);
+        i32 path_length = snprintf(entry_path, sizeof(entry_path), "%s/%s", root, entry_relative);
+        if (relative_length >= (i32) sizeof(entry_relative) || path_length >= (i32) sizeof(entry_path)) {
+            log_error("CREATOR", "Path is too long: %s/%s", path, entry->d_name);
+            success = false;
+            break;
+        }
+
+        struct stat status;
+        if (lstat(entry_path, &status) != 0) {
+            log_error("CREATOR", "Failed to stat file: %s", entry_path);
+            success = false;
+        } else if (S_ISDIR(status.st_mode)) {
+            success = torrent_creator_files_walk(info, files_capacity, root, entry_relative);
+        } else if (S_ISREG(status.st_mode)) {
+            success = torrent_creator_file_add(info, files_capacity, entry_relative, status.st_size);
+        } else {
+            log_warn("CREATOR", "Skipping %s, it is not a regular file", entry_path);
+        }
+    }
+
+    closedir(directory);
+    return success;
+}
+
+static bool torrent_creator_file_add(TorrentMetadataInfo* info, usize* files_capacity, const char* path, u64 length) {
+    if (info->files_length == *files_capacity) {
+        usize capacity = (*files_capacity == 0) ? 64 : *files_capacity * 2;
+        TorrentMetadataInfoFile* files = (TorrentMetadataInfoFile*) realloc(info->files, sizeof(TorrentMetadataInfoFile) * capacity);
+        if (!files) {
+            log_error("CREATOR", "Failed to allocate memory for files!");
+            return false;
+        }
+
+        info->files = files;
+        *files_capacity = capacity;
+    }
+
+    TorrentMetadataInfoFile* file = &info->files[info->files_length];
+    memset(file, 0, sizeof(TorrentMetadataInfoFile));
+    file->path = strdup(path);
+    if (!file->path) {
+        log_error("CREATOR", "Failed to allocate memory for file path!");
+        return false;
+    }
+
+    file->length = length;
+    info->files_length++;
+    info->length += length;
+    return true;
+}
+
+static i32 torrent_creator_file_compare(const void* a, const void* b) {
+    return strcmp(((const TorrentMetadataInfoFile*) a)->path, ((const TorrentMetadataInfoFile*) b)->path);
+}
+
+/* every thread reads and hashes whole pieces on its own, so throughput grows with threads until the disk is the limit */
+static bool torrent_creator_pieces_hash(TorrentMetadata* metadata, const char* directory, u32 threads) {
+    TorrentMetadataInfo* info = &metadata->info;
+
+    u64 piece_count = (info->length + info->piece_length - 1) / info->piece_length;
+    if (piece_count > UINT32_MAX) {
+        log_error("CREATOR", "Too many pieces, pick a bigger piece length!");
+        return false;
+    }
+    info->piece_count = piece_count;
+
+    info->pieces = (u8**) calloc(info->piece_count, sizeof(u8*));
+    if (!info->pieces) {
+        log_error("CREATOR", "Failed to allocate memory for piece hashes!");
+        return false;
+    }
+    for (u32 i = 0; i < info->piece_count; i++) {
+        info->pieces[i] = (u8*) malloc(sizeof(u8) * SHA_DIGEST_LENGTH);
+        if (!info->pieces[i]) {
+            log_error("CREATOR", "Failed to allocate memory for piece hash!");
+            return false;
+        }
+    }
+
+    TorrentStorage* storage = torrent_storage_open(metadata, directory);
+    if (!storage) { return false; }
+
+    if (threads > info->piece_count) { threads = info->piece_count; }
+
+    log_info("CREATOR", "Hashing %u pieces of %zu bytes on %u threads", info->piece_count, info->piece_length, threads);
+
+    TorrentCreatorHasher hasher = { .info = info, .storage = storage };
+    pthread_t workers[TORRENT_CREATOR_THREADS_MAX];
+    u32 workers_length = 0;
+    for (; workers_length < threads; workers_length++) {
+        if (pthread_create(&workers[workers_length], NULL, torrent_creator_hash_run, &hasher) != 0) { break; }
+    }
+
+    // with no thread at all the work is done here
+    if (workers_length == 0) { torrent_creator_hash_run(&hasher); }
+    for (u32 i = 0; i < workers_length; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    torrent_storage_destroy(storage);
+    return !hasher.failed && hasher.pieces_hashed == info->piece_count;
+}
+
+static void* torrent_creator_hash_run(void* argument) {
+    TorrentCreatorHasher* hasher = (TorrentCreatorHasher*) argument;
+    TorrentMetadataInfo* info = hasher->info;
+
+    u8* buffer = (u8*) malloc(sizeof(u8) * info->piece_length);
+    if (!buffer) {
+        log_error("CREATOR", "Failed to allocate memory for piece buffer!");
+        __atomic_store_n(&hasher->failed, true, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    u32 progress_step = (info->piece_count >= 10) ? info->piece_count / 10 : 1;
+    while (!__atomic_load_n(&hasher->failed, __ATOMIC_RELAXED)) {
+        u32 index = __atomic_fetch_add(&hasher->next_piece, 1, __ATOMIC_RELAXED);
+        if (index >= info->piece_count) { break; }
+
+        u64 begin = (u64) index * info->piece_length;
+        usize length = (info->length - begin < info->piece_length) ? (usize) (info->length - begin) : info->piece_length;
+        if (!torrent_storage_read(hasher->storage, index, 0, buffer, length)) {
+            __atomic_store_n(&hasher->failed, true, __ATOMIC_RELAXED);
+            break;
+        }
+
+        SHA1(buffer, length, info->pieces[index]);
+
+        u32 hashed = __atomic_add_fetch(&hasher->pieces_hashed, 1, __ATOMIC_RELAXED);
+        if (hashed % progress_step == 0) {
+            log_info("CREATOR", "Hashed %u/%u pieces", hashed, info->piece_count);
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+/* info_data and info_sha1 are filled in exactly like torrent_metadata_create() does for a loaded file */
+static bool torrent_creator_info_encode(TorrentMetadata* metadata) {
+    BencodeWriter writer;
+    bencode_writer_init(&writer, NULL, 0);
+    torrent_creator_info_write(&writer, &metadata->info);
+    if (!bencode_writer_finish(&writer)) {
+        log_error("CREATOR", "Failed to encode info dictionary!");
+        return false;
+    }
+
+    metadata->info_data_length = writer.length;
+    metadata->info_data = (u8*) malloc(sizeof(u8) * metadata->info_data_length);
+    if (!metadata->info_data) {
+        log_error("CREATOR", "Failed to allocate memory for info dictionary!");
+        return false;
+    }
+
+    bencode_writer_init(&writer, metadata->info_data, metadata->info_data_length);
+    torrent_creator_info_write(&writer, &metadata->info);
+
+    SHA1(metadata->info_data, metadata->info_data_length, metadata->info_sha1);
+    return true;
+}
+
+/* keys in sorted order, multi file paths are split back into their components */
+static void torrent_creator_info_write(BencodeWriter* writer, TorrentMetadataInfo* info) {
+    bencode_writer_dictionary_begin(writer);
+
+    if (info->type == MULTIPLE_FILES) {
+        bencode_writer_key(writer, "files");
+        bencode_writer_list_begin(writer);
+        for (usize i = 0; i < info->files_length; i++) {
+            bencode_writer_dictionary_begin(writer);
+            bencode_writer_key(writer, "length");
+            bencode_writer_integer(writer, info->files[i].length);
+            bencode_writer_key(writer, "path");
+            bencode_writer_list_begin(writer);
+            for (const char* component = info->files[i].path; component; ) {
+                const char* separator = strchr(component, '/');
+                bencode_writer_string(writer, component, separator ? (usize) (separator - component) : strlen(component));
+                component = separator ? separator + 1 : NULL;
+            }
+            bencode_writer_end(writer);
+            bencode_writer_end(writer);
+        }
+        bencode_writer_end(writer);
+    } else {
+        bencode_writer_key(writer, "length");
+        bencode_writer_integer(writer, info->length);
+    }
+
+    bencode_writer_key(writer, "name");
+    bencode_writer_text(writer, info->name);
+    bencode_writer_key(writer, "piece length");
+    bencode_writer_integer(writer, info->piece_length);
+
+    bencode_writer_key(writer, "pieces");
+    u8* pieces = bencode_writer_string_reserve(writer, (usize) info->piece_count * SHA_DIGEST_LENGTH);
+    if (pieces) {
+        for (u32 i = 0; i < info->piece_count; i++) {
+            memcpy(pieces + ((usize) i * SHA_DIGEST_LENGTH), info->pieces[i], SHA_DIGEST_LENGTH);
+        }
+    }
+
+    bencode_writer_end(writer);
+}
+
+static bool torrent_creator_announce_set(TorrentMetadata* metadata, const TorrentCreatorOptions* options) {
+    if (options->announce_list_length == 0) { return true; } // trackerless, peers come from the dht
+
+    metadata->announce = strdup(options->announce_list[0]);
+    metadata->announce_list = (char**) calloc(options->announce_list_length, sizeof(char*));
+    if (!metadata->announce || !metadata->announce_list) {
+        log_error("CREATOR", "Failed to allocate memory for announce list!");
+        return false;
+    }
+
+    for (usize i = 0; i < options->announce_list_length; i++) {
+        metadata->announce_list[i] = strdup(options->announce_list[i]);
+        if (!metadata->announce_list[i]) {
+            log_error("CREATOR", "Failed to allocate memory for announce url!");
+            return false;
+        }
+        metadata->announce_list_length++;
+    }
+
+    return true;
+}
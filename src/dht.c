@@ -0,0 +1,1046 @@
+#include "dht.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bencode.h"
+#include "tracker.h"
+#include "types.h"
+#include "utils/log.h"
+#include "utils/time.h"
+
+#define DHT_MESSAGE_MAX 1500
+#define DHT_LOOKUP_CAPACITY 64
+#define DHT_LOOKUP_TIMEOUT_MS 8000
+#define DHT_QUERY_TIMEOUT_MS 1500
+#define DHT_TOKEN_SECRET_LIFETIME 300
+#define DHT_STORED_PEER_LIFETIME 1800
+#define DHT_NODE_STALE_AFTER 900
+#define DHT_NODE_MAX_FAILED_QUERIES 2
+#define DHT_VALUES_MAX 50
+#define DHT_RECEIVED_TOKEN_MAX 32
+
+typedef enum DHTLookupEntryState {
+    DHT_LOOKUP_QUEUED,
+    DHT_LOOKUP_IN_FLIGHT,
+    DHT_LOOKUP_RESPONDED,
+    DHT_LOOKUP_FAILED,
+} DHTLookupEntryState;
+
+typedef struct DHTLookupEntry {
+    u8 id[20];
+    u8 distance[20];
+    struct sockaddr_in address;
+    DHTLookupEntryState state;
+
+    u16 transaction;
+    i64 sent_at;
+
+    u8 token[DHT_RECEIVED_TOKEN_MAX];
+    usize token_length;
+} DHTLookupEntry;
+
+/* state of one iterative find_node or get_peers lookup */
+typedef struct DHTLookup {
+    u8 target[20];
+    bool get_peers;
+    u16 announce_port; // get_peers only, 0 doesn't announce
+    i64 deadline; // 0 until it has someone to ask
+    bool finished;
+
+    DHTLookupEntry entries[DHT_LOOKUP_CAPACITY];
+    usize entries_length;
+
+    TorrentTrackerPeer* peers;
+    usize peers_length;
+    usize peers_capacity;
+    usize peers_taken; // handed out by dht_peers_take, a finished lookup goes once all are
+} DHTLookup;
+
+static void dht_distance(const u8 a[20], const u8 b[20], u8 distance[20]);
+static usize dht_bucket_index(const u8 id[20], const u8 other[20]);
+static bool dht_address_equal(const struct sockaddr_in* a, const struct sockaddr_in* b);
+
+static void dht_routing_table_update(DHT* dht, const u8 id[20], const struct sockaddr_in* address);
+static void dht_routing_table_node_failed(DHT* dht, const struct sockaddr_in* address);
+static usize dht_routing_table_closest(DHT* dht, const u8 target[20], DHTNode* nodes, usize nodes_max);
+static bool dht_routing_table_load(DHT* dht, const char* path);
+
+static void dht_token_secret_rotate(DHT* dht);
+static void dht_token_compute(const u8 secret[20], const struct sockaddr_in* address, u8 token[DHT_TOKEN_LENGTH]);
+static bool dht_token_validate(DHT* dht, const struct sockaddr_in* address, const u8* token, usize token_length);
+
+static void dht_stored_peer_add(DHT* dht, const u8 info_hash[20], const struct sockaddr_in* address);
+
+static void dht_message_write_nodes(DHT* dht, BencodeWriter* message, const u8 target[20]);
+static bool dht_message_send(DHT* dht, BencodeWriter* message, const struct sockaddr_in* address);
+static void dht_error_send(DHT* dht, i64 code, const char* description, BencodeObject* transaction, const struct sockaddr_in* address);
+
+static bool dht_query_send(DHT* dht, DHTLookup* lookup, DHTLookupEntry* entry);
+static void dht_announce_send(DHT* dht, DHTLookupEntry* entry, const u8 info_hash[20], u16 port);
+
+static void dht_receive(DHT* dht);
+static void dht_packet_handle(DHT* dht, u8* data, usize length, const struct sockaddr_in* from);
+static void dht_query_handle(DHT* dht, BencodeObject* message, BencodeObject* transaction, const struct sockaddr_in* from);
+static void dht_response_handle(DHT* dht, BencodeObject* message, BencodeObject* transaction, const struct sockaddr_in* from);
+static void dht_error_handle(DHT* dht, BencodeObject* transaction, const struct sockaddr_in* from);
+
+static DHTLookup* dht_lookup_create(DHT* dht, const u8 target[20], bool get_peers);
+static DHTLookupEntry* dht_lookup_entry_find(DHT* dht, BencodeObject* transaction, const struct sockaddr_in* from, DHTLookup** lookup);
+static void dht_lookup_entry_add(DHT* dht, DHTLookup* lookup, const u8 id[20], const struct sockaddr_in* address);
+static void dht_lookup_entries_sort(DHTLookup* lookup);
+static void dht_lookup_peer_add(DHTLookup* lookup, const u8 compact_peer[6]);
+static void dht_lookup_seed(DHT* dht, DHTLookup* lookup);
+static bool dht_lookup_step(DHT* dht, DHTLookup* lookup, i64 now);
+static void dht_lookup_announce(DHT* dht, DHTLookup* lookup);
+static void dht_lookup_destroy(DHTLookup* lookup);
+
+static inline bool dht_string_is(BencodeObject* object, usize length) {
+    return object && object->type == STRING && object->string_length == length;
+}
+
+DHT* dht_create(u16 port, const char* routing_table_path) {
+    DHT* dht = (DHT*) malloc(sizeof(DHT));
+    if (!dht) {
+        log_error("DHT", "Failed to allocate memory for dht!");
+        return NULL;
+    }
+
+    memset(dht, 0, sizeof(DHT));
+
+    dht->stored_peers = (DHTStoredPeer*) malloc(sizeof(DHTStoredPeer) * DHT_STORED_PEERS_MAX);
+    if (!dht->stored_peers) {
+        log_error("DHT", "Failed to allocate memory for stored peers!");
+        free(dht);
+        return NULL;
+    }
+
+    if (RAND_bytes(dht->id, sizeof(dht->id)) != 1 || RAND_bytes(dht->token_secret, sizeof(dht->token_secret)) != 1) {
+        log_error("DHT", "Failed to generate random node id!");
+        free(dht->stored_peers);
+        free(dht);
+        return NULL;
+    }
+    memcpy(dht->previous_token_secret, dht->token_secret, sizeof(dht->token_secret));
+    dht->token_secret_changed = time(NULL);
+
+    dht->socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (dht->socket == -1) {
+        log_error("DHT", "Failed to create socket!");
+        free(dht->stored_peers);
+        free(dht);
+        return NULL;
+    }
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+
+    if (bind(dht->socket, (struct sockaddr*) &address, sizeof(address)) == -1) {
+        // someone else already has the port, any port works for a dht node
+        address.sin_port = 0;
+        if (bind(dht->socket, (struct sockaddr*) &address, sizeof(address)) == -1) {
+            log_error("DHT", "Failed to bind socket!");
+            close(dht->socket);
+            free(dht->stored_peers);
+            free(dht);
+            return NULL;
+        }
+    }
+
+    socklen_t address_length = sizeof(address);
+    getsockname(dht->socket, (struct sockaddr*) &address, &address_length);
+    dht->port = ntohs(address.sin_port);
+
+    if (routing_table_path) {
+        dht->routing_table_path = strdup(routing_table_path);
+        dht_routing_table_load(dht, routing_table_path);
+    }
+
+    return dht;
+}
+
+/*
+ * starts a find_node lookup for our own id at the given node, or adds the node to the one
+ * already running. the routing table fills as the lookup goes on
+ */
+bool dht_bootstrap(DHT* dht, const char* host, const char* port) {
+    struct addrinfo address_hints = {0};
+    address_hints.ai_family = AF_INET; // BEP 5 is IPv4 only
+    address_hints.ai_socktype = SOCK_DGRAM;
+
+    struct addrinfo* address_info;
+    i32 status;
+    if ((status = getaddrinfo(host, port, &address_hints, &address_info)) != 0) {
+        log_warn("DHT", "[BOOTSTRAP] Failed to get address infomation for %s:%s: %s", host, port, gai_strerror(status));
+        return false;
+    }
+
+    DHTLookup* lookup = NULL;
+    for (usize i = 0; i < dht->lookups_length; i++) {
+        if (!dht->lookups[i]->get_peers && !dht->lookups[i]->finished) { lookup = dht->lookups[i]; }
+    }
+
+    bool created = !lookup;
+    if (created) {
+        lookup = dht_lookup_create(dht, dht->id, false);
+        if (!lookup) {
+            freeaddrinfo(address_info);
+            return false;
+        }
+    }
+
+    // the bootstrap node's id is unknown until it answers
+    u8 unknown_id[20] = {0};
+    dht_lookup_entry_add(dht, lookup, unknown_id, (struct sockaddr_in*) address_info->ai_addr);
+    freeaddrinfo(address_info);
+
+    if (created) { dht_lookup_seed(dht, lookup); }
+    return true;
+}
+
+usize dht_nodes_count(DHT* dht) {
+    usize count = 0;
+    for (usize i = 0; i < DHT_BUCKET_COUNT; i++) {
+        count += dht->buckets[i].nodes_length;
+    }
+    return count;
+}
+
+/*
+ * starts a get_peers lookup, what it finds comes out of dht_peers_take as the answers arrive.
+ * a lookup for the hash that is still running is kept instead. announce_port 0 doesn't announce
+ */
+bool dht_get_peers(DHT* dht, const u8 info_hash[20], u16 announce_port) {
+    for (usize i = 0; i < dht->lookups_length; i++) {
+        DHTLookup* lookup = dht->lookups[i];
+        if (lookup->get_peers && !lookup->finished && memcmp(lookup->target, info_hash, 20) == 0) { return true; }
+    }
+
+    DHTLookup* lookup = dht_lookup_create(dht, info_hash, true);
+    if (!lookup) { return false; }
+
+    lookup->announce_port = announce_port;
+    return true;
+}
+
+bool dht_lookups_active(DHT* dht) {
+    for (usize i = 0; i < dht->lookups_length; i++) {
+        if (!dht->lookups[i]->finished) { return true; }
+    }
+    return false;
+}
+
+/*
+ * answers incoming queries and moves the lookups along, never blocks. call it when the socket
+ * is readable and at least every few hundred ms, so queries that got no answer time out
+ */
+void dht_process(DHT* dht) {
+    dht_token_secret_rotate(dht);
+    dht_receive(dht);
+
+    i64 now = time_now_ms();
+    usize i = 0;
+    while (i < dht->lookups_length) {
+        DHTLookup* lookup = dht->lookups[i];
+        if (!lookup->finished && dht_lookup_step(dht, lookup, now)) {
+            lookup->finished = true;
+            if (lookup->get_peers) { dht_lookup_announce(dht, lookup); }
+        }
+
+        // a finished lookup stays until its peers are taken
+        if (lookup->finished && lookup->peers_taken == lookup->peers_length) {
+            dht_lookup_destroy(lookup);
+            dht->lookups_length--;
+            memmove(&dht->lookups[i], &dht->lookups[i + 1], sizeof(DHTLookup*) * (dht->lookups_length - i));
+            continue;
+        }
+        i++;
+    }
+}
+
+/* MUST BE FREED, the peers every lookup found since the last call. NULL with *peers_length = 0 when there are none */
+TorrentTrackerPeer* dht_peers_take(DHT* dht, usize* peers_length) {
+    *peers_length = 0;
+
+    usize untaken = 0;
+    for (usize i = 0; i < dht->lookups_length; i++) {
+        untaken += dht->lookups[i]->peers_length - dht->lookups[i]->peers_taken;
+    }
+    if (untaken == 0) { return NULL; }
+
+    TorrentTrackerPeer* peers = (TorrentTrackerPeer*) malloc(sizeof(TorrentTrackerPeer) * untaken);
+    if (!peers) {
+        log_error("DHT", "[GET PEERS] Failed to allocate memory for peers!");
+        return NULL;
+    }
+
+    for (usize i = 0; i < dht->lookups_length; i++) {
+        DHTLookup* lookup = dht->lookups[i];
+        usize length = lookup->peers_length - lookup->peers_taken;
+        memcpy(peers + *peers_length, lookup->peers + lookup->peers_taken, sizeof(TorrentTrackerPeer) * length);
+        *peers_length += length;
+        lookup->peers_taken = lookup->peers_length;
+    }
+
+    return peers;
+}
+
+/*
+ * file layout: "DHT1", our node id, big endian u32 node count, then the nodes
+ * in the same 26 byte compact form used on the wire
+ */
+bool dht_routing_table_save(DHT* dht, const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        log_error("DHT", "Failed to open routing table file for writing: %s", path);
+        return false;
+    }
+
+    u32 count = dht_nodes_count(dht);
+    u8 header[28];
+    memcpy(header, "DHT1", 4);
+    memcpy(header + 4, dht->id, 20);
+    header[24] = (count >> 24) & 0xFF;
+    header[25] = (count >> 16) & 0xFF;
+    header[26] = (count >> 8) & 0xFF;
+    header[27] = count & 0xFF;
+
+    bool success = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+    for (usize i = 0; i < DHT_BUCKET_COUNT && success; i++) {
+        for (usize j = 0; j < dht->buckets[i].nodes_length && success; j++) {
+            DHTNode* node = &dht->buckets[i].nodes[j];
+
+            u8 compact_node[26];
+            memcpy(compact_node, node->id, 20);
+            memcpy(compact_node + 20, &node->address.sin_addr.s_addr, 4);
+            memcpy(compact_node + 24, &node->address.sin_port, 2);
+            success = fwrite(compact_node, 1, sizeof(compact_node), file) == sizeof(compact_node);
+        }
+    }
+
+    fclose(file);
+
+    if (!success) {
+        log_error("DHT", "Failed to write routing table file: %s", path);
+    }
+    return success;
+}
+
+void dht_destroy(DHT* dht) {
+    if (dht->routing_table_path) {
+        dht_routing_table_save(dht, dht->routing_table_path);
+        free(dht->routing_table_path);
+    }
+    for (usize i = 0; i < dht->lookups_length; i++) {
+        dht_lookup_destroy(dht->lookups[i]);
+    }
+    close(dht->socket);
+    free(dht->stored_peers);
+    free(dht);
+}
+
+static void dht_distance(const u8 a[20], const u8 b[20], u8 distance[20]) {
+    for (usize i = 0; i < 20; i++) {
+        distance[i] = a[i] ^ b[i];
+    }
+}
+
+/* length of the common prefix, nodes sharing more leading bits with us go in higher buckets */
+static usize dht_bucket_index(const u8 id[20], const u8 other[20]) {
+    for (usize i = 0; i < 20; i++) {
+        u8 difference = id[i] ^ other[i];
+        if (difference != 0) {
+            return (i * 8) + (__builtin_clz(difference) - 24);
+        }
+    }
+    return DHT_BUCKET_COUNT - 1;
+}
+
+static bool dht_address_equal(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static void dht_routing_table_update(DHT* dht, const u8 id[20], const struct sockaddr_in* address) {
+    if (memcmp(id, dht->id, 20) == 0 || address->sin_port == 0) { return; }
+
+    DHTBucket* bucket = &dht->buckets[dht_bucket_index(dht->id, id)];
+    time_t now = time(NULL);
+
+    for (usize i = 0; i < bucket->nodes_length; i++) {
+        if (memcmp(bucket->nodes[i].id, id, 20) == 0) {
+            bucket->nodes[i].address = *address;
+            bucket->nodes[i].last_seen = now;
+            bucket->nodes[i].failed_queries = 0;
+            return;
+        }
+    }
+
+    DHTNode* slot = NULL;
+    if (bucket->nodes_length < DHT_K) {
+        slot = &bucket->nodes[bucket->nodes_length];
+        bucket->nodes_length++;
+    } else {
+        // full bucket, only evict nodes that stopped answering or went quiet
+        for (usize i = 0; i < bucket->nodes_length; i++) {
+            DHTNode* node = &bucket->nodes[i];
+            if (node->failed_queries >= DHT_NODE_MAX_FAILED_QUERIES || now - node->last_seen > DHT_NODE_STALE_AFTER) {
+                slot = node;
+                break;
+            }
+        }
+    }
+
+    if (!slot) { return; }
+
+    memcpy(slot->id, id, 20);
+    slot->address = *address;
+    slot->last_seen = now;
+    slot->failed_queries = 0;
+}
+
+static void dht_routing_table_node_failed(DHT* dht, const struct sockaddr_in* address) {
+    for (usize i = 0; i < DHT_BUCKET_COUNT; i++) {
+        for (usize j = 0; j < dht->buckets[i].nodes_length; j++) {
+            if (dht_address_equal(&dht->buckets[i].nodes[j].address, address)) {
+                dht->buckets[i].nodes[j].failed_queries++;
+                return;
+            }
+        }
+    }
+}
+
+/* returns how many nodes were written, closest first */
+static usize dht_routing_table_closest(DHT* dht, const u8 target[20], DHTNode* nodes, usize nodes_max) {
+    u8 distances[DHT_LOOKUP_CAPACITY][20];
+    if (nodes_max > DHT_LOOKUP_CAPACITY) { nodes_max = DHT_LOOKUP_CAPACITY; }
+
+    usize nodes_length = 0;
+    for (usize i = 0; i < DHT_BUCKET_COUNT; i++) {
+        for (usize j = 0; j < dht->buckets[i].nodes_length; j++) {
+            DHTNode* node = &dht->buckets[i].nodes[j];
+            if (node->failed_queries >= DHT_NODE_MAX_FAILED_QUERIES) { continue; }
+
+            u8 distance[20];
+            dht_distance(node->id, target, distance);
+
+            // insertion into the sorted result, dropping the farthest when full
+            usize position = nodes_length;
+            while (position > 0 && memcmp(distance, distances[position - 1], 20) < 0) {
+                position--;
+            }
+            if (position >= nodes_max) { continue; }
+
+            usize last = (nodes_length < nodes_max) ? nodes_length : nodes_max - 1;
+            memmove(&nodes[position + 1], &nodes[position], sizeof(DHTNode) * (last - position));
+            memmove(distances[position + 1], distances[position], 20 * (last - position));
+
+            nodes[position] = *node;
+            memcpy(distances[position], distance, 20);
+            if (nodes_length < nodes_max) { nodes_length++; }
+        }
+    }
+
+    return nodes_length;
+}
+
+static bool dht_routing_table_load(DHT* dht, const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) { return false; } // no saved table yet, nothing to warm start from
+
+    u8 header[28];
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, "DHT1", 4) != 0) {
+        log_error("DHT", "Routing table file is invalid: %s", path);
+        fclose(file);
+        return false;
+    }
+
+    memcpy(dht->id, header + 4, 20);
+    u32 count = ((u32) header[24] << 24) | ((u32) header[25] << 16) | ((u32) header[26] << 8) | header[27];
+
+    u8 compact_node[26];
+    for (u32 i = 0; i < count && fread(compact_node, 1, sizeof(compact_node), file) == sizeof(compact_node); i++) {
+        struct sockaddr_in address = {0};
+        address.sin_family = AF_INET;
+        memcpy(&address.sin_addr.s_addr, compact_node + 20, 4);
+        memcpy(&address.sin_port, compact_node + 24, 2);
+
+        dht_routing_table_update(dht, compact_node, &address);
+    }
+
+    fclose(file);
+    return true;
+}
+
+static void dht_token_secret_rotate(DHT* dht) {
+    time_t now = time(NULL);
+    if (now - dht->token_secret_changed < DHT_TOKEN_SECRET_LIFETIME) { return; }
+
+    memcpy(dht->previous_token_secret, dht->token_secret, sizeof(dht->token_secret));
+    RAND_bytes(dht->token_secret, sizeof(dht->token_secret));
+    dht->token_secret_changed = now;
+}
+
+static void dht_token_compute(const u8 secret[20], const struct sockaddr_in* address, u8 token[DHT_TOKEN_LENGTH]) {
+    u8 data[24];
+    memcpy(data, secret, 20);
+    memcpy(data + 20, &address->sin_addr.s_addr, 4);
+
+    u8 hash[SHA_DIGEST_LENGTH];
+    SHA1(data, sizeof(data), hash);
+    memcpy(token, hash, DHT_TOKEN_LENGTH);
+}
+
+/* tokens from the current and the previous secret are accepted, so a token lives 5 to 10 minutes */
+static bool dht_token_validate(DHT* dht, const struct sockaddr_in* address, const u8* token, usize token_length) {
+    if (token_length != DHT_TOKEN_LENGTH) { return false; }
+
+    u8 expected[DHT_TOKEN_LENGTH];
+    dht_token_compute(dht->token_secret, address, expected);
+    if (memcmp(expected, token, DHT_TOKEN_LENGTH) == 0) { return true; }
+
+    dht_token_compute(dht->previous_token_secret, address, expected);
+    return memcmp(expected, token, DHT_TOKEN_LENGTH) == 0;
+}
+
+static void dht_stored_peer_add(DHT* dht, const u8 info_hash[20], const struct sockaddr_in* address) {
+    time_t now = time(NULL);
+
+    DHTStoredPeer* slot = NULL;
+    for (usize i = 0; i < dht->stored_peers_length; i++) {
+        DHTStoredPeer* stored_peer = &dht->stored_peers[i];
+        if (memcmp(stored_peer->info_hash, info_hash, 20) == 0 && dht_address_equal(&stored_peer->address, address)) {
+            slot = stored_peer;
+            break;
+        }
+        if (!slot && now - stored_peer->announced > DHT_STORED_PEER_LIFETIME) {
+            slot = stored_peer;
+        }
+    }
+
+    if (!slot && dht->stored_peers_length < DHT_STORED_PEERS_MAX) {
+        slot = &dht->stored_peers[dht->stored_peers_length];
+        dht->stored_peers_length++;
+    }
+
+    if (!slot) {
+        // storage is full of live announces, replace the oldest one
+        slot = &dht->stored_peers[0];
+        for (usize i = 1; i < dht->stored_peers_length; i++) {
+            if (dht->stored_peers[i].announced < slot->announced) { slot = &dht->stored_peers[i]; }
+        }
+    }
+
+    memcpy(slot->info_hash, info_hash, 20);
+    slot->address = *address;
+    slot->announced = now;
+}
+
+/* writes the "nodes" key followed by the DHT_K closest nodes we know to target */
+static void dht_message_write_nodes(DHT* dht, BencodeWriter* message, const u8 target[20]) {
+    DHTNode nodes[DHT_K];
+    usize nodes_length = dht_routing_table_closest(dht, target, nodes, DHT_K);
+
+    bencode_writer_key(message, "nodes");
+    u8* compact = bencode_writer_string_reserve(message, nodes_length * 26);
+    if (!compact) { return; }
+
+    for (usize i = 0; i < nodes_length; i++) {
+        memcpy(compact + (i * 26), nodes[i].id, 20);
+        memcpy(compact + (i * 26) + 20, &nodes[i].address.sin_addr.s_addr, 4);
+        memcpy(compact + (i * 26) + 24, &nodes[i].address.sin_port, 2);
+    }
+}
+
+static bool dht_message_send(DHT* dht, BencodeWriter* message, const struct sockaddr_in* address) {
+    if (!bencode_writer_finish(message)) {
+        log_error("DHT", "Message is too long to send!");
+        return false;
+    }
+
+    if (sendto(dht->socket, message->data, message->length, 0, (const struct sockaddr*) address, sizeof(*address)) == -1) {
+        log_warn("DHT", "Failed to send message to %s:%u!", inet_ntoa(address->sin_addr), ntohs(address->sin_port));
+        return false;
+    }
+
+    return true;
+}
+
+static void dht_error_send(DHT* dht, i64 code, const char* description, BencodeObject* transaction, const struct sockaddr_in* address) {
+    u8 data[DHT_MESSAGE_MAX];
+    BencodeWriter error;
+    bencode_writer_init(&error, data, sizeof(data));
+
+    bencode_writer_dictionary_begin(&error);
+    bencode_writer_key(&error, "e");
+    bencode_writer_list_begin(&error);
+    bencode_writer_integer(&error, code);
+    bencode_writer_text(&error, description);
+    bencode_writer_end(&error);
+    bencode_writer_key(&error, "t");
+    bencode_writer_string(&error, transaction->string, transaction->string_length);
+    bencode_writer_key(&error, "y");
+    bencode_writer_text(&error, "e");
+    bencode_writer_end(&error);
+
+    dht_message_send(dht, &error, address);
+}
+
+static bool dht_query_send(DHT* dht, DHTLookup* lookup, DHTLookupEntry* entry) {
+    entry->transaction = dht->transaction_counter++;
+    u8 transaction[2] = { entry->transaction >> 8, entry->transaction & 0xFF };
+
+    u8 data[DHT_MESSAGE_MAX];
+    BencodeWriter message;
+    bencode_writer_init(&message, data, sizeof(data));
+
+    bencode_writer_dictionary_begin(&message);
+    bencode_writer_key(&message, "a");
+    bencode_writer_dictionary_begin(&message);
+    bencode_writer_key(&message, "id");
+    bencode_writer_string(&message, dht->id, 20);
+    bencode_writer_key(&message, lookup->get_peers ? "info_hash" : "target");
+    bencode_writer_string(&message, lookup->target, 20);
+    bencode_writer_end(&message);
+    bencode_writer_key(&message, "q");
+    bencode_writer_text(&message, lookup->get_peers ? "get_peers" : "find_node");
+    bencode_writer_key(&message, "t");
+    bencode_writer_string(&message, transaction, sizeof(transaction));
+    bencode_writer_key(&message, "y");
+    bencode_writer_text(&message, "q");
+    bencode_writer_end(&message);
+
+    entry->sent_at = time_now_ms();
+    return dht_message_send(dht, &message, &entry->address);
+}
+
+static void dht_announce_send(DHT* dht, DHTLookupEntry* entry, const u8 info_hash[20], u16 port) {
+    u16 transaction_id = dht->transaction_counter++;
+    u8 transaction[2] = { transaction_id >> 8, transaction_id & 0xFF };
+
+    u8 data[DHT_MESSAGE_MAX];
+    BencodeWriter message;
+    bencode_writer_init(&message, data, sizeof(data));
+
+    bencode_writer_dictionary_begin(&message);
+    bencode_writer_key(&message, "a");
+    bencode_writer_dictionary_begin(&message);
+    bencode_writer_key(&message, "id");
+    bencode_writer_string(&message, dht->id, 20);
+    bencode_writer_key(&message, "implied_port");
+    bencode_writer_integer(&message, 0);
+    bencode_writer_key(&message, "info_hash");
+    bencode_writer_string(&message, info_hash, 20);
+    bencode_writer_key(&message, "port");
+    bencode_writer_integer(&message, port);
+    bencode_writer_key(&message, "token");
+    bencode_writer_string(&message, entry->token, entry->token_length);
+    bencode_writer_end(&message);
+    bencode_writer_key(&message, "q");
+    bencode_writer_text(&message, "announce_peer");
+    bencode_writer_key(&message, "t");
+    bencode_writer_string(&message, transaction, sizeof(transaction));
+    bencode_writer_key(&message, "y");
+    bencode_writer_text(&message, "q");
+    bencode_writer_end(&message);
+
+    dht_message_send(dht, &message, &entry->address);
+}
+
+static void dht_receive(DHT* dht) {
+    u8 buffer[DHT_MESSAGE_MAX * 2];
+    while (true) {
+        struct sockaddr_in from;
+        socklen_t from_length = sizeof(from);
+
+        ssize_t bytes_received = recvfrom(dht->socket, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr*) &from, &from_length);
+        if (bytes_received == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_warn("DHT", "Failed to receive message!");
+            }
+            return;
+        }
+
+        if (from.sin_family != AF_INET || bytes_received == 0) { continue; }
+        dht_packet_handle(dht, buffer, bytes_received, &from);
+    }
+}
+
+static void dht_packet_handle(DHT* dht, u8* data, usize length, const struct sockaddr_in* from) {
+    usize index = 0;
+    BencodeObject* message = bencode_object_parse(data, length, &index);
+    if (!message) { return; }
+
+    BencodeObject* type = bencode_object_dictionary_get(message, "y");
+    BencodeObject* transaction = bencode_object_dictionary_get(message, "t");
+    if (!dht_string_is(type, 1) || !transaction || transaction->type != STRING) {
+        bencode_object_destroy(message);
+        return;
+    }
+
+    switch (type->string[0]) {
+        case 'q': dht_query_handle(dht, message, transaction, from); break;
+        case 'r': dht_response_handle(dht, message, transaction, from); break;
+        case 'e': dht_error_handle(dht, transaction, from); break;
+        default: break;
+    }
+
+    bencode_object_destroy(message);
+}
+
+static void dht_query_handle(DHT* dht, BencodeObject* message, BencodeObject* transaction, const struct sockaddr_in* from) {
+    BencodeObject* query = bencode_object_dictionary_get(message, "q");
+    BencodeObject* arguments = bencode_object_dictionary_get(message, "a");
+    BencodeObject* id = bencode_object_dictionary_get(arguments, "id");
+    if (!query || query->type != STRING || !dht_string_is(id, 20)) { return; }
+
+    dht_routing_table_update(dht, id->string, from);
+
+    u8 data[DHT_MESSAGE_MAX];
+    BencodeWriter response;
+    bencode_writer_init(&response, data, sizeof(data));
+
+    bencode_writer_dictionary_begin(&response);
+    bencode_writer_key(&response, "r");
+    bencode_writer_dictionary_begin(&response);
+    bencode_writer_key(&response, "id");
+    bencode_writer_string(&response, dht->id, 20);
+
+    if (dht_string_is(query, 4) && memcmp(query->string, "ping", 4) == 0) {
+        // nothing besides our id
+    } else if (dht_string_is(query, 9) && memcmp(query->string, "find_node", 9) == 0) {
+        BencodeObject* target = bencode_object_dictionary_get(arguments, "target");
+        if (!dht_string_is(target, 20)) { return; }
+
+        dht_message_write_nodes(dht, &response, target->string);
+    } else if (dht_string_is(query, 9) && memcmp(query->string, "get_peers", 9) == 0) {
+        BencodeObject* info_hash = bencode_object_dictionary_get(arguments, "info_hash");
+        if (!dht_string_is(info_hash, 20)) { return; }
+
+        usize values_length = 0;
+        u8 values[DHT_VALUES_MAX][6];
+        time_t now = time(NULL);
+        for (usize i = 0; i < dht->stored_peers_length && values_length < DHT_VALUES_MAX; i++) {
+            DHTStoredPeer* stored_peer = &dht->stored_peers[i];
+            if (now - stored_peer->announced > DHT_STORED_PEER_LIFETIME) { continue; }
+            if (memcmp(stored_peer->info_hash, info_hash->string, 20) != 0) { continue; }
+
+            memcpy(values[values_length], &stored_peer->address.sin_addr.s_addr, 4);
+            memcpy(values[values_length] + 4, &stored_peer->address.sin_port, 2);
+            values_length++;
+        }
+
+        if (values_length == 0) {
+            dht_message_write_nodes(dht, &response, info_hash->string);
+        }
+
+        u8 token[DHT_TOKEN_LENGTH];
+        dht_token_compute(dht->token_secret, from, token);
+        bencode_writer_key(&response, "token");
+        bencode_writer_string(&response, token, sizeof(token));
+
+        if (values_length > 0) {
+            bencode_writer_key(&response, "values");
+            bencode_writer_list_begin(&response);
+            for (usize i = 0; i < values_length; i++) {
+                bencode_writer_string(&response, values[i], 6);
+            }
+            bencode_writer_end(&response);
+        }
+    } else if (dht_string_is(query, 13) && memcmp(query->string, "announce_peer", 13) == 0) {
+        BencodeObject* info_hash = bencode_object_dictionary_get(arguments, "info_hash");
+        BencodeObject* token = bencode_object_dictionary_get(arguments, "token");
+        BencodeObject* port = bencode_object_dictionary_get(arguments, "port");
+        BencodeObject* implied_port = bencode_object_dictionary_get(arguments, "implied_port");
+        if (!dht_string_is(info_hash, 20) || !token || token->type != STRING) { return; }
+
+        if (!dht_token_validate(dht, from, token->string, token->string_length)) {
+            dht_error_send(dht, 203, "Bad token", transaction, from);
+            return;
+        }
+
+        struct sockaddr_in peer_address = *from;
+        bool use_implied_port = implied_port && implied_port->type == INTEGER && implied_port->number != 0;
+        if (!use_implied_port) {
+            if (!port || port->type != INTEGER || port->number <= 0 || port->number > 65535) { return; }
+            peer_address.sin_port = htons(port->number);
+        }
+
+        dht_stored_peer_add(dht, info_hash->string, &peer_address);
+    } else {
+        dht_error_send(dht, 204, "Method Unknown", transaction, from);
+        return;
+    }
+
+    bencode_writer_end(&response);
+    bencode_writer_key(&response, "t");
+    bencode_writer_string(&response, transaction->string, transaction->string_length);
+    bencode_writer_key(&response, "y");
+    bencode_writer_text(&response, "r");
+    bencode_writer_end(&response);
+
+    dht_message_send(dht, &response, from);
+}
+
+static void dht_response_handle(DHT* dht, BencodeObject* message, BencodeObject* transaction, const struct sockaddr_in* from) {
+    BencodeObject* response = bencode_object_dictionary_get(message, "r");
+    BencodeObject* id = bencode_object_dictionary_get(response, "id");
+    if (!dht_string_is(id, 20)) { return; }
+
+    dht_routing_table_update(dht, id->string, from);
+
+    DHTLookup* lookup;
+    DHTLookupEntry* entry = dht_lookup_entry_find(dht, transaction, from, &lookup);
+    if (!entry) { return; } // late or unsolicited response
+
+    entry->state = DHT_LOOKUP_RESPONDED;
+    memcpy(entry->id, id->string, 20);
+    dht_distance(entry->id, lookup->target, entry->distance);
+
+    BencodeObject* token = bencode_object_dictionary_get(response, "token");
+    if (token && token->type == STRING && token->string_length <= DHT_RECEIVED_TOKEN_MAX) {
+        memcpy(entry->token, token->string, token->string_length);
+        entry->token_length = token->string_length;
+    }
+
+    BencodeObject* values = bencode_object_dictionary_get(response, "values");
+    if (values && values->type == LIST) {
+        for (usize i = 0; i < values->list_length; i++) {
+            if (dht_string_is(values->list[i], 6)) {
+                dht_lookup_peer_add(lookup, values->list[i]->string);
+            }
+        }
+    }
+
+    BencodeObject* nodes = bencode_object_dictionary_get(response, "nodes");
+    if (nodes && nodes->type == STRING) {
+        for (usize i = 0; i + 26 <= nodes->string_length; i += 26) {
+            struct sockaddr_in address = {0};
+            address.sin_family = AF_INET;
+            memcpy(&address.sin_addr.s_addr, nodes->string + i + 20, 4);
+            memcpy(&address.sin_port, nodes->string + i + 24, 2);
+
+            dht_lookup_entry_add(dht, lookup, nodes->string + i, &address);
+        }
+    }
+
+    dht_lookup_entries_sort(lookup);
+}
+
+static void dht_error_handle(DHT* dht, BencodeObject* transaction, const struct sockaddr_in* from) {
+    DHTLookup* lookup;
+    DHTLookupEntry* entry = dht_lookup_entry_find(dht, transaction, from, &lookup);
+    if (!entry) { return; }
+
+    entry->state = DHT_LOOKUP_FAILED;
+    dht_routing_table_node_failed(dht, from);
+}
+
+/* NULL when no new lookup fits */
+static DHTLookup* dht_lookup_create(DHT* dht, const u8 target[20], bool get_peers) {
+    if (dht->lookups_length == DHT_LOOKUPS_MAX) {
+        log_warn("DHT", "Too many lookups running, not starting another!");
+        return NULL;
+    }
+
+    DHTLookup* lookup = (DHTLookup*) malloc(sizeof(DHTLookup));
+    if (!lookup) {
+        log_error("DHT", "Failed to allocate memory for lookup!");
+        return NULL;
+    }
+
+    memset(lookup, 0, sizeof(DHTLookup));
+    memcpy(lookup->target, target, 20);
+    lookup->get_peers = get_peers;
+
+    dht->lookups[dht->lookups_length] = lookup;
+    dht->lookups_length++;
+    return lookup;
+}
+
+/* the in flight query an answer is for, transaction ids are unique across lookups */
+static DHTLookupEntry* dht_lookup_entry_find(DHT* dht, BencodeObject* transaction, const struct sockaddr_in* from, DHTLookup** lookup) {
+    if (transaction->string_length != 2) { return NULL; }
+    u16 transaction_id = ((u16) transaction->string[0] << 8) | transaction->string[1];
+
+    for (usize i = 0; i < dht->lookups_length; i++) {
+        for (usize j = 0; j < dht->lookups[i]->entries_length; j++) {
+            DHTLookupEntry* entry = &dht->lookups[i]->entries[j];
+            if (entry->state == DHT_LOOKUP_IN_FLIGHT && entry->transaction == transaction_id && dht_address_equal(&entry->address, from)) {
+                *lookup = dht->lookups[i];
+                return entry;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void dht_lookup_entry_add(DHT* dht, DHTLookup* lookup, const u8 id[20], const struct sockaddr_in* address) {
+    if (memcmp(id, dht->id, 20) == 0 || address->sin_port == 0 || address->sin_addr.s_addr == 0) { return; }
+
+    for (usize i = 0; i < lookup->entries_length; i++) {
+        if (dht_address_equal(&lookup->entries[i].address, address)) { return; }
+    }
+
+    u8 distance[20];
+    dht_distance(id, lookup->target, distance);
+
+    if (lookup->entries_length == DHT_LOOKUP_CAPACITY) {
+        // the list is sorted, so only replace the farthest entry if we are closer
+        DHTLookupEntry* farthest = &lookup->entries[DHT_LOOKUP_CAPACITY - 1];
+        if (farthest->state == DHT_LOOKUP_IN_FLIGHT || memcmp(distance, farthest->distance, 20) >= 0) { return; }
+        lookup->entries_length--;
+    }
+
+    DHTLookupEntry* entry = &lookup->entries[lookup->entries_length];
+    memset(entry, 0, sizeof(DHTLookupEntry));
+    memcpy(entry->id, id, 20);
+    memcpy(entry->distance, distance, 20);
+    entry->address = *address;
+    entry->address.sin_family = AF_INET;
+    entry->state = DHT_LOOKUP_QUEUED;
+    lookup->entries_length++;
+
+    dht_lookup_entries_sort(lookup);
+}
+
+static void dht_lookup_entries_sort(DHTLookup* lookup) {
+    // insertion sort, the list is almost always sorted already
+    for (usize i = 1; i < lookup->entries_length; i++) {
+        DHTLookupEntry entry = lookup->entries[i];
+
+        usize j = i;
+        while (j > 0 && memcmp(entry.distance, lookup->entries[j - 1].distance, 20) < 0) {
+            lookup->entries[j] = lookup->entries[j - 1];
+            j--;
+        }
+        lookup->entries[j] = entry;
+    }
+}
+
+static void dht_lookup_peer_add(DHTLookup* lookup, const u8 compact_peer[6]) {
+    struct in_addr ip;
+    memcpy(&ip.s_addr, compact_peer, 4);
+    u16 port = ((u16) compact_peer[4] << 8) | compact_peer[5];
+    if (port == 0) { return; }
+
+    TorrentTrackerPeer peer = {0};
+    inet_ntop(AF_INET, &ip, peer.ip, sizeof(peer.ip));
+    snprintf(peer.port, sizeof(peer.port), "%u", port);
+
+    for (usize i = 0; i < lookup->peers_length; i++) {
+        if (strcmp(lookup->peers[i].ip, peer.ip) == 0 && strcmp(lookup->peers[i].port, peer.port) == 0) { return; }
+    }
+
+    if (lookup->peers_length == lookup->peers_capacity) {
+        usize capacity = (lookup->peers_capacity == 0) ? 32 : lookup->peers_capacity * 2;
+        TorrentTrackerPeer* temp = (TorrentTrackerPeer*) realloc(lookup->peers, sizeof(TorrentTrackerPeer) * capacity);
+        if (!temp) {
+            log_error("DHT", "Failed to reallocate memory for peers!");
+            return;
+        }
+
+        lookup->peers = temp;
+        lookup->peers_capacity = capacity;
+    }
+
+    lookup->peers[lookup->peers_length] = peer;
+    lookup->peers_length++;
+}
+
+static void dht_lookup_seed(DHT* dht, DHTLookup* lookup) {
+    DHTNode nodes[DHT_LOOKUP_CAPACITY / 2];
+    usize nodes_length = dht_routing_table_closest(dht, lookup->target, nodes, DHT_LOOKUP_CAPACITY / 2);
+
+    for (usize i = 0; i < nodes_length; i++) {
+        dht_lookup_entry_add(dht, lookup, nodes[i].id, &nodes[i].address);
+    }
+}
+
+/*
+ * keeps up to DHT_ALPHA queries in flight to the closest unqueried nodes, true once the DHT_K
+ * closest live nodes have all answered or the deadline passed. a lookup started before the
+ * routing table had anyone in it waits for the bootstrap
+ */
+static bool dht_lookup_step(DHT* dht, DHTLookup* lookup, i64 now) {
+    if (lookup->entries_length == 0) {
+        dht_lookup_seed(dht, lookup);
+        if (lookup->entries_length == 0) {
+            for (usize i = 0; i < dht->lookups_length; i++) {
+                if (!dht->lookups[i]->get_peers && !dht->lookups[i]->finished) { return false; }
+            }
+
+            log_warn("DHT", "[GET PEERS] Routing table is empty, bootstrap first!");
+            return true;
+        }
+    }
+
+    if (lookup->deadline == 0) { lookup->deadline = now + DHT_LOOKUP_TIMEOUT_MS; }
+    if (now >= lookup->deadline) { return true; }
+
+    usize in_flight = 0;
+    for (usize i = 0; i < lookup->entries_length; i++) {
+        DHTLookupEntry* entry = &lookup->entries[i];
+        if (entry->state != DHT_LOOKUP_IN_FLIGHT) { continue; }
+
+        if (now - entry->sent_at > DHT_QUERY_TIMEOUT_MS) {
+            entry->state = DHT_LOOKUP_FAILED;
+            dht_routing_table_node_failed(dht, &entry->address);
+        } else {
+            in_flight++;
+        }
+    }
+
+    bool pending = false;
+    usize considered = 0;
+    for (usize i = 0; i < lookup->entries_length && considered < DHT_K; i++) {
+        DHTLookupEntry* entry = &lookup->entries[i];
+        if (entry->state == DHT_LOOKUP_FAILED) { continue; }
+        considered++;
+
+        if (entry->state != DHT_LOOKUP_QUEUED) { continue; }
+        if (in_flight >= DHT_ALPHA) {
+            pending = true;
+            continue;
+        }
+
+        if (dht_query_send(dht, lookup, entry)) {
+            entry->state = DHT_LOOKUP_IN_FLIGHT;
+            in_flight++;
+        } else {
+            entry->state = DHT_LOOKUP_FAILED;
+        }
+    }
+
+    return in_flight == 0 && !pending;
+}
+
+/* tells the closest nodes that answered with a token that we have the torrent */
+static void dht_lookup_announce(DHT* dht, DHTLookup* lookup) {
+    if (lookup->announce_port == 0) { return; }
+
+    usize announced = 0;
+    for (usize i = 0; i < lookup->entries_length && announced < DHT_K; i++) {
+        DHTLookupEntry* entry = &lookup->entries[i];
+        if (entry->state != DHT_LOOKUP_RESPONDED || entry->token_length == 0) { continue; }
+
+        dht_announce_send(dht, entry, lookup->target, lookup->announce_port);
+        announced++;
+    }
+}
+
+static void dht_lookup_destroy(DHTLookup* lookup) {
+    if (lookup->peers) { free(lookup->peers); }
+    free(lookup);
+}
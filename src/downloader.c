@@ -1,67 +1,1978 @@
 #include "downloader.h"
 
+#include <errno.h>
 #include <openssl/sha.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "ban_list.h"
+#include "dht.h"
+#include "extension.h"
+#include "fast.h"
+#include "hash_exchange.h"
+#include "magnet.h"
 #include "metadata.h"
+#include "metadata_exchange.h"
+#include "metrics.h"
 #include "peer.h"
+#include "peer_store.h"
+#include "pex.h"
+#include "picker.h"
+#include "shard.h"
+#include "smart_ban.h"
+#include "storage.h"
+#include "super_seed.h"
 #include "tracker.h"
 #include "types.h"
+#include "utils/buffer.h"
+#include "utils/log.h"
+#include "utils/time.h"
+#include "web_seed.h"
+
+static const char* dht_bootstrap_nodes[][2] = {
+    { "router.bittorrent.com", "6881" },
+    { "dht.transmissionbt.com", "6881" },
+    { "router.utorrent.com", "6881" },
+};
+
+static TorrentDownloader* torrent_downloader_allocate();
+static void torrent_downloader_info_hash_set(TorrentDownloader* downloader, const u8 info_hash[20]);
+static bool torrent_downloader_tracker_add(TorrentDownloader* downloader, const char* tracker);
+static bool torrent_downloader_download_prepare(TorrentDownloader* downloader);
+static void torrent_downloader_network_start(TorrentDownloader* downloader);
+static bool torrent_downloader_shards_start(TorrentDownloader* downloader);
+static void torrent_downloader_shard_events_handle(TorrentDownloader* downloader);
+static bool torrent_downloader_metadata_finish(TorrentDownloader* downloader);
+static u32 torrent_downloader_metadata_pieces_max(TorrentDownloader* downloader);
+static bool torrent_downloader_web_seeds_create(TorrentDownloader* downloader);
+
+static void torrent_downloader_peers_discover(TorrentDownloader* downloader);
+static void torrent_downloader_peers_collect(TorrentDownloader* downloader);
+static void torrent_downloader_peers_dial(TorrentDownloader* downloader);
+static void torrent_downloader_peers_accept(TorrentDownloader* downloader);
+static void torrent_downloader_peers_choke(TorrentDownloader* downloader);
+static void torrent_downloader_peers_maintain(TorrentDownloader* downloader);
+static void torrent_downloader_peers_sweep(TorrentDownloader* downloader);
+
+static bool torrent_downloader_peer_add(TorrentDownloader* downloader, TorrentPeer* peer);
+static void torrent_downloader_peer_event(TorrentDownloader* downloader, TorrentPeer* peer, i16 events);
+static void torrent_downloader_peer_connected(TorrentDownloader* downloader, TorrentPeer* peer);
+static void torrent_downloader_peer_input(TorrentDownloader* downloader, TorrentPeer* peer);
+static void torrent_downloader_peer_handshaked(TorrentDownloader* downloader, TorrentPeer* peer);
+static bool torrent_downloader_peer_fast_grant(TorrentDownloader* downloader, TorrentPeer* peer);
+static void torrent_downloader_peer_update(TorrentDownloader* downloader, TorrentPeer* peer);
+static bool torrent_downloader_peer_block_pick(TorrentDownloader* downloader, TorrentPeer* peer, TorrentPickerBlock* block);
+static bool torrent_downloader_peer_duplicate(TorrentDownloader* downloader, TorrentPeer* peer);
+static void torrent_downloader_peer_disconnect(TorrentDownloader* downloader, TorrentPeer* peer);
+static void torrent_downloader_peer_ban(TorrentDownloader* downloader, const char* ip, const char* reason);
+static void torrent_downloader_peer_closed(TorrentDownloader* downloader, TorrentPeer* peer, bool handshaked);
+static void torrent_downloader_requests_release(TorrentDownloader* downloader, TorrentPeer* peer);
+static void torrent_downloader_web_seed_event(TorrentDownloader* downloader, TorrentWebSeed* seed, i16 events);
+static void torrent_downloader_super_seed_update(TorrentDownloader* downloader, TorrentPeer* peer);
+static void torrent_downloader_super_seed_have(TorrentDownloader* downloader, TorrentPeer* peer, u32 index);
+
+static bool torrent_downloader_message_handle(TorrentDownloader* downloader, TorrentPeer* peer, TorrentPeerMessage* message);
+static bool torrent_downloader_request_handle(TorrentDownloader* downloader, TorrentPeer* peer, TorrentPeerMessage* message);
+static bool torrent_downloader_cancel_handle(TorrentPeer* peer, TorrentPeerMessage* message);
+static bool torrent_downloader_uploads_send(TorrentDownloader* downloader, TorrentPeer* peer);
+static bool torrent_downloader_uploads_choke(TorrentPeer* peer);
+static bool torrent_downloader_reject_handle(TorrentDownloader* downloader, TorrentPeer* peer, TorrentPeerMessage* message);
+static bool torrent_downloader_block_handle(TorrentDownloader* downloader, TorrentPeer* peer, TorrentPeerMessage* message);
+static bool torrent_downloader_extended_handle(TorrentDownloader* downloader, TorrentPeer* peer, TorrentPeerMessage* message);
+static bool torrent_downloader_hash_message_handle(TorrentDownloader* downloader, TorrentPeer* peer, TorrentPeerMessage* message);
+static bool torrent_downloader_block_store(TorrentDownloader* downloader, TorrentPeer* sender, u32 index, u32 begin, const u8* block, u32 block_length);
+static void torrent_downloader_piece_finish(TorrentDownloader* downloader, u32 index);
+static void torrent_downloader_pieces_unverified_finish(TorrentDownloader* downloader);
+static void torrent_downloader_piece_complete(TorrentDownloader* downloader, u32 index);
+static void torrent_downloader_duplicates_complete(TorrentDownloader* downloader, u32 index, const u8* data, u32 length);
+static void torrent_downloader_block_cancel(TorrentDownloader* downloader, TorrentPeer* receiver, u32 index, u32 begin);
+static bool torrent_downloader_stream_start(TorrentDownloader* downloader);
+static void torrent_downloader_stream_update(TorrentDownloader* downloader);
+static void torrent_downloader_rates_update(TorrentDownloader* downloader);
+
+static void torrent_downloader_metrics_serve(TorrentDownloader* downloader);
+static void torrent_downloader_metrics_snapshot(TorrentDownloader* downloader);
+static bool torrent_downloader_metrics_prometheus_write(TorrentDownloader* downloader, TorrentMetricsText* text);
+static bool torrent_downloader_metrics_json_write(TorrentDownloader* downloader, TorrentMetricsText* text);
 
 TorrentDownloader* torrent_downloader_create(const char* torrent_file) {
+    TorrentDownloader* downloader = torrent_downloader_allocate();
+    if (!downloader) { return NULL; }
+
+    downloader->metadata = torrent_metadata_create(torrent_file);
+    if (!downloader->metadata) {
+        log_error("DOWNLOADER", "Failed to create torrent metadata from torrent file: %s", torrent_file);
+        torrent_downloader_destroy(downloader);
+        return NULL;
+    }
+
+    torrent_downloader_info_hash_set(downloader, torrent_metadata_info_hash(downloader->metadata));
+
+    downloader->peer_store = torrent_peer_store_create(downloader->info_hash, ".");
+    if (!downloader->peer_store) {
+        torrent_downloader_destroy(downloader);
+        return NULL;
+    }
+
+    if (downloader->metadata->announce && !torrent_downloader_tracker_add(downloader, downloader->metadata->announce)) {
+        torrent_downloader_destroy(downloader);
+        return NULL;
+    }
+
+    // we have the info dictionary already, so we can hand it to magnet link peers
+    downloader->metadata_exchange = torrent_metadata_exchange_create(downloader->metadata->info_data, downloader->metadata->info_data_length);
+    if (!downloader->metadata_exchange || !torrent_downloader_download_prepare(downloader)) {
+        torrent_downloader_destroy(downloader);
+        return NULL;
+    }
+
+    return downloader;
+}
+
+/* the info dictionary is fetched from peers (BEP 9) before any piece is picked */
+TorrentDownloader* torrent_downloader_create_from_magnet(const char* magnet_uri) {
+    TorrentMagnet* magnet = torrent_magnet_parse(magnet_uri);
+    if (!magnet) {
+        log_error("DOWNLOADER", "Failed to parse magnet link: %s", magnet_uri);
+        return NULL;
+    }
+
+    TorrentDownloader* downloader = torrent_downloader_allocate();
+    if (!downloader) {
+        torrent_magnet_destroy(magnet);
+        return NULL;
+    }
+
+    torrent_downloader_info_hash_set(downloader, magnet->info_hash);
+
+    downloader->peer_store = torrent_peer_store_create(downloader->info_hash, ".");
+    if (!downloader->peer_store) {
+        torrent_magnet_destroy(magnet);
+        torrent_downloader_destroy(downloader);
+        return NULL;
+    }
+
+    for (usize i = 0; i < magnet->trackers_length; i++) {
+        if (!torrent_downloader_tracker_add(downloader, magnet->trackers[i])) {
+            torrent_magnet_destroy(magnet);
+            torrent_downloader_destroy(downloader);
+            return NULL;
+        }
+    }
+
+    for (usize i = 0; i < magnet->peers_length; i++) {
+        torrent_downloader_candidate_add(downloader, magnet->peers[i].ip, magnet->peers[i].port);
+    }
+
+    log_info("DOWNLOADER", "Fetching metadata for %s", magnet->name ? magnet->name : "(unnamed torrent)");
+    torrent_magnet_destroy(magnet);
+
+    downloader->metadata_exchange = torrent_metadata_exchange_create(NULL, 0);
+    if (!downloader->metadata_exchange) {
+        torrent_downloader_destroy(downloader);
+        return NULL;
+    }
+
+    return downloader;
+}
+
+/*
+ * hashes whatever is already on disk and marks the pieces that check out as verified, so a
+ * seed serves its files and an interrupted download only fetches what is still missing
+ */
+bool torrent_downloader_recheck(TorrentDownloader* downloader) {
+    TorrentPicker* picker = downloader->picker;
+    if (!picker) { return true; }
+
+    TorrentMetadataInfo* info = &downloader->metadata->info;
+    u8* data = (u8*) malloc(sizeof(u8) * info->piece_length);
+    if (!data) {
+        log_error("DOWNLOADER", "Failed to allocate memory for piece!");
+        return false;
+    }
+
+    for (u32 i = 0; i < picker->pieces_length; i++) {
+        u32 length = picker->pieces[i].length;
+        if (!torrent_storage_has(downloader->storage, i, 0, length) || !torrent_storage_read(downloader->storage, i, 0, data, length)) { continue; }
+
+        bool valid = false;
+        if (info->v1) {
+            u8 hash[SHA_DIGEST_LENGTH];
+            SHA1(data, length, hash);
+            valid = memcmp(hash, info->pieces[i], SHA_DIGEST_LENGTH) == 0;
+        } else if (!torrent_hash_exchange_piece_verify(downloader->hash_exchange, i, data, &valid)) {
+            valid = false;
+        }
+
+        if (valid) { torrent_picker_piece_complete(picker, i); }
+    }
+
+    free(data);
+    log_info("DOWNLOADER", "Found %u of %u pieces on disk", picker->pieces_completed, picker->pieces_length);
+    return true;
+}
+
+/* runs the connection engine until every piece is verified and written, or for good when seeding */
+bool torrent_downloader_run(TorrentDownloader* downloader) {
+    struct pollfd poll_sockets[TORRENT_DOWNLOADER_PEERS_MAX + TORRENT_DOWNLOADER_WEB_SEEDS_MAX + 4];
+    i64 last_maintenance = 0;
+
+    log_torrent_set(downloader->info_hash_hex);
+    if (downloader->stream && downloader->picker && !torrent_downloader_stream_start(downloader)) { return false; }
+
+    if (downloader->super_seeding && !downloader->super_seed) {
+        if (!downloader->picker || !torrent_picker_finished(downloader->picker)) {
+            log_warn("DOWNLOADER", "Super seeding needs every piece on disk, seeding normally instead");
+        } else {
+            downloader->super_seed = torrent_super_seed_create(downloader->picker->pieces_length);
+            if (!downloader->super_seed) { return false; }
+            log_info("DOWNLOADER", "Super seeding, peers are offered one piece at a time");
+        }
+    }
+
+    torrent_downloader_network_start(downloader);
+
+    while (downloader->keep_seeding || !downloader->picker || !torrent_picker_finished(downloader->picker)) {
+        i64 now = time_now_ms();
+
+        bool starving = downloader->peers_length == 0 && !torrent_peer_store_best(downloader->peer_store, now);
+        if (starving && now - downloader->last_discover >= TORRENT_DOWNLOADER_DISCOVER_INTERVAL_MS) {
+            torrent_downloader_peers_discover(downloader);
+        }
+
+        torrent_downloader_peers_dial(downloader);
+
+        // web seeds connect and top up their pipelines before the sockets are polled
+        for (usize i = 0; i < downloader->web_seeds_length; i++) {
+            TorrentWebSeed* seed = downloader->web_seeds[i];
+            if (!torrent_web_seed_update(seed, now)) { torrent_web_seed_fail(seed, now); }
+        }
+
+        // a sharded peer's socket is -1, its shard polls it
+        usize poll_sockets_length = 0;
+        for (usize i = 0; i < downloader->peers_length; i++) {
+            TorrentPeer* peer = downloader->peers[i];
+
+            poll_sockets[poll_sockets_length].fd = peer->socket;
+            poll_sockets[poll_sockets_length].events = (peer->state == TORRENT_PEER_CONNECTING) ? POLLOUT : POLLIN;
+            if (peer->output.length > peer->output.offset) { poll_sockets[poll_sockets_length].events |= POLLOUT; }
+            poll_sockets[poll_sockets_length].revents = 0;
+            poll_sockets_length++;
+        }
+
+        // web seeds without a connection are left out, poll ignores the negative descriptor
+        usize web_seeds_poll_index = poll_sockets_length;
+        for (usize i = 0; i < downloader->web_seeds_length; i++) {
+            TorrentWebSeed* seed = downloader->web_seeds[i];
+
+            poll_sockets[poll_sockets_length].fd = (seed->state == TORRENT_WEB_SEED_IDLE) ? -1 : seed->socket;
+            poll_sockets[poll_sockets_length].events = (seed->state == TORRENT_WEB_SEED_CONNECTING) ? POLLOUT : POLLIN;
+            if (seed->output.length > seed->output.offset) { poll_sockets[poll_sockets_length].events |= POLLOUT; }
+            poll_sockets[poll_sockets_length].revents = 0;
+            poll_sockets_length++;
+        }
+
+        // only here to wake us, dht_process below runs every pass
+        if (downloader->dht) {
+            poll_sockets[poll_sockets_length] = (struct pollfd) { .fd = downloader->dht->socket, .events = POLLIN };
+            poll_sockets_length++;
+        }
+
+        usize metrics_poll_index = poll_sockets_length;
+        if (downloader->metrics_server) {
+            poll_sockets[poll_sockets_length] = (struct pollfd) { .fd = downloader->metrics_server->socket, .events = POLLIN };
+            poll_sockets_length++;
+        }
+
+        // a full peer list leaves new peers waiting in the backlog, a replay's incoming peers come through a pipe
+        usize listen_poll_index = poll_sockets_length;
+        i32 listen_socket = downloader->replay ? downloader->replay->incoming[0] : downloader->listen_socket;
+        if (listen_socket != -1) {
+            i32 fd = (downloader->peers_length < TORRENT_DOWNLOADER_PEERS_MAX) ? listen_socket : -1;
+            poll_sockets[poll_sockets_length] = (struct pollfd) { .fd = fd, .events = POLLIN };
+            poll_sockets_length++;
+        }
+
+        usize shard_poll_index = poll_sockets_length;
+        if (downloader->shards) {
+            poll_sockets[poll_sockets_length] = (struct pollfd) { .fd = downloader->shard_events.wake[0], .events = POLLIN };
+            poll_sockets_length++;
+        }
+
+        if (poll(poll_sockets, poll_sockets_length, 250) == -1 && errno != EINTR) {
+            log_error("DOWNLOADER", "Failed to poll sockets!");
+            return false;
+        }
+
+        for (usize i = 0; i < downloader->peers_length; i++) {
+            if (poll_sockets[i].revents != 0) {
+                torrent_downloader_peer_event(downloader, downloader->peers[i], poll_sockets[i].revents);
+            }
+        }
+
+        for (usize i = 0; i < downloader->web_seeds_length; i++) {
+            if (poll_sockets[web_seeds_poll_index + i].revents != 0) {
+                torrent_downloader_web_seed_event(downloader, downloader->web_seeds[i], poll_sockets[web_seeds_poll_index + i].revents);
+            }
+        }
+
+        if (listen_socket != -1 && poll_sockets[listen_poll_index].revents & POLLIN) {
+            torrent_downloader_peers_accept(downloader);
+        }
+
+        if (downloader->shards && poll_sockets[shard_poll_index].revents & POLLIN) {
+            torrent_downloader_shard_events_handle(downloader);
+        }
+
+        torrent_downloader_peers_collect(downloader);
+
+        if (downloader->metrics_server && poll_sockets[metrics_poll_index].revents & POLLIN) {
+            torrent_downloader_metrics_serve(downloader);
+        }
+
+        if (now - last_maintenance >= 1000) {
+            torrent_downloader_peers_maintain(downloader);
+            last_maintenance = now;
+        }
+
+        if (!downloader->picker && torrent_metadata_exchange_complete(downloader->metadata_exchange)
+            && !torrent_downloader_metadata_finish(downloader)) {
+            return false;
+        }
+
+        if (downloader->stream && downloader->picker) { torrent_downloader_stream_update(downloader); }
+
+        if (downloader->keep_seeding && !downloader->seeding && downloader->picker && torrent_picker_finished(downloader->picker)) {
+            log_info("DOWNLOADER", "Seeding %s (%u pieces)", downloader->metadata->info.name, downloader->picker->pieces_length);
+            downloader->seeding = true;
+        }
+
+        torrent_downloader_peers_sweep(downloader);
+
+        if (downloader->replay && torrent_replay_finished(downloader->replay)) {
+            log_warn("DOWNLOADER", "The trace ran out before the download finished");
+            return false;
+        }
+    }
+
+    log_info("DOWNLOADER", "Finished downloading %s (%u pieces)", downloader->metadata->info.name, downloader->picker->pieces_length);
+    torrent_downloader_metrics_snapshot(downloader);
+    return true;
+}
+
+/* queues an address for dialing, addresses we already know about are ignored */
+bool torrent_downloader_candidate_add(TorrentDownloader* downloader, const char* ip, const char* port) {
+    if (torrent_ban_list_contains(ip)) { return false; }
+    return torrent_peer_store_add(downloader->peer_store, ip, port);
+}
+
+void torrent_downloader_destroy(TorrentDownloader* downloader) {
+    if (downloader->peers) {
+        for (usize i = 0; i < downloader->peers_length; i++) {
+            TorrentPeer* peer = downloader->peers[i];
+            if (peer->state != TORRENT_PEER_DISCONNECTED) {
+                torrent_downloader_peer_closed(downloader, peer, peer->state == TORRENT_PEER_CONNECTED);
+            }
+            torrent_peer_destroy(peer);
+        }
+        free(downloader->peers);
+    }
+    if (downloader->shards) {
+        for (u32 i = 0; i < downloader->shards_length; i++) {
+            torrent_shard_destroy(downloader->shards[i]);
+        }
+        free(downloader->shards);
+        torrent_shard_mailbox_destroy(&downloader->shard_events);
+    }
+    if (downloader->listen_socket != -1) { close(downloader->listen_socket); }
+    if (downloader->web_seeds) {
+        for (usize i = 0; i < downloader->web_seeds_length; i++) {
+            torrent_web_seed_destroy(downloader->web_seeds[i]);
+        }
+        free(downloader->web_seeds);
+    }
+    if (downloader->peer_store) { torrent_peer_store_destroy(downloader->peer_store); }
+    if (downloader->trackers) {
+        for (usize i = 0; i < downloader->trackers_length; i++) {
+            free(downloader->trackers[i]);
+        }
+        free(downloader->trackers);
+    }
+    if (downloader->metadata_exchange) { torrent_metadata_exchange_destroy(downloader->metadata_exchange); }
+    if (downloader->hash_exchange) { torrent_hash_exchange_destroy(downloader->hash_exchange); }
+    if (downloader->storage) { torrent_storage_destroy(downloader->storage); }
+    if (downloader->smart_ban) { torrent_smart_ban_destroy(downloader->smart_ban); }
+    if (downloader->super_seed) { torrent_super_seed_destroy(downloader->super_seed); }
+    if (downloader->picker) { torrent_picker_destroy(downloader->picker); }
+    if (downloader->metadata) { torrent_metadata_destroy(downloader->metadata); }
+    if (downloader->dht) { dht_destroy(downloader->dht); }
+    if (downloader->metrics_server) { torrent_metrics_server_destroy(downloader->metrics_server); }
+    free(downloader);
+}
+
+static TorrentDownloader* torrent_downloader_allocate() {
     TorrentDownloader* downloader = (TorrentDownloader*) malloc(sizeof(TorrentDownloader));
     if (!downloader) {
-        fprintf(stderr, "[ERROR] [DOWNLOADER] Failed to allocate memory for downloader!\n");
+        log_error("DOWNLOADER", "Failed to allocate memory for downloader!");
         return NULL;
     }
 
-    srand(time(NULL));
+    memset(downloader, 0, sizeof(TorrentDownloader));
+    downloader->dht_enabled = true;
+    downloader->listen_socket = -1;
+
+    // clients started in the same second would otherwise share a peer id and drop each other as themselves
+    srand(time(NULL) ^ getpid());
     for (usize i = 0; i < sizeof(downloader->peer_id); i++) {
         downloader->peer_id[i] = (rand() % 26) + 97;
     }
 
-    downloader->metadata = torrent_metadata_create(torrent_file);
-    if (!downloader->metadata) {
-        fprintf(stderr, "[ERROR] [DOWNLOADER] Failed to create torrent metadata from torrent file: %s\n", torrent_file);
+    downloader->peers = (TorrentPeer**) malloc(sizeof(TorrentPeer*) * TORRENT_DOWNLOADER_PEERS_MAX);
+    if (!downloader->peers) {
+        log_error("DOWNLOADER", "Failed to allocate memory for peers!");
         free(downloader);
         return NULL;
     }
 
-    TorrentTrackerResult tracker_result = torrent_tracker_get(downloader->metadata, downloader->peer_id);
-    if (tracker_result.failed) {
-        fprintf(stderr, "[ERROR] [DOWNLOADER] Failed to get result from tracker!\n");
-        torrent_metadata_destroy(downloader->metadata);
-        free(downloader);
-        return NULL;
+    return downloader;
+}
+
+/* the hex form tags every log message from this thread with the torrent */
+static void torrent_downloader_info_hash_set(TorrentDownloader* downloader, const u8 info_hash[20]) {
+    memcpy(downloader->info_hash, info_hash, sizeof(downloader->info_hash));
+    for (usize i = 0; i < sizeof(downloader->info_hash); i++) {
+        snprintf(downloader->info_hash_hex + (i * 2), 3, "%02x", info_hash[i]);
     }
+    log_torrent_set(downloader->info_hash_hex);
+}
 
-    downloader->peers_length = tracker_result.peers_length;
-    downloader->peers = (TorrentPeer**) malloc(sizeof(TorrentPeer*) * downloader->peers_length);
-    if (!downloader->peers) {
-        fprintf(stderr, "[ERROR] [DOWNLOADER] Failed to allocate memory for peers!\n");
+static bool torrent_downloader_tracker_add(TorrentDownloader* downloader, const char* tracker) {
+    char** temp = (char**) realloc(downloader->trackers, sizeof(char*) * (downloader->trackers_length + 1));
+    if (!temp) {
+        log_error("DOWNLOADER", "Failed to reallocate memory for trackers!");
+        return false;
+    }
+    downloader->trackers = temp;
+
+    downloader->trackers[downloader->trackers_length] = strdup(tracker);
+    if (!downloader->trackers[downloader->trackers_length]) {
+        log_error("DOWNLOADER", "Failed to allocate memory for tracker!");
+        return false;
+    }
+    downloader->trackers_length++;
+
+    return true;
+}
+
+/* creates the picker and storage once the metadata is known */
+static bool torrent_downloader_download_prepare(TorrentDownloader* downloader) {
+    TorrentMetadataInfo* info = &downloader->metadata->info;
+    downloader->picker = torrent_picker_create(info->piece_count, info->piece_length, info->length);
+    if (!downloader->picker) {
+        log_error("DOWNLOADER", "Failed to create piece picker!");
+        return false;
+    }
+
+    downloader->storage = torrent_storage_create(downloader->metadata, ".");
+    if (!downloader->storage) {
+        log_error("DOWNLOADER", "Failed to create storage!");
+        return false;
+    }
+
+    downloader->smart_ban = torrent_smart_ban_create();
+    if (!downloader->smart_ban) { return false; }
+
+    if (info->v2) {
+        downloader->hash_exchange = torrent_hash_exchange_create(downloader->metadata, downloader->picker, downloader->storage);
+        if (!downloader->hash_exchange) { return false; }
+    }
+
+    if (!torrent_downloader_web_seeds_create(downloader)) { return false; }
+
+    // a magnet link's stream is waiting for the metadata, a torrent file's is started by run
+    if (downloader->stream && !torrent_downloader_stream_start(downloader)) { return false; }
+
+    return true;
+}
+
+static void torrent_downloader_network_start(TorrentDownloader* downloader) {
+    if (downloader->shards_length > 0 && !torrent_downloader_shards_start(downloader)) {
+        log_warn("DOWNLOADER", "Failed to start the network threads, running every connection on this one");
+        downloader->shards_length = 0;
+    }
+
+    // a torrent file's mirrors and the saved peers were set up before we knew, a replay only
+    // knows what the trace discovered and leaves the saved peers as they were
+    if (downloader->replay) {
+        for (usize i = 0; i < downloader->web_seeds_length; i++) {
+            torrent_web_seed_destroy(downloader->web_seeds[i]);
+        }
+        downloader->web_seeds_length = 0;
+        downloader->peer_store->entries_length = 0;
+        downloader->listen_port = 0;
+        downloader->dht_enabled = false;
+    }
+
+    if (downloader->listen_port != 0) {
+        downloader->listen_socket = torrent_peer_listen(downloader->listen_port);
+        if (downloader->listen_socket == -1) {
+            downloader->listen_port = 0;
+        } else {
+            log_info("DOWNLOADER", "Accepting peers on port %u", downloader->listen_port);
+        }
+    }
+
+    if (downloader->metrics_port != 0) {
+        downloader->metrics_server = torrent_metrics_server_create(downloader->metrics_port);
+    }
+
+    if (downloader->dht_enabled) {
+        downloader->dht = dht_create(TORRENT_DOWNLOADER_DHT_PORT, TORRENT_DOWNLOADER_DHT_ROUTING_TABLE);
+    }
+    // the bootstrap only starts here, the run loop's dht_process carries it on
+    if (downloader->dht && downloader->dht_router[0]) {
+        dht_bootstrap(downloader->dht, downloader->dht_router[0], downloader->dht_router[1]);
+    } else if (downloader->dht && dht_nodes_count(downloader->dht) < DHT_K) {
+        // a saved routing table lets us skip the bootstrap routers entirely
+        for (usize i = 0; i < sizeof(dht_bootstrap_nodes) / sizeof(dht_bootstrap_nodes[0]); i++) {
+            dht_bootstrap(downloader->dht, dht_bootstrap_nodes[i][0], dht_bootstrap_nodes[i][1]);
+        }
+    }
+
+    // peers saved by earlier runs start connecting while the tracker is still being asked
+    torrent_downloader_peers_dial(downloader);
+    torrent_downloader_peers_discover(downloader);
+}
+
+/* starts the network threads, every one posts its events to the same mailbox */
+static bool torrent_downloader_shards_start(TorrentDownloader* downloader) {
+    if (downloader->shards_length > TORRENT_SHARDS_MAX) { downloader->shards_length = TORRENT_SHARDS_MAX; }
+
+    downloader->shards = (TorrentShard**) calloc(downloader->shards_length, sizeof(TorrentShard*));
+    if (!downloader->shards) {
+        log_error("DOWNLOADER", "Failed to allocate memory for shards!");
+        return false;
+    }
+
+    if (!torrent_shard_mailbox_init(&downloader->shard_events)) {
+        free(downloader->shards);
+        downloader->shards = NULL;
+        return false;
+    }
+
+    for (u32 i = 0; i < downloader->shards_length; i++) {
+        downloader->shards[i] = torrent_shard_create(i, &downloader->shard_events, downloader->info_hash_hex);
+        if (!downloader->shards[i]) {
+            for (u32 j = 0; j < i; j++) {
+                torrent_shard_destroy(downloader->shards[j]);
+            }
+            free(downloader->shards);
+            downloader->shards = NULL;
+            torrent_shard_mailbox_destroy(&downloader->shard_events);
+            return false;
+        }
+    }
+
+    log_info("DOWNLOADER", "Running peer connections on %u network threads", downloader->shards_length);
+    return true;
+}
+
+/* what the shards saw on their sockets since the last look, for connections that are still ours */
+static void torrent_downloader_shard_events_handle(TorrentDownloader* downloader) {
+    TorrentShardMessage* message;
+    while ((message = torrent_shard_mailbox_take(&downloader->shard_events))) {
+        TorrentPeer* peer = NULL;
+        for (usize i = 0; i < downloader->peers_length; i++) {
+            if (downloader->peers[i]->shard && downloader->peers[i]->connection == message->connection) {
+                peer = downloader->peers[i];
+                break;
+            }
+        }
+
+        if (peer && peer->state != TORRENT_PEER_DISCONNECTED) {
+            switch (message->type) {
+                case TORRENT_SHARD_CONNECTED: torrent_downloader_peer_connected(downloader, peer); break;
+                case TORRENT_SHARD_RECEIVED: {
+                    if (!torrent_peer_input_append(peer, message->data, message->length)) {
+                        torrent_downloader_peer_disconnect(downloader, peer);
+                        break;
+                    }
+                    torrent_downloader_peer_input(downloader, peer);
+                    break;
+                }
+                case TORRENT_SHARD_CLOSED: torrent_downloader_peer_disconnect(downloader, peer); break;
+                case TORRENT_SHARD_SENT: {
+                    peer->output_pending -= (message->length < peer->output_pending) ? message->length : peer->output_pending;
+                    if (!torrent_downloader_uploads_send(downloader, peer)) { torrent_downloader_peer_disconnect(downloader, peer); }
+                    break;
+                }
+                default: break;
+            }
+        }
+
+        torrent_shard_message_destroy(message);
+    }
+}
+
+/*
+ * how many pieces a torrent we have no metadata for can have. magnet links carry a v1 info
+ * hash, so the info dictionary holds a SHA-1 per piece and its size bounds the piece count
+ */
+static u32 torrent_downloader_metadata_pieces_max(TorrentDownloader* downloader) {
+    usize size = downloader->metadata_exchange->length;
+    if (size == 0) { size = TORRENT_METADATA_EXCHANGE_SIZE_MAX; }
+    return size / SHA_DIGEST_LENGTH;
+}
+
+/*
+ * turns the fetched info dictionary into metadata and starts the actual download.
+ * a dictionary that doesn't match the info hash is fetched again, false is fatal
+ */
+static bool torrent_downloader_metadata_finish(TorrentDownloader* downloader) {
+    TorrentMetadataExchange* exchange = downloader->metadata_exchange;
+
+    const char* announce = downloader->trackers_length > 0 ? downloader->trackers[0] : NULL;
+    downloader->metadata = torrent_metadata_create_from_info(exchange->data, exchange->length, downloader->info_hash, announce);
+    if (!downloader->metadata) {
+        log_warn("DOWNLOADER", "Fetched metadata is invalid, fetching it again!");
+        torrent_metadata_exchange_reset(exchange);
+        return true;
+    }
+
+    log_info("DOWNLOADER", "Metadata for %s received (%zu bytes)", downloader->metadata->info.name, exchange->length);
+
+    if (!torrent_downloader_download_prepare(downloader)) { return false; }
+
+    // bitfields collected so far were sized by whatever the peers sent
+    TorrentPicker* picker = downloader->picker;
+    for (usize i = 0; i < downloader->peers_length; i++) {
+        TorrentPeer* peer = downloader->peers[i];
+        if (peer->state != TORRENT_PEER_CONNECTED) { continue; }
+
+        if (!torrent_peer_bitfield_resize(peer, picker->pieces_length)) {
+            torrent_downloader_peer_disconnect(downloader, peer);
+            continue;
+        }
+        if (peer->fast.have_all) {
+            memset(peer->bitfield, 0xFF, peer->bitfield_length);
+            torrent_peer_bitfield_resize(peer, picker->pieces_length);
+        }
+
+        torrent_picker_availability_add(picker, peer->bitfield, peer->bitfield_length);
+        if (!torrent_downloader_peer_fast_grant(downloader, peer)) {
+            torrent_downloader_peer_disconnect(downloader, peer);
+            continue;
+        }
+
+        torrent_downloader_peer_update(downloader, peer);
+    }
+
+    return true;
+}
+
+/* mirrors we can't speak to are skipped, only running out of memory fails */
+static bool torrent_downloader_web_seeds_create(TorrentDownloader* downloader) {
+    TorrentMetadata* metadata = downloader->metadata;
+    if (metadata->url_list_length == 0 || downloader->replay) { return true; }
+
+    usize web_seeds_length = (metadata->url_list_length < TORRENT_DOWNLOADER_WEB_SEEDS_MAX) ? metadata->url_list_length : TORRENT_DOWNLOADER_WEB_SEEDS_MAX;
+    downloader->web_seeds = (TorrentWebSeed**) malloc(sizeof(TorrentWebSeed*) * web_seeds_length);
+    if (!downloader->web_seeds) {
+        log_error("DOWNLOADER", "Failed to allocate memory for web seeds!");
+        return false;
+    }
+
+    for (usize i = 0; i < web_seeds_length; i++) {
+        TorrentWebSeed* seed = torrent_web_seed_create(metadata->url_list[i], metadata, downloader->picker);
+        if (seed) { downloader->web_seeds[downloader->web_seeds_length++] = seed; }
+    }
+
+    return true;
+}
+
+/* asks every tracker and the dht for peers, so a dead tracker still leaves us with candidates */
+static void torrent_downloader_peers_discover(TorrentDownloader* downloader) {
+    downloader->last_discover = time_now_ms();
+
+    // a replay's recorded answers come in through torrent_downloader_peers_collect
+    for (usize i = 0; i < downloader->trackers_length && !downloader->replay; i++) {
+        TorrentTrackerResult tracker_result = torrent_tracker_get(downloader->trackers[i], downloader->info_hash, downloader->peer_id, downloader->listen_port);
+        if (tracker_result.failed) {
+            log_warn("DOWNLOADER", "Failed to get result from tracker: %s", downloader->trackers[i]);
+        } else {
+            if (downloader->trace) { torrent_trace_peers(downloader->trace, tracker_result.peers, tracker_result.peers_length); }
+            for (usize j = 0; j < tracker_result.peers_length; j++) {
+                torrent_downloader_candidate_add(downloader, tracker_result.peers[j].ip, tracker_result.peers[j].port);
+            }
+        }
         torrent_tracker_result_destroy(&tracker_result);
-        torrent_metadata_destroy(downloader->metadata);
-        free(downloader);
-        return NULL;
     }
 
+    // the lookup's peers turn up in torrent_downloader_peers_collect as they are found. the
+    // port is only announced when we accept peers on it
+    if (downloader->dht) {
+        dht_get_peers(downloader->dht, downloader->info_hash, downloader->listen_port);
+    }
+
+    bool searching = downloader->dht && dht_lookups_active(downloader->dht);
+    if (!searching && !downloader->replay && !torrent_peer_store_best(downloader->peer_store, time_now_ms())) {
+        log_warn("DOWNLOADER", "Failed to find any new peers from the tracker or the dht!");
+    }
+}
+
+/* moves the dht along and adds whatever its lookups, or the replayed discoveries, found */
+static void torrent_downloader_peers_collect(TorrentDownloader* downloader) {
+    usize peers_length = 0;
+    TorrentTrackerPeer* peers = NULL;
+    if (downloader->replay) {
+        peers = torrent_replay_peers(downloader->replay, &peers_length);
+    } else if (downloader->dht) {
+        dht_process(downloader->dht);
+        peers = dht_peers_take(downloader->dht, &peers_length);
+    }
+    if (!peers) { return; }
+
+    if (downloader->trace) { torrent_trace_peers(downloader->trace, peers, peers_length); }
+    for (usize i = 0; i < peers_length; i++) {
+        torrent_downloader_candidate_add(downloader, peers[i].ip, peers[i].port);
+    }
+    free(peers);
+}
+
+static void torrent_downloader_peers_dial(TorrentDownloader* downloader) {
+    usize connecting = 0;
     for (usize i = 0; i < downloader->peers_length; i++) {
-        downloader->peers[i] = torrent_peer_connect(tracker_result.peers[i].ip, tracker_result.peers[i].port, downloader->peer_id, downloader->metadata);
-        if (!downloader->peers[i]) {
-            fprintf(stderr, "[ERROR] [DOWNLOADER] Failed to connect to peer (index: %lu)!\n", i);
+        if (downloader->peers[i]->state == TORRENT_PEER_CONNECTING) { connecting++; }
+    }
+
+    i64 now = time_now_ms();
+    while (downloader->peers_length < TORRENT_DOWNLOADER_PEERS_MAX && connecting < TORRENT_DOWNLOADER_CONNECTING_MAX) {
+        // the best scoring peers from earlier sessions go first
+        TorrentPeerStoreEntry* entry = torrent_peer_store_best(downloader->peer_store, now);
+        if (!entry) { break; }
+
+        entry->in_use = true;
+
+        // banned by another torrent since we heard of it
+        if (torrent_ban_list_contains(entry->ip)) { continue; }
+
+        TorrentPeer* peer;
+        if (downloader->replay) {
+            // an address the trace never connected to fails like a refused connection
+            i32 replay_socket = torrent_replay_connect(downloader->replay, entry->ip, entry->port);
+            peer = (replay_socket != -1) ? torrent_peer_adopt(replay_socket, entry->ip, entry->port, false) : NULL;
+        } else {
+            peer = torrent_peer_connect(entry->ip, entry->port);
+        }
+        if (!peer) {
+            torrent_peer_store_closed(entry, false, 0, 0, now);
+            continue;
         }
+
+        torrent_metrics_count(TORRENT_METRICS_PEERS_DIALED, 1);
+
+        if (!torrent_downloader_peer_add(downloader, peer)) {
+            torrent_peer_destroy(peer);
+            torrent_peer_store_closed(entry, false, 0, 0, now);
+            continue;
+        }
+        connecting++;
     }
+}
 
-    return downloader;
+static void torrent_downloader_peers_accept(TorrentDownloader* downloader) {
+    while (downloader->peers_length < TORRENT_DOWNLOADER_PEERS_MAX) {
+        TorrentPeer* peer;
+        if (downloader->replay) {
+            char ip[32];
+            char port[16];
+            i32 replay_socket = torrent_replay_accept(downloader->replay, ip, port);
+            if (replay_socket == -1) { break; }
+            peer = torrent_peer_adopt(replay_socket, ip, port, true);
+        } else {
+            peer = torrent_peer_accept(downloader->listen_socket);
+        }
+        if (!peer) { break; }
+
+        if (torrent_ban_list_contains(peer->ip) || !torrent_downloader_peer_add(downloader, peer)) {
+            torrent_peer_destroy(peer);
+        }
+    }
 }
 
-void torrent_downloader_destroy(TorrentDownloader* downloader) {
-    if (downloader->metadata) { torrent_metadata_destroy(downloader->metadata); }
+/*
+ * hands the upload slots to interested peers. a peer that lost interest gives its slot back,
+ * and while peers are waiting the one unchoked longest gives its slot up after a while
+ */
+static void torrent_downloader_peers_choke(TorrentDownloader* downloader) {
+    i64 now = time_now_ms();
+
+    usize unchoked = 0;
+    usize waiting = 0;
+    TorrentPeer* oldest = NULL;
     for (usize i = 0; i < downloader->peers_length; i++) {
-        if (downloader->peers[i]) { free(downloader->peers[i]); }
+        TorrentPeer* peer = downloader->peers[i];
+        if (peer->state != TORRENT_PEER_CONNECTED) { continue; }
+
+        if (peer->am_choking) {
+            if (peer->peer_interested) { waiting++; }
+            continue;
+        }
+
+        if (!peer->peer_interested) {
+            if (!torrent_downloader_uploads_choke(peer)) { torrent_downloader_peer_disconnect(downloader, peer); }
+            continue;
+        }
+
+        unchoked++;
+        if (!oldest || peer->unchoked_at < oldest->unchoked_at) { oldest = peer; }
     }
-    if (downloader->peers) { free(downloader->peers); }
-    free(downloader);
+
+    if (waiting > 0 && unchoked >= TORRENT_DOWNLOADER_UNCHOKE_SLOTS && now - oldest->unchoked_at >= TORRENT_DOWNLOADER_UNCHOKE_ROTATE_MS) {
+        if (!torrent_downloader_uploads_choke(oldest)) { torrent_downloader_peer_disconnect(downloader, oldest); }
+        unchoked--;
+    }
+
+    for (usize i = 0; i < downloader->peers_length && unchoked < TORRENT_DOWNLOADER_UNCHOKE_SLOTS; i++) {
+        TorrentPeer* peer = downloader->peers[i];
+        if (peer->state != TORRENT_PEER_CONNECTED || !peer->am_choking || !peer->peer_interested || peer == oldest) { continue; }
+
+        if (!torrent_peer_send_choke(peer, false)) {
+            torrent_downloader_peer_disconnect(downloader, peer);
+            continue;
+        }
+        unchoked++;
+    }
+}
+
+/* timeouts, keep-alives and pex, runs about once a second */
+static void torrent_downloader_peers_maintain(TorrentDownloader* downloader) {
+    i64 now = time_now_ms();
+
+    if (now - downloader->last_peer_store_save >= TORRENT_DOWNLOADER_PEER_STORE_SAVE_INTERVAL_MS) {
+        if (!downloader->replay) { torrent_peer_store_save(downloader->peer_store); }
+        downloader->last_peer_store_save = now;
+    }
+
+    if (downloader->metrics_snapshot_path && now - downloader->last_metrics_snapshot >= TORRENT_DOWNLOADER_METRICS_SNAPSHOT_INTERVAL_MS) {
+        torrent_downloader_metrics_snapshot(downloader);
+        downloader->last_metrics_snapshot = now;
+    }
+
+    torrent_downloader_rates_update(downloader);
+    torrent_downloader_peers_choke(downloader);
+
+    // what it took to get one full copy out of us, the number super seeding keeps close to 1
+    if (downloader->seeding && !downloader->copy_distributed) {
+        TorrentPicker* picker = downloader->picker;
+        bool distributed = true;
+        for (u32 i = 0; i < picker->pieces_length && distributed; i++) {
+            distributed = picker->pieces[i].availability > 0;
+        }
+
+        if (distributed) {
+            log_info("DOWNLOADER", "Peers hold a full copy between them, %.2f copies uploaded", (double) downloader->bytes_uploaded / downloader->metadata->info.length);
+            downloader->copy_distributed = true;
+        }
+    }
+
+    for (usize i = 0; i < downloader->peers_length; i++) {
+        TorrentPeer* peer = downloader->peers[i];
+
+        switch (peer->state) {
+            case TORRENT_PEER_CONNECTING: {
+                if (now - peer->connect_started > TORRENT_DOWNLOADER_CONNECT_TIMEOUT_MS) {
+                    torrent_downloader_peer_disconnect(downloader, peer);
+                }
+            } break;
+            case TORRENT_PEER_HANDSHAKING: {
+                if (now - peer->last_received > TORRENT_DOWNLOADER_HANDSHAKE_TIMEOUT_MS) {
+                    torrent_downloader_peer_disconnect(downloader, peer);
+                }
+            } break;
+            case TORRENT_PEER_CONNECTED: {
+                if (now - peer->last_received > TORRENT_DOWNLOADER_INACTIVITY_TIMEOUT_MS) {
+                    torrent_downloader_peer_disconnect(downloader, peer);
+                    break;
+                }
+
+                // a peer sitting on our requests gets them taken away so others can serve them
+                if (peer->requests_length > 0 && now - peer->requests[0].sent_at > TORRENT_DOWNLOADER_REQUEST_TIMEOUT_MS) {
+                    log_peer_warn("DOWNLOADER", peer->ip, peer->port, "Requests timed out!");
+                    torrent_metrics_count(TORRENT_METRICS_REQUESTS_TIMED_OUT, 1);
+                    torrent_downloader_requests_release(downloader, peer);
+                }
+
+                if (!downloader->picker) { torrent_metadata_exchange_maintain(downloader->metadata_exchange); }
+
+                bool alive = true;
+                if (now - peer->last_sent > TORRENT_DOWNLOADER_KEEP_ALIVE_MS) {
+                    alive = torrent_peer_send_keep_alive(peer);
+                }
+                if (alive && downloader->hash_exchange && peer->supports_v2) {
+                    alive = torrent_hash_exchange_layers_request(downloader->hash_exchange, peer);
+                }
+                if (alive) {
+                    alive = torrent_pex_send(peer, downloader->peers, downloader->peers_length, downloader->picker ? downloader->picker->pieces_length : 0);
+                }
+
+                if (!alive) {
+                    torrent_downloader_peer_disconnect(downloader, peer);
+                } else {
+                    torrent_downloader_peer_update(downloader, peer);
+                }
+            } break;
+            case TORRENT_PEER_DISCONNECTED: break;
+        }
+    }
+}
+
+static void torrent_downloader_peers_sweep(TorrentDownloader* downloader) {
+    usize kept = 0;
+    for (usize i = 0; i < downloader->peers_length; i++) {
+        TorrentPeer* peer = downloader->peers[i];
+        if (peer->state == TORRENT_PEER_DISCONNECTED) {
+            torrent_peer_destroy(peer);
+            continue;
+        }
+
+        downloader->peers[kept] = peer;
+        kept++;
+    }
+    downloader->peers_length = kept;
+}
+
+/* takes a dialed or accepted peer in, false if it couldn't be and the caller still owns it */
+static bool torrent_downloader_peer_add(TorrentDownloader* downloader, TorrentPeer* peer) {
+    u64 connection = ++downloader->connections_next;
+
+    // round robin over the shards, the connection never moves off the one it lands on
+    if (downloader->shards) {
+        TorrentShard* shard = downloader->shards[connection % downloader->shards_length];
+        if (!torrent_shard_add(shard, connection, peer->socket)) { return false; }
+
+        peer->shard = shard;
+        peer->socket = -1;
+    }
+    peer->connection = connection;
+
+    if (downloader->trace) {
+        peer->trace = downloader->trace;
+        torrent_trace_connect(downloader->trace, connection, peer->ip, peer->port, peer->incoming);
+    }
+
+    downloader->peers[downloader->peers_length] = peer;
+    downloader->peers_length++;
+    return true;
+}
+
+static void torrent_downloader_peer_event(TorrentDownloader* downloader, TorrentPeer* peer, i16 events) {
+    if (peer->state == TORRENT_PEER_DISCONNECTED) { return; }
+
+    if (peer->state == TORRENT_PEER_CONNECTING) {
+        torrent_downloader_peer_connected(downloader, peer);
+        return;
+    }
+
+    if ((events & POLLOUT) && (!torrent_peer_flush(peer) || !torrent_downloader_uploads_send(downloader, peer))) {
+        torrent_downloader_peer_disconnect(downloader, peer);
+        return;
+    }
+
+    if (!(events & (POLLIN | POLLERR | POLLHUP))) { return; }
+
+    if (!torrent_peer_receive(peer)) {
+        torrent_downloader_peer_disconnect(downloader, peer);
+        return;
+    }
+
+    torrent_downloader_peer_input(downloader, peer);
+}
+
+static void torrent_downloader_peer_connected(TorrentDownloader* downloader, TorrentPeer* peer) {
+    if (!torrent_peer_connect_finish(peer) || !torrent_peer_handshake_send(peer, downloader->info_hash, downloader->peer_id)) {
+        torrent_downloader_peer_disconnect(downloader, peer);
+        return;
+    }
+
+    TorrentPeerStoreEntry* entry = torrent_peer_store_find(downloader->peer_store, peer->ip, peer->port);
+    if (entry) { torrent_peer_store_connected(entry, time_now_ms() - peer->connect_started); }
+
+    i64 now_us = time_now_us();
+    torrent_metrics_count(TORRENT_METRICS_PEERS_CONNECTED, 1);
+    torrent_metrics_record(TORRENT_METRICS_CONNECT_TIME, now_us - peer->stage_started_us);
+    peer->stage_started_us = now_us;
+}
+
+/* handles the handshake and every whole message in the peer's receive buffer */
+static void torrent_downloader_peer_input(TorrentDownloader* downloader, TorrentPeer* peer) {
+    if (peer->state == TORRENT_PEER_HANDSHAKING) {
+        bool complete;
+        if (!torrent_peer_handshake_receive(peer, downloader->info_hash, &complete)) {
+            log_peer_warn("DOWNLOADER", peer->ip, peer->port, "Failed to validate handshake!");
+            torrent_downloader_peer_disconnect(downloader, peer);
+            return;
+        }
+        if (!complete) { return; }
+
+        torrent_metrics_count(TORRENT_METRICS_PEERS_HANDSHAKED, 1);
+        torrent_metrics_record(TORRENT_METRICS_HANDSHAKE_TIME, time_now_us() - peer->stage_started_us);
+
+        torrent_downloader_peer_handshaked(downloader, peer);
+        if (peer->state == TORRENT_PEER_DISCONNECTED) { return; }
+    }
+
+    TorrentPeerMessage message;
+    bool failed = false;
+    while (torrent_peer_message_next(peer, &message, &failed)) {
+        if (!torrent_downloader_message_handle(downloader, peer, &message)) {
+            log_peer_warn("DOWNLOADER", peer->ip, peer->port, "Invalid message %u!", message.id);
+            torrent_downloader_peer_disconnect(downloader, peer);
+            return;
+        }
+        if (peer->state == TORRENT_PEER_DISCONNECTED) { return; } // banned for what it sent
+    }
+
+    if (failed) {
+        torrent_downloader_peer_disconnect(downloader, peer);
+        return;
+    }
+
+    torrent_downloader_peer_update(downloader, peer);
+}
+
+static void torrent_downloader_peer_handshaked(TorrentDownloader* downloader, TorrentPeer* peer) {
+    TorrentPicker* picker = downloader->picker;
+
+    if (torrent_downloader_peer_duplicate(downloader, peer)) {
+        torrent_downloader_peer_disconnect(downloader, peer);
+        return;
+    }
+
+    TorrentPeerStoreEntry* entry = torrent_peer_store_find(downloader->peer_store, peer->ip, peer->port);
+    if (entry) { torrent_peer_store_handshaked(entry); }
+
+    // without metadata the piece count is unknown, the bitfield then grows with what the peer sends
+    if (picker && !torrent_peer_bitfield_create(peer, picker->pieces_length)) {
+        torrent_downloader_peer_disconnect(downloader, peer);
+        return;
+    }
+
+    // what we have must be the first message, fast peers get have all / have none instead of a bitfield.
+    // a super seed claims to have nothing and hands out pieces with haves later
+    bool success = true;
+    if (downloader->super_seed) {
+        if (peer->supports_fast) { success = torrent_peer_message_send(peer, TORRENT_PEER_MESSAGE_HAVE_NONE, NULL, 0); }
+    } else if (peer->supports_fast && (!picker || picker->pieces_completed == 0)) {
+        success = torrent_peer_message_send(peer, TORRENT_PEER_MESSAGE_HAVE_NONE, NULL, 0);
+    } else if (peer->supports_fast && torrent_picker_finished(picker)) {
+        success = torrent_peer_message_send(peer, TORRENT_PEER_MESSAGE_HAVE_ALL, NULL, 0);
+    } else if (picker && picker->pieces_completed > 0) {
+        success = torrent_peer_message_send(peer, TORRENT_PEER_MESSAGE_BITFIELD, picker->bitfield, picker->bitfield_length);
+    }
+
+    if (success && peer->supports_extensions) {
+        TorrentMetadataExchange* exchange = downloader->metadata_exchange;
+        success = torrent_extension_handshake_send(peer, downloader->listen_port, torrent_metadata_exchange_complete(exchange) ? exchange->length : 0);
+    }
+
+    if (success && picker && !downloader->super_seed) {
+        success = torrent_downloader_peer_fast_grant(downloader, peer);
+    }
+
+    if (!success) {
+        torrent_downloader_peer_disconnect(downloader, peer);
+    }
+}
+
+/* computes the peer's allowed fast set, pieces we don't have yet are announced from torrent_downloader_piece_finish() */
+static bool torrent_downloader_peer_fast_grant(TorrentDownloader* downloader, TorrentPeer* peer) {
+    if (!peer->supports_fast) { return true; }
+
+    TorrentPicker* picker = downloader->picker;
+    TorrentFastState* fast = &peer->fast;
+    fast->granted_length = torrent_fast_allowed_set(peer->ip, downloader->info_hash, picker->pieces_length, fast->granted, TORRENT_FAST_ALLOWED_SET_LENGTH);
+
+    for (usize i = 0; i < fast->granted_length; i++) {
+        if (torrent_picker_has(picker, fast->granted[i]) && !torrent_peer_send_allowed_fast(peer, fast->granted[i])) { return false; }
+    }
+    return true;
+}
+
+/* keeps our interest in sync with what the peer has and its request pipeline full */
+static void torrent_downloader_peer_update(TorrentDownloader* downloader, TorrentPeer* peer) {
+    if (peer->state != TORRENT_PEER_CONNECTED) { return; }
+
+    if (!downloader->picker) {
+        if (!torrent_metadata_exchange_request(downloader->metadata_exchange, peer)) {
+            torrent_downloader_peer_disconnect(downloader, peer);
+        }
+        return;
+    }
+
+    if (downloader->super_seed) {
+        torrent_downloader_super_seed_update(downloader, peer);
+        if (peer->state != TORRENT_PEER_CONNECTED) { return; }
+    }
+
+    TorrentPicker* picker = downloader->picker;
+    bool interesting = torrent_picker_is_interesting(picker, peer->bitfield, peer->bitfield_length);
+    if (interesting != peer->am_interested && !torrent_peer_send_interested(peer, interesting)) {
+        torrent_downloader_peer_disconnect(downloader, peer);
+        return;
+    }
+
+    if (!peer->am_interested) { return; }
+
+    usize requests_max = TORRENT_PEER_REQUESTS_MAX;
+    if (peer->extensions.request_queue_length > 0 && peer->extensions.request_queue_length < requests_max) {
+        requests_max = peer->extensions.request_queue_length;
+    }
+
+    i64 now = time_now_ms();
+    while (peer->requests_length < requests_max) {
+        TorrentPickerBlock block;
+        if (!torrent_downloader_peer_block_pick(downloader, peer, &block)) { break; }
+
+        if (!torrent_peer_send_request(peer, block.index, block.begin, block.length)) {
+            torrent_picker_block_release(picker, block.index, block.begin);
+            torrent_downloader_peer_disconnect(downloader, peer);
+            return;
+        }
+
+        peer->requests[peer->requests_length] = (TorrentPeerRequest) { block.index, block.begin, block.length, now, time_now_us() };
+        peer->requests_length++;
+        torrent_metrics_count(TORRENT_METRICS_BLOCKS_REQUESTED, 1);
+
+        // the piece's block hashes come from whoever serves its first blocks
+        if (downloader->hash_exchange && peer->supports_v2 && !torrent_hash_exchange_piece_request(downloader->hash_exchange, peer, block.index)) {
+            torrent_downloader_peer_disconnect(downloader, peer);
+            return;
+        }
+    }
+}
+
+/* a choking peer only serves its allowed fast pieces, an unchoked one gets its suggestions tried first */
+static bool torrent_downloader_peer_block_pick(TorrentDownloader* downloader, TorrentPeer* peer, TorrentPickerBlock* block) {
+    TorrentPicker* picker = downloader->picker;
+    TorrentFastState* fast = &peer->fast;
+
+    if (peer->peer_choking) {
+        if (!peer->supports_fast) { return false; }
+
+        for (usize i = 0; i < fast->allowed_length; i++) {
+            if (torrent_peer_has_piece(peer, fast->allowed[i]) && torrent_picker_block_pick_piece(picker, fast->allowed[i], block)) { return true; }
+        }
+        return false;
+    }
+
+    // a streaming reader's next pieces come before suggestions and rarity, late ones are raced on fast peers
+    if (picker->window_length > 0) {
+        if (torrent_picker_block_pick_critical(picker, peer->bitfield, peer->bitfield_length, block)) { return true; }
+        if (peer->download_rate >= downloader->race_rate_min
+            && torrent_picker_block_pick_late(picker, peer->bitfield, peer->bitfield_length, peer->requests, peer->requests_length, time_now_ms(), block)) { return true; }
+    }
+
+    for (usize i = fast->suggested_length; i > 0; i--) {
+        u32 index = fast->suggested[i - 1];
+        if (torrent_peer_has_piece(peer, index) && torrent_picker_block_pick_piece(picker, index, block)) { return true; }
+    }
+
+    return torrent_picker_block_pick(picker, peer->bitfield, peer->bitfield_length, block);
+}
+
+/*
+ * whether the peer is ourselves, dialed through our own announce, or already connected. of two
+ * connections to the same peer both ends keep the one opened by the lower peer id
+ */
+static bool torrent_downloader_peer_duplicate(TorrentDownloader* downloader, TorrentPeer* peer) {
+    if (memcmp(peer->id, downloader->peer_id, sizeof(peer->id)) == 0) { return true; }
+
+    const u8* opener = peer->incoming ? peer->id : (const u8*) downloader->peer_id;
+    for (usize i = 0; i < downloader->peers_length; i++) {
+        TorrentPeer* other = downloader->peers[i];
+        if (other == peer || other->state != TORRENT_PEER_CONNECTED || memcmp(other->id, peer->id, sizeof(peer->id)) != 0) { continue; }
+
+        const u8* other_opener = other->incoming ? other->id : (const u8*) downloader->peer_id;
+        if (memcmp(opener, other_opener, sizeof(peer->id)) < 0) {
+            torrent_downloader_peer_disconnect(downloader, other);
+            return false;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+static void torrent_downloader_peer_disconnect(TorrentDownloader* downloader, TorrentPeer* peer) {
+    if (peer->state == TORRENT_PEER_DISCONNECTED) { return; }
+
+    torrent_metadata_exchange_peer_release(downloader->metadata_exchange, peer);
+    torrent_downloader_requests_release(downloader, peer);
+    if (downloader->picker && peer->state == TORRENT_PEER_CONNECTED && peer->bitfield) {
+        torrent_picker_availability_remove(downloader->picker, peer->bitfield, peer->bitfield_length);
+    }
+
+    if (peer->shard) { torrent_shard_close(peer->shard, peer->connection); }
+    if (downloader->super_seed) { torrent_super_seed_release(downloader->super_seed, &peer->super_seed); }
+
+    torrent_downloader_peer_closed(downloader, peer, peer->state == TORRENT_PEER_CONNECTED);
+    peer->state = TORRENT_PEER_DISCONNECTED;
+    torrent_metrics_count(TORRENT_METRICS_PEERS_DISCONNECTED, 1);
+}
+
+/* bans the address for the whole process and drops every connection to it */
+static void torrent_downloader_peer_ban(TorrentDownloader* downloader, const char* ip, const char* reason) {
+    if (torrent_ban_list_add(ip)) {
+        log_warn("DOWNLOADER", "Banned %s, it %s", ip, reason);
+        torrent_metrics_count(TORRENT_METRICS_PEERS_BANNED, 1);
+    }
+
+    for (usize i = 0; i < downloader->peers_length; i++) {
+        if (strcmp(downloader->peers[i]->ip, ip) == 0) { torrent_downloader_peer_disconnect(downloader, downloader->peers[i]); }
+    }
+}
+
+/* records how the session went so the next dial (or the next run) can pick better peers */
+static void torrent_downloader_peer_closed(TorrentDownloader* downloader, TorrentPeer* peer, bool handshaked) {
+    if (peer->trace) { torrent_trace_record(peer->trace, TORRENT_TRACE_CLOSE, peer->connection, NULL, 0); }
+
+    TorrentPeerStoreEntry* entry = torrent_peer_store_find(downloader->peer_store, peer->ip, peer->port);
+    if (!entry) { return; }
+
+    i64 now = time_now_ms();
+    torrent_peer_store_closed(entry, handshaked, peer->bytes_downloaded, now - peer->connect_started, now);
+}
+
+static void torrent_downloader_requests_release(TorrentDownloader* downloader, TorrentPeer* peer) {
+    for (usize i = 0; i < peer->requests_length; i++) {
+        torrent_picker_block_release(downloader->picker, peer->requests[i].index, peer->requests[i].begin);
+    }
+    peer->requests_length = 0;
+}
+
+/* any failure, including the server hanging up, gives the seed's unfinished pieces back to the peers */
+static void torrent_downloader_web_seed_event(TorrentDownloader* downloader, TorrentWebSeed* seed, i16 events) {
+    i64 now = time_now_ms();
+
+    if (seed->state == TORRENT_WEB_SEED_CONNECTING) {
+        if (!torrent_web_seed_connect_finish(seed)) { torrent_web_seed_fail(seed, now); }
+        return;
+    }
+
+    if ((events & POLLOUT) && !torrent_web_seed_flush(seed)) {
+        torrent_web_seed_fail(seed, now);
+        return;
+    }
+
+    if (!(events & (POLLIN | POLLERR | POLLHUP))) { return; }
+
+    if (!torrent_web_seed_receive(seed)) {
+        torrent_web_seed_fail(seed, now);
+        return;
+    }
+
+    TorrentPickerBlock block;
+    const u8* data;
+    bool failed = false;
+    while (torrent_web_seed_block_next(seed, &block, &data, &failed)) {
+        torrent_metrics_count(TORRENT_METRICS_BLOCKS_RECEIVED, 1);
+        torrent_metrics_count(TORRENT_METRICS_BYTES_DOWNLOADED, block.length);
+        torrent_metrics_count(TORRENT_METRICS_WEB_SEED_BYTES, block.length);
+
+        if (!torrent_downloader_block_store(downloader, NULL, block.index, block.begin, data, block.length)) {
+            log_warn("DOWNLOADER", "Block %u:%u from %s failed hash verification!", block.index, block.begin, seed->url);
+            failed = true;
+            break;
+        }
+    }
+
+    if (failed || seed->closed) { torrent_web_seed_fail(seed, now); }
+}
+
+/*
+ * offers the peer its next piece once the last one spread to another peer. a piece nobody
+ * else is missing can't spread, and one that takes too long stops holding the peer up
+ */
+static void torrent_downloader_super_seed_update(TorrentDownloader* downloader, TorrentPeer* peer) {
+    TorrentSuperSeedPeer* state = &peer->super_seed;
+    if (state->offered) {
+        if (!torrent_peer_has_piece(peer, state->piece)) { return; }
+
+        i64 now = time_now_ms();
+        if (state->held_at == 0) { state->held_at = now; }
+
+        bool wanted = false;
+        for (usize i = 0; i < downloader->peers_length && !wanted; i++) {
+            TorrentPeer* other = downloader->peers[i];
+            wanted = other != peer && other->state == TORRENT_PEER_CONNECTED && !torrent_peer_has_piece(other, state->piece);
+        }
+
+        if (!state->spread && wanted && now - state->held_at < TORRENT_SUPER_SEED_WAIT_MS) { return; }
+    }
+
+    if (!torrent_super_seed_offer(downloader->super_seed, state, downloader->picker, peer->bitfield, peer->bitfield_length)) { return; }
+
+    if (!torrent_peer_send_have(peer, state->piece)) {
+        torrent_downloader_peer_disconnect(downloader, peer);
+    }
+}
+
+/* a piece turning up at a peer means whoever else we offered it to passed it on */
+static void torrent_downloader_super_seed_have(TorrentDownloader* downloader, TorrentPeer* peer, u32 index) {
+    for (usize i = 0; i < downloader->peers_length; i++) {
+        TorrentPeer* other = downloader->peers[i];
+        if (other == peer || other->state != TORRENT_PEER_CONNECTED || !other->super_seed.offered || other->super_seed.piece != index) { continue; }
+
+        other->super_seed.spread = true;
+        torrent_downloader_super_seed_update(downloader, other);
+    }
+}
+
+/* false means the peer broke the protocol and should be dropped */
+static bool torrent_downloader_message_handle(TorrentDownloader* downloader, TorrentPeer* peer, TorrentPeerMessage* message) {
+    if (message->keep_alive) { return true; }
+
+    TorrentPicker* picker = downloader->picker;
+    switch (message->id) {
+        case TORRENT_PEER_MESSAGE_CHOKE: {
+            // choking throws away every request the peer still had queued, fast peers reject them one by one instead
+            peer->peer_choking = true;
+            if (!peer->supports_fast) { torrent_downloader_requests_release(downloader, peer); }
+        } break;
+        case TORRENT_PEER_MESSAGE_UNCHOKE: peer->peer_choking = false; break;
+        case TORRENT_PEER_MESSAGE_INTERESTED: {
+            peer->peer_interested = true;
+            torrent_downloader_peers_choke(downloader);
+        } break;
+        case TORRENT_PEER_MESSAGE_NOT_INTERESTED: {
+            peer->peer_interested = false;
+            torrent_downloader_peers_choke(downloader);
+        } break;
+        case TORRENT_PEER_MESSAGE_HAVE: {
+            if (message->payload_length != 4) { return false; }
+
+            u32 index = buffer_read_big_endian(message->payload);
+            if (!picker) {
+                if (index >= torrent_downloader_metadata_pieces_max(downloader)) { return false; }
+                if (index / 8 >= peer->bitfield_length && !torrent_peer_bitfield_resize(peer, index + 1)) { return false; }
+
+                peer->bitfield[index / 8] |= 1 << (7 - (index % 8));
+                break;
+            }
+            if (index >= picker->pieces_length) { return false; }
+
+            if (!torrent_peer_has_piece(peer, index)) {
+                peer->bitfield[index / 8] |= 1 << (7 - (index % 8));
+                torrent_picker_availability_have(picker, index);
+                if (downloader->super_seed) { torrent_downloader_super_seed_have(downloader, peer, index); }
+            }
+        } break;
+        case TORRENT_PEER_MESSAGE_BITFIELD: {
+            // kept as is until the metadata tells us how long it should be
+            if (!picker) {
+                if (message->payload_length > (torrent_downloader_metadata_pieces_max(downloader) + 7) / 8) { return false; }
+                if (!torrent_peer_bitfield_resize(peer, message->payload_length * 8)) { return false; }
+
+                memcpy(peer->bitfield, message->payload, peer->bitfield_length);
+                break;
+            }
+            if (message->payload_length != peer->bitfield_length) { return false; }
+
+            torrent_picker_availability_remove(picker, peer->bitfield, peer->bitfield_length);
+            memcpy(peer->bitfield, message->payload, peer->bitfield_length);
+            torrent_picker_availability_add(picker, peer->bitfield, peer->bitfield_length);
+        } break;
+        case TORRENT_PEER_MESSAGE_REQUEST: return torrent_downloader_request_handle(downloader, peer, message);
+        case TORRENT_PEER_MESSAGE_PIECE: return torrent_downloader_block_handle(downloader, peer, message);
+        case TORRENT_PEER_MESSAGE_SUGGEST_PIECE: {
+            if (!peer->supports_fast || message->payload_length != 4) { return false; }
+
+            u32 index = buffer_read_big_endian(message->payload);
+            if (picker && index >= picker->pieces_length) { return false; }
+
+            torrent_fast_suggested_add(&peer->fast, index);
+        } break;
+        case TORRENT_PEER_MESSAGE_HAVE_ALL: {
+            if (!peer->supports_fast || message->payload_length != 0) { return false; }
+
+            // without metadata we can't size the bitfield yet
+            if (!picker) {
+                peer->fast.have_all = true;
+                break;
+            }
+
+            // sized first so every byte gets filled, the second resize clears the spare bits
+            if (!torrent_peer_bitfield_resize(peer, picker->pieces_length)) { return false; }
+            torrent_picker_availability_remove(picker, peer->bitfield, peer->bitfield_length);
+            memset(peer->bitfield, 0xFF, peer->bitfield_length);
+            torrent_peer_bitfield_resize(peer, picker->pieces_length);
+            torrent_picker_availability_add(picker, peer->bitfield, peer->bitfield_length);
+        } break;
+        case TORRENT_PEER_MESSAGE_HAVE_NONE: {
+            if (!peer->supports_fast || message->payload_length != 0) { return false; }
+        } break;
+        case TORRENT_PEER_MESSAGE_REJECT_REQUEST: return torrent_downloader_reject_handle(downloader, peer, message);
+        case TORRENT_PEER_MESSAGE_ALLOWED_FAST: {
+            if (!peer->supports_fast || message->payload_length != 4) { return false; }
+
+            u32 index = buffer_read_big_endian(message->payload);
+            if (picker && index >= picker->pieces_length) { return false; }
+
+            torrent_fast_allowed_add(&peer->fast, index);
+        } break;
+        case TORRENT_PEER_MESSAGE_EXTENDED: return torrent_downloader_extended_handle(downloader, peer, message);
+        case TORRENT_PEER_MESSAGE_HASH_REQUEST:
+        case TORRENT_PEER_MESSAGE_HASHES:
+        case TORRENT_PEER_MESSAGE_HASH_REJECT: return torrent_downloader_hash_message_handle(downloader, peer, message);
+        case TORRENT_PEER_MESSAGE_CANCEL: return torrent_downloader_cancel_handle(peer, message);
+        default: break; // ports and unknown messages need nothing from us
+    }
+
+    return true;
+}
+
+/*
+ * serves peers the choker unchoked, and choked peers only for the allowed fast pieces we
+ * granted them. requests queue up to the reqq we advertise and are served as the peer reads
+ * what we sent. fast peers get every other request rejected, the rest are ignored
+ */
+static bool torrent_downloader_request_handle(TorrentDownloader* downloader, TorrentPeer* peer, TorrentPeerMessage* message) {
+    if (message->payload_length != 12) { return false; }
+
+    u32 index = buffer_read_big_endian(message->payload);
+    u32 begin = buffer_read_big_endian(message->payload + 4);
+    u32 length = buffer_read_big_endian(message->payload + 8);
+
+    // a choked peer only gets the pieces it was allowed fast, others are rejected or, without fast, dropped
+    TorrentPicker* picker = downloader->picker;
+    bool allowed = !peer->am_choking || (peer->supports_fast && torrent_fast_is_granted(&peer->fast, index));
+    bool servable = picker && allowed && torrent_picker_has(picker, index)
+        && length > 0 && length <= TORRENT_PEER_BLOCK_LENGTH && begin < picker->pieces[index].length
+        && length <= picker->pieces[index].length - begin;
+    if (!servable || peer->uploads_length == TORRENT_PEER_UPLOADS_MAX) {
+        return peer->supports_fast ? torrent_peer_send_reject(peer, index, begin, length) : true;
+    }
+
+    peer->uploads[peer->uploads_length] = (TorrentPeerRequest) { .index = index, .begin = begin, .length = length };
+    peer->uploads_length++;
+
+    return torrent_downloader_uploads_send(downloader, peer);
+}
+
+/* a queued request is dropped, fast peers get a reject for it (BEP 6) */
+static bool torrent_downloader_cancel_handle(TorrentPeer* peer, TorrentPeerMessage* message) {
+    if (message->payload_length != 12) { return false; }
+
+    u32 index = buffer_read_big_endian(message->payload);
+    u32 begin = buffer_read_big_endian(message->payload + 4);
+    u32 length = buffer_read_big_endian(message->payload + 8);
+
+    for (usize i = 0; i < peer->uploads_length; i++) {
+        TorrentPeerRequest* upload = &peer->uploads[i];
+        if (upload->index != index || upload->begin != begin || upload->length != length) { continue; }
+
+        memmove(upload, upload + 1, sizeof(TorrentPeerRequest) * (peer->uploads_length - i - 1));
+        peer->uploads_length--;
+        return peer->supports_fast ? torrent_peer_send_reject(peer, index, begin, length) : true;
+    }
+
+    return true;
+}
+
+/* reads and sends queued blocks, oldest first, until TORRENT_PEER_OUTPUT_MAX is waiting for the peer to read */
+static bool torrent_downloader_uploads_send(TorrentDownloader* downloader, TorrentPeer* peer) {
+    usize sent = 0;
+    while (sent < peer->uploads_length && torrent_peer_output_unsent(peer) < TORRENT_PEER_OUTPUT_MAX) {
+        TorrentPeerRequest* upload = &peer->uploads[sent];
+        sent++;
+
+        u8 block[TORRENT_PEER_BLOCK_LENGTH];
+        if (!torrent_storage_read(downloader->storage, upload->index, upload->begin, block, upload->length)) {
+            log_peer_error("DOWNLOADER", peer->ip, peer->port, "Failed to read block %u:%u!", upload->index, upload->begin);
+            if (peer->supports_fast && !torrent_peer_send_reject(peer, upload->index, upload->begin, upload->length)) { return false; }
+            continue;
+        }
+
+        peer->bytes_uploaded += upload->length;
+        downloader->bytes_uploaded += upload->length;
+        torrent_metrics_count(TORRENT_METRICS_BYTES_UPLOADED, upload->length);
+
+        if (!torrent_peer_send_piece(peer, upload->index, upload->begin, block, upload->length)) { return false; }
+    }
+
+    memmove(peer->uploads, peer->uploads + sent, sizeof(TorrentPeerRequest) * (peer->uploads_length - sent));
+    peer->uploads_length -= sent;
+    return true;
+}
+
+/* chokes the peer, what it queued goes except for allowed fast pieces. fast peers get a reject for each */
+static bool torrent_downloader_uploads_choke(TorrentPeer* peer) {
+    if (!torrent_peer_send_choke(peer, true)) { return false; }
+
+    usize kept = 0;
+    for (usize i = 0; i < peer->uploads_length; i++) {
+        TorrentPeerRequest* upload = &peer->uploads[i];
+        if (peer->supports_fast && torrent_fast_is_granted(&peer->fast, upload->index)) {
+            peer->uploads[kept] = *upload;
+            kept++;
+            continue;
+        }
+
+        if (peer->supports_fast && !torrent_peer_send_reject(peer, upload->index, upload->begin, upload->length)) { return false; }
+    }
+    peer->uploads_length = kept;
+
+    return true;
+}
+
+/* the block goes back to the picker right away instead of waiting for the request timeout */
+static bool torrent_downloader_reject_handle(TorrentDownloader* downloader, TorrentPeer* peer, TorrentPeerMessage* message) {
+    if (!peer->supports_fast || message->payload_length != 12) { return false; }
+
+    u32 index = buffer_read_big_endian(message->payload);
+    u32 begin = buffer_read_big_endian(message->payload + 4);
+    torrent_metrics_count(TORRENT_METRICS_BLOCKS_REJECTED, 1);
+
+    for (usize i = 0; i < peer->requests_length; i++) {
+        if (peer->requests[i].index == index && peer->requests[i].begin == begin) {
+            torrent_picker_block_release(downloader->picker, index, begin);
+            memmove(&peer->requests[i], &peer->requests[i + 1], sizeof(TorrentPeerRequest) * (peer->requests_length - i - 1));
+            peer->requests_length--;
+            break;
+        }
+    }
+
+    return true;
+}
+
+static bool torrent_downloader_block_handle(TorrentDownloader* downloader, TorrentPeer* peer, TorrentPeerMessage* message) {
+    if (message->payload_length < 8) { return false; }
+    if (!downloader->picker) { return true; } // nothing can have been requested yet
+
+    u32 index = buffer_read_big_endian(message->payload);
+    u32 begin = buffer_read_big_endian(message->payload + 4);
+    u8* block = message->payload + 8;
+    u32 block_length = message->payload_length - 8;
+
+    for (usize i = 0; i < peer->requests_length; i++) {
+        if (peer->requests[i].index == index && peer->requests[i].begin == begin) {
+            torrent_metrics_record(TORRENT_METRICS_BLOCK_LATENCY, time_now_us() - peer->requests[i].sent_at_us);
+            memmove(&peer->requests[i], &peer->requests[i + 1], sizeof(TorrentPeerRequest) * (peer->requests_length - i - 1));
+            peer->requests_length--;
+            break;
+        }
+    }
+
+    peer->bytes_downloaded += block_length;
+    torrent_metrics_count(TORRENT_METRICS_BLOCKS_RECEIVED, 1);
+    torrent_metrics_count(TORRENT_METRICS_BYTES_DOWNLOADED, block_length);
+
+    if (!torrent_downloader_block_store(downloader, peer, index, begin, block, block_length)) {
+        log_peer_warn("DOWNLOADER", peer->ip, peer->port, "Block %u:%u failed hash verification!", index, begin);
+    }
+
+    return true;
+}
+
+static bool torrent_downloader_extended_handle(TorrentDownloader* downloader, TorrentPeer* peer, TorrentPeerMessage* message) {
+    if (message->payload_length < 1) { return false; }
+
+    u8 extension_id = message->payload[0];
+    u8* payload = message->payload + 1;
+    usize payload_length = message->payload_length - 1;
+
+    switch (extension_id) {
+        case TORRENT_EXTENSION_HANDSHAKE_ID: {
+            if (payload_length > TORRENT_EXTENSION_MESSAGE_MAX) { return false; }
+            return torrent_extension_handshake_handle(peer, payload, payload_length);
+        }
+        case TORRENT_EXTENSION_UT_METADATA_ID: return torrent_metadata_exchange_handle(downloader->metadata_exchange, peer, payload, payload_length);
+        case TORRENT_EXTENSION_UT_PEX_ID: {
+            if (payload_length > TORRENT_EXTENSION_MESSAGE_MAX) { return false; }
+
+            TorrentTrackerPeer added[TORRENT_PEX_ADDED_MAX];
+            usize added_length = torrent_pex_parse(peer, payload, payload_length, added, TORRENT_PEX_ADDED_MAX);
+            for (usize i = 0; i < added_length; i++) {
+                torrent_downloader_candidate_add(downloader, added[i].ip, added[i].port);
+            }
+        } break;
+        default: break; // extensions we never advertised
+    }
+
+    return true;
+}
+
+/* hash requests are rejected while we have nothing to serve them from (BEP 52) */
+static bool torrent_downloader_hash_message_handle(TorrentDownloader* downloader, TorrentPeer* peer, TorrentPeerMessage* message) {
+    if (!peer->supports_v2) { return false; }
+
+    TorrentHashExchange* exchange = downloader->hash_exchange;
+    switch (message->id) {
+        case TORRENT_PEER_MESSAGE_HASH_REQUEST: {
+            if (exchange) { return torrent_hash_exchange_request_handle(exchange, peer, message->payload, message->payload_length); }
+
+            TorrentMerkleRequest request;
+            if (!torrent_merkle_request_parse(message->payload, message->payload_length, &request)) { return false; }
+            return torrent_peer_send_hash_reject(peer, &request);
+        }
+        case TORRENT_PEER_MESSAGE_HASHES: {
+            if (!exchange) { return true; }
+            if (!torrent_hash_exchange_hashes_handle(exchange, peer, message->payload, message->payload_length)) { return false; }
+
+            torrent_downloader_pieces_unverified_finish(downloader);
+            return true;
+        }
+        case TORRENT_PEER_MESSAGE_HASH_REJECT: return !exchange || torrent_hash_exchange_reject_handle(exchange, message->payload, message->payload_length);
+        default: return true;
+    }
+}
+
+/*
+ * hands a block from a peer or a web seed (sender NULL) to the picker, remembering who sent it.
+ * false when it failed its v2 block hash, the peer is banned for that
+ */
+static bool torrent_downloader_block_store(TorrentDownloader* downloader, TorrentPeer* sender, u32 index, u32 begin, const u8* block, u32 block_length) {
+    // a raced block only needs to arrive once
+    if (downloader->picker->window_length > 0) { torrent_downloader_block_cancel(downloader, sender, index, begin); }
+
+    // a v2 block is checked on its own, so only it has to be fetched again and we know exactly who sent it
+    if (downloader->hash_exchange && !torrent_hash_exchange_block_verify(downloader->hash_exchange, index, begin, block, block_length)) {
+        torrent_metrics_count(TORRENT_METRICS_BLOCKS_FAILED, 1);
+        torrent_picker_block_release(downloader->picker, index, begin);
+        if (sender) { torrent_downloader_peer_ban(downloader, sender->ip, "sent a block that failed its hash"); }
+        return false;
+    }
+
+    if (sender && sender->smart_ban_source == 0) { sender->smart_ban_source = torrent_smart_ban_source(downloader->smart_ban, sender->ip); }
+
+    // blocks we never asked for, or that arrived after a timeout handed them to someone else, are dropped
+    bool piece_finished;
+    u32 source = sender ? sender->smart_ban_source : 0;
+    if (torrent_picker_block_receive(downloader->picker, index, begin, block, block_length, source, &piece_finished) && piece_finished) {
+        torrent_downloader_piece_finish(downloader, index);
+    }
+
+    return true;
+}
+
+/* the v2 piece hash is preferred where there is one, hybrid torrents fall back to SHA-1 while it isn't known */
+static void torrent_downloader_piece_finish(TorrentDownloader* downloader, u32 index) {
+    TorrentPicker* picker = downloader->picker;
+    TorrentPiece* piece = &picker->pieces[index];
+    TorrentMetadataInfo* info = &downloader->metadata->info;
+
+    // a web seed's piece can be finished by a peer's racing blocks, whatever happens to it now isn't the seed's
+    for (usize i = 0; i < downloader->web_seeds_length; i++) {
+        torrent_web_seed_piece_forget(downloader->web_seeds[i], index);
+    }
+
+    i64 started_us = time_now_us();
+    bool valid = false;
+    if (!downloader->hash_exchange || !torrent_hash_exchange_piece_verify(downloader->hash_exchange, index, piece->data, &valid)) {
+        if (!info->pieces) {
+            // a v2 piece can finish before its piece layer arrives, it stays partial with all
+            // its data until torrent_downloader_pieces_unverified_finish tries it again
+            log_info("DOWNLOADER", "Piece %u is kept until its piece layer arrives", index);
+            return;
+        }
+
+        u8 hash[SHA_DIGEST_LENGTH];
+        SHA1(piece->data, piece->length, hash);
+        valid = memcmp(hash, info->pieces[index], SHA_DIGEST_LENGTH) == 0;
+    }
+    torrent_metrics_record(TORRENT_METRICS_HASH_TIME, time_now_us() - started_us);
+
+    if (!valid) {
+        log_warn("DOWNLOADER", "Piece %u failed hash verification!", index);
+        torrent_metrics_count(TORRENT_METRICS_PIECES_FAILED, 1);
+
+        // the blocks are kept by hash until a good copy shows which of them were bad
+        u32 culprit = torrent_smart_ban_piece_failed(downloader->smart_ban, index, piece->data, piece->length, piece->sources, piece->blocks_length);
+        if (culprit != 0) { torrent_downloader_peer_ban(downloader, torrent_smart_ban_source_ip(downloader->smart_ban, culprit), "sent every block of a piece that failed its hash"); }
+
+        torrent_picker_piece_reset(picker, index);
+        return;
+    }
+
+    u32 culprits[TORRENT_DOWNLOADER_CULPRITS_MAX];
+    usize culprits_length = torrent_smart_ban_piece_passed(downloader->smart_ban, index, piece->data, piece->length, culprits, TORRENT_DOWNLOADER_CULPRITS_MAX);
+    for (usize i = 0; i < culprits_length; i++) {
+        torrent_downloader_peer_ban(downloader, torrent_smart_ban_source_ip(downloader->smart_ban, culprits[i]), "sent a block that differs from the verified piece");
+    }
+
+    started_us = time_now_us();
+    bool written = torrent_storage_write(downloader->storage, index, 0, piece->data, piece->length);
+    torrent_metrics_record(TORRENT_METRICS_DISK_WRITE_TIME, time_now_us() - started_us);
+
+    if (!written) {
+        log_error("DOWNLOADER", "Failed to write piece %u!", index);
+        torrent_metrics_count(TORRENT_METRICS_PIECES_FAILED, 1);
+        torrent_picker_piece_reset(picker, index);
+        return;
+    }
+
+    torrent_metrics_count(TORRENT_METRICS_PIECES_VERIFIED, 1);
+    if (downloader->hash_exchange) {
+        torrent_hash_exchange_piece_done(downloader->hash_exchange, index);
+        torrent_downloader_duplicates_complete(downloader, index, piece->data, piece->length);
+    }
+
+    torrent_downloader_piece_complete(downloader, index);
+}
+
+/* verifies the pieces that got all their blocks before there was a hash to check them against */
+static void torrent_downloader_pieces_unverified_finish(TorrentDownloader* downloader) {
+    TorrentPicker* picker = downloader->picker;
+
+    // finishing a piece swaps the last partial one into its place, so walk from the end. its
+    // duplicates finish with it and can shorten the list further
+    for (u32 i = picker->partial_length; i > 0; i--) {
+        if (i > picker->partial_length) { continue; }
+
+        TorrentPiece* piece = &picker->pieces[picker->partial[i - 1]];
+        if (piece->blocks_received == piece->blocks_length) { torrent_downloader_piece_finish(downloader, picker->partial[i - 1]); }
+    }
+}
+
+/* marks a written piece as ours and tells everyone about it */
+static void torrent_downloader_piece_complete(TorrentDownloader* downloader, u32 index) {
+    TorrentPicker* picker = downloader->picker;
+    torrent_picker_piece_complete(picker, index);
+    log_info("DOWNLOADER", "Piece %u verified (%u/%u)", index, picker->pieces_completed, picker->pieces_length);
+
+    if (downloader->stream) { torrent_stream_piece_verified(downloader->stream, index); }
+
+    for (usize i = 0; i < downloader->peers_length; i++) {
+        TorrentPeer* peer = downloader->peers[i];
+        if (peer->state != TORRENT_PEER_CONNECTED) { continue; }
+
+        bool success = torrent_peer_send_have(peer, index);
+        if (success && peer->supports_fast && torrent_fast_is_granted(&peer->fast, index)) {
+            success = torrent_peer_send_allowed_fast(peer, index);
+        }
+
+        if (!success) {
+            torrent_downloader_peer_disconnect(downloader, peer);
+        }
+    }
+}
+
+/*
+ * v2 files with the same root have the same contents, so a verified piece of one is
+ * written to the others as well. their last pieces may differ in padding, which is zeros
+ */
+static void torrent_downloader_duplicates_complete(TorrentDownloader* downloader, u32 index, const u8* data, u32 length) {
+    TorrentPicker* picker = downloader->picker;
+
+    u32 duplicates[TORRENT_DOWNLOADER_DUPLICATES_MAX];
+    usize duplicates_length = torrent_hash_exchange_duplicates(downloader->hash_exchange, index, duplicates, TORRENT_DOWNLOADER_DUPLICATES_MAX);
+    for (usize i = 0; i < duplicates_length; i++) {
+        u32 duplicate = duplicates[i];
+        if (duplicate >= picker->pieces_length || torrent_picker_has(picker, duplicate)) { continue; }
+
+        // past the shorter of the two there is only padding, which is never written
+        u32 duplicate_length = (picker->pieces[duplicate].length < length) ? picker->pieces[duplicate].length : length;
+        if (!torrent_storage_write(downloader->storage, duplicate, 0, data, duplicate_length)) {
+            log_error("DOWNLOADER", "Failed to write piece %u!", duplicate);
+            continue;
+        }
+
+        torrent_hash_exchange_piece_done(downloader->hash_exchange, duplicate);
+        torrent_downloader_piece_complete(downloader, duplicate);
+    }
+}
+
+/* cancels the copies of a raced block that other peers still owe us */
+static void torrent_downloader_block_cancel(TorrentDownloader* downloader, TorrentPeer* receiver, u32 index, u32 begin) {
+    for (usize i = 0; i < downloader->peers_length; i++) {
+        TorrentPeer* peer = downloader->peers[i];
+        if (peer == receiver || peer->state != TORRENT_PEER_CONNECTED) { continue; }
+
+        for (usize j = 0; j < peer->requests_length; j++) {
+            if (peer->requests[j].index != index || peer->requests[j].begin != begin) { continue; }
+
+            u32 length = peer->requests[j].length;
+            memmove(&peer->requests[j], &peer->requests[j + 1], sizeof(TorrentPeerRequest) * (peer->requests_length - j - 1));
+            peer->requests_length--;
+
+            if (!torrent_peer_send_cancel(peer, index, begin, length)) {
+                torrent_downloader_peer_disconnect(downloader, peer);
+            }
+            break;
+        }
+    }
+}
+
+static bool torrent_downloader_stream_start(TorrentDownloader* downloader) {
+    TorrentPicker* picker = downloader->picker;
+    if (!torrent_stream_start(downloader->stream, downloader->storage, picker->piece_length, picker->length, picker->bitfield, picker->bitfield_length)) { return false; }
+
+    torrent_downloader_stream_update(downloader);
+    return true;
+}
+
+/* keeps the picker's window on the pieces just ahead of the reader, the rest of the torrent is still picked rarest first */
+static void torrent_downloader_stream_update(TorrentDownloader* downloader) {
+    TorrentPicker* picker = downloader->picker;
+
+    u32 cursor_piece;
+    if (!torrent_stream_cursor_piece(downloader->stream, &cursor_piece)) {
+        if (picker->window_length > 0) { torrent_picker_window_set(picker, 0, 0, 0, 0); }
+        return;
+    }
+
+    // completed pieces at the front need no deadline, the window starts at the first missing one
+    while (cursor_piece < picker->pieces_length && torrent_picker_has(picker, cursor_piece)) { cursor_piece++; }
+    if (cursor_piece == picker->window_begin && picker->window_length > 0) { return; }
+
+    torrent_picker_window_set(picker, cursor_piece, TORRENT_STREAM_WINDOW_PIECES, time_now_ms() + TORRENT_STREAM_DEADLINE_MS, TORRENT_STREAM_DEADLINE_STEP_MS);
+}
+
+/* smooths every peer's download rate and finds how fast a peer has to be to race late blocks */
+static void torrent_downloader_rates_update(TorrentDownloader* downloader) {
+    u32 fastest[TORRENT_STREAM_RACE_PEERS] = {0};
+
+    for (usize i = 0; i < downloader->peers_length; i++) {
+        TorrentPeer* peer = downloader->peers[i];
+        if (peer->state != TORRENT_PEER_CONNECTED) { continue; }
+
+        u64 delta = peer->bytes_downloaded - peer->download_rate_mark;
+        peer->download_rate_mark = peer->bytes_downloaded;
+        peer->download_rate = (u32) (((u64) peer->download_rate * 3 + delta) / 4);
+
+        // insertion into the top TORRENT_STREAM_RACE_PEERS, kept in descending order
+        u32 rate = peer->download_rate;
+        for (usize j = 0; j < TORRENT_STREAM_RACE_PEERS; j++) {
+            if (rate <= fastest[j]) { continue; }
+
+            u32 displaced = fastest[j];
+            fastest[j] = rate;
+            rate = displaced;
+        }
+    }
+
+    downloader->race_rate_min = fastest[TORRENT_STREAM_RACE_PEERS - 1];
+}
+
+/* /metrics in the prometheus text format, /metrics.json as the same json the snapshots hold */
+static void torrent_downloader_metrics_serve(TorrentDownloader* downloader) {
+    char path[64];
+    i32 client;
+    while ((client = torrent_metrics_server_accept(downloader->metrics_server, path, sizeof(path))) != -1) {
+        TorrentMetricsText text = {0};
+        if (strcmp(path, "/metrics") == 0 && torrent_downloader_metrics_prometheus_write(downloader, &text)) {
+            torrent_metrics_server_respond(client, "200 OK", "text/plain; version=0.0.4", &text);
+        } else if (strcmp(path, "/metrics.json") == 0 && torrent_downloader_metrics_json_write(downloader, &text)) {
+            torrent_metrics_server_respond(client, "200 OK", "application/json", &text);
+        } else {
+            text.length = 0;
+            torrent_metrics_text_append(&text, "not found\n");
+            torrent_metrics_server_respond(client, "404 Not Found", "text/plain", &text);
+        }
+        torrent_metrics_text_destroy(&text);
+    }
+}
+
+static void torrent_downloader_metrics_snapshot(TorrentDownloader* downloader) {
+    if (!downloader->metrics_snapshot_path) { return; }
+
+    TorrentMetricsText text = {0};
+    if (torrent_downloader_metrics_json_write(downloader, &text)) {
+        torrent_metrics_snapshot_save(downloader->metrics_snapshot_path, &text);
+    }
+    torrent_metrics_text_destroy(&text);
+}
+
+/* the torrent's gauges and one series per connected peer, followed by the registry */
+static bool torrent_downloader_metrics_prometheus_write(TorrentDownloader* downloader, TorrentMetricsText* text) {
+    usize states[TORRENT_PEER_DISCONNECTED + 1] = {0};
+    for (usize i = 0; i < downloader->peers_length; i++) {
+        states[downloader->peers[i]->state]++;
+    }
+
+    TorrentPicker* picker = downloader->picker;
+    bool success = torrent_metrics_text_append(text,
+        "# HELP torrent_pieces Pieces in the torrent, 0 until the metadata is known.\n# TYPE torrent_pieces gauge\ntorrent_pieces %u\n"
+        "# HELP torrent_pieces_completed Pieces verified and written.\n# TYPE torrent_pieces_completed gauge\ntorrent_pieces_completed %u\n"
+        "# HELP torrent_peers Open peer connections by state.\n# TYPE torrent_peers gauge\n"
+        "torrent_peers{state=\"connecting\"} %zu\ntorrent_peers{state=\"handshaking\"} %zu\ntorrent_peers{state=\"connected\"} %zu\n"
+        "# HELP torrent_peer_candidates Addresses known for the torrent.\n# TYPE torrent_peer_candidates gauge\ntorrent_peer_candidates %zu\n",
+        picker ? picker->pieces_length : 0, picker ? picker->pieces_completed : 0,
+        states[TORRENT_PEER_CONNECTING], states[TORRENT_PEER_HANDSHAKING], states[TORRENT_PEER_CONNECTED], downloader->peer_store->entries_length);
+
+    if (success) {
+        success = torrent_metrics_text_append(text,
+            "# HELP torrent_peer_downloaded_bytes Block bytes received from the peer.\n# TYPE torrent_peer_downloaded_bytes gauge\n");
+    }
+    for (usize i = 0; i < downloader->peers_length && success; i++) {
+        TorrentPeer* peer = downloader->peers[i];
+        if (peer->state != TORRENT_PEER_CONNECTED) { continue; }
+        success = torrent_metrics_text_append(text, "torrent_peer_downloaded_bytes{peer=\"%s:%s\"} %llu\n", peer->ip, peer->port, (unsigned long long) peer->bytes_downloaded);
+    }
+
+    if (success) {
+        success = torrent_metrics_text_append(text,
+            "# HELP torrent_peer_uploaded_bytes Block bytes sent to the peer.\n# TYPE torrent_peer_uploaded_bytes gauge\n");
+    }
+    for (usize i = 0; i < downloader->peers_length && success; i++) {
+        TorrentPeer* peer = downloader->peers[i];
+        if (peer->state != TORRENT_PEER_CONNECTED) { continue; }
+        success = torrent_metrics_text_append(text, "torrent_peer_uploaded_bytes{peer=\"%s:%s\"} %llu\n", peer->ip, peer->port, (unsigned long long) peer->bytes_uploaded);
+    }
+
+    if (success) {
+        success = torrent_metrics_text_append(text,
+            "# HELP torrent_peer_requests Block requests outstanding with the peer.\n# TYPE torrent_peer_requests gauge\n");
+    }
+    for (usize i = 0; i < downloader->peers_length && success; i++) {
+        TorrentPeer* peer = downloader->peers[i];
+        if (peer->state != TORRENT_PEER_CONNECTED) { continue; }
+        success = torrent_metrics_text_append(text, "torrent_peer_requests{peer=\"%s:%s\"} %zu\n", peer->ip, peer->port, peer->requests_length);
+    }
+
+    if (success) {
+        success = torrent_metrics_text_append(text,
+            "# HELP torrent_peer_choking Whether the peer is choking us.\n# TYPE torrent_peer_choking gauge\n");
+    }
+    for (usize i = 0; i < downloader->peers_length && success; i++) {
+        TorrentPeer* peer = downloader->peers[i];
+        if (peer->state != TORRENT_PEER_CONNECTED) { continue; }
+        success = torrent_metrics_text_append(text, "torrent_peer_choking{peer=\"%s:%s\"} %u\n", peer->ip, peer->port, peer->peer_choking ? 1 : 0);
+    }
+
+    return success && torrent_metrics_prometheus_write(text);
+}
+
+static bool torrent_downloader_metrics_json_write(TorrentDownloader* downloader, TorrentMetricsText* text) {
+    usize states[TORRENT_PEER_DISCONNECTED + 1] = {0};
+    for (usize i = 0; i < downloader->peers_length; i++) {
+        states[downloader->peers[i]->state]++;
+    }
+
+    TorrentPicker* picker = downloader->picker;
+    bool success = torrent_metrics_text_append(text,
+        "{\"time_ms\":%lld,\"torrent\":{\"info_hash\":\"%s\",\"pieces\":%u,\"pieces_completed\":%u,"
+        "\"peers\":{\"connecting\":%zu,\"handshaking\":%zu,\"connected\":%zu},\"peer_candidates\":%zu},\"peers\":[",
+        (long long) time_now_ms(), downloader->info_hash_hex, picker ? picker->pieces_length : 0, picker ? picker->pieces_completed : 0,
+        states[TORRENT_PEER_CONNECTING], states[TORRENT_PEER_HANDSHAKING], states[TORRENT_PEER_CONNECTED], downloader->peer_store->entries_length);
+
+    bool first = true;
+    for (usize i = 0; i < downloader->peers_length && success; i++) {
+        TorrentPeer* peer = downloader->peers[i];
+        if (peer->state != TORRENT_PEER_CONNECTED) { continue; }
+
+        success = torrent_metrics_text_append(text, "%s{\"peer\":\"%s:%s\",\"downloaded_bytes\":%llu,\"uploaded_bytes\":%llu,\"requests\":%zu,\"choking\":%s}",
+            first ? "" : ",", peer->ip, peer->port, (unsigned long long) peer->bytes_downloaded, (unsigned long long) peer->bytes_uploaded,
+            peer->requests_length, peer->peer_choking ? "true" : "false");
+        first = false;
+    }
+
+    success = success && torrent_metrics_text_append(text, "],\"metrics\":");
+    success = success && torrent_metrics_json_write(text);
+    return success && torrent_metrics_text_append(text, "}");
 }
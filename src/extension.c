@@ -0,0 +1,146 @@
+#include "extension.h"
+
+#include <string.h>
+
+#include "bencode.h"
+#include "peer.h"
+#include "types.h"
+#include "utils/log.h"
+
+#define TORRENT_EXTENSION_CLIENT_NAME "bittorrent-client"
+
+typedef struct TorrentExtensionHandshake {
+    u16 listen_port;
+    u32 metadata_size;
+} TorrentExtensionHandshake;
+
+static void torrent_extension_handshake_write(BencodeWriter* writer, const void* context);
+static u8 torrent_extension_id_get(BencodeObject* extension_ids, const char* name);
+
+/* metadata_size is 0 while we don't have the info dictionary ourselves */
+bool torrent_extension_handshake_send(TorrentPeer* peer, u16 listen_port, u32 metadata_size) {
+    TorrentExtensionHandshake handshake = { .listen_port = listen_port, .metadata_size = metadata_size };
+    return torrent_extension_message_encode(peer, TORRENT_EXTENSION_HANDSHAKE_ID, torrent_extension_handshake_write, &handshake, NULL, 0);
+}
+
+bool torrent_extension_handshake_handle(TorrentPeer* peer, const u8* payload, usize payload_length) {
+    usize index = 0;
+    BencodeObject* handshake = bencode_object_parse((u8*) payload, payload_length, &index);
+    if (!handshake || handshake->type != DICTIONARY) {
+        log_peer_warn("EXTENSION", peer->ip, peer->port, "[HANDSHAKE] Handshake is invalid!");
+        if (handshake) { bencode_object_destroy(handshake); }
+        return false;
+    }
+
+    TorrentExtensions* extensions = &peer->extensions;
+    extensions->handshake_received = true;
+
+    // a later handshake only updates what it mentions, but m is always complete
+    BencodeObject* extension_ids = bencode_object_dictionary_get(handshake, "m");
+    if (extension_ids && extension_ids->type == DICTIONARY) {
+        extensions->ut_pex = torrent_extension_id_get(extension_ids, "ut_pex");
+        extensions->ut_metadata = torrent_extension_id_get(extension_ids, "ut_metadata");
+    }
+
+    BencodeObject* metadata_size = bencode_object_dictionary_get(handshake, "metadata_size");
+    if (metadata_size && metadata_size->type == INTEGER && metadata_size->number > 0) {
+        extensions->metadata_size = metadata_size->number;
+    }
+
+    BencodeObject* listen_port = bencode_object_dictionary_get(handshake, "p");
+    if (listen_port && listen_port->type == INTEGER && listen_port->number > 0 && listen_port->number <= 65535) {
+        extensions->listen_port = listen_port->number;
+    }
+
+    BencodeObject* request_queue_length = bencode_object_dictionary_get(handshake, "reqq");
+    if (request_queue_length && request_queue_length->type == INTEGER && request_queue_length->number > 0) {
+        extensions->request_queue_length = request_queue_length->number;
+    }
+
+    BencodeObject* client = bencode_object_dictionary_get(handshake, "v");
+    if (client && client->type == STRING) {
+        usize client_length = client->string_length < sizeof(extensions->client) - 1 ? client->string_length : sizeof(extensions->client) - 1;
+        memcpy(extensions->client, client->string, client_length);
+        extensions->client[client_length] = '\0';
+    }
+
+    bencode_object_destroy(handshake);
+    return true;
+}
+
+bool torrent_extension_message_send(TorrentPeer* peer, u8 extension_id, const u8* payload, usize payload_length) {
+    u8* message = torrent_extension_message_reserve(peer, extension_id, payload_length);
+    if (!message) { return false; }
+
+    memcpy(message, payload, payload_length);
+    return torrent_peer_flush(peer);
+}
+
+/* like torrent_peer_message_reserve(), the payload goes right after the extension id */
+u8* torrent_extension_message_reserve(TorrentPeer* peer, u8 extension_id, usize payload_length) {
+    u8* message = torrent_peer_message_reserve(peer, TORRENT_PEER_MESSAGE_EXTENDED, payload_length + 1);
+    if (!message) { return NULL; }
+
+    message[0] = extension_id;
+    return message + 1;
+}
+
+/*
+ * runs write twice, once to measure the dictionary and once to encode it straight into the
+ * send buffer, followed by trailer_length raw bytes (ut_metadata data messages)
+ */
+bool torrent_extension_message_encode(TorrentPeer* peer, u8 extension_id, TorrentExtensionWrite write, const void* context, const u8* trailer, usize trailer_length) {
+    BencodeWriter writer;
+    bencode_writer_init(&writer, NULL, 0);
+    write(&writer, context);
+    if (!bencode_writer_finish(&writer)) {
+        log_error("EXTENSION", "Failed to encode message %u!", extension_id);
+        return false;
+    }
+
+    usize dictionary_length = writer.length;
+    u8* message = torrent_extension_message_reserve(peer, extension_id, dictionary_length + trailer_length);
+    if (!message) { return false; }
+
+    bencode_writer_init(&writer, message, dictionary_length);
+    write(&writer, context);
+    if (trailer_length > 0) { memcpy(message + dictionary_length, trailer, trailer_length); }
+
+    return torrent_peer_flush(peer);
+}
+
+static void torrent_extension_handshake_write(BencodeWriter* writer, const void* context) {
+    const TorrentExtensionHandshake* handshake = (const TorrentExtensionHandshake*) context;
+
+    bencode_writer_dictionary_begin(writer);
+
+    bencode_writer_key(writer, "m");
+    bencode_writer_dictionary_begin(writer);
+    bencode_writer_key(writer, "ut_metadata");
+    bencode_writer_integer(writer, TORRENT_EXTENSION_UT_METADATA_ID);
+    bencode_writer_key(writer, "ut_pex");
+    bencode_writer_integer(writer, TORRENT_EXTENSION_UT_PEX_ID);
+    bencode_writer_end(writer);
+
+    if (handshake->metadata_size != 0) {
+        bencode_writer_key(writer, "metadata_size");
+        bencode_writer_integer(writer, handshake->metadata_size);
+    }
+    if (handshake->listen_port != 0) {
+        bencode_writer_key(writer, "p");
+        bencode_writer_integer(writer, handshake->listen_port);
+    }
+    bencode_writer_key(writer, "reqq");
+    bencode_writer_integer(writer, TORRENT_EXTENSION_REQUEST_QUEUE_LENGTH);
+    bencode_writer_key(writer, "v");
+    bencode_writer_text(writer, TORRENT_EXTENSION_CLIENT_NAME);
+
+    bencode_writer_end(writer);
+}
+
+static u8 torrent_extension_id_get(BencodeObject* extension_ids, const char* name) {
+    BencodeObject* id = bencode_object_dictionary_get(extension_ids, name);
+    if (!id || id->type != INTEGER || id->number <= 0 || id->number > 255) { return 0; }
+
+    return (u8) id->number;
+}
@@ -0,0 +1,81 @@
+#include "fast.h"
+
+#include <arpa/inet.h>
+#include <openssl/sha.h>
+#include <string.h>
+
+#include "types.h"
+#include "utils/buffer.h"
+
+static bool torrent_fast_contains(const u32* pieces, usize pieces_length, u32 index);
+
+/*
+ * the canonical allowed fast set from BEP 6, so both sides of a connection agree on it.
+ * only IPv4 addresses are defined, anything else gets an empty set
+ */
+usize torrent_fast_allowed_set(const char* ip, const u8 info_hash[20], u32 pieces_length, u32* set, usize set_length) {
+    struct in_addr address;
+    if (inet_pton(AF_INET, ip, &address) != 1 || pieces_length == 0) { return 0; }
+
+    if (set_length > pieces_length) { set_length = pieces_length; }
+
+    // the last octet is masked so peers behind the same /24 share a set
+    u8 hash[SHA_DIGEST_LENGTH + 4];
+    memcpy(hash, &address.s_addr, 4);
+    hash[3] = 0;
+    memcpy(hash + 4, info_hash, 20);
+
+    u8 digest[SHA_DIGEST_LENGTH];
+    SHA1(hash, sizeof(hash), digest);
+
+    usize length = 0;
+    while (length < set_length) {
+        for (usize i = 0; i < 5 && length < set_length; i++) {
+            u32 index = buffer_read_big_endian(digest + (i * 4)) % pieces_length;
+            if (torrent_fast_contains(set, length, index)) { continue; }
+
+            set[length] = index;
+            length++;
+        }
+
+        SHA1(digest, sizeof(digest), digest);
+    }
+
+    return length;
+}
+
+/* pieces past TORRENT_FAST_ALLOWED_MAX are dropped, a peer has no reason to allow that many */
+void torrent_fast_allowed_add(TorrentFastState* state, u32 index) {
+    if (state->allowed_length == TORRENT_FAST_ALLOWED_MAX || torrent_fast_contains(state->allowed, state->allowed_length, index)) { return; }
+
+    state->allowed[state->allowed_length] = index;
+    state->allowed_length++;
+}
+
+/* the oldest suggestion makes room for the newest one */
+void torrent_fast_suggested_add(TorrentFastState* state, u32 index) {
+    if (torrent_fast_contains(state->suggested, state->suggested_length, index)) { return; }
+
+    if (state->suggested_length == TORRENT_FAST_SUGGESTED_MAX) {
+        memmove(state->suggested, state->suggested + 1, sizeof(u32) * (TORRENT_FAST_SUGGESTED_MAX - 1));
+        state->suggested_length--;
+    }
+
+    state->suggested[state->suggested_length] = index;
+    state->suggested_length++;
+}
+
+bool torrent_fast_is_allowed(TorrentFastState* state, u32 index) {
+    return torrent_fast_contains(state->allowed, state->allowed_length, index);
+}
+
+bool torrent_fast_is_granted(TorrentFastState* state, u32 index) {
+    return torrent_fast_contains(state->granted, state->granted_length, index);
+}
+
+static bool torrent_fast_contains(const u32* pieces, usize pieces_length, u32 index) {
+    for (usize i = 0; i < pieces_length; i++) {
+        if (pieces[i] == index) { return true; }
+    }
+    return false;
+}
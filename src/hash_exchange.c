@@ -0,0 +1,476 @@
+#include "hash_exchange.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "merkle.h"
+#include "metadata.h"
+#include "metrics.h"
+#include "peer.h"
+#include "picker.h"
+#include "storage.h"
+#include "types.h"
+#include "utils/log.h"
+#include "utils/time.h"
+
+static const u8* torrent_hash_exchange_piece_hash(TorrentHashExchange* exchange, TorrentMetadataInfoFile* file, u32 piece_in_file);
+static u32 torrent_hash_exchange_piece_width(TorrentHashExchange* exchange, TorrentMetadataInfoFile* file);
+static u32 torrent_hash_exchange_piece_bytes(TorrentHashExchange* exchange, TorrentMetadataInfoFile* file, u32 piece_in_file);
+static bool torrent_hash_exchange_layer_known(TorrentMetadataInfoFile* file, u32 from, u32 to);
+static bool torrent_hash_exchange_leaves(const u8* data, u32 length, u8* leaves);
+static bool torrent_hash_exchange_hashes_build(TorrentHashExchange* exchange, const TorrentMerkleRequest* request, u8* hashes);
+static void torrent_hash_exchange_block_hashes_add(TorrentHashExchange* exchange, TorrentPeer* peer, TorrentMetadataInfoFile* file, const TorrentMerkleRequest* request, const u8* hashes);
+static void torrent_hash_exchange_layer_add(TorrentHashExchange* exchange, TorrentPeer* peer, TorrentMetadataInfoFile* file, const TorrentMerkleRequest* request, const u8* hashes);
+static inline bool torrent_hash_exchange_is_zero(const u8* hash);
+
+/* metadata, picker and storage must outlive the exchange */
+TorrentHashExchange* torrent_hash_exchange_create(TorrentMetadata* metadata, TorrentPicker* picker, TorrentStorage* storage) {
+    TorrentHashExchange* exchange = (TorrentHashExchange*) malloc(sizeof(TorrentHashExchange));
+    if (!exchange) {
+        log_error("HASH EXCHANGE", "Failed to allocate memory for hash exchange!");
+        return NULL;
+    }
+
+    memset(exchange, 0, sizeof(TorrentHashExchange));
+    exchange->metadata = metadata;
+    exchange->picker = picker;
+    exchange->storage = storage;
+
+    exchange->piece_blocks = metadata->info.piece_length / TORRENT_MERKLE_BLOCK_LENGTH;
+    exchange->piece_layer = torrent_merkle_layers(exchange->piece_blocks);
+    torrent_merkle_pad_hash(exchange->piece_layer, exchange->piece_pad);
+
+    usize pieces_length = picker->pieces_length > 0 ? picker->pieces_length : 1;
+    exchange->piece_files = (TorrentMetadataInfoFile**) calloc(pieces_length, sizeof(TorrentMetadataInfoFile*));
+    exchange->block_hashes = (u8**) calloc(pieces_length, sizeof(u8*));
+    exchange->hashes_requested = (i64*) calloc(pieces_length, sizeof(i64));
+    exchange->layers_requested = (i64*) calloc(pieces_length, sizeof(i64));
+    if (!exchange->piece_files || !exchange->block_hashes || !exchange->hashes_requested || !exchange->layers_requested) {
+        log_error("HASH EXCHANGE", "Failed to allocate memory for piece hashes!");
+        torrent_hash_exchange_destroy(exchange);
+        return NULL;
+    }
+
+    for (usize i = 0; i < metadata->info.files_length; i++) {
+        TorrentMetadataInfoFile* file = &metadata->info.files[i];
+        if (!file->has_pieces_root) { continue; }
+
+        if ((u64) file->first_piece + file->pieces_length > picker->pieces_length) {
+            log_error("HASH EXCHANGE", "File tree does not fit in the torrent's pieces!");
+            torrent_hash_exchange_destroy(exchange);
+            return NULL;
+        }
+
+        for (u32 j = 0; j < file->pieces_length; j++) {
+            exchange->piece_files[file->first_piece + j] = file;
+        }
+    }
+
+    return exchange;
+}
+
+/*
+ * asks the peer for the hashes of a piece's blocks so each one can be checked as it arrives.
+ * nothing is sent if they are known, on their way, or there is no piece hash to prove them
+ * against yet. returns false only if sending failed
+ */
+bool torrent_hash_exchange_piece_request(TorrentHashExchange* exchange, TorrentPeer* peer, u32 index) {
+    if (index >= exchange->picker->pieces_length) { return true; }
+
+    TorrentMetadataInfoFile* file = exchange->piece_files[index];
+    if (!file || exchange->block_hashes[index]) { return true; }
+
+    u32 piece_in_file = index - file->first_piece;
+    if (torrent_hash_exchange_piece_bytes(exchange, file, piece_in_file) <= TORRENT_MERKLE_BLOCK_LENGTH) { return true; }
+    if (!torrent_hash_exchange_piece_hash(exchange, file, piece_in_file)) { return true; }
+
+    i64 now = time_now_ms();
+    if (exchange->hashes_requested[index] != 0 && now - exchange->hashes_requested[index] < TORRENT_HASH_EXCHANGE_REQUEST_TIMEOUT_MS) { return true; }
+
+    TorrentMerkleRequest request = {0};
+    memcpy(request.pieces_root, file->pieces_root, TORRENT_MERKLE_HASH_LENGTH);
+    request.base_layer = 0;
+    request.length = torrent_hash_exchange_piece_width(exchange, file);
+    request.index = piece_in_file * request.length;
+    request.proof_layers = 0;
+
+    exchange->hashes_requested[index] = now;
+    return torrent_peer_send_hash_request(peer, &request);
+}
+
+/* asks for every chunk of a piece layer we don't have and nobody is fetching, with the proof up to the file's root */
+bool torrent_hash_exchange_layers_request(TorrentHashExchange* exchange, TorrentPeer* peer) {
+    i64 now = time_now_ms();
+
+    for (usize i = 0; i < exchange->metadata->info.files_length; i++) {
+        TorrentMetadataInfoFile* file = &exchange->metadata->info.files[i];
+        if (!file->piece_layer) { continue; }
+        if (torrent_metadata_file_find(exchange->metadata, file->pieces_root) != file) { continue; } // an identical file asks for both
+
+        u32 width = (u32) 1 << torrent_merkle_layers(file->pieces_length);
+        u32 chunk_length = (width < TORRENT_HASH_EXCHANGE_LAYER_CHUNK) ? width : TORRENT_HASH_EXCHANGE_LAYER_CHUNK;
+
+        for (u32 begin = 0; begin < file->pieces_length; begin += chunk_length) {
+            // a chunk is proven as a whole, so its first hash tells whether the rest is known
+            if (!torrent_hash_exchange_is_zero(file->piece_layer + ((usize) begin * TORRENT_MERKLE_HASH_LENGTH))) { continue; }
+
+            i64* requested = &exchange->layers_requested[file->first_piece + begin];
+            if (*requested != 0 && now - *requested < TORRENT_HASH_EXCHANGE_REQUEST_TIMEOUT_MS) { continue; }
+
+            TorrentMerkleRequest request = {0};
+            memcpy(request.pieces_root, file->pieces_root, TORRENT_MERKLE_HASH_LENGTH);
+            request.base_layer = exchange->piece_layer;
+            request.index = begin;
+            request.length = chunk_length;
+            request.proof_layers = (chunk_length < width) ? torrent_merkle_layers(width) : 0;
+
+            *requested = now;
+            if (!torrent_peer_send_hash_request(peer, &request)) { return false; }
+        }
+    }
+
+    return true;
+}
+
+/* false only if the block's hash is known and the data doesn't match it, padding always passes */
+bool torrent_hash_exchange_block_verify(TorrentHashExchange* exchange, u32 index, u32 begin, const u8* data, u32 length) {
+    if (index >= exchange->picker->pieces_length || !exchange->block_hashes[index]) { return true; }
+    if (begin % TORRENT_MERKLE_BLOCK_LENGTH != 0) { return true; }
+
+    TorrentMetadataInfoFile* file = exchange->piece_files[index];
+    u32 piece_bytes = torrent_hash_exchange_piece_bytes(exchange, file, index - file->first_piece);
+    if (begin >= piece_bytes) { return true; }
+    if (length > piece_bytes - begin) { length = piece_bytes - begin; }
+
+    u8 hash[TORRENT_MERKLE_HASH_LENGTH];
+    torrent_merkle_block_hash(data, length, hash);
+
+    return memcmp(hash, exchange->block_hashes[index] + ((usize) (begin / TORRENT_MERKLE_BLOCK_LENGTH) * TORRENT_MERKLE_HASH_LENGTH), TORRENT_MERKLE_HASH_LENGTH) == 0;
+}
+
+/*
+ * checks a whole piece against its v2 hash, false if there is none to check against yet.
+ * in a hybrid torrent the tail of a file's last piece is padding, only the file's bytes are hashed
+ */
+bool torrent_hash_exchange_piece_verify(TorrentHashExchange* exchange, u32 index, const u8* data, bool* valid) {
+    if (index >= exchange->picker->pieces_length) { return false; }
+
+    TorrentMetadataInfoFile* file = exchange->piece_files[index];
+    if (!file) { return false; }
+
+    u32 piece_in_file = index - file->first_piece;
+    const u8* expected = torrent_hash_exchange_piece_hash(exchange, file, piece_in_file);
+    if (!expected) { return false; }
+
+    u32 piece_bytes = torrent_hash_exchange_piece_bytes(exchange, file, piece_in_file);
+    u32 count = (piece_bytes + TORRENT_MERKLE_BLOCK_LENGTH - 1) / TORRENT_MERKLE_BLOCK_LENGTH;
+
+    u8* leaves = (u8*) malloc(sizeof(u8) * TORRENT_MERKLE_HASH_LENGTH * count);
+    if (!leaves) {
+        log_error("HASH EXCHANGE", "Failed to allocate memory for block hashes!");
+        return false;
+    }
+
+    torrent_hash_exchange_leaves(data, piece_bytes, leaves);
+
+    u8 zero[TORRENT_MERKLE_HASH_LENGTH] = {0};
+    u8 root[TORRENT_MERKLE_HASH_LENGTH];
+    bool hashed = torrent_merkle_root(leaves, count, torrent_hash_exchange_piece_width(exchange, file), zero, root);
+    free(leaves);
+
+    if (!hashed) { return false; }
+
+    *valid = memcmp(root, expected, TORRENT_MERKLE_HASH_LENGTH) == 0;
+    return true;
+}
+
+/* the piece is verified and written, its block hashes are no longer needed */
+void torrent_hash_exchange_piece_done(TorrentHashExchange* exchange, u32 index) {
+    if (index >= exchange->picker->pieces_length) { return; }
+
+    if (exchange->block_hashes[index]) { free(exchange->block_hashes[index]); }
+    exchange->block_hashes[index] = NULL;
+    exchange->hashes_requested[index] = 0;
+}
+
+/* the same piece of every other file with identical contents, they are done as soon as this one is */
+usize torrent_hash_exchange_duplicates(TorrentHashExchange* exchange, u32 index, u32* duplicates, usize duplicates_max) {
+    if (index >= exchange->picker->pieces_length) { return 0; }
+
+    TorrentMetadataInfoFile* file = exchange->piece_files[index];
+    if (!file) { return 0; }
+
+    usize duplicates_length = 0;
+    for (usize i = 0; i < exchange->metadata->info.files_length && duplicates_length < duplicates_max; i++) {
+        TorrentMetadataInfoFile* other = &exchange->metadata->info.files[i];
+        if (other == file || !other->has_pieces_root || memcmp(other->pieces_root, file->pieces_root, TORRENT_MERKLE_HASH_LENGTH) != 0) { continue; }
+
+        duplicates[duplicates_length] = other->first_piece + (index - file->first_piece);
+        duplicates_length++;
+    }
+
+    return duplicates_length;
+}
+
+/* serves block hashes of pieces we have and piece layers we know in full, anything else is rejected */
+bool torrent_hash_exchange_request_handle(TorrentHashExchange* exchange, TorrentPeer* peer, const u8* payload, usize payload_length) {
+    if (payload_length != TORRENT_MERKLE_REQUEST_LENGTH) { return false; }
+
+    TorrentMerkleRequest request;
+    if (!torrent_merkle_request_parse(payload, payload_length, &request)) {
+        memcpy(request.pieces_root, payload, TORRENT_MERKLE_HASH_LENGTH);
+        return torrent_peer_send_hash_reject(peer, &request);
+    }
+
+    usize hashes_length = request.length + torrent_merkle_request_uncles(&request);
+    u8* hashes = (u8*) malloc(sizeof(u8) * TORRENT_MERKLE_HASH_LENGTH * hashes_length);
+    if (!hashes) {
+        log_error("HASH EXCHANGE", "Failed to allocate memory for hashes!");
+        return torrent_peer_send_hash_reject(peer, &request);
+    }
+
+    bool success;
+    if (torrent_hash_exchange_hashes_build(exchange, &request, hashes)) {
+        success = torrent_peer_send_hashes(peer, &request, hashes, hashes_length);
+    } else {
+        success = torrent_peer_send_hash_reject(peer, &request);
+    }
+
+    free(hashes);
+    return success;
+}
+
+/* identical files share a root, so whatever proves out is applied to all of them */
+bool torrent_hash_exchange_hashes_handle(TorrentHashExchange* exchange, TorrentPeer* peer, const u8* payload, usize payload_length) {
+    TorrentMerkleRequest request;
+    if (!torrent_merkle_request_parse(payload, payload_length, &request)) { return false; }
+
+    usize hashes_data_length = payload_length - TORRENT_MERKLE_REQUEST_LENGTH;
+    if (hashes_data_length % TORRENT_MERKLE_HASH_LENGTH != 0) { return false; }
+    if (hashes_data_length / TORRENT_MERKLE_HASH_LENGTH != request.length + torrent_merkle_request_uncles(&request)) { return false; }
+
+    const u8* hashes = payload + TORRENT_MERKLE_REQUEST_LENGTH;
+    for (usize i = 0; i < exchange->metadata->info.files_length; i++) {
+        TorrentMetadataInfoFile* file = &exchange->metadata->info.files[i];
+        if (!file->has_pieces_root || memcmp(file->pieces_root, request.pieces_root, TORRENT_MERKLE_HASH_LENGTH) != 0) { continue; }
+
+        // with 16 KiB pieces the piece layer is the block layer, and block hashes are never asked for
+        if (request.base_layer == exchange->piece_layer && file->piece_layer) {
+            torrent_hash_exchange_layer_add(exchange, peer, file, &request, hashes);
+        } else if (request.base_layer == 0) {
+            torrent_hash_exchange_block_hashes_add(exchange, peer, file, &request, hashes);
+        }
+    }
+
+    return true;
+}
+
+/* lets the next peer be asked right away instead of after the timeout */
+bool torrent_hash_exchange_reject_handle(TorrentHashExchange* exchange, const u8* payload, usize payload_length) {
+    if (payload_length != TORRENT_MERKLE_REQUEST_LENGTH) { return false; }
+
+    TorrentMerkleRequest request;
+    if (!torrent_merkle_request_parse(payload, payload_length, &request)) { return true; }
+
+    for (usize i = 0; i < exchange->metadata->info.files_length; i++) {
+        TorrentMetadataInfoFile* file = &exchange->metadata->info.files[i];
+        if (!file->has_pieces_root || memcmp(file->pieces_root, request.pieces_root, TORRENT_MERKLE_HASH_LENGTH) != 0) { continue; }
+
+        if (request.base_layer == exchange->piece_layer && file->piece_layer) {
+            if (request.index < file->pieces_length) { exchange->layers_requested[file->first_piece + request.index] = 0; }
+        } else if (request.base_layer == 0) {
+            u32 piece_in_file = request.index / torrent_hash_exchange_piece_width(exchange, file);
+            if (piece_in_file < file->pieces_length) { exchange->hashes_requested[file->first_piece + piece_in_file] = 0; }
+        }
+    }
+
+    return true;
+}
+
+void torrent_hash_exchange_destroy(TorrentHashExchange* exchange) {
+    if (exchange->block_hashes) {
+        for (u32 i = 0; i < exchange->picker->pieces_length; i++) {
+            if (exchange->block_hashes[i]) { free(exchange->block_hashes[i]); }
+        }
+        free(exchange->block_hashes);
+    }
+    if (exchange->piece_files) { free(exchange->piece_files); }
+    if (exchange->hashes_requested) { free(exchange->hashes_requested); }
+    if (exchange->layers_requested) { free(exchange->layers_requested); }
+    free(exchange);
+}
+
+/* the hash a piece's blocks add up to: its piece layer entry, or the root for a file of one piece. NULL while unknown */
+static const u8* torrent_hash_exchange_piece_hash(TorrentHashExchange* exchange, TorrentMetadataInfoFile* file, u32 piece_in_file) {
+    (void) exchange;
+    if (!file->piece_layer) { return file->pieces_root; }
+
+    const u8* hash = file->piece_layer + ((usize) piece_in_file * TORRENT_MERKLE_HASH_LENGTH);
+    return torrent_hash_exchange_is_zero(hash) ? NULL : hash;
+}
+
+/* leaves below one piece hash, a file of one piece only pads its blocks up to a power of two */
+static u32 torrent_hash_exchange_piece_width(TorrentHashExchange* exchange, TorrentMetadataInfoFile* file) {
+    if (file->piece_layer) { return exchange->piece_blocks; }
+
+    u64 blocks = (file->length + TORRENT_MERKLE_BLOCK_LENGTH - 1) / TORRENT_MERKLE_BLOCK_LENGTH;
+    return (u32) 1 << torrent_merkle_layers(blocks);
+}
+
+/* the file's bytes in one of its pieces, only the last piece has fewer than a full piece */
+static u32 torrent_hash_exchange_piece_bytes(TorrentHashExchange* exchange, TorrentMetadataInfoFile* file, u32 piece_in_file) {
+    u64 piece_length = exchange->metadata->info.piece_length;
+    u64 remaining = file->length - ((u64) piece_in_file * piece_length);
+    return (u32) (remaining < piece_length ? remaining : piece_length);
+}
+
+static bool torrent_hash_exchange_layer_known(TorrentMetadataInfoFile* file, u32 from, u32 to) {
+    for (u32 i = from; i < to && i < file->pieces_length; i++) {
+        if (torrent_hash_exchange_is_zero(file->piece_layer + ((usize) i * TORRENT_MERKLE_HASH_LENGTH))) { return false; }
+    }
+    return true;
+}
+
+/* one SHA-256 per 16 KiB of data, the last one over whatever is left */
+static bool torrent_hash_exchange_leaves(const u8* data, u32 length, u8* leaves) {
+    for (u32 begin = 0, i = 0; begin < length; begin += TORRENT_MERKLE_BLOCK_LENGTH, i++) {
+        u32 block_length = (length - begin < TORRENT_MERKLE_BLOCK_LENGTH) ? length - begin : TORRENT_MERKLE_BLOCK_LENGTH;
+        torrent_merkle_block_hash(data + begin, block_length, leaves + ((usize) i * TORRENT_MERKLE_HASH_LENGTH));
+    }
+    return true;
+}
+
+/*
+ * fills hashes with what the request asks for followed by its uncles. block hashes are
+ * rebuilt from storage, their proof leaves the piece through the piece layer
+ */
+static bool torrent_hash_exchange_hashes_build(TorrentHashExchange* exchange, const TorrentMerkleRequest* request, u8* hashes) {
+    TorrentMetadataInfoFile* file = torrent_metadata_file_find(exchange->metadata, request->pieces_root);
+    if (!file) { return false; }
+
+    u32 covered = torrent_merkle_layers(request->length);
+    u32 uncles = torrent_merkle_request_uncles(request);
+    u32 layer_width = file->piece_layer ? (u32) 1 << torrent_merkle_layers(file->pieces_length) : 1;
+    u8* uncles_data = hashes + ((usize) request->length * TORRENT_MERKLE_HASH_LENGTH);
+
+    if (request->base_layer == exchange->piece_layer && file->piece_layer) {
+        if ((u64) request->index + request->length > layer_width || covered + uncles > torrent_merkle_layers(layer_width)) { return false; }
+        if (!torrent_hash_exchange_layer_known(file, 0, file->pieces_length)) { return false; }
+
+        for (u32 i = 0; i < request->length; i++) {
+            u32 index = request->index + i;
+            memcpy(hashes + ((usize) i * TORRENT_MERKLE_HASH_LENGTH), index < file->pieces_length ? file->piece_layer + ((usize) index * TORRENT_MERKLE_HASH_LENGTH) : exchange->piece_pad, TORRENT_MERKLE_HASH_LENGTH);
+        }
+
+        return torrent_merkle_uncles(file->piece_layer, file->pieces_length, layer_width, exchange->piece_pad, request->index, covered, uncles, uncles_data);
+    }
+
+    if (request->base_layer != 0) { return false; }
+
+    // the requested blocks must all sit in one piece we have
+    u32 width = torrent_hash_exchange_piece_width(exchange, file);
+    u32 piece_layers = torrent_merkle_layers(width);
+    u32 piece_in_file = request->index / width;
+    if (request->length > width || piece_in_file >= file->pieces_length) { return false; }
+    if (covered + uncles > piece_layers + torrent_merkle_layers(layer_width)) { return false; }
+    if (covered + uncles > piece_layers && !torrent_hash_exchange_layer_known(file, 0, file->pieces_length)) { return false; }
+
+    u32 index = file->first_piece + piece_in_file;
+    if (!torrent_picker_has(exchange->picker, index)) { return false; }
+
+    u32 piece_bytes = torrent_hash_exchange_piece_bytes(exchange, file, piece_in_file);
+    u32 count = (piece_bytes + TORRENT_MERKLE_BLOCK_LENGTH - 1) / TORRENT_MERKLE_BLOCK_LENGTH;
+    u8* data = (u8*) malloc(sizeof(u8) * piece_bytes);
+    u8* leaves = (u8*) calloc(width, TORRENT_MERKLE_HASH_LENGTH);
+    if (!data || !leaves) {
+        log_error("HASH EXCHANGE", "Failed to allocate memory for block hashes!");
+        if (data) { free(data); }
+        if (leaves) { free(leaves); }
+        return false;
+    }
+
+    bool success = torrent_storage_read(exchange->storage, index, 0, data, piece_bytes);
+    if (success) {
+        torrent_hash_exchange_leaves(data, piece_bytes, leaves);
+        memcpy(hashes, leaves + ((usize) (request->index % width) * TORRENT_MERKLE_HASH_LENGTH), (usize) request->length * TORRENT_MERKLE_HASH_LENGTH);
+
+        u8 zero[TORRENT_MERKLE_HASH_LENGTH] = {0};
+        u32 inner = (uncles < piece_layers - covered) ? uncles : piece_layers - covered;
+        success = torrent_merkle_uncles(leaves, count, width, zero, request->index % width, covered, inner, uncles_data);
+        if (success && uncles > inner) {
+            success = torrent_merkle_uncles(file->piece_layer, file->pieces_length, layer_width, exchange->piece_pad, piece_in_file, 0, uncles - inner, uncles_data + ((usize) inner * TORRENT_MERKLE_HASH_LENGTH));
+        }
+    }
+
+    free(data);
+    free(leaves);
+    return success;
+}
+
+/* we only ask for the blocks of a whole piece, they must add up to its piece hash */
+static void torrent_hash_exchange_block_hashes_add(TorrentHashExchange* exchange, TorrentPeer* peer, TorrentMetadataInfoFile* file, const TorrentMerkleRequest* request, const u8* hashes) {
+    u32 width = torrent_hash_exchange_piece_width(exchange, file);
+    if (request->length != width) { return; }
+
+    u32 piece_in_file = request->index / width;
+    if (piece_in_file >= file->pieces_length) { return; }
+
+    u32 index = file->first_piece + piece_in_file;
+    TorrentPiece* piece = &exchange->picker->pieces[index];
+    if (exchange->block_hashes[index] || piece->state != TORRENT_PIECE_PARTIAL) { return; }
+
+    const u8* expected = torrent_hash_exchange_piece_hash(exchange, file, piece_in_file);
+    if (!expected) { return; }
+
+    if (!torrent_merkle_verify(hashes, width, request->index, NULL, 0, expected)) {
+        log_peer_warn("HASH EXCHANGE", peer->ip, peer->port, "Block hashes for piece %u do not match its piece hash!", index);
+        return;
+    }
+
+    u32 count = (torrent_hash_exchange_piece_bytes(exchange, file, piece_in_file) + TORRENT_MERKLE_BLOCK_LENGTH - 1) / TORRENT_MERKLE_BLOCK_LENGTH;
+    exchange->block_hashes[index] = (u8*) malloc(sizeof(u8) * TORRENT_MERKLE_HASH_LENGTH * count);
+    if (!exchange->block_hashes[index]) {
+        log_error("HASH EXCHANGE", "Failed to allocate memory for block hashes!");
+        return;
+    }
+    memcpy(exchange->block_hashes[index], hashes, (usize) TORRENT_MERKLE_HASH_LENGTH * count);
+
+    // blocks that arrived before their hashes are checked now, bad ones are fetched again
+    for (u32 i = 0; i < count && i < piece->blocks_length; i++) {
+        if (piece->blocks[i] != TORRENT_BLOCK_RECEIVED) { continue; }
+
+        u32 begin = i * TORRENT_MERKLE_BLOCK_LENGTH;
+        u32 length = (piece->length - begin < TORRENT_MERKLE_BLOCK_LENGTH) ? piece->length - begin : TORRENT_MERKLE_BLOCK_LENGTH;
+        if (torrent_hash_exchange_block_verify(exchange, index, begin, piece->data + begin, length)) { continue; }
+
+        log_warn("HASH EXCHANGE", "Block %u:%u does not match its hash, fetching it again", index, begin);
+        torrent_metrics_count(TORRENT_METRICS_BLOCKS_FAILED, 1);
+        torrent_picker_block_reset(exchange->picker, index, begin);
+    }
+}
+
+/* a chunk of a piece layer, proven with its uncles up to the file's root */
+static void torrent_hash_exchange_layer_add(TorrentHashExchange* exchange, TorrentPeer* peer, TorrentMetadataInfoFile* file, const TorrentMerkleRequest* request, const u8* hashes) {
+    (void) exchange;
+    u32 width = (u32) 1 << torrent_merkle_layers(file->pieces_length);
+    if ((u64) request->index + request->length > width || request->index >= file->pieces_length) { return; }
+
+    const u8* uncles = hashes + ((usize) request->length * TORRENT_MERKLE_HASH_LENGTH);
+    if (!torrent_merkle_verify(hashes, request->length, request->index, uncles, torrent_merkle_request_uncles(request), file->pieces_root)) {
+        log_peer_warn("HASH EXCHANGE", peer->ip, peer->port, "Piece layer hashes do not prove out to their root!");
+        return;
+    }
+
+    u32 end = request->index + request->length;
+    if (end > file->pieces_length) { end = file->pieces_length; }
+    memcpy(file->piece_layer + ((usize) request->index * TORRENT_MERKLE_HASH_LENGTH), hashes, (usize) (end - request->index) * TORRENT_MERKLE_HASH_LENGTH);
+
+    log_debug("HASH EXCHANGE", "Piece layer hashes %u to %u proven", request->index, end);
+}
+
+static inline bool torrent_hash_exchange_is_zero(const u8* hash) {
+    for (usize i = 0; i < TORRENT_MERKLE_HASH_LENGTH; i++) {
+        if (hash[i] != 0) { return false; }
+    }
+    return true;
+}
@@ -0,0 +1,198 @@
+#include "magnet.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tracker.h"
+#include "types.h"
+#include "utils/log.h"
+#include "utils/url.h"
+
+#define TORRENT_MAGNET_PREFIX "magnet:?"
+#define TORRENT_MAGNET_BTIH_PREFIX "urn:btih:"
+
+static bool torrent_magnet_parameter_handle(TorrentMagnet* magnet, const char* key, usize key_length, const char* value, bool* has_info_hash);
+static bool torrent_magnet_info_hash_decode(const char* string, u8 info_hash[20]);
+static bool torrent_magnet_tracker_add(TorrentMagnet* magnet, const char* tracker);
+static bool torrent_magnet_peer_add(TorrentMagnet* magnet, const char* address);
+
+/* returns NULL if the uri isn't a magnet link or has no v1 info hash */
+TorrentMagnet* torrent_magnet_parse(const char* uri) {
+    if (strncmp(uri, TORRENT_MAGNET_PREFIX, strlen(TORRENT_MAGNET_PREFIX)) != 0) {
+        log_error("MAGNET", "Not a magnet link: %s", uri);
+        return NULL;
+    }
+
+    TorrentMagnet* magnet = (TorrentMagnet*) malloc(sizeof(TorrentMagnet));
+    if (!magnet) {
+        log_error("MAGNET", "Failed to allocate memory for magnet!");
+        return NULL;
+    }
+
+    memset(magnet, 0, sizeof(TorrentMagnet));
+
+    bool has_info_hash = false;
+    const char* position = uri + strlen(TORRENT_MAGNET_PREFIX);
+    while (*position != '\0') {
+        const char* end = strchr(position, '&');
+        if (!end) { end = position + strlen(position); }
+
+        const char* equals = memchr(position, '=', end - position);
+        if (equals) {
+            char* value = url_decode(equals + 1, end - (equals + 1));
+            if (!value) {
+                torrent_magnet_destroy(magnet);
+                return NULL;
+            }
+
+            bool success = torrent_magnet_parameter_handle(magnet, position, equals - position, value, &has_info_hash);
+            free(value);
+
+            if (!success) {
+                torrent_magnet_destroy(magnet);
+                return NULL;
+            }
+        }
+
+        position = (*end == '&') ? end + 1 : end;
+    }
+
+    if (!has_info_hash) {
+        log_error("MAGNET", "Magnet link has no btih info hash!");
+        torrent_magnet_destroy(magnet);
+        return NULL;
+    }
+
+    return magnet;
+}
+
+void torrent_magnet_destroy(TorrentMagnet* magnet) {
+    if (magnet->name) { free(magnet->name); }
+    if (magnet->trackers) {
+        for (usize i = 0; i < magnet->trackers_length; i++) {
+            free(magnet->trackers[i]);
+        }
+        free(magnet->trackers);
+    }
+    if (magnet->peers) { free(magnet->peers); }
+    free(magnet);
+}
+
+/* unknown parameters are skipped, false only on a bad info hash or allocation failure */
+static bool torrent_magnet_parameter_handle(TorrentMagnet* magnet, const char* key, usize key_length, const char* value, bool* has_info_hash) {
+    if (key_length == 2 && strncmp(key, "xt", 2) == 0) {
+        // other exact topics (btmh for v2) may sit next to the v1 one
+        if (strncmp(value, TORRENT_MAGNET_BTIH_PREFIX, strlen(TORRENT_MAGNET_BTIH_PREFIX)) != 0) { return true; }
+
+        if (!torrent_magnet_info_hash_decode(value + strlen(TORRENT_MAGNET_BTIH_PREFIX), magnet->info_hash)) {
+            log_error("MAGNET", "Info hash is invalid: %s", value);
+            return false;
+        }
+        *has_info_hash = true;
+    } else if (key_length == 2 && strncmp(key, "dn", 2) == 0) {
+        if (magnet->name) { free(magnet->name); }
+        magnet->name = strdup(value);
+        if (!magnet->name) {
+            log_error("MAGNET", "Failed to allocate memory for name!");
+            return false;
+        }
+    } else if (key_length == 2 && strncmp(key, "tr", 2) == 0) {
+        return torrent_magnet_tracker_add(magnet, value);
+    } else if (key_length == 4 && strncmp(key, "x.pe", 4) == 0) {
+        return torrent_magnet_peer_add(magnet, value);
+    }
+
+    return true;
+}
+
+/* the hash is either 40 hex characters or 32 base32 characters */
+static bool torrent_magnet_info_hash_decode(const char* string, u8 info_hash[20]) {
+    usize string_length = strlen(string);
+
+    if (string_length == 40) {
+        for (usize i = 0; i < 20; i++) {
+            if (!isxdigit((u8) string[i * 2]) || !isxdigit((u8) string[i * 2 + 1])) { return false; }
+
+            char hex[3] = { string[i * 2], string[i * 2 + 1], '\0' };
+            info_hash[i] = (u8) strtol(hex, NULL, 16);
+        }
+        return true;
+    }
+
+    if (string_length == 32) {
+        u32 bits = 0;
+        u32 bits_length = 0;
+        usize hash_length = 0;
+        for (usize i = 0; i < 32; i++) {
+            char c = toupper((u8) string[i]);
+
+            u32 value;
+            if (c >= 'A' && c <= 'Z') {
+                value = c - 'A';
+            } else if (c >= '2' && c <= '7') {
+                value = c - '2' + 26;
+            } else {
+                return false;
+            }
+
+            bits = (bits << 5) | value;
+            bits_length += 5;
+            if (bits_length >= 8) {
+                info_hash[hash_length] = (bits >> (bits_length - 8)) & 0xFF;
+                hash_length++;
+                bits_length -= 8;
+            }
+        }
+        return hash_length == 20;
+    }
+
+    return false;
+}
+
+static bool torrent_magnet_tracker_add(TorrentMagnet* magnet, const char* tracker) {
+    char** temp = (char**) realloc(magnet->trackers, sizeof(char*) * (magnet->trackers_length + 1));
+    if (!temp) {
+        log_error("MAGNET", "Failed to reallocate memory for trackers!");
+        return false;
+    }
+    magnet->trackers = temp;
+
+    magnet->trackers[magnet->trackers_length] = strdup(tracker);
+    if (!magnet->trackers[magnet->trackers_length]) {
+        log_error("MAGNET", "Failed to allocate memory for tracker!");
+        return false;
+    }
+    magnet->trackers_length++;
+
+    return true;
+}
+
+/* host:port or [ipv6]:port, malformed addresses are skipped */
+static bool torrent_magnet_peer_add(TorrentMagnet* magnet, const char* address) {
+    const char* port = strrchr(address, ':');
+    if (!port || port == address || port[1] == '\0') { return true; }
+
+    const char* host = address;
+    usize host_length = port - address;
+    if (host[0] == '[' && host[host_length - 1] == ']') {
+        host++;
+        host_length -= 2;
+    }
+
+    TorrentTrackerPeer* temp = (TorrentTrackerPeer*) realloc(magnet->peers, sizeof(TorrentTrackerPeer) * (magnet->peers_length + 1));
+    if (!temp) {
+        log_error("MAGNET", "Failed to reallocate memory for peers!");
+        return false;
+    }
+    magnet->peers = temp;
+
+    TorrentTrackerPeer* peer = &magnet->peers[magnet->peers_length];
+    memset(peer, 0, sizeof(TorrentTrackerPeer));
+    snprintf(peer->ip, sizeof(peer->ip), "%.*s", (int) host_length, host);
+    snprintf(peer->port, sizeof(peer->port), "%s", port + 1);
+    magnet->peers_length++;
+
+    return true;
+}
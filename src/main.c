@@ -1,13 +1,360 @@
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "creator.h"
 #include "downloader.h"
+#include "metadata.h"
+#include "replay.h"
+#include "stream.h"
+#include "trace.h"
+#include "utils/log.h"
+#include "utils/time.h"
 
-int main() {
-    TorrentDownloader* downloader = torrent_downloader_create("../debian-13.2.0-amd64-DVD-1.iso.torrent");
+#define MAIN_ANNOUNCE_MAX 32
+#define MAIN_STREAM_CHUNK_LENGTH (64 * 1024)
+
+static i32 main_create(int argc, char** argv);
+static i32 main_seed(int argc, char** argv);
+static i32 main_replay(int argc, char** argv);
+static void* main_stream_thread(void* arg);
+
+/*
+ * usage: bittorrent-client [-l log level] [-m metrics port] [-j metrics snapshot path] [-r trace path] [-s] [-t network threads] <torrent file | magnet uri>
+ *        bittorrent-client create [-a announce url]... [-p piece length in KiB] [-t threads] [-o output] <file | directory>
+ *        bittorrent-client seed [-l log level] [-m metrics port] [-p listen port] [-r trace path] [-s] [-t network threads] <torrent file>
+ *        bittorrent-client replay [-l log level] [-x speed] [-t network threads] <trace file> <torrent file | magnet uri>
+ */
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "create") == 0) {
+        return main_create(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "seed") == 0) {
+        return main_seed(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "replay") == 0) {
+        return main_replay(argc - 1, argv + 1);
+    }
+
+    u16 metrics_port = 0;
+    const char* metrics_snapshot_path = NULL;
+    const char* trace_path = NULL;
+    bool stream_stdout = false;
+    i64 network_threads = -1;
+
+    i32 option;
+    while ((option = getopt(argc, argv, "l:m:j:r:st:")) != -1) {
+        switch (option) {
+            case 'l': {
+                LogLevel level;
+                if (!log_level_parse(optarg, &level)) {
+                    fprintf(stderr, "unknown log level %s, expected debug, info, warn, error or off\n", optarg);
+                    return -1;
+                }
+                log_level_set(level);
+            } break;
+            case 'm': metrics_port = strtol(optarg, NULL, 10); break;
+            case 'j': metrics_snapshot_path = optarg; break;
+            case 'r': trace_path = optarg; break;
+            case 's': stream_stdout = true; break;
+            case 't': network_threads = strtol(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "usage: %s [-l log level] [-m metrics port] [-j metrics snapshot path] [-r trace path] [-s] [-t network threads] <torrent file | magnet uri>\n", argv[0]);
+                return -1;
+        }
+    }
+
+    const char* torrent_file = (optind < argc) ? argv[optind] : "../debian-13.2.0-amd64-DVD-1.iso.torrent";
+
+    TorrentDownloader* downloader;
+    if (strncmp(torrent_file, "magnet:", 7) == 0) {
+        downloader = torrent_downloader_create_from_magnet(torrent_file);
+    } else {
+        downloader = torrent_downloader_create(torrent_file);
+    }
     if (!downloader) {
-        fprintf(stderr, "[ERROR] Failed to create torrent downloader!\n");
+        log_error("MAIN", "Failed to create torrent downloader!");
         return -1;
     }
 
+    downloader->metrics_port = metrics_port;
+    downloader->metrics_snapshot_path = metrics_snapshot_path;
+
+    // -t moves peer sockets onto network threads, -t 0 starts one per online core
+    if (network_threads == 0) { network_threads = sysconf(_SC_NPROCESSORS_ONLN); }
+    if (network_threads > 0) { downloader->shards_length = network_threads; }
+
+    // -r records every connection for bittorrent-client replay, it outlives the downloader's last disconnect
+    TorrentTrace* trace = NULL;
+    if (trace_path) {
+        trace = torrent_trace_create(trace_path, downloader->info_hash);
+        if (!trace) {
+            torrent_downloader_destroy(downloader);
+            return -1;
+        }
+        downloader->trace = trace;
+    }
+
+    // -s writes the payload to stdout in order while it downloads, so it can be piped into a player
+    TorrentStream* stream = NULL;
+    pthread_t stream_thread;
+    if (stream_stdout) {
+        stream = torrent_stream_create();
+        if (!stream || pthread_create(&stream_thread, NULL, main_stream_thread, stream) != 0) {
+            log_error("MAIN", "Failed to start streaming to stdout!");
+            if (stream) { torrent_stream_destroy(stream); }
+            torrent_downloader_destroy(downloader);
+            if (trace) { torrent_trace_destroy(trace); }
+            return -1;
+        }
+        downloader->stream = stream;
+    }
+
+    bool downloaded = torrent_downloader_run(downloader);
+
+    if (stream) {
+        torrent_stream_close(stream);
+        pthread_join(stream_thread, NULL);
+        torrent_stream_destroy(stream);
+    }
+
+    torrent_downloader_destroy(downloader);
+    if (trace) { torrent_trace_destroy(trace); }
+
+    if (!downloaded) {
+        log_error("MAIN", "Failed to download torrent!");
+        return -1;
+    }
+}
+
+static void* main_stream_thread(void* arg) {
+    TorrentStream* stream = (TorrentStream*) arg;
+
+    u8* chunk = (u8*) malloc(sizeof(u8) * MAIN_STREAM_CHUNK_LENGTH);
+    if (!chunk) {
+        log_error("MAIN", "Failed to allocate memory for the stream chunk!");
+        return NULL;
+    }
+
+    ssize_t read_length;
+    while ((read_length = torrent_stream_read(stream, chunk, MAIN_STREAM_CHUNK_LENGTH)) > 0) {
+        if (fwrite(chunk, 1, read_length, stdout) != (usize) read_length) {
+            log_error("MAIN", "Failed to write the stream to stdout!");
+            break;
+        }
+    }
+    fflush(stdout);
+
+    free(chunk);
+    return NULL;
+}
+
+/* argv[0] is "create", the torrent is written to <name>.torrent unless -o says otherwise */
+static i32 main_create(int argc, char** argv) {
+    const char* announce_list[MAIN_ANNOUNCE_MAX];
+    TorrentCreatorOptions options = { .announce_list = announce_list };
+    const char* output = NULL;
+
+    i32 option;
+    while ((option = getopt(argc, argv, "a:p:t:o:")) != -1) {
+        switch (option) {
+            case 'a': {
+                if (options.announce_list_length == MAIN_ANNOUNCE_MAX) {
+                    fprintf(stderr, "at most %u announce urls are supported\n", MAIN_ANNOUNCE_MAX);
+                    return -1;
+                }
+                announce_list[options.announce_list_length++] = optarg;
+            } break;
+            case 'p': options.piece_length = strtoul(optarg, NULL, 10) * 1024; break;
+            case 't': options.threads = strtoul(optarg, NULL, 10); break;
+            case 'o': output = optarg; break;
+            default:
+                fprintf(stderr, "usage: bittorrent-client create [-a announce url]... [-p piece length in KiB] [-t threads] [-o output] <file | directory>\n");
+                return -1;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "usage: bittorrent-client create [-a announce url]... [-p piece length in KiB] [-t threads] [-o output] <file | directory>\n");
+        return -1;
+    }
+    options.path = argv[optind];
+
+    TorrentMetadata* metadata = torrent_creator_create(&options);
+    if (!metadata) {
+        log_error("MAIN", "Failed to create torrent from %s!", options.path);
+        return -1;
+    }
+
+    char default_output[512];
+    if (!output) {
+        snprintf(default_output, sizeof(default_output), "%s.torrent", metadata->info.name);
+        output = default_output;
+    }
+
+    if (!torrent_metadata_save(metadata, output)) {
+        torrent_metadata_destroy(metadata);
+        return -1;
+    }
+
+    char info_hash[41];
+    for (usize i = 0; i < 20; i++) {
+        snprintf(info_hash + (i * 2), 3, "%02x", metadata->info_sha1[i]);
+    }
+    log_info("MAIN", "Created %s, %u pieces of %zu bytes", output, metadata->info.piece_count, metadata->info.piece_length);
+    printf("%s\n", info_hash);
+
+    torrent_metadata_destroy(metadata);
+    return 0;
+}
+
+/*
+ * argv[0] is "seed". serves the torrent's files from the current directory until stopped,
+ * fetching whatever is missing first. -s super seeds, for the first seed of a new torrent
+ */
+static i32 main_seed(int argc, char** argv) {
+    u16 metrics_port = 0;
+    u16 listen_port = TORRENT_DOWNLOADER_LISTEN_PORT;
+    const char* trace_path = NULL;
+    bool super_seeding = false;
+    i64 network_threads = -1;
+
+    i32 option;
+    while ((option = getopt(argc, argv, "l:m:p:r:st:")) != -1) {
+        switch (option) {
+            case 'l': {
+                LogLevel level;
+                if (!log_level_parse(optarg, &level)) {
+                    fprintf(stderr, "unknown log level %s, expected debug, info, warn, error or off\n", optarg);
+                    return -1;
+                }
+                log_level_set(level);
+            } break;
+            case 'm': metrics_port = strtol(optarg, NULL, 10); break;
+            case 'p': listen_port = strtol(optarg, NULL, 10); break;
+            case 'r': trace_path = optarg; break;
+            case 's': super_seeding = true; break;
+            case 't': network_threads = strtol(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "usage: bittorrent-client seed [-l log level] [-m metrics port] [-p listen port] [-r trace path] [-s] [-t network threads] <torrent file>\n");
+                return -1;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "usage: bittorrent-client seed [-l log level] [-m metrics port] [-p listen port] [-r trace path] [-s] [-t network threads] <torrent file>\n");
+        return -1;
+    }
+
+    TorrentDownloader* downloader = torrent_downloader_create(argv[optind]);
+    if (!downloader) {
+        log_error("MAIN", "Failed to create torrent downloader!");
+        return -1;
+    }
+
+    downloader->metrics_port = metrics_port;
+    downloader->listen_port = listen_port;
+    downloader->keep_seeding = true;
+    downloader->super_seeding = super_seeding;
+    if (network_threads == 0) { network_threads = sysconf(_SC_NPROCESSORS_ONLN); }
+    if (network_threads > 0) { downloader->shards_length = network_threads; }
+
+    TorrentTrace* trace = NULL;
+    if (trace_path) {
+        trace = torrent_trace_create(trace_path, downloader->info_hash);
+        if (!trace) {
+            torrent_downloader_destroy(downloader);
+            return -1;
+        }
+        downloader->trace = trace;
+    }
+
+    bool seeded = torrent_downloader_recheck(downloader) && torrent_downloader_run(downloader);
+
+    torrent_downloader_destroy(downloader);
+    if (trace) { torrent_trace_destroy(trace); }
+
+    if (!seeded) {
+        log_error("MAIN", "Failed to seed torrent!");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * argv[0] is "replay". plays a trace recorded with -r back into a fresh download, no network
+ * involved, and prints how long it took as one json object so builds can be compared.
+ * -x scales the recorded pace, 0 replays as fast as the downloader keeps up
+ */
+static i32 main_replay(int argc, char** argv) {
+    double speed = 1.0;
+    i64 network_threads = -1;
+
+    i32 option;
+    while ((option = getopt(argc, argv, "l:x:t:")) != -1) {
+        switch (option) {
+            case 'l': {
+                LogLevel level;
+                if (!log_level_parse(optarg, &level)) {
+                    fprintf(stderr, "unknown log level %s, expected debug, info, warn, error or off\n", optarg);
+                    return -1;
+                }
+                log_level_set(level);
+            } break;
+            case 'x': speed = strtod(optarg, NULL); break;
+            case 't': network_threads = strtol(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "usage: bittorrent-client replay [-l log level] [-x speed] [-t network threads] <trace file> <torrent file | magnet uri>\n");
+                return -1;
+        }
+    }
+
+    if (optind + 1 >= argc) {
+        fprintf(stderr, "usage: bittorrent-client replay [-l log level] [-x speed] [-t network threads] <trace file> <torrent file | magnet uri>\n");
+        return -1;
+    }
+    const char* trace_file = argv[optind];
+    const char* torrent_file = argv[optind + 1];
+
+    TorrentReplay* replay = torrent_replay_create(trace_file, speed);
+    if (!replay) { return -1; }
+
+    TorrentDownloader* downloader;
+    if (strncmp(torrent_file, "magnet:", 7) == 0) {
+        downloader = torrent_downloader_create_from_magnet(torrent_file);
+    } else {
+        downloader = torrent_downloader_create(torrent_file);
+    }
+    if (!downloader) {
+        log_error("MAIN", "Failed to create torrent downloader!");
+        torrent_replay_destroy(replay);
+        return -1;
+    }
+
+    if (memcmp(downloader->info_hash, replay->trace->info_hash, 20) != 0) {
+        log_error("MAIN", "%s wasn't recorded for this torrent!", trace_file);
+        torrent_downloader_destroy(downloader);
+        torrent_replay_destroy(replay);
+        return -1;
+    }
+
+    downloader->replay = replay;
+    if (network_threads == 0) { network_threads = sysconf(_SC_NPROCESSORS_ONLN); }
+    if (network_threads > 0) { downloader->shards_length = network_threads; }
+
+    i64 started = time_now_us();
+    bool downloaded = torrent_replay_start(replay) && torrent_downloader_run(downloader);
+    i64 elapsed = time_now_us() - started;
+
+    u32 pieces_completed = downloader->picker ? downloader->picker->pieces_completed : 0;
+    u32 pieces_length = downloader->picker ? downloader->picker->pieces_length : 0;
+    printf("{\"speed\":%.2f,\"network_threads\":%u,\"elapsed_ms\":%.2f,\"pieces_completed\":%u,\"pieces\":%u,\"completed\":%s}\n",
+        speed, downloader->shards_length, elapsed / 1000.0, pieces_completed, pieces_length, downloaded ? "true" : "false");
+
+    // the downloader hangs up first so the replay sees every connection close
     torrent_downloader_destroy(downloader);
+    torrent_replay_destroy(replay);
+    return downloaded ? 0 : -1;
 }
@@ -0,0 +1,163 @@
+#include "merkle.h"
+
+#include <openssl/sha.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "utils/buffer.h"
+#include "utils/log.h"
+
+static void torrent_merkle_pair_hash(const u8* left, const u8* right, u8* parent);
+static usize torrent_merkle_layer_reduce(u8* layer, usize count, u8 pad[TORRENT_MERKLE_HASH_LENGTH]);
+
+/* false if the message is too short or asks for something no tree can have */
+bool torrent_merkle_request_parse(const u8* data, usize data_length, TorrentMerkleRequest* request) {
+    if (data_length < TORRENT_MERKLE_REQUEST_LENGTH) { return false; }
+
+    memcpy(request->pieces_root, data, TORRENT_MERKLE_HASH_LENGTH);
+    request->base_layer = buffer_read_big_endian(data + 32);
+    request->index = buffer_read_big_endian(data + 36);
+    request->length = buffer_read_big_endian(data + 40);
+    request->proof_layers = buffer_read_big_endian(data + 44);
+
+    if (request->length == 0 || request->length > TORRENT_MERKLE_HASHES_MAX) { return false; }
+    if ((request->length & (request->length - 1)) != 0 || request->index % request->length != 0) { return false; }
+    return request->base_layer < 64 && request->proof_layers < 64;
+}
+
+void torrent_merkle_request_write(u8* data, const TorrentMerkleRequest* request) {
+    memcpy(data, request->pieces_root, TORRENT_MERKLE_HASH_LENGTH);
+    buffer_write_big_endian(data + 32, request->base_layer);
+    buffer_write_big_endian(data + 36, request->index);
+    buffer_write_big_endian(data + 40, request->length);
+    buffer_write_big_endian(data + 44, request->proof_layers);
+}
+
+/* how many uncle hashes follow the requested ones in the hashes message */
+u32 torrent_merkle_request_uncles(const TorrentMerkleRequest* request) {
+    u32 covered = torrent_merkle_layers(request->length);
+    return request->proof_layers > covered ? request->proof_layers - covered : 0;
+}
+
+/* layers above count leaves once they are padded to a power of two */
+u32 torrent_merkle_layers(u64 count) {
+    u32 layers = 0;
+    while (((u64) 1 << layers) < count) { layers++; }
+    return layers;
+}
+
+void torrent_merkle_block_hash(const u8* data, usize length, u8 hash[TORRENT_MERKLE_HASH_LENGTH]) {
+    SHA256(data, length, hash);
+}
+
+/* the root of a subtree that only covers padding, leaves past the end of a file are all zero */
+void torrent_merkle_pad_hash(u32 layer, u8 hash[TORRENT_MERKLE_HASH_LENGTH]) {
+    memset(hash, 0, TORRENT_MERKLE_HASH_LENGTH);
+    for (u32 i = 0; i < layer; i++) {
+        torrent_merkle_pair_hash(hash, hash, hash);
+    }
+}
+
+/* hashes count nodes up to one root, width is count rounded up to a power of two and pad fills the rest */
+bool torrent_merkle_root(const u8* hashes, usize count, usize width, const u8 pad[TORRENT_MERKLE_HASH_LENGTH], u8 root[TORRENT_MERKLE_HASH_LENGTH]) {
+    if (count > width) { return false; }
+
+    u8* layer = (u8*) malloc(sizeof(u8) * TORRENT_MERKLE_HASH_LENGTH * (count > 0 ? count : 1));
+    if (!layer) {
+        log_error("MERKLE", "Failed to allocate memory for a tree layer!");
+        return false;
+    }
+    memcpy(layer, hashes, TORRENT_MERKLE_HASH_LENGTH * count);
+
+    u8 pad_current[TORRENT_MERKLE_HASH_LENGTH];
+    memcpy(pad_current, pad, TORRENT_MERKLE_HASH_LENGTH);
+
+    for (usize remaining = width; remaining > 1; remaining /= 2) {
+        count = torrent_merkle_layer_reduce(layer, count, pad_current);
+    }
+
+    memcpy(root, count > 0 ? layer : pad_current, TORRENT_MERKLE_HASH_LENGTH);
+    free(layer);
+    return true;
+}
+
+/*
+ * the proof for the node at index: one sibling per layer on the way up, the first skip
+ * layers left out. false if that climbs past the root
+ */
+bool torrent_merkle_uncles(const u8* hashes, usize count, usize width, const u8 pad[TORRENT_MERKLE_HASH_LENGTH], usize index, u32 skip, u32 layers, u8* uncles) {
+    if (count > width || index >= width) { return false; }
+
+    u8* layer = (u8*) malloc(sizeof(u8) * TORRENT_MERKLE_HASH_LENGTH * (count > 0 ? count : 1));
+    if (!layer) {
+        log_error("MERKLE", "Failed to allocate memory for a tree layer!");
+        return false;
+    }
+    memcpy(layer, hashes, TORRENT_MERKLE_HASH_LENGTH * count);
+
+    u8 pad_current[TORRENT_MERKLE_HASH_LENGTH];
+    memcpy(pad_current, pad, TORRENT_MERKLE_HASH_LENGTH);
+
+    u32 written = 0;
+    for (u32 level = 0; written < layers; level++) {
+        if (width <= 1) {
+            free(layer);
+            return false;
+        }
+
+        if (level >= skip) {
+            usize sibling = index ^ 1;
+            memcpy(uncles + (written * TORRENT_MERKLE_HASH_LENGTH), sibling < count ? layer + (sibling * TORRENT_MERKLE_HASH_LENGTH) : pad_current, TORRENT_MERKLE_HASH_LENGTH);
+            written++;
+        }
+
+        count = torrent_merkle_layer_reduce(layer, count, pad_current);
+        width /= 2;
+        index /= 2;
+    }
+
+    free(layer);
+    return true;
+}
+
+/* hashes are a full aligned run of length nodes, the uncles take their subtree root up to root */
+bool torrent_merkle_verify(const u8* hashes, usize length, usize index, const u8* uncles, u32 uncles_length, const u8 root[TORRENT_MERKLE_HASH_LENGTH]) {
+    u8 zero[TORRENT_MERKLE_HASH_LENGTH] = {0};
+    u8 node[TORRENT_MERKLE_HASH_LENGTH];
+    if (!torrent_merkle_root(hashes, length, length, zero, node)) { return false; }
+
+    usize position = index / length;
+    for (u32 i = 0; i < uncles_length; i++) {
+        const u8* uncle = uncles + (i * TORRENT_MERKLE_HASH_LENGTH);
+        if (position & 1) {
+            torrent_merkle_pair_hash(uncle, node, node);
+        } else {
+            torrent_merkle_pair_hash(node, uncle, node);
+        }
+        position /= 2;
+    }
+
+    return memcmp(node, root, TORRENT_MERKLE_HASH_LENGTH) == 0;
+}
+
+/* parent may alias either child */
+static void torrent_merkle_pair_hash(const u8* left, const u8* right, u8* parent) {
+    u8 pair[TORRENT_MERKLE_HASH_LENGTH * 2];
+    memcpy(pair, left, TORRENT_MERKLE_HASH_LENGTH);
+    memcpy(pair + TORRENT_MERKLE_HASH_LENGTH, right, TORRENT_MERKLE_HASH_LENGTH);
+    SHA256(pair, sizeof(pair), parent);
+}
+
+/* replaces a layer with its parents in place and moves pad up with it, returns the parent count */
+static usize torrent_merkle_layer_reduce(u8* layer, usize count, u8 pad[TORRENT_MERKLE_HASH_LENGTH]) {
+    usize parents = (count + 1) / 2;
+    for (usize i = 0; i < parents; i++) {
+        const u8* left = layer + (2 * i * TORRENT_MERKLE_HASH_LENGTH);
+        const u8* right = (2 * i + 1 < count) ? layer + ((2 * i + 1) * TORRENT_MERKLE_HASH_LENGTH) : pad;
+        torrent_merkle_pair_hash(left, right, layer + (i * TORRENT_MERKLE_HASH_LENGTH));
+    }
+
+    torrent_merkle_pair_hash(pad, pad, pad);
+    return parents;
+}
@@ -8,18 +8,32 @@
 #include "types.h"
 #include "utils/file.h"
 #include "bencode.h"
+#include "merkle.h"
+#include "utils/log.h"
+
+#define TORRENT_METADATA_PATH_MAX 4096
+
+static TorrentMetadata* torrent_metadata_allocate();
+static bool torrent_metadata_info_parse(TorrentMetadata* metadata, const u8* bencode, BencodeObject* bencoded_info);
+static bool torrent_metadata_url_list_parse(TorrentMetadata* metadata, BencodeObject* bencoded_url_list);
+static bool torrent_metadata_files_parse(TorrentMetadata* metadata, BencodeObject* bencoded_files);
+static bool torrent_metadata_file_tree_parse(TorrentMetadata* metadata, BencodeObject* bencoded_file_tree);
+static bool torrent_metadata_file_tree_walk(BencodeObject* bencoded_node, char* path, usize path_length, TorrentMetadataInfoFile** files, usize* files_length, usize* files_capacity);
+static bool torrent_metadata_file_tree_match(TorrentMetadata* metadata, TorrentMetadataInfoFile* leaves, usize leaves_length);
+static bool torrent_metadata_file_tree_align(TorrentMetadata* metadata, TorrentMetadataInfoFile* leaves, usize leaves_length);
+static bool torrent_metadata_file_layer_allocate(TorrentMetadata* metadata, TorrentMetadataInfoFile* file, u64 offset);
+static void torrent_metadata_piece_layers_parse(TorrentMetadata* metadata, BencodeObject* bencoded_piece_layers);
+static char* torrent_metadata_string_copy(BencodeObject* bencoded_string);
+static void torrent_metadata_write(BencodeWriter* writer, TorrentMetadata* metadata);
 
 TorrentMetadata* torrent_metadata_create(const char* filename) {
-    TorrentMetadata* metadata = (TorrentMetadata*) malloc(sizeof(TorrentMetadata));
-	if (!metadata) {
-		fprintf(stderr, "[ERROR] [METADATA] Failed to allocate memory for torrent metadata!\n");
-		return NULL;
-	}
+    TorrentMetadata* metadata = torrent_metadata_allocate();
+	if (!metadata) { return NULL; }
 
     usize bencode_length = 0;
 	u8* bencode = file_to_byte_array(filename, &bencode_length);
 	if (!bencode) {
-		fprintf(stderr, "[ERROR] [METADATA] Failed to open torrent file: %s\n", filename);
+		log_error("METADATA", "Failed to open torrent file: %s", filename);
 		free(metadata);
 		return NULL;
 	}
@@ -27,87 +41,170 @@ TorrentMetadata* torrent_metadata_create(const char* filename) {
 	usize bencode_string_index = 0;
 	BencodeObject* bencoded_metadata = bencode_object_parse(bencode, bencode_length, &bencode_string_index);
 	if (!bencoded_metadata) {
-		fprintf(stderr, "[ERROR] [METADATA] Failed to parse bencoded torrent metadata from file: %s\n", filename);
+		log_error("METADATA", "Failed to parse bencoded torrent metadata from file: %s", filename);
 		free((void*) bencode);
 		free(metadata);
 		return NULL;
 	}
 
-	free((void*) bencode);
-
+	// trackerless torrents have no announce, they rely on the dht
 	BencodeObject* bencoded_announce = bencode_object_dictionary_get(bencoded_metadata, "announce");
+	if (bencoded_announce && bencoded_announce->type == STRING) {
+		metadata->announce = torrent_metadata_string_copy(bencoded_announce);
+		if (!metadata->announce) {
+			log_error("METADATA", "Failed to allocate memory for announce string!");
+			bencode_object_destroy(bencoded_metadata);
+			free((void*) bencode);
+			torrent_metadata_destroy(metadata);
+			return NULL;
+		}
+	}
 
-	metadata->announce = (char*) malloc(sizeof(char) * (bencoded_announce->string_length + 1));
-	if (!metadata->announce) {
-		fprintf(stderr, "[ERROR] [METADATA] Failed to allocate memory for announce string!\n");
+	BencodeObject* bencoded_url_list = bencode_object_dictionary_get(bencoded_metadata, "url-list");
+	if (bencoded_url_list && !torrent_metadata_url_list_parse(metadata, bencoded_url_list)) {
 		bencode_object_destroy(bencoded_metadata);
-		free(metadata);
+		free((void*) bencode);
+		torrent_metadata_destroy(metadata);
 		return NULL;
 	}
 
-	memcpy(metadata->announce, bencoded_announce->string, bencoded_announce->string_length);
-	metadata->announce[bencoded_announce->string_length] = '\0';
-
 	BencodeObject* bencoded_info = bencode_object_dictionary_get(bencoded_metadata, "info");
+	if (!bencoded_info || bencoded_info->type != DICTIONARY) {
+		log_error("METADATA", "Torrent file has no info dictionary: %s", filename);
+		bencode_object_destroy(bencoded_metadata);
+		free((void*) bencode);
+		torrent_metadata_destroy(metadata);
+		return NULL;
+	}
 
-	SHA1(bencoded_info->bencode_data, bencoded_info->bencode_data_length, metadata->info_sha1);
-
-	BencodeObject* bencoded_name = bencode_object_dictionary_get(bencoded_info, "name");
-	BencodeObject* bencoded_length = bencode_object_dictionary_get(bencoded_info, "length");
-	BencodeObject* bencoded_piece_length = bencode_object_dictionary_get(bencoded_info, "piece length");
-	BencodeObject* bencoded_pieces = bencode_object_dictionary_get(bencoded_info, "pieces");
+	SHA1(bencode + bencoded_info->bencode_offset, bencoded_info->bencode_length, metadata->info_sha1);
+	SHA256(bencode + bencoded_info->bencode_offset, bencoded_info->bencode_length, metadata->info_sha256);
 
-	metadata->info.name = (char*) malloc(sizeof(char) * bencoded_name->string_length + 1);
-	if (!metadata->announce) {
-		fprintf(stderr, "[ERROR] [METADATA] Failed to allocate memory for announce string!\n");
-		free(metadata->announce);
+	if (!torrent_metadata_info_parse(metadata, bencode, bencoded_info)) {
 		bencode_object_destroy(bencoded_metadata);
-		free(metadata);
+		free((void*) bencode);
+		torrent_metadata_destroy(metadata);
 		return NULL;
 	}
 
-	memcpy(metadata->info.name, bencoded_name->string, bencoded_name->string_length);
-	metadata->info.name[bencoded_name->string_length] = '\0';
+	// piece layers live outside the info dictionary, peers can fill in any that are missing
+	BencodeObject* bencoded_piece_layers = bencode_object_dictionary_get(bencoded_metadata, "piece layers");
+	if (metadata->info.v2 && bencoded_piece_layers && bencoded_piece_layers->type == DICTIONARY) {
+		torrent_metadata_piece_layers_parse(metadata, bencoded_piece_layers);
+	}
 
-	metadata->info.length = bencoded_length->number;
-	metadata->info.piece_length = bencoded_piece_length->number;
-	metadata->info.piece_count = (bencoded_pieces->string_length / 20);
-	metadata->info.pieces = (u8**) malloc(sizeof(u8*) * metadata->info.piece_count);
-	if (!metadata->info.pieces) {
-		fprintf(stderr, "[ERROR] [METADATA] Failed to allocate memory for piece strings!\n");
-		free(metadata->info.name);
-		free(metadata->announce);
-		bencode_object_destroy(bencoded_metadata);
-		free(metadata);
+	bencode_object_destroy(bencoded_metadata);
+	free((void*) bencode);
+
+	return metadata;
+}
+
+/*
+ * builds metadata from a bare info dictionary, e.g. one fetched from peers for a magnet link.
+ * returns NULL if the dictionary doesn't hash to info_sha1, announce may be NULL
+ */
+TorrentMetadata* torrent_metadata_create_from_info(u8* info, usize info_length, const u8 info_sha1[20], const char* announce) {
+	u8 hash[SHA_DIGEST_LENGTH];
+	SHA1(info, info_length, hash);
+	if (memcmp(hash, info_sha1, SHA_DIGEST_LENGTH) != 0) {
+		log_error("METADATA", "Info dictionary does not match the info hash!");
 		return NULL;
 	}
 
-	for (usize i = 0; i < metadata->info.piece_count; i++) {
-		metadata->info.pieces[i] = (u8*) malloc(sizeof(u8) * 20);
-		if (!metadata->info.pieces[i]) {
-			fprintf(stderr, "[ERROR] [METADATA] Failed to allocate memory for piece string!\n");
-			free(metadata->info.pieces);
-			free(metadata->info.name);
-			free(metadata->announce);
-			bencode_object_destroy(bencoded_metadata);
-			free(metadata);
+    TorrentMetadata* metadata = torrent_metadata_allocate();
+	if (!metadata) { return NULL; }
+
+	memcpy(metadata->info_sha1, hash, SHA_DIGEST_LENGTH);
+	SHA256(info, info_length, metadata->info_sha256);
+
+	if (announce) {
+		metadata->announce = strdup(announce);
+		if (!metadata->announce) {
+			log_error("METADATA", "Failed to allocate memory for announce string!");
+			torrent_metadata_destroy(metadata);
+			return NULL;
 		}
+	}
 
-		memcpy(metadata->info.pieces[i], bencoded_pieces->string + (i * 20), 20);
+	usize index = 0;
+	BencodeObject* bencoded_info = bencode_object_parse(info, info_length, &index);
+	if (!bencoded_info || bencoded_info->type != DICTIONARY || index != info_length) {
+		log_error("METADATA", "Failed to parse bencoded info dictionary!");
+		if (bencoded_info) { bencode_object_destroy(bencoded_info); }
+		torrent_metadata_destroy(metadata);
+		return NULL;
 	}
 
-	bencode_object_destroy(bencoded_metadata);
+	if (!torrent_metadata_info_parse(metadata, info, bencoded_info)) {
+		bencode_object_destroy(bencoded_info);
+		torrent_metadata_destroy(metadata);
+		return NULL;
+	}
+
+	bencode_object_destroy(bencoded_info);
 
 	return metadata;
 }
 
+/* writes a .torrent file, info_data is embedded exactly as it was hashed */
+bool torrent_metadata_save(TorrentMetadata* metadata, const char* filename) {
+	BencodeWriter writer;
+	bencode_writer_init(&writer, NULL, 0);
+	torrent_metadata_write(&writer, metadata);
+	if (!bencode_writer_finish(&writer)) {
+		log_error("METADATA", "Failed to encode torrent metadata!");
+		return false;
+	}
+
+	usize bencode_length = writer.length;
+	u8* bencode = (u8*) malloc(sizeof(u8) * bencode_length);
+	if (!bencode) {
+		log_error("METADATA", "Failed to allocate memory for torrent file!");
+		return false;
+	}
+
+	bencode_writer_init(&writer, bencode, bencode_length);
+	torrent_metadata_write(&writer, metadata);
+
+	FILE* file = fopen(filename, "wb");
+	if (!file) {
+		log_error("METADATA", "Failed to open torrent file for writing: %s", filename);
+		free(bencode);
+		return false;
+	}
+
+	bool success = fwrite(bencode, 1, bencode_length, file) == bencode_length;
+	success = (fclose(file) == 0) && success;
+	if (!success) { log_error("METADATA", "Failed to write torrent file: %s", filename); }
+
+	free(bencode);
+	return success;
+}
+
+/* the 20 bytes that name the torrent in handshakes and announces, v2 only torrents use a truncated SHA-256 */
+const u8* torrent_metadata_info_hash(TorrentMetadata* metadata) {
+	return metadata->info.v1 ? metadata->info_sha1 : metadata->info_sha256;
+}
+
+/* the first file with this pieces root, identical files share one */
+TorrentMetadataInfoFile* torrent_metadata_file_find(TorrentMetadata* metadata, const u8 pieces_root[32]) {
+	for (usize i = 0; i < metadata->info.files_length; i++) {
+		TorrentMetadataInfoFile* file = &metadata->info.files[i];
+		if (file->has_pieces_root && memcmp(file->pieces_root, pieces_root, 32) == 0) { return file; }
+	}
+
+	return NULL;
+}
+
 void torrent_metadata_print(TorrentMetadata* metadata) {
-	printf("announce: %s\n", metadata->announce);
+	printf("announce: %s\n", metadata->announce ? metadata->announce : "(none)");
 	printf("info:\n");
 	printf("\tname: %s\n", metadata->info.name);
-	printf("\tlength: %u\n", metadata->info.length);
-	printf("\tpiece length: %u\n", metadata->info.piece_length);
+	printf("\tlength: %llu\n", (unsigned long long) metadata->info.length);
+	printf("\tpiece length: %zu\n", metadata->info.piece_length);
 	printf("\tpiece count: %u\n", metadata->info.piece_count);
+	if (!metadata->info.pieces) { return; }
+
 	printf("\tpieces (%u out of %u shown):\n", metadata->info.piece_count / 2, metadata->info.piece_count);
 
 	for (usize i = 0; i < metadata->info.piece_count / 2; i++) {
@@ -121,6 +218,20 @@ void torrent_metadata_print(TorrentMetadata* metadata) {
 
 void torrent_metadata_destroy(TorrentMetadata* metadata) {
 	if (metadata->announce) { free(metadata->announce); }
+	if (metadata->announce_list) {
+		for (usize i = 0; i < metadata->announce_list_length; i++) {
+			if (metadata->announce_list[i]) { free(metadata->announce_list[i]); }
+		}
+		free(metadata->announce_list);
+	}
+	if (metadata->url_list) {
+		for (usize i = 0; i < metadata->url_list_length; i++) {
+			if (metadata->url_list[i]) { free(metadata->url_list[i]); }
+		}
+		free(metadata->url_list);
+	}
+	if (metadata->created_by) { free(metadata->created_by); }
+	if (metadata->encoding) { free(metadata->encoding); }
 	if (metadata->info.name) { free(metadata->info.name); }
 	if (metadata->info.pieces) {
 		for (usize i = 0; i < metadata->info.piece_count; i++) {
@@ -128,5 +239,480 @@ void torrent_metadata_destroy(TorrentMetadata* metadata) {
 		}
 		free(metadata->info.pieces);
 	}
+	if (metadata->info.files) {
+		for (usize i = 0; i < metadata->info.files_length; i++) {
+			if (metadata->info.files[i].path) { free(metadata->info.files[i].path); }
+			if (metadata->info.files[i].piece_layer) { free(metadata->info.files[i].piece_layer); }
+		}
+		free(metadata->info.files);
+	}
+	if (metadata->info_data) { free(metadata->info_data); }
 	free(metadata);
 }
+
+static TorrentMetadata* torrent_metadata_allocate() {
+    TorrentMetadata* metadata = (TorrentMetadata*) malloc(sizeof(TorrentMetadata));
+	if (!metadata) {
+		log_error("METADATA", "Failed to allocate memory for torrent metadata!");
+		return NULL;
+	}
+
+	memset(metadata, 0, sizeof(TorrentMetadata));
+	metadata->info.type = SINGLE_FILE;
+
+	return metadata;
+}
+
+/* fills metadata->info and keeps the raw dictionary, copied out of bencode, so it can be handed to other peers */
+static bool torrent_metadata_info_parse(TorrentMetadata* metadata, const u8* bencode, BencodeObject* bencoded_info) {
+	BencodeObject* bencoded_name = bencode_object_dictionary_get(bencoded_info, "name");
+	BencodeObject* bencoded_length = bencode_object_dictionary_get(bencoded_info, "length");
+	BencodeObject* bencoded_files = bencode_object_dictionary_get(bencoded_info, "files");
+	BencodeObject* bencoded_piece_length = bencode_object_dictionary_get(bencoded_info, "piece length");
+	BencodeObject* bencoded_pieces = bencode_object_dictionary_get(bencoded_info, "pieces");
+	BencodeObject* bencoded_meta_version = bencode_object_dictionary_get(bencoded_info, "meta version");
+	BencodeObject* bencoded_file_tree = bencode_object_dictionary_get(bencoded_info, "file tree");
+
+	metadata->info.v1 = bencoded_pieces && bencoded_pieces->type == STRING && bencoded_pieces->string_length % 20 == 0;
+	metadata->info.v2 = bencoded_meta_version && bencoded_meta_version->type == INTEGER && bencoded_meta_version->number == 2
+		&& bencoded_file_tree && bencoded_file_tree->type == DICTIONARY;
+
+	if (!bencoded_name || bencoded_name->type != STRING
+		|| !bencoded_piece_length || bencoded_piece_length->type != INTEGER || bencoded_piece_length->number <= 0
+		|| (bencoded_pieces && !metadata->info.v1) || (!metadata->info.v1 && !metadata->info.v2)) {
+		log_error("METADATA", "Info dictionary is missing required keys!");
+		return false;
+	}
+
+	metadata->info_data = (u8*) malloc(sizeof(u8) * bencoded_info->bencode_length);
+	if (!metadata->info_data) {
+		log_error("METADATA", "Failed to allocate memory for info dictionary!");
+		return false;
+	}
+
+	memcpy(metadata->info_data, bencode + bencoded_info->bencode_offset, bencoded_info->bencode_length);
+	metadata->info_data_length = bencoded_info->bencode_length;
+
+	metadata->info.name = torrent_metadata_string_copy(bencoded_name);
+	if (!metadata->info.name) {
+		log_error("METADATA", "Failed to allocate memory for name string!");
+		return false;
+	}
+
+	metadata->info.piece_length = bencoded_piece_length->number;
+
+	// a v2 only torrent has no v1 file list, its layout comes from the file tree
+	if (!metadata->info.v1) { return torrent_metadata_file_tree_parse(metadata, bencoded_file_tree); }
+
+	if (bencoded_length && bencoded_length->type == INTEGER) {
+		metadata->info.type = SINGLE_FILE;
+		metadata->info.length = bencoded_length->number;
+	} else if (bencoded_files && bencoded_files->type == LIST) {
+		metadata->info.type = MULTIPLE_FILES;
+		if (!torrent_metadata_files_parse(metadata, bencoded_files)) { return false; }
+	} else {
+		log_error("METADATA", "Info dictionary has neither length nor files!");
+		return false;
+	}
+
+	metadata->info.piece_count = (bencoded_pieces->string_length / 20);
+	metadata->info.pieces = (u8**) calloc(metadata->info.piece_count, sizeof(u8*));
+	if (!metadata->info.pieces) {
+		log_error("METADATA", "Failed to allocate memory for piece strings!");
+		return false;
+	}
+
+	for (usize i = 0; i < metadata->info.piece_count; i++) {
+		metadata->info.pieces[i] = (u8*) malloc(sizeof(u8) * 20);
+		if (!metadata->info.pieces[i]) {
+			log_error("METADATA", "Failed to allocate memory for piece string!");
+			return false;
+		}
+
+		memcpy(metadata->info.pieces[i], bencoded_pieces->string + (i * 20), 20);
+	}
+
+	return !metadata->info.v2 || torrent_metadata_file_tree_parse(metadata, bencoded_file_tree);
+}
+
+/* each file's path list is joined with '/', info.length becomes the sum of all files */
+static bool torrent_metadata_files_parse(TorrentMetadata* metadata, BencodeObject* bencoded_files) {
+	metadata->info.files = (TorrentMetadataInfoFile*) calloc(bencoded_files->list_length, sizeof(TorrentMetadataInfoFile));
+	if (!metadata->info.files) {
+		log_error("METADATA", "Failed to allocate memory for files!");
+		return false;
+	}
+	metadata->info.files_length = bencoded_files->list_length;
+	metadata->info.length = 0;
+
+	for (usize i = 0; i < bencoded_files->list_length; i++) {
+		BencodeObject* bencoded_file_length = bencode_object_dictionary_get(bencoded_files->list[i], "length");
+		BencodeObject* bencoded_path = bencode_object_dictionary_get(bencoded_files->list[i], "path");
+		BencodeObject* bencoded_attr = bencode_object_dictionary_get(bencoded_files->list[i], "attr");
+		if (!bencoded_file_length || bencoded_file_length->type != INTEGER || bencoded_file_length->number < 0
+			|| !bencoded_path || bencoded_path->type != LIST || bencoded_path->list_length == 0) {
+			log_error("METADATA", "File %zu in info dictionary is invalid!", i);
+			return false;
+		}
+
+		usize path_length = 0;
+		for (usize j = 0; j < bencoded_path->list_length; j++) {
+			if (bencoded_path->list[j]->type != STRING) {
+				log_error("METADATA", "File %zu has an invalid path!", i);
+				return false;
+			}
+			path_length += bencoded_path->list[j]->string_length + 1;
+		}
+
+		char* path = (char*) malloc(sizeof(char) * path_length);
+		if (!path) {
+			log_error("METADATA", "Failed to allocate memory for file path!");
+			return false;
+		}
+
+		char* position = path;
+		for (usize j = 0; j < bencoded_path->list_length; j++) {
+			memcpy(position, bencoded_path->list[j]->string, bencoded_path->list[j]->string_length);
+			position += bencoded_path->list[j]->string_length;
+			*position = (j == bencoded_path->list_length - 1) ? '\0' : '/';
+			position++;
+		}
+
+		metadata->info.files[i].path = path;
+		metadata->info.files[i].length = bencoded_file_length->number;
+		metadata->info.files[i].padding = bencoded_attr && bencoded_attr->type == STRING && memchr(bencoded_attr->string, 'p', bencoded_attr->string_length);
+		metadata->info.length += bencoded_file_length->number;
+	}
+
+	return true;
+}
+
+/*
+ * walks the v2 file tree (BEP 52). a hybrid torrent must list the same files in the same
+ * order as its v1 file list, a v2 only torrent gets its whole layout from the tree
+ */
+static bool torrent_metadata_file_tree_parse(TorrentMetadata* metadata, BencodeObject* bencoded_file_tree) {
+	usize piece_length = metadata->info.piece_length;
+	if (piece_length < TORRENT_MERKLE_BLOCK_LENGTH || (piece_length & (piece_length - 1)) != 0) {
+		log_error("METADATA", "Piece length %zu is not a power of two of at least 16 KiB!", piece_length);
+		return false;
+	}
+
+	char path[TORRENT_METADATA_PATH_MAX];
+	TorrentMetadataInfoFile* leaves = NULL;
+	usize leaves_length = 0;
+	usize leaves_capacity = 0;
+
+	bool success = torrent_metadata_file_tree_walk(bencoded_file_tree, path, 0, &leaves, &leaves_length, &leaves_capacity);
+	if (success && leaves_length == 0) {
+		log_error("METADATA", "File tree has no files!");
+		success = false;
+	}
+	if (success) {
+		success = metadata->info.v1 ? torrent_metadata_file_tree_match(metadata, leaves, leaves_length) : torrent_metadata_file_tree_align(metadata, leaves, leaves_length);
+	}
+
+	for (usize i = 0; i < leaves_length; i++) {
+		if (leaves[i].path) { free(leaves[i].path); }
+	}
+	if (leaves) { free(leaves); }
+
+	return success;
+}
+
+/* collects every file below bencoded_node in order, path holds the components above it */
+static bool torrent_metadata_file_tree_walk(BencodeObject* bencoded_node, char* path, usize path_length, TorrentMetadataInfoFile** files, usize* files_length, usize* files_capacity) {
+	for (usize i = 0; i < bencoded_node->dictionary_length; i++) {
+		BencodeObject* bencoded_name = bencoded_node->dictionary[i].key;
+		BencodeObject* bencoded_child = bencoded_node->dictionary[i].value;
+		if (bencoded_child->type != DICTIONARY || bencoded_name->string_length == 0
+			|| memchr(bencoded_name->string, '/', bencoded_name->string_length)
+			|| path_length + bencoded_name->string_length + 2 > TORRENT_METADATA_PATH_MAX) {
+			log_error("METADATA", "File tree has an invalid entry!");
+			return false;
+		}
+
+		usize child_path_length = path_length;
+		if (child_path_length > 0) {
+			path[child_path_length] = '/';
+			child_path_length++;
+		}
+		memcpy(path + child_path_length, bencoded_name->string, bencoded_name->string_length);
+		child_path_length += bencoded_name->string_length;
+		path[child_path_length] = '\0';
+
+		// files are the nodes with an empty key, everything else is a directory
+		BencodeObject* bencoded_file = bencode_object_dictionary_get(bencoded_child, "");
+		if (!bencoded_file) {
+			if (!torrent_metadata_file_tree_walk(bencoded_child, path, child_path_length, files, files_length, files_capacity)) { return false; }
+			continue;
+		}
+
+		BencodeObject* bencoded_length = bencode_object_dictionary_get(bencoded_file, "length");
+		BencodeObject* bencoded_pieces_root = bencode_object_dictionary_get(bencoded_file, "pieces root");
+		if (bencoded_file->type != DICTIONARY || !bencoded_length || bencoded_length->type != INTEGER || bencoded_length->number < 0
+			|| (bencoded_length->number > 0 && (!bencoded_pieces_root || bencoded_pieces_root->type != STRING || bencoded_pieces_root->string_length != 32))) {
+			log_error("METADATA", "File %s in the file tree is invalid!", path);
+			return false;
+		}
+
+		if (*files_length == *files_capacity) {
+			usize capacity = (*files_capacity > 0) ? *files_capacity * 2 : 16;
+			TorrentMetadataInfoFile* temp = (TorrentMetadataInfoFile*) realloc(*files, sizeof(TorrentMetadataInfoFile) * capacity);
+			if (!temp) {
+				log_error("METADATA", "Failed to allocate memory for files!");
+				return false;
+			}
+			*files = temp;
+			*files_capacity = capacity;
+		}
+
+		TorrentMetadataInfoFile* file = &(*files)[*files_length];
+		memset(file, 0, sizeof(TorrentMetadataInfoFile));
+		(*files_length)++;
+
+		file->path = strdup(path);
+		if (!file->path) {
+			log_error("METADATA", "Failed to allocate memory for file path!");
+			return false;
+		}
+
+		file->length = bencoded_length->number;
+		if (file->length > 0) {
+			file->has_pieces_root = true;
+			memcpy(file->pieces_root, bencoded_pieces_root->string, 32);
+		}
+	}
+
+	return true;
+}
+
+/* gives the v1 files of a hybrid torrent their v2 roots, padding files have no counterpart in the tree */
+static bool torrent_metadata_file_tree_match(TorrentMetadata* metadata, TorrentMetadataInfoFile* leaves, usize leaves_length) {
+	if (metadata->info.type == SINGLE_FILE) {
+		if (leaves_length != 1 || leaves[0].length != metadata->info.length) {
+			log_error("METADATA", "File tree does not match the v1 file!");
+			return false;
+		}
+
+		metadata->info.files = (TorrentMetadataInfoFile*) calloc(1, sizeof(TorrentMetadataInfoFile));
+		if (!metadata->info.files) {
+			log_error("METADATA", "Failed to allocate memory for files!");
+			return false;
+		}
+		metadata->info.files_length = 1;
+
+		TorrentMetadataInfoFile* file = &metadata->info.files[0];
+		file->length = leaves[0].length;
+		file->has_pieces_root = leaves[0].has_pieces_root;
+		memcpy(file->pieces_root, leaves[0].pieces_root, 32);
+
+		return !file->has_pieces_root || torrent_metadata_file_layer_allocate(metadata, file, 0);
+	}
+
+	usize leaf = 0;
+	u64 offset = 0;
+	for (usize i = 0; i < metadata->info.files_length; i++) {
+		TorrentMetadataInfoFile* file = &metadata->info.files[i];
+		u64 file_offset = offset;
+		offset += file->length;
+		if (file->padding) { continue; }
+
+		if (leaf == leaves_length || leaves[leaf].length != file->length || strcmp(leaves[leaf].path, file->path) != 0) {
+			log_error("METADATA", "File tree does not match the v1 file list at %s!", file->path);
+			return false;
+		}
+
+		file->has_pieces_root = leaves[leaf].has_pieces_root;
+		memcpy(file->pieces_root, leaves[leaf].pieces_root, 32);
+		leaf++;
+
+		if (file->has_pieces_root && !torrent_metadata_file_layer_allocate(metadata, file, file_offset)) { return false; }
+	}
+
+	if (leaf != leaves_length) {
+		log_error("METADATA", "File tree has files the v1 file list does not!");
+		return false;
+	}
+
+	return true;
+}
+
+/* a v2 only torrent has no v1 list, its files are laid out in tree order with padding up to the next piece */
+static bool torrent_metadata_file_tree_align(TorrentMetadata* metadata, TorrentMetadataInfoFile* leaves, usize leaves_length) {
+	usize piece_length = metadata->info.piece_length;
+
+	// a lone file named like the torrent is stored like a v1 single file torrent
+	bool single = leaves_length == 1 && strcmp(leaves[0].path, metadata->info.name) == 0;
+	metadata->info.type = single ? SINGLE_FILE : MULTIPLE_FILES;
+
+	metadata->info.files = (TorrentMetadataInfoFile*) calloc(leaves_length * 2, sizeof(TorrentMetadataInfoFile));
+	if (!metadata->info.files) {
+		log_error("METADATA", "Failed to allocate memory for files!");
+		return false;
+	}
+
+	u64 offset = 0;
+	for (usize i = 0; i < leaves_length; i++) {
+		TorrentMetadataInfoFile* file = &metadata->info.files[metadata->info.files_length];
+		metadata->info.files_length++;
+
+		*file = leaves[i];
+		leaves[i].path = NULL;
+		if (single) {
+			free(file->path);
+			file->path = NULL;
+		}
+
+		if (file->has_pieces_root && !torrent_metadata_file_layer_allocate(metadata, file, offset)) { return false; }
+		offset += file->length;
+
+		u64 remainder = offset % piece_length;
+		if (i == leaves_length - 1 || remainder == 0) { continue; }
+
+		TorrentMetadataInfoFile* padding = &metadata->info.files[metadata->info.files_length];
+		metadata->info.files_length++;
+		padding->length = piece_length - remainder;
+		padding->padding = true;
+		offset += padding->length;
+	}
+
+	metadata->info.length = offset;
+	metadata->info.piece_count = (offset + piece_length - 1) / piece_length;
+
+	return true;
+}
+
+/* places a v2 file at offset in the piece stream, files longer than a piece get room for their piece layer */
+static bool torrent_metadata_file_layer_allocate(TorrentMetadata* metadata, TorrentMetadataInfoFile* file, u64 offset) {
+	usize piece_length = metadata->info.piece_length;
+	if (offset % piece_length != 0) {
+		log_error("METADATA", "File %s does not start on a piece boundary!", file->path ? file->path : metadata->info.name);
+		return false;
+	}
+
+	file->first_piece = offset / piece_length;
+	file->pieces_length = (file->length + piece_length - 1) / piece_length;
+	if (file->length <= piece_length) { return true; }
+
+	file->piece_layer = (u8*) calloc(file->pieces_length, TORRENT_MERKLE_HASH_LENGTH);
+	if (!file->piece_layer) {
+		log_error("METADATA", "Failed to allocate memory for a piece layer!");
+		return false;
+	}
+
+	return true;
+}
+
+/* fills in the piece layers the torrent file carries, a layer that doesn't hash to its file's root is left unknown */
+static void torrent_metadata_piece_layers_parse(TorrentMetadata* metadata, BencodeObject* bencoded_piece_layers) {
+	u8 pad[TORRENT_MERKLE_HASH_LENGTH];
+	torrent_merkle_pad_hash(torrent_merkle_layers(metadata->info.piece_length / TORRENT_MERKLE_BLOCK_LENGTH), pad);
+
+	for (usize i = 0; i < metadata->info.files_length; i++) {
+		TorrentMetadataInfoFile* file = &metadata->info.files[i];
+		if (!file->piece_layer) { continue; }
+
+		for (usize j = 0; j < bencoded_piece_layers->dictionary_length; j++) {
+			BencodeObject* bencoded_root = bencoded_piece_layers->dictionary[j].key;
+			BencodeObject* bencoded_layer = bencoded_piece_layers->dictionary[j].value;
+			if (bencoded_root->string_length != 32 || memcmp(bencoded_root->string, file->pieces_root, 32) != 0) { continue; }
+
+			u8 root[TORRENT_MERKLE_HASH_LENGTH];
+			bool valid = bencoded_layer->type == STRING && bencoded_layer->string_length == (usize) file->pieces_length * TORRENT_MERKLE_HASH_LENGTH
+				&& torrent_merkle_root(bencoded_layer->string, file->pieces_length, (usize) 1 << torrent_merkle_layers(file->pieces_length), pad, root)
+				&& memcmp(root, file->pieces_root, TORRENT_MERKLE_HASH_LENGTH) == 0;
+
+			if (valid) {
+				memcpy(file->piece_layer, bencoded_layer->string, bencoded_layer->string_length);
+			} else {
+				log_warn("METADATA", "Piece layer of %s does not match its pieces root!", file->path ? file->path : metadata->info.name);
+			}
+			break;
+		}
+	}
+}
+
+/* a single url or a list of them, entries that aren't strings are skipped */
+static bool torrent_metadata_url_list_parse(TorrentMetadata* metadata, BencodeObject* bencoded_url_list) {
+	usize urls_length = (bencoded_url_list->type == LIST) ? bencoded_url_list->list_length : 1;
+	if (bencoded_url_list->type != LIST && bencoded_url_list->type != STRING) { return true; }
+	if (urls_length == 0) { return true; }
+
+	metadata->url_list = (char**) calloc(urls_length, sizeof(char*));
+	if (!metadata->url_list) {
+		log_error("METADATA", "Failed to allocate memory for url list!");
+		return false;
+	}
+
+	for (usize i = 0; i < urls_length; i++) {
+		BencodeObject* bencoded_url = (bencoded_url_list->type == LIST) ? bencoded_url_list->list[i] : bencoded_url_list;
+		if (bencoded_url->type != STRING || bencoded_url->string_length == 0) { continue; }
+
+		metadata->url_list[metadata->url_list_length] = torrent_metadata_string_copy(bencoded_url);
+		if (!metadata->url_list[metadata->url_list_length]) {
+			log_error("METADATA", "Failed to allocate memory for url!");
+			return false;
+		}
+		metadata->url_list_length++;
+	}
+
+	return true;
+}
+
+/* MUST BE FREED */
+static char* torrent_metadata_string_copy(BencodeObject* bencoded_string) {
+	char* string = (char*) malloc(sizeof(char) * (bencoded_string->string_length + 1));
+	if (!string) { return NULL; }
+
+	memcpy(string, bencoded_string->string, bencoded_string->string_length);
+	string[bencoded_string->string_length] = '\0';
+
+	return string;
+}
+
+/* announce-list puts every tracker in a tier of its own (BEP 12), keys in sorted order */
+static void torrent_metadata_write(BencodeWriter* writer, TorrentMetadata* metadata) {
+	bencode_writer_dictionary_begin(writer);
+
+	if (metadata->announce) {
+		bencode_writer_key(writer, "announce");
+		bencode_writer_text(writer, metadata->announce);
+	}
+	if (metadata->announce_list_length > 0) {
+		bencode_writer_key(writer, "announce-list");
+		bencode_writer_list_begin(writer);
+		for (usize i = 0; i < metadata->announce_list_length; i++) {
+			bencode_writer_list_begin(writer);
+			bencode_writer_text(writer, metadata->announce_list[i]);
+			bencode_writer_end(writer);
+		}
+		bencode_writer_end(writer);
+	}
+	if (metadata->created_by) {
+		bencode_writer_key(writer, "created by");
+		bencode_writer_text(writer, metadata->created_by);
+	}
+	if (metadata->creation_date != 0) {
+		bencode_writer_key(writer, "creation date");
+		bencode_writer_integer(writer, metadata->creation_date);
+	}
+	if (metadata->encoding) {
+		bencode_writer_key(writer, "encoding");
+		bencode_writer_text(writer, metadata->encoding);
+	}
+
+	bencode_writer_key(writer, "info");
+	bencode_writer_raw(writer, metadata->info_data, metadata->info_data_length);
+
+	if (metadata->url_list_length > 0) {
+		bencode_writer_key(writer, "url-list");
+		bencode_writer_list_begin(writer);
+		for (usize i = 0; i < metadata->url_list_length; i++) {
+			bencode_writer_text(writer, metadata->url_list[i]);
+		}
+		bencode_writer_end(writer);
+	}
+
+	bencode_writer_end(writer);
+}
@@ -0,0 +1,234 @@
+#include "metadata_exchange.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bencode.h"
+#include "extension.h"
+#include "peer.h"
+#include "types.h"
+#include "utils/log.h"
+#include "utils/time.h"
+
+typedef struct TorrentMetadataExchangeMessage {
+    TorrentMetadataExchangeMessageType type;
+    u32 piece;
+    usize total_size; // data messages only
+} TorrentMetadataExchangeMessage;
+
+static bool torrent_metadata_exchange_size_set(TorrentMetadataExchange* exchange, usize length);
+static u32 torrent_metadata_exchange_piece_length(TorrentMetadataExchange* exchange, u32 piece);
+static bool torrent_metadata_exchange_serve(TorrentMetadataExchange* exchange, TorrentPeer* peer, u32 piece);
+static void torrent_metadata_exchange_message_write(BencodeWriter* writer, const void* context);
+static void torrent_metadata_exchange_receive(TorrentMetadataExchange* exchange, TorrentPeer* peer, u32 piece, BencodeObject* total_size, const u8* data, usize data_length);
+
+/* info is NULL for magnet links, otherwise it is the dictionary we serve to other peers */
+TorrentMetadataExchange* torrent_metadata_exchange_create(const u8* info, usize info_length) {
+    TorrentMetadataExchange* exchange = (TorrentMetadataExchange*) malloc(sizeof(TorrentMetadataExchange));
+    if (!exchange) {
+        log_error("METADATA EXCHANGE", "Failed to allocate memory for metadata exchange!");
+        return NULL;
+    }
+
+    memset(exchange, 0, sizeof(TorrentMetadataExchange));
+
+    if (info) {
+        if (!torrent_metadata_exchange_size_set(exchange, info_length)) {
+            torrent_metadata_exchange_destroy(exchange);
+            return NULL;
+        }
+
+        memcpy(exchange->data, info, info_length);
+        for (u32 i = 0; i < exchange->pieces_length; i++) {
+            exchange->pieces[i].state = TORRENT_METADATA_PIECE_RECEIVED;
+        }
+        exchange->pieces_received = exchange->pieces_length;
+    }
+
+    return exchange;
+}
+
+/*
+ * keeps up to TORRENT_METADATA_EXCHANGE_PEER_REQUESTS_MAX pieces in flight to the peer so
+ * the dictionary is fetched from several peers at once. returns false only if sending failed
+ */
+bool torrent_metadata_exchange_request(TorrentMetadataExchange* exchange, TorrentPeer* peer) {
+    if (torrent_metadata_exchange_complete(exchange)) { return true; }
+
+    u32 metadata_size = peer->extensions.metadata_size;
+    if (peer->extensions.ut_metadata == 0 || metadata_size == 0 || metadata_size > TORRENT_METADATA_EXCHANGE_SIZE_MAX) { return true; }
+
+    // the first size we hear about wins, peers that disagree are probably on another torrent
+    if (exchange->length == 0 && !torrent_metadata_exchange_size_set(exchange, metadata_size)) { return true; }
+    if (exchange->length != metadata_size) { return true; }
+
+    u32 requested = 0;
+    for (u32 i = 0; i < exchange->pieces_length; i++) {
+        if (exchange->pieces[i].state == TORRENT_METADATA_PIECE_REQUESTED && exchange->pieces[i].peer == peer) { requested++; }
+    }
+
+    i64 now = time_now_ms();
+    for (u32 i = 0; i < exchange->pieces_length && requested < TORRENT_METADATA_EXCHANGE_PEER_REQUESTS_MAX; i++) {
+        TorrentMetadataExchangePiece* piece = &exchange->pieces[i];
+        if (piece->state != TORRENT_METADATA_PIECE_MISSING) { continue; }
+
+        TorrentMetadataExchangeMessage message = { .type = TORRENT_METADATA_EXCHANGE_REQUEST, .piece = i };
+        if (!torrent_extension_message_encode(peer, peer->extensions.ut_metadata, torrent_metadata_exchange_message_write, &message, NULL, 0)) { return false; }
+
+        piece->state = TORRENT_METADATA_PIECE_REQUESTED;
+        piece->peer = peer;
+        piece->requested_at = now;
+        requested++;
+    }
+
+    return true;
+}
+
+/* false means the message was malformed and the peer should be dropped */
+bool torrent_metadata_exchange_handle(TorrentMetadataExchange* exchange, TorrentPeer* peer, const u8* payload, usize payload_length) {
+    // data messages carry the raw piece right after the dictionary, only the dictionary is parsed
+    usize dictionary_length = (payload_length < TORRENT_METADATA_EXCHANGE_DICTIONARY_MAX) ? payload_length : TORRENT_METADATA_EXCHANGE_DICTIONARY_MAX;
+    usize index = 0;
+    BencodeObject* message = bencode_object_parse((u8*) payload, dictionary_length, &index);
+    if (!message || message->type != DICTIONARY) {
+        log_peer_warn("METADATA EXCHANGE", peer->ip, peer->port, "Message is invalid!");
+        if (message) { bencode_object_destroy(message); }
+        return false;
+    }
+
+    BencodeObject* message_type = bencode_object_dictionary_get(message, "msg_type");
+    BencodeObject* piece = bencode_object_dictionary_get(message, "piece");
+    if (!message_type || message_type->type != INTEGER || !piece || piece->type != INTEGER || piece->number < 0) {
+        log_peer_warn("METADATA EXCHANGE", peer->ip, peer->port, "Message is missing msg_type or piece!");
+        bencode_object_destroy(message);
+        return false;
+    }
+
+    bool success = true;
+    switch (message_type->number) {
+        case TORRENT_METADATA_EXCHANGE_REQUEST: success = torrent_metadata_exchange_serve(exchange, peer, piece->number); break;
+        case TORRENT_METADATA_EXCHANGE_DATA: {
+            BencodeObject* total_size = bencode_object_dictionary_get(message, "total_size");
+            torrent_metadata_exchange_receive(exchange, peer, piece->number, total_size, payload + index, payload_length - index);
+        } break;
+        case TORRENT_METADATA_EXCHANGE_REJECT: {
+            if ((u32) piece->number < exchange->pieces_length && exchange->pieces[piece->number].peer == peer
+                && exchange->pieces[piece->number].state == TORRENT_METADATA_PIECE_REQUESTED) {
+                exchange->pieces[piece->number].state = TORRENT_METADATA_PIECE_MISSING;
+            }
+
+            // it doesn't have the metadata (yet), stop asking it
+            peer->extensions.metadata_size = 0;
+        } break;
+        default: break; // unknown message types must be ignored
+    }
+
+    bencode_object_destroy(message);
+    return success;
+}
+
+/* hands pieces that a peer sat on for too long back to everyone else */
+void torrent_metadata_exchange_maintain(TorrentMetadataExchange* exchange) {
+    i64 now = time_now_ms();
+    for (u32 i = 0; i < exchange->pieces_length; i++) {
+        TorrentMetadataExchangePiece* piece = &exchange->pieces[i];
+        if (piece->state == TORRENT_METADATA_PIECE_REQUESTED && now - piece->requested_at > TORRENT_METADATA_EXCHANGE_REQUEST_TIMEOUT_MS) {
+            piece->state = TORRENT_METADATA_PIECE_MISSING;
+            piece->peer = NULL;
+        }
+    }
+}
+
+void torrent_metadata_exchange_peer_release(TorrentMetadataExchange* exchange, TorrentPeer* peer) {
+    for (u32 i = 0; i < exchange->pieces_length; i++) {
+        TorrentMetadataExchangePiece* piece = &exchange->pieces[i];
+        if (piece->peer != peer) { continue; }
+
+        if (piece->state == TORRENT_METADATA_PIECE_REQUESTED) { piece->state = TORRENT_METADATA_PIECE_MISSING; }
+        piece->peer = NULL;
+    }
+}
+
+bool torrent_metadata_exchange_complete(TorrentMetadataExchange* exchange) {
+    return exchange->length > 0 && exchange->pieces_received == exchange->pieces_length;
+}
+
+/* throws away everything fetched so far, used when the result didn't match the info hash */
+void torrent_metadata_exchange_reset(TorrentMetadataExchange* exchange) {
+    if (exchange->data) { free(exchange->data); }
+    if (exchange->pieces) { free(exchange->pieces); }
+    memset(exchange, 0, sizeof(TorrentMetadataExchange));
+}
+
+void torrent_metadata_exchange_destroy(TorrentMetadataExchange* exchange) {
+    torrent_metadata_exchange_reset(exchange);
+    free(exchange);
+}
+
+static bool torrent_metadata_exchange_size_set(TorrentMetadataExchange* exchange, usize length) {
+    exchange->pieces_length = (length + TORRENT_METADATA_EXCHANGE_PIECE_LENGTH - 1) / TORRENT_METADATA_EXCHANGE_PIECE_LENGTH;
+    exchange->pieces = (TorrentMetadataExchangePiece*) calloc(exchange->pieces_length, sizeof(TorrentMetadataExchangePiece));
+    exchange->data = (u8*) malloc(sizeof(u8) * length);
+    if (!exchange->pieces || !exchange->data) {
+        log_error("METADATA EXCHANGE", "Failed to allocate memory for %zu bytes of metadata!", length);
+        torrent_metadata_exchange_reset(exchange);
+        return false;
+    }
+
+    exchange->length = length;
+    exchange->pieces_received = 0;
+    return true;
+}
+
+static u32 torrent_metadata_exchange_piece_length(TorrentMetadataExchange* exchange, u32 piece) {
+    usize begin = (usize) piece * TORRENT_METADATA_EXCHANGE_PIECE_LENGTH;
+    return (exchange->length - begin < TORRENT_METADATA_EXCHANGE_PIECE_LENGTH) ? exchange->length - begin : TORRENT_METADATA_EXCHANGE_PIECE_LENGTH;
+}
+
+/* sends the piece if we have the whole dictionary, a reject otherwise */
+static bool torrent_metadata_exchange_serve(TorrentMetadataExchange* exchange, TorrentPeer* peer, u32 piece) {
+    if (peer->extensions.ut_metadata == 0) { return true; } // no id to answer with
+
+    if (!torrent_metadata_exchange_complete(exchange) || piece >= exchange->pieces_length) {
+        TorrentMetadataExchangeMessage reject = { .type = TORRENT_METADATA_EXCHANGE_REJECT, .piece = piece };
+        return torrent_extension_message_encode(peer, peer->extensions.ut_metadata, torrent_metadata_exchange_message_write, &reject, NULL, 0);
+    }
+
+    // the piece follows the dictionary and is copied once, straight into the send buffer
+    TorrentMetadataExchangeMessage data = { .type = TORRENT_METADATA_EXCHANGE_DATA, .piece = piece, .total_size = exchange->length };
+    const u8* piece_data = exchange->data + ((usize) piece * TORRENT_METADATA_EXCHANGE_PIECE_LENGTH);
+    return torrent_extension_message_encode(peer, peer->extensions.ut_metadata, torrent_metadata_exchange_message_write, &data, piece_data, torrent_metadata_exchange_piece_length(exchange, piece));
+}
+
+static void torrent_metadata_exchange_message_write(BencodeWriter* writer, const void* context) {
+    const TorrentMetadataExchangeMessage* message = (const TorrentMetadataExchangeMessage*) context;
+
+    bencode_writer_dictionary_begin(writer);
+    bencode_writer_key(writer, "msg_type");
+    bencode_writer_integer(writer, message->type);
+    bencode_writer_key(writer, "piece");
+    bencode_writer_integer(writer, message->piece);
+    if (message->type == TORRENT_METADATA_EXCHANGE_DATA) {
+        bencode_writer_key(writer, "total_size");
+        bencode_writer_integer(writer, message->total_size);
+    }
+    bencode_writer_end(writer);
+}
+
+/* pieces that don't fit the size we settled on are dropped, they may still come from a different peer */
+static void torrent_metadata_exchange_receive(TorrentMetadataExchange* exchange, TorrentPeer* peer, u32 piece, BencodeObject* total_size, const u8* data, usize data_length) {
+    if (piece >= exchange->pieces_length || exchange->pieces[piece].state == TORRENT_METADATA_PIECE_RECEIVED) { return; }
+    if (total_size && (total_size->type != INTEGER || (usize) total_size->number != exchange->length)) { return; }
+
+    if (data_length != torrent_metadata_exchange_piece_length(exchange, piece)) {
+        log_peer_warn("METADATA EXCHANGE", peer->ip, peer->port, "Piece %u has the wrong length!", piece);
+        return;
+    }
+
+    memcpy(exchange->data + ((usize) piece * TORRENT_METADATA_EXCHANGE_PIECE_LENGTH), data, data_length);
+    exchange->pieces[piece].state = TORRENT_METADATA_PIECE_RECEIVED;
+    exchange->pieces[piece].peer = NULL;
+    exchange->pieces_received++;
+
+    log_peer_info("METADATA EXCHANGE", peer->ip, peer->port, "Piece %u received (%u/%u)", piece, exchange->pieces_received, exchange->pieces_length);
+}
@@ -0,0 +1,371 @@
+#include "metrics.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "utils/log.h"
+
+#define TORRENT_METRICS_HISTOGRAM_VALUE_MAX ((1ULL << 40) - 1)
+#define TORRENT_METRICS_REQUEST_TIMEOUT_MS 100
+
+/* one per thread, aligned so two threads never write the same cache line */
+typedef struct __attribute__((aligned(64))) TorrentMetricsSlot {
+    u64 counters[TORRENT_METRICS_COUNTERS_LENGTH];
+    u64 buckets[TORRENT_METRICS_HISTOGRAMS_LENGTH][TORRENT_METRICS_HISTOGRAM_BUCKETS];
+    u64 sums[TORRENT_METRICS_HISTOGRAMS_LENGTH];
+} TorrentMetricsSlot;
+
+static const char* torrent_metrics_counter_names[][2] = {
+    [TORRENT_METRICS_PEERS_DIALED] = { "peers_dialed", "Outgoing peer connections started." },
+    [TORRENT_METRICS_PEERS_CONNECTED] = { "peers_connected", "Outgoing peer connections established." },
+    [TORRENT_METRICS_PEERS_HANDSHAKED] = { "peers_handshaked", "Peers that completed the BitTorrent handshake." },
+    [TORRENT_METRICS_PEERS_DISCONNECTED] = { "peers_disconnected", "Peer connections closed for any reason." },
+    [TORRENT_METRICS_BYTES_DOWNLOADED] = { "bytes_downloaded", "Block payload bytes received." },
+    [TORRENT_METRICS_BYTES_UPLOADED] = { "bytes_uploaded", "Block payload bytes sent." },
+    [TORRENT_METRICS_BLOCKS_REQUESTED] = { "blocks_requested", "Block requests sent." },
+    [TORRENT_METRICS_BLOCKS_RECEIVED] = { "blocks_received", "Blocks received, requested or not." },
+    [TORRENT_METRICS_BLOCKS_REJECTED] = { "blocks_rejected", "Block requests rejected by peers." },
+    [TORRENT_METRICS_REQUESTS_TIMED_OUT] = { "requests_timed_out", "Request pipelines taken back after a timeout." },
+    [TORRENT_METRICS_PIECES_VERIFIED] = { "pieces_verified", "Pieces that passed hash verification and were written." },
+    [TORRENT_METRICS_PIECES_FAILED] = { "pieces_failed", "Pieces that failed hash verification or could not be written." },
+    [TORRENT_METRICS_BLOCKS_FAILED] = { "blocks_failed", "Blocks that did not match their v2 block hash." },
+    [TORRENT_METRICS_WEB_SEED_BYTES] = { "web_seed_bytes", "Block payload bytes received from web seeds." },
+    [TORRENT_METRICS_PEERS_BANNED] = { "peers_banned", "Addresses banned for sending data that failed a hash check." },
+};
+
+static const char* torrent_metrics_histogram_names[][2] = {
+    [TORRENT_METRICS_CONNECT_TIME] = { "connect", "Time from dialing a peer to the TCP connection being established." },
+    [TORRENT_METRICS_HANDSHAKE_TIME] = { "handshake", "Time from sending our handshake to receiving the peer's." },
+    [TORRENT_METRICS_BLOCK_LATENCY] = { "block_request", "Time from sending a block request to receiving the block." },
+    [TORRENT_METRICS_HASH_TIME] = { "hash", "Time spent hashing a finished piece." },
+    [TORRENT_METRICS_DISK_WRITE_TIME] = { "disk_write", "Time spent writing a verified piece to storage." },
+    [TORRENT_METRICS_STREAM_STALL_TIME] = { "stream_stall", "Time a stream read waited for its piece to be verified." },
+};
+
+static TorrentMetricsSlot torrent_metrics_slots[TORRENT_METRICS_SLOTS];
+static u32 torrent_metrics_slots_used;
+static __thread i32 torrent_metrics_slot = -1;
+
+static TorrentMetricsSlot* torrent_metrics_slot_get();
+static u32 torrent_metrics_bucket_index(u64 value);
+static u64 torrent_metrics_bucket_lower(u32 index);
+static u64 torrent_metrics_histogram_merge(TorrentMetricsHistogram histogram, u64 buckets[TORRENT_METRICS_HISTOGRAM_BUCKETS], u64* sum);
+
+void torrent_metrics_count(TorrentMetricsCounter counter, u64 value) {
+    __atomic_fetch_add(&torrent_metrics_slot_get()->counters[counter], value, __ATOMIC_RELAXED);
+}
+
+/* negative values (a clock that went backwards) are recorded as 0 */
+void torrent_metrics_record(TorrentMetricsHistogram histogram, i64 value_us) {
+    u64 value = (value_us > 0) ? (u64) value_us : 0;
+    if (value > TORRENT_METRICS_HISTOGRAM_VALUE_MAX) { value = TORRENT_METRICS_HISTOGRAM_VALUE_MAX; }
+
+    TorrentMetricsSlot* slot = torrent_metrics_slot_get();
+    __atomic_fetch_add(&slot->buckets[histogram][torrent_metrics_bucket_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&slot->sums[histogram], value, __ATOMIC_RELAXED);
+}
+
+/* every thread's slot summed, the result can be a little behind writers on other threads */
+u64 torrent_metrics_counter_read(TorrentMetricsCounter counter) {
+    u64 value = 0;
+    for (usize i = 0; i < TORRENT_METRICS_SLOTS; i++) {
+        value += __atomic_load_n(&torrent_metrics_slots[i].counters[counter], __ATOMIC_RELAXED);
+    }
+    return value;
+}
+
+/* the highest value equivalent to the percentile's bucket, 0 for an empty histogram */
+u64 torrent_metrics_histogram_percentile(TorrentMetricsHistogram histogram, double percentile) {
+    u64 buckets[TORRENT_METRICS_HISTOGRAM_BUCKETS];
+    u64 sum;
+    u64 count = torrent_metrics_histogram_merge(histogram, buckets, &sum);
+    if (count == 0) { return 0; }
+
+    u64 target = (u64) (percentile / 100.0 * count);
+    if (target == 0) { target = 1; }
+    if (target > count) { target = count; }
+
+    u64 seen = 0;
+    for (u32 i = 0; i < TORRENT_METRICS_HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= target) { return torrent_metrics_bucket_lower(i + 1) - 1; }
+    }
+    return TORRENT_METRICS_HISTOGRAM_VALUE_MAX;
+}
+
+bool torrent_metrics_text_append(TorrentMetricsText* text, const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    i32 length = vsnprintf(NULL, 0, format, arguments);
+    va_end(arguments);
+    if (length < 0) { return false; }
+
+    if (text->length + length + 1 > text->capacity) {
+        usize capacity = (text->capacity == 0) ? 4096 : text->capacity;
+        while (text->length + length + 1 > capacity) { capacity *= 2; }
+
+        char* temp = (char*) realloc(text->data, sizeof(char) * capacity);
+        if (!temp) {
+            log_error("METRICS", "Failed to reallocate memory for text!");
+            return false;
+        }
+
+        text->data = temp;
+        text->capacity = capacity;
+    }
+
+    va_start(arguments, format);
+    vsnprintf(text->data + text->length, text->capacity - text->length, format, arguments);
+    va_end(arguments);
+    text->length += length;
+
+    return true;
+}
+
+void torrent_metrics_text_destroy(TorrentMetricsText* text) {
+    if (text->data) { free(text->data); }
+    memset(text, 0, sizeof(TorrentMetricsText));
+}
+
+/* the registry in the prometheus text format, histogram buckets are every 4x from 1us up */
+bool torrent_metrics_prometheus_write(TorrentMetricsText* text) {
+    bool success = true;
+    for (usize i = 0; i < TORRENT_METRICS_COUNTERS_LENGTH && success; i++) {
+        const char* name = torrent_metrics_counter_names[i][0];
+        success = torrent_metrics_text_append(text, "# HELP torrent_%s_total %s\n# TYPE torrent_%s_total counter\ntorrent_%s_total %llu\n",
+            name, torrent_metrics_counter_names[i][1], name, name, (unsigned long long) torrent_metrics_counter_read(i));
+    }
+
+    for (usize i = 0; i < TORRENT_METRICS_HISTOGRAMS_LENGTH && success; i++) {
+        const char* name = torrent_metrics_histogram_names[i][0];
+
+        u64 buckets[TORRENT_METRICS_HISTOGRAM_BUCKETS];
+        u64 sum;
+        u64 count = torrent_metrics_histogram_merge(i, buckets, &sum);
+
+        success = torrent_metrics_text_append(text, "# HELP torrent_%s_seconds %s\n# TYPE torrent_%s_seconds histogram\n",
+            name, torrent_metrics_histogram_names[i][1], name);
+
+        u32 bucket = 0;
+        u64 cumulative = 0;
+        for (u32 exponent = 0; exponent <= 38 && success; exponent += 2) {
+            u64 bound = 1ULL << exponent;
+            while (bucket < TORRENT_METRICS_HISTOGRAM_BUCKETS && torrent_metrics_bucket_lower(bucket + 1) <= bound) {
+                cumulative += buckets[bucket];
+                bucket++;
+            }
+            success = torrent_metrics_text_append(text, "torrent_%s_seconds_bucket{le=\"%.9g\"} %llu\n", name, bound / 1e6, (unsigned long long) cumulative);
+        }
+
+        if (success) {
+            success = torrent_metrics_text_append(text, "torrent_%s_seconds_bucket{le=\"+Inf\"} %llu\ntorrent_%s_seconds_sum %.6f\ntorrent_%s_seconds_count %llu\n",
+                name, (unsigned long long) count, name, sum / 1e6, name, (unsigned long long) count);
+        }
+    }
+
+    return success;
+}
+
+/* {"counters":{...},"histograms":{"<name>_us":{"count":..,"mean":..,"p50":..,...}}} */
+bool torrent_metrics_json_write(TorrentMetricsText* text) {
+    bool success = torrent_metrics_text_append(text, "{\"counters\":{");
+    for (usize i = 0; i < TORRENT_METRICS_COUNTERS_LENGTH && success; i++) {
+        success = torrent_metrics_text_append(text, "%s\"%s\":%llu", (i > 0) ? "," : "",
+            torrent_metrics_counter_names[i][0], (unsigned long long) torrent_metrics_counter_read(i));
+    }
+
+    if (success) { success = torrent_metrics_text_append(text, "},\"histograms\":{"); }
+    for (usize i = 0; i < TORRENT_METRICS_HISTOGRAMS_LENGTH && success; i++) {
+        u64 buckets[TORRENT_METRICS_HISTOGRAM_BUCKETS];
+        u64 sum;
+        u64 count = torrent_metrics_histogram_merge(i, buckets, &sum);
+
+        success = torrent_metrics_text_append(text, "%s\"%s_us\":{\"count\":%llu,\"mean\":%.1f,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+            (i > 0) ? "," : "", torrent_metrics_histogram_names[i][0], (unsigned long long) count, count ? (double) sum / count : 0.0,
+            (unsigned long long) torrent_metrics_histogram_percentile(i, 50), (unsigned long long) torrent_metrics_histogram_percentile(i, 90),
+            (unsigned long long) torrent_metrics_histogram_percentile(i, 99), (unsigned long long) torrent_metrics_histogram_percentile(i, 99.9),
+            (unsigned long long) torrent_metrics_histogram_percentile(i, 100));
+    }
+
+    if (success) { success = torrent_metrics_text_append(text, "}}"); }
+    return success;
+}
+
+/* written next to path first and renamed over it, readers never see half a snapshot */
+bool torrent_metrics_snapshot_save(const char* path, TorrentMetricsText* text) {
+    usize temporary_path_length = strlen(path) + strlen(".tmp") + 1;
+    char* temporary_path = (char*) malloc(sizeof(char) * temporary_path_length);
+    if (!temporary_path) {
+        log_error("METRICS", "Failed to allocate memory for snapshot path!");
+        return false;
+    }
+    snprintf(temporary_path, temporary_path_length, "%s.tmp", path);
+
+    FILE* file = fopen(temporary_path, "wb");
+    if (!file) {
+        log_error("METRICS", "Failed to open snapshot file for writing: %s", temporary_path);
+        free(temporary_path);
+        return false;
+    }
+
+    bool success = fwrite(text->data, 1, text->length, file) == text->length && fputc('\n', file) != EOF;
+    success = (fclose(file) == 0) && success;
+    success = success && rename(temporary_path, path) == 0;
+    if (!success) {
+        log_error("METRICS", "Failed to write snapshot file: %s", path);
+        unlink(temporary_path);
+    }
+
+    free(temporary_path);
+    return success;
+}
+
+/* listens on 127.0.0.1 only, the endpoint is for a local scraper */
+TorrentMetricsServer* torrent_metrics_server_create(u16 port) {
+    TorrentMetricsServer* server = (TorrentMetricsServer*) malloc(sizeof(TorrentMetricsServer));
+    if (!server) {
+        log_error("METRICS", "Failed to allocate memory for server!");
+        return NULL;
+    }
+
+    server->socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->socket == -1) {
+        log_error("METRICS", "Failed to create socket!");
+        free(server);
+        return NULL;
+    }
+
+    i32 reuse = 1;
+    setsockopt(server->socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    socklen_t address_length = sizeof(address);
+    if (bind(server->socket, (struct sockaddr*) &address, sizeof(address)) == -1 || listen(server->socket, 16) == -1
+        || getsockname(server->socket, (struct sockaddr*) &address, &address_length) == -1
+        || fcntl(server->socket, F_SETFL, fcntl(server->socket, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        log_error("METRICS", "Failed to listen on 127.0.0.1:%u!", port);
+        close(server->socket);
+        free(server);
+        return NULL;
+    }
+
+    server->port = ntohs(address.sin_port);
+    log_info("METRICS", "Serving on http://127.0.0.1:%u/metrics", server->port);
+
+    return server;
+}
+
+/*
+ * accepts one client and reads its request line, path gets the requested path ("" for
+ * anything but a GET). a scraper sends its request right away, so waiting for it briefly
+ * here is simpler than tracking half read requests. -1 if nobody was waiting
+ */
+i32 torrent_metrics_server_accept(TorrentMetricsServer* server, char* path, usize path_length) {
+    i32 client = accept(server->socket, NULL, NULL);
+    if (client == -1) { return -1; }
+
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = TORRENT_METRICS_REQUEST_TIMEOUT_MS * 1000 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char request[1024];
+    usize request_length = 0;
+    while (request_length < sizeof(request) - 1) {
+        ssize_t bytes_received = recv(client, request + request_length, sizeof(request) - 1 - request_length, 0);
+        if (bytes_received <= 0) { break; }
+
+        request_length += bytes_received;
+        request[request_length] = '\0';
+        if (strstr(request, "\r\n")) { break; }
+    }
+    request[request_length] = '\0';
+
+    path[0] = '\0';
+    if (strncmp(request, "GET ", 4) == 0) {
+        char* path_start = request + 4;
+        usize length = strcspn(path_start, " \r\n");
+        if (length < path_length) { snprintf(path, path_length, "%.*s", (int) length, path_start); }
+    }
+
+    return client;
+}
+
+/* sends the whole response and closes the client */
+bool torrent_metrics_server_respond(i32 client, const char* status, const char* content_type, TorrentMetricsText* body) {
+    char header[256];
+    i32 header_length = snprintf(header, sizeof(header), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+        status, content_type, body->length);
+
+    bool success = send(client, header, header_length, MSG_NOSIGNAL) == header_length;
+
+    usize sent = 0;
+    while (success && sent < body->length) {
+        ssize_t bytes_sent = send(client, body->data + sent, body->length - sent, MSG_NOSIGNAL);
+        if (bytes_sent <= 0) {
+            success = false;
+            break;
+        }
+        sent += bytes_sent;
+    }
+
+    close(client);
+    return success;
+}
+
+void torrent_metrics_server_destroy(TorrentMetricsServer* server) {
+    close(server->socket);
+    free(server);
+}
+
+static TorrentMetricsSlot* torrent_metrics_slot_get() {
+    if (torrent_metrics_slot == -1) {
+        torrent_metrics_slot = __atomic_fetch_add(&torrent_metrics_slots_used, 1, __ATOMIC_RELAXED) % TORRENT_METRICS_SLOTS;
+    }
+    return &torrent_metrics_slots[torrent_metrics_slot];
+}
+
+/* values below 16 get a bucket each, above that every power of two is split in 8 */
+static u32 torrent_metrics_bucket_index(u64 value) {
+    if (value < 2 * TORRENT_METRICS_HISTOGRAM_SUB_BUCKETS) { return value; }
+
+    u32 exponent = 63 - __builtin_clzll(value);
+    return ((exponent - 2) * TORRENT_METRICS_HISTOGRAM_SUB_BUCKETS) + ((value >> (exponent - 3)) & (TORRENT_METRICS_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static u64 torrent_metrics_bucket_lower(u32 index) {
+    if (index < 2 * TORRENT_METRICS_HISTOGRAM_SUB_BUCKETS) { return index; }
+
+    u32 exponent = (index / TORRENT_METRICS_HISTOGRAM_SUB_BUCKETS) + 2;
+    return (u64) (TORRENT_METRICS_HISTOGRAM_SUB_BUCKETS + (index % TORRENT_METRICS_HISTOGRAM_SUB_BUCKETS)) << (exponent - 3);
+}
+
+/* every slot's buckets summed into buckets, returns the number of values recorded */
+static u64 torrent_metrics_histogram_merge(TorrentMetricsHistogram histogram, u64 buckets[TORRENT_METRICS_HISTOGRAM_BUCKETS], u64* sum) {
+    memset(buckets, 0, sizeof(u64) * TORRENT_METRICS_HISTOGRAM_BUCKETS);
+    *sum = 0;
+
+    u64 count = 0;
+    for (usize i = 0; i < TORRENT_METRICS_SLOTS; i++) {
+        TorrentMetricsSlot* slot = &torrent_metrics_slots[i];
+        for (u32 j = 0; j < TORRENT_METRICS_HISTOGRAM_BUCKETS; j++) {
+            u64 value = __atomic_load_n(&slot->buckets[histogram][j], __ATOMIC_RELAXED);
+            buckets[j] += value;
+            count += value;
+        }
+        *sum += __atomic_load_n(&slot->sums[histogram], __ATOMIC_RELAXED);
+    }
+    return count;
+}
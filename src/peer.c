@@ -1,28 +1,48 @@
 #include "peer.h"
-#include "metadata.h"
 #include "types.h"
 
-#include <asm-generic/socket.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <netdb.h>
+#include <netinet/in.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
-static void torrent_peer_handshake_send(TorrentPeer* peer, TorrentMetadata* metadata, const char* peer_id);
-static bool torrent_peer_handshake_validate(u8 handshake_data[68], TorrentMetadata* metadata);
-
-static void buffer_write_big_endian(u8* buffer, u32 value);
-
-TorrentPeer* torrent_peer_connect(char ip[32], char port[16], char peer_id[20], TorrentMetadata* metadata) {
+#include "extension.h"
+#include "fast.h"
+#include "merkle.h"
+#include "pex.h"
+#include "shard.h"
+#include "trace.h"
+#include "utils/buffer.h"
+#include "utils/log.h"
+#include "utils/time.h"
+
+#define TORRENT_PEER_RECEIVE_CHUNK 65536
+#define TORRENT_PEER_RECEIVE_MAX_PER_CALL (4 * TORRENT_PEER_RECEIVE_CHUNK)
+
+static bool torrent_peer_output_reserve(TorrentPeer* peer, usize length);
+static bool torrent_peer_buffer_reserve(TorrentPeerBuffer* buffer, usize length);
+static void torrent_peer_buffer_destroy(TorrentPeerBuffer* buffer);
+
+/* starts a non-blocking connect, poll for POLLOUT and call torrent_peer_connect_finish() */
+TorrentPeer* torrent_peer_connect(const char* ip, const char* port) {
     TorrentPeer* peer = (TorrentPeer*) malloc(sizeof(TorrentPeer));
     if (!peer) {
-        fprintf(stderr, "[ERROR] [PEER] Failed to allocate memory for peer!\n");
+        log_error("PEER", "Failed to allocate memory for peer!");
         return NULL;
     }
 
+    memset(peer, 0, sizeof(TorrentPeer));
+    snprintf(peer->ip, sizeof(peer->ip), "%s", ip);
+    snprintf(peer->port, sizeof(peer->port), "%s", port);
+    peer->am_choking = true;
+    peer->peer_choking = true;
+
     struct addrinfo address_hints = {0};
     address_hints.ai_family = AF_UNSPEC; // allows for either IPv4 or IPv6, it doesnt matter to us
     address_hints.ai_socktype = SOCK_STREAM; // use TCP
@@ -30,39 +50,31 @@ TorrentPeer* torrent_peer_connect(char ip[32], char port[16], char peer_id[20],
     struct addrinfo* address_info;
     i32 status;
     if ((status = getaddrinfo(ip, port, &address_hints, &address_info)) != 0) {
-        fprintf(stderr, "[ERROR] [PEER] Failed to get address infomation: %s\n", gai_strerror(status));
+        log_peer_warn("PEER", ip, port, "Failed to get address infomation: %s", gai_strerror(status));
         free(peer);
         return NULL;
     }
 
     peer->socket = socket(address_info->ai_family, address_info->ai_socktype, address_info->ai_protocol);
     if (peer->socket == -1) {
-        fprintf(stderr, "[ERROR] [PEER] Failed to create socket!\n");
-        freeaddrinfo(address_info);
-        free(peer);
-        return NULL;
-    }
-
-    struct timeval timeout;
-    timeout.tv_sec = 5;
-    timeout.tv_usec = 0;
-
-    if (setsockopt(peer->socket, SOL_SOCKET, SO_RCVTIMEO, (const char*) &timeout, sizeof(timeout)) < 0) {
-        fprintf(stderr, "[ERROR] [PEER] Failed to set receive timeout!\n");
+        log_error("PEER", "Failed to create socket!");
         freeaddrinfo(address_info);
         free(peer);
         return NULL;
     }
 
-    if (setsockopt(peer->socket, SOL_SOCKET, SO_SNDTIMEO, (const char*) &timeout, sizeof(timeout)) < 0) {
-        fprintf(stderr, "[ERROR] [PEER] Failed to set send timeout!\n");
+    if (fcntl(peer->socket, F_SETFL, fcntl(peer->socket, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        log_error("PEER", "Failed to make socket non-blocking!");
+        close(peer->socket);
         freeaddrinfo(address_info);
         free(peer);
         return NULL;
     }
 
-    if (connect(peer->socket, address_info->ai_addr, address_info->ai_addrlen) == -1) {
-        fprintf(stderr, "[ERROR] [PEER] Failed to connect: %s:%s!\n", ip, port);
+    peer->connect_started = time_now_ms();
+    peer->stage_started_us = time_now_us();
+    if (connect(peer->socket, address_info->ai_addr, address_info->ai_addrlen) == -1 && errno != EINPROGRESS) {
+        log_peer_warn("PEER", ip, port, "Failed to connect!");
         close(peer->socket);
         freeaddrinfo(address_info);
         free(peer);
@@ -70,79 +82,113 @@ TorrentPeer* torrent_peer_connect(char ip[32], char port[16], char peer_id[20],
     }
 
     freeaddrinfo(address_info);
-    peer->connected = true;
+    peer->state = TORRENT_PEER_CONNECTING;
 
-    torrent_peer_handshake_send(peer, metadata, peer_id);
+    return peer;
+}
 
-    u8 buffer[16384];
-    i32 bytes_received = recv(peer->socket, buffer, sizeof(buffer), 0);
-    if (bytes_received == 0 || bytes_received == -1) {
-        fprintf(stderr, "[ERROR] [PEER] Failed to receive response!\n");
-        close(peer->socket);
-        free(peer);
-        return NULL;
+/* a non-blocking IPv4 socket accepting peers on every interface, -1 on failure */
+i32 torrent_peer_listen(u16 port) {
+    i32 listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket == -1) {
+        log_error("PEER", "Failed to create listen socket!");
+        return -1;
     }
 
-    if (!torrent_peer_handshake_validate(buffer, metadata)) {
-        fprintf(stderr, "[ERROR] [PEER] Failed to validate peer handshake!\n");
-        close(peer->socket);
-        free(peer);
-        return NULL;
-    }
+    i32 reuse = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
-    torrent_peer_send_request(peer, metadata, 0, 0, sizeof(buffer));
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
 
-    bytes_received = recv(peer->socket, buffer, sizeof(buffer), 0);
-    if (bytes_received == 0 || bytes_received == -1) {
-        fprintf(stderr, "[ERROR] [PEER] Failed to receive response!\n");
-        close(peer->socket);
-        free(peer);
-        return NULL;
+    if (bind(listen_socket, (struct sockaddr*) &address, sizeof(address)) == -1 || listen(listen_socket, 64) == -1) {
+        log_error("PEER", "Failed to listen on port %u: %s", port, strerror(errno));
+        close(listen_socket);
+        return -1;
     }
 
-    printf("bytes received: %d\n", bytes_received);
-
-    for (usize i = 0; i < bytes_received; i++) {
-        printf("%02x ", buffer[i]);
+    if (fcntl(listen_socket, F_SETFL, fcntl(listen_socket, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        log_error("PEER", "Failed to make listen socket non-blocking!");
+        close(listen_socket);
+        return -1;
     }
-    printf("\n");
 
-    return peer;
+    return listen_socket;
 }
 
-void torrent_peer_send_request(TorrentPeer* peer, TorrentMetadata* metadata, usize index, usize begin, usize length) {
-    u8 request_data[17];
-    u8* position = request_data;
+/*
+ * takes the next peer that dialed us, NULL once there are none waiting. it starts out
+ * connecting like a dialed peer, so the first POLLOUT finishes it the same way
+ */
+TorrentPeer* torrent_peer_accept(i32 listen_socket) {
+    struct sockaddr_storage address;
+    socklen_t address_length = sizeof(address);
+    i32 peer_socket = accept(listen_socket, (struct sockaddr*) &address, &address_length);
+    if (peer_socket == -1) { return NULL; }
+
+    char ip[32];
+    char port[16];
+    i32 status = getnameinfo((struct sockaddr*) &address, address_length, ip, sizeof(ip), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV);
+    if (status != 0) {
+        log_warn("PEER", "Failed to read the address of an incoming peer: %s", gai_strerror(status));
+        close(peer_socket);
+        return NULL;
+    }
 
-    buffer_write_big_endian(position, 13);
-    position += 4;
+    return torrent_peer_adopt(peer_socket, ip, port, true);
+}
 
-    *position = 6;
-    position += 1;
+/* wraps a socket that is already connected, or connecting, and closes it if that fails */
+TorrentPeer* torrent_peer_adopt(i32 socket, const char* ip, const char* port, bool incoming) {
+    TorrentPeer* peer = (TorrentPeer*) malloc(sizeof(TorrentPeer));
+    if (!peer) {
+        log_error("PEER", "Failed to allocate memory for peer!");
+        close(socket);
+        return NULL;
+    }
 
-    buffer_write_big_endian(position, index);
-    position += 4;
+    memset(peer, 0, sizeof(TorrentPeer));
+    snprintf(peer->ip, sizeof(peer->ip), "%s", ip);
+    snprintf(peer->port, sizeof(peer->port), "%s", port);
+    peer->socket = socket;
+    peer->incoming = incoming;
+    peer->am_choking = true;
+    peer->peer_choking = true;
+
+    if (fcntl(peer->socket, F_SETFL, fcntl(peer->socket, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        log_error("PEER", "Failed to make socket non-blocking!");
+        close(socket);
+        free(peer);
+        return NULL;
+    }
 
-    buffer_write_big_endian(position, begin);
-    position += 4;
+    peer->connect_started = time_now_ms();
+    peer->stage_started_us = time_now_us();
+    peer->state = TORRENT_PEER_CONNECTING;
 
-    buffer_write_big_endian(position, length);
-    position += 4;
+    return peer;
+}
 
-    if (send(peer->socket, request_data, sizeof(request_data), 0) == -1) {
-        fprintf(stderr, "[ERROR] [PEER] [REQUEST] Failed to send request data!\n");
-        close(peer->socket);
-        return;
+/* a sharded peer's socket was already checked by its shard */
+bool torrent_peer_connect_finish(TorrentPeer* peer) {
+    i32 error = 0;
+    socklen_t error_length = sizeof(error);
+    if ((!peer->shard && getsockopt(peer->socket, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1) || error != 0) {
+        log_peer_warn("PEER", peer->ip, peer->port, "Failed to connect: %s!", strerror(error));
+        return false;
     }
-}
 
-void torrent_peer_destroy(TorrentPeer* peer) {
-    close(peer->socket);
-    free(peer);
+    if (peer->trace) { torrent_trace_record(peer->trace, TORRENT_TRACE_CONNECTED, peer->connection, NULL, 0); }
+
+    peer->state = TORRENT_PEER_HANDSHAKING;
+    peer->last_received = time_now_ms();
+    return true;
 }
 
-static void torrent_peer_handshake_send(TorrentPeer* peer, TorrentMetadata* metadata, const char* peer_id) {
-    u8 handshake_data[68];
+bool torrent_peer_handshake_send(TorrentPeer* peer, const u8 info_hash[20], const char peer_id[20]) {
+    u8 handshake_data[TORRENT_PEER_HANDSHAKE_LENGTH];
     u8* position = handshake_data;
 
     *position = 19;
@@ -154,32 +200,396 @@ static void torrent_peer_handshake_send(TorrentPeer* peer, TorrentMetadata* meta
     for (usize i = 0; i < 8; i++) {
         position[i] = 0;
     }
+    position[5] |= TORRENT_EXTENSION_RESERVED_BIT; // BEP 10
+    position[7] |= TORRENT_FAST_RESERVED_BIT; // BEP 6
+    position[7] |= TORRENT_MERKLE_RESERVED_BIT; // BEP 52
     position += 8;
 
-    memcpy(position, metadata->info_sha1, 20);
+    memcpy(position, info_hash, 20);
     position += 20;
 
     memcpy(position, peer_id, 20);
     position += 20;
 
-    if (send(peer->socket, handshake_data, sizeof(handshake_data), 0) == -1) {
-        fprintf(stderr, "[ERROR] [PEER] [HANDSHAKE] Failed to send handshake data!\n");
-        close(peer->socket);
-        return;
+    if (!torrent_peer_output_reserve(peer, sizeof(handshake_data))) {
+        log_error("PEER", "[HANDSHAKE] Failed to queue handshake data!");
+        return false;
     }
+
+    memcpy(peer->output.data + peer->output.length, handshake_data, sizeof(handshake_data));
+    peer->output.length += sizeof(handshake_data);
+
+    return torrent_peer_flush(peer);
 }
 
-static bool torrent_peer_handshake_validate(u8 handshake_data[68], TorrentMetadata* metadata) {
+/* false when the handshake is invalid, *complete stays false until all 68 bytes have arrived */
+bool torrent_peer_handshake_receive(TorrentPeer* peer, const u8 info_hash[20], bool* complete) {
+    *complete = false;
+
+    usize available = peer->input.length - peer->input.offset;
+    if (available < TORRENT_PEER_HANDSHAKE_LENGTH) { return true; }
+
+    u8* handshake_data = peer->input.data + peer->input.offset;
+    if (peer->trace) { torrent_trace_record(peer->trace, TORRENT_TRACE_INBOUND, peer->connection, handshake_data, TORRENT_PEER_HANDSHAKE_LENGTH); }
+
     if (handshake_data[0] != 19) { return false; }
     if (memcmp(handshake_data + 1, "BitTorrent protocol", 19) != 0) { return false; }
-    if (memcmp(handshake_data + 28, metadata->info_sha1, 20) != 0) { return false; }
+    if (memcmp(handshake_data + 28, info_hash, 20) != 0) { return false; }
+
+    peer->supports_extensions = (handshake_data[20 + 5] & TORRENT_EXTENSION_RESERVED_BIT) != 0;
+    peer->supports_fast = (handshake_data[20 + 7] & TORRENT_FAST_RESERVED_BIT) != 0;
+    peer->supports_v2 = (handshake_data[20 + 7] & TORRENT_MERKLE_RESERVED_BIT) != 0;
+    memcpy(peer->id, handshake_data + 48, 20);
+
+    peer->input.offset += TORRENT_PEER_HANDSHAKE_LENGTH;
+    peer->state = TORRENT_PEER_CONNECTED;
+    *complete = true;
+
+    return true;
+}
+
+/* reads whatever the socket has, false once the peer hung up or the connection failed */
+bool torrent_peer_receive(TorrentPeer* peer) {
+    usize total_bytes = 0;
+    while (total_bytes < TORRENT_PEER_RECEIVE_MAX_PER_CALL) {
+        if (!torrent_peer_buffer_reserve(&peer->input, TORRENT_PEER_RECEIVE_CHUNK)) {
+            log_error("PEER", "Failed to grow receive buffer!");
+            return false;
+        }
+
+        ssize_t bytes_received = recv(peer->socket, peer->input.data + peer->input.length, peer->input.capacity - peer->input.length, 0);
+        if (bytes_received == 0) {
+            return false;
+        } else if (bytes_received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+            if (errno == EINTR) { continue; }
+            return false;
+        }
+
+        peer->input.length += bytes_received;
+        total_bytes += bytes_received;
+    }
+
+    if (total_bytes > 0) {
+        peer->last_received = time_now_ms();
+    }
+    return true;
+}
+
+/* for a sharded peer, whose shard reads the socket and hands the bytes over */
+bool torrent_peer_input_append(TorrentPeer* peer, const u8* data, usize length) {
+    if (!torrent_peer_buffer_reserve(&peer->input, length)) {
+        log_error("PEER", "Failed to grow receive buffer!");
+        return false;
+    }
+
+    memcpy(peer->input.data + peer->input.length, data, length);
+    peer->input.length += length;
+    peer->last_received = time_now_ms();
+    return true;
+}
+
+/* returns false when no complete message is buffered, *failed is set if the peer broke the framing */
+bool torrent_peer_message_next(TorrentPeer* peer, TorrentPeerMessage* message, bool* failed) {
+    *failed = false;
+
+    usize available = peer->input.length - peer->input.offset;
+    if (available < 4) { return false; }
+
+    u8* data = peer->input.data + peer->input.offset;
+    u32 message_length = buffer_read_big_endian(data);
+    if (message_length > TORRENT_PEER_MESSAGE_MAX) {
+        log_peer_warn("PEER", peer->ip, peer->port, "Message is too long (%u bytes)!", message_length);
+        *failed = true;
+        return false;
+    }
+
+    if (available < 4 + (usize) message_length) { return false; }
+
+    if (peer->trace) { torrent_trace_record(peer->trace, TORRENT_TRACE_INBOUND, peer->connection, data, 4 + message_length); }
+    peer->input.offset += 4 + message_length;
+
+    if (message_length == 0) {
+        *message = (TorrentPeerMessage) { .keep_alive = true };
+        return true;
+    }
+
+    message->keep_alive = false;
+    message->id = data[4];
+    message->payload = data + 5;
+    message->payload_length = message_length - 1;
+
+    return true;
+}
+
+/* queues the message and writes as much as the socket takes right now */
+bool torrent_peer_message_send(TorrentPeer* peer, u8 id, const u8* payload, usize payload_length) {
+    u8* message = torrent_peer_message_reserve(peer, id, payload_length);
+    if (!message) { return false; }
+
+    if (payload_length > 0) {
+        memcpy(message, payload, payload_length);
+    }
+
+    return torrent_peer_flush(peer);
+}
+
+/*
+ * queues a message's header and returns where its payload_length bytes go, so the payload
+ * can be written straight into the send buffer. fill it in and call torrent_peer_flush()
+ */
+u8* torrent_peer_message_reserve(TorrentPeer* peer, u8 id, usize payload_length) {
+    if (!torrent_peer_output_reserve(peer, 5 + payload_length)) {
+        log_error("PEER", "Failed to grow send buffer!");
+        return NULL;
+    }
+
+    u8* position = peer->output.data + peer->output.length;
+    buffer_write_big_endian(position, payload_length + 1);
+    position[4] = id;
+    peer->output.length += 5 + payload_length;
+
+    return position + 5;
+}
+
+bool torrent_peer_flush(TorrentPeer* peer) {
+    // everything queued since the last flush is whole messages
+    if (peer->trace && peer->output_traced < peer->output.length) {
+        torrent_trace_record(peer->trace, TORRENT_TRACE_OUTBOUND, peer->connection, peer->output.data + peer->output_traced, peer->output.length - peer->output_traced);
+        peer->output_traced = peer->output.length;
+    }
+
+    // the shard writes it out, the copy it keeps frees our buffer right away
+    if (peer->shard) {
+        if (peer->output.offset == peer->output.length) { return true; }
+
+        bool sent = torrent_shard_send(peer->shard, peer->connection, peer->output.data + peer->output.offset, peer->output.length - peer->output.offset);
+        peer->output_pending += peer->output.length - peer->output.offset;
+        peer->output.offset = 0;
+        peer->output.length = 0;
+        peer->output_traced = 0;
+        peer->last_sent = time_now_ms();
+        return sent;
+    }
+
+    while (peer->output.offset < peer->output.length) {
+        ssize_t bytes_sent = send(peer->socket, peer->output.data + peer->output.offset, peer->output.length - peer->output.offset, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+            if (errno == EINTR) { continue; }
+            return false;
+        }
+
+        peer->output.offset += bytes_sent;
+        peer->last_sent = time_now_ms();
+    }
+
+    if (peer->output.offset == peer->output.length) {
+        peer->output.offset = 0;
+        peer->output.length = 0;
+        peer->output_traced = 0;
+    }
+
+    return true;
+}
+
+/* queued here or at the shard, what the peer hasn't read from its socket yet */
+usize torrent_peer_output_unsent(TorrentPeer* peer) {
+    return (peer->output.length - peer->output.offset) + peer->output_pending;
+}
+
+bool torrent_peer_send_keep_alive(TorrentPeer* peer) {
+    if (!torrent_peer_output_reserve(peer, 4)) { return false; }
+
+    buffer_write_big_endian(peer->output.data + peer->output.length, 0);
+    peer->output.length += 4;
+
+    return torrent_peer_flush(peer);
+}
+
+bool torrent_peer_send_choke(TorrentPeer* peer, bool choke) {
+    peer->am_choking = choke;
+    if (!choke) { peer->unchoked_at = time_now_ms(); }
+    return torrent_peer_message_send(peer, choke ? TORRENT_PEER_MESSAGE_CHOKE : TORRENT_PEER_MESSAGE_UNCHOKE, NULL, 0);
+}
+
+bool torrent_peer_send_interested(TorrentPeer* peer, bool interested) {
+    peer->am_interested = interested;
+    return torrent_peer_message_send(peer, interested ? TORRENT_PEER_MESSAGE_INTERESTED : TORRENT_PEER_MESSAGE_NOT_INTERESTED, NULL, 0);
+}
+
+bool torrent_peer_send_have(TorrentPeer* peer, u32 index) {
+    u8 have_data[4];
+    buffer_write_big_endian(have_data, index);
+
+    return torrent_peer_message_send(peer, TORRENT_PEER_MESSAGE_HAVE, have_data, sizeof(have_data));
+}
+
+bool torrent_peer_send_request(TorrentPeer* peer, u32 index, u32 begin, u32 length) {
+    u8 request_data[12];
+    u8* position = request_data;
+
+    buffer_write_big_endian(position, index);
+    position += 4;
+
+    buffer_write_big_endian(position, begin);
+    position += 4;
+
+    buffer_write_big_endian(position, length);
+    position += 4;
+
+    if (!torrent_peer_message_send(peer, TORRENT_PEER_MESSAGE_REQUEST, request_data, sizeof(request_data))) {
+        log_error("PEER", "[REQUEST] Failed to send request data!");
+        return false;
+    }
+
+    return true;
+}
+
+bool torrent_peer_send_cancel(TorrentPeer* peer, u32 index, u32 begin, u32 length) {
+    u8 cancel_data[12];
+    buffer_write_big_endian(cancel_data, index);
+    buffer_write_big_endian(cancel_data + 4, begin);
+    buffer_write_big_endian(cancel_data + 8, length);
+
+    return torrent_peer_message_send(peer, TORRENT_PEER_MESSAGE_CANCEL, cancel_data, sizeof(cancel_data));
+}
+
+bool torrent_peer_send_piece(TorrentPeer* peer, u32 index, u32 begin, const u8* block, u32 block_length) {
+    // written straight into the send buffer so the block is only copied once
+    u8* payload = torrent_peer_message_reserve(peer, TORRENT_PEER_MESSAGE_PIECE, 8 + block_length);
+    if (!payload) { return false; }
+
+    buffer_write_big_endian(payload, index);
+    buffer_write_big_endian(payload + 4, begin);
+    memcpy(payload + 8, block, block_length);
+
+    return torrent_peer_flush(peer);
+}
+
+bool torrent_peer_send_reject(TorrentPeer* peer, u32 index, u32 begin, u32 length) {
+    u8 reject_data[12];
+    buffer_write_big_endian(reject_data, index);
+    buffer_write_big_endian(reject_data + 4, begin);
+    buffer_write_big_endian(reject_data + 8, length);
+
+    return torrent_peer_message_send(peer, TORRENT_PEER_MESSAGE_REJECT_REQUEST, reject_data, sizeof(reject_data));
+}
+
+bool torrent_peer_send_allowed_fast(TorrentPeer* peer, u32 index) {
+    u8 allowed_fast_data[4];
+    buffer_write_big_endian(allowed_fast_data, index);
+
+    return torrent_peer_message_send(peer, TORRENT_PEER_MESSAGE_ALLOWED_FAST, allowed_fast_data, sizeof(allowed_fast_data));
+}
+
+bool torrent_peer_send_hash_request(TorrentPeer* peer, const TorrentMerkleRequest* request) {
+    u8 request_data[TORRENT_MERKLE_REQUEST_LENGTH];
+    torrent_merkle_request_write(request_data, request);
+
+    return torrent_peer_message_send(peer, TORRENT_PEER_MESSAGE_HASH_REQUEST, request_data, sizeof(request_data));
+}
+
+/* hashes_length counts hashes, the requested ones followed by their uncles */
+bool torrent_peer_send_hashes(TorrentPeer* peer, const TorrentMerkleRequest* request, const u8* hashes, usize hashes_length) {
+    u8* payload = torrent_peer_message_reserve(peer, TORRENT_PEER_MESSAGE_HASHES, TORRENT_MERKLE_REQUEST_LENGTH + (hashes_length * TORRENT_MERKLE_HASH_LENGTH));
+    if (!payload) { return false; }
+
+    torrent_merkle_request_write(payload, request);
+    memcpy(payload + TORRENT_MERKLE_REQUEST_LENGTH, hashes, hashes_length * TORRENT_MERKLE_HASH_LENGTH);
+
+    return torrent_peer_flush(peer);
+}
+
+bool torrent_peer_send_hash_reject(TorrentPeer* peer, const TorrentMerkleRequest* request) {
+    u8 reject_data[TORRENT_MERKLE_REQUEST_LENGTH];
+    torrent_merkle_request_write(reject_data, request);
+
+    return torrent_peer_message_send(peer, TORRENT_PEER_MESSAGE_HASH_REJECT, reject_data, sizeof(reject_data));
+}
+
+bool torrent_peer_bitfield_create(TorrentPeer* peer, u32 pieces_length) {
+    peer->bitfield_length = (pieces_length + 7) / 8;
+    peer->bitfield = (u8*) calloc(peer->bitfield_length, sizeof(u8));
+    if (!peer->bitfield) {
+        log_error("PEER", "Failed to allocate memory for bitfield!");
+        peer->bitfield_length = 0;
+        return false;
+    }
+
+    return true;
+}
+
+/* keeps the bits that still fit, new bytes and the spare bits after the last piece are cleared */
+bool torrent_peer_bitfield_resize(TorrentPeer* peer, u32 pieces_length) {
+    usize bitfield_length = (pieces_length + 7) / 8;
+    u8* bitfield = (u8*) realloc(peer->bitfield, sizeof(u8) * (bitfield_length > 0 ? bitfield_length : 1));
+    if (!bitfield) {
+        log_error("PEER", "Failed to reallocate memory for bitfield!");
+        return false;
+    }
+
+    if (bitfield_length > peer->bitfield_length) {
+        memset(bitfield + peer->bitfield_length, 0, bitfield_length - peer->bitfield_length);
+    }
+    if (pieces_length % 8 != 0) {
+        bitfield[bitfield_length - 1] &= (u8) (0xFF << (8 - (pieces_length % 8)));
+    }
+
+    peer->bitfield = bitfield;
+    peer->bitfield_length = bitfield_length;
+    return true;
+}
+
+bool torrent_peer_has_piece(TorrentPeer* peer, u32 index) {
+    if (index / 8 >= peer->bitfield_length) { return false; }
+    return (peer->bitfield[index / 8] >> (7 - (index % 8))) & 1;
+}
+
+void torrent_peer_destroy(TorrentPeer* peer) {
+    if (peer->socket != -1) { close(peer->socket); }
+    torrent_pex_state_destroy(&peer->pex);
+    torrent_peer_buffer_destroy(&peer->input);
+    torrent_peer_buffer_destroy(&peer->output);
+    if (peer->bitfield) { free(peer->bitfield); }
+    free(peer);
+}
+
+/* reserving may move the unsent bytes up, the part the trace hasn't seen stays the same */
+static bool torrent_peer_output_reserve(TorrentPeer* peer, usize length) {
+    usize untraced = peer->output.length - peer->output_traced;
+    if (!torrent_peer_buffer_reserve(&peer->output, length)) { return false; }
+
+    peer->output_traced = peer->output.length - untraced;
+    return true;
+}
+
+/* makes room for length more bytes after buffer->length */
+static bool torrent_peer_buffer_reserve(TorrentPeerBuffer* buffer, usize length) {
+    if (buffer->length + length <= buffer->capacity) { return true; }
+
+    // reuse the space in front of data that was already consumed before growing
+    if (buffer->offset > 0) {
+        memmove(buffer->data, buffer->data + buffer->offset, buffer->length - buffer->offset);
+        buffer->length -= buffer->offset;
+        buffer->offset = 0;
+        if (buffer->length + length <= buffer->capacity) { return true; }
+    }
+
+    usize capacity = (buffer->capacity == 0) ? TORRENT_PEER_RECEIVE_CHUNK : buffer->capacity;
+    while (capacity < buffer->length + length) {
+        capacity *= 2;
+    }
+
+    u8* temp = (u8*) realloc(buffer->data, sizeof(u8) * capacity);
+    if (!temp) { return false; }
 
+    buffer->data = temp;
+    buffer->capacity = capacity;
     return true;
 }
 
-static void buffer_write_big_endian(u8* buffer, u32 value) {
-    buffer[0] = (value >> 24) & 0xFF;
-    buffer[1] = (value >> 16) & 0xFF;
-    buffer[2] = (value >> 8) & 0xFF;
-    buffer[3] = (value) & 0xFF;
+static void torrent_peer_buffer_destroy(TorrentPeerBuffer* buffer) {
+    if (buffer->data) { free(buffer->data); }
+    *buffer = (TorrentPeerBuffer) {0};
 }
@@ -0,0 +1,269 @@
+#include "peer_store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "utils/buffer.h"
+#include "utils/log.h"
+#include "utils/time.h"
+
+#define TORRENT_PEER_STORE_MAGIC "PST1"
+#define TORRENT_PEER_STORE_RECORD_LENGTH 62
+
+static bool torrent_peer_store_load(TorrentPeerStore* store);
+static TorrentPeerStoreEntry* torrent_peer_store_entry_add(TorrentPeerStore* store, const char* ip, const char* port);
+static i64 torrent_peer_store_score(const TorrentPeerStoreEntry* entry);
+static i32 torrent_peer_store_compare(const void* a, const void* b);
+static i64 torrent_peer_store_backoff(u32 failures);
+
+/* loads <info hash>.peers from directory if an earlier run left one behind */
+TorrentPeerStore* torrent_peer_store_create(const u8 info_hash[20], const char* directory) {
+    TorrentPeerStore* store = (TorrentPeerStore*) malloc(sizeof(TorrentPeerStore));
+    if (!store) {
+        log_error("PEER STORE", "Failed to allocate memory for peer store!");
+        return NULL;
+    }
+
+    memset(store, 0, sizeof(TorrentPeerStore));
+
+    usize path_length = strlen(directory) + 1 + 40 + strlen(".peers") + 1;
+    store->path = (char*) malloc(sizeof(char) * path_length);
+    if (!store->path) {
+        log_error("PEER STORE", "Failed to allocate memory for peer store path!");
+        free(store);
+        return NULL;
+    }
+
+    usize position = snprintf(store->path, path_length, "%s/", directory);
+    for (usize i = 0; i < 20; i++) {
+        position += snprintf(store->path + position, path_length - position, "%02x", info_hash[i]);
+    }
+    snprintf(store->path + position, path_length - position, ".peers");
+
+    if (torrent_peer_store_load(store)) {
+        log_info("PEER STORE", "Loaded %zu peers from %s", store->entries_length, store->path);
+    }
+
+    return store;
+}
+
+/* false if the address is already known or couldn't be stored */
+bool torrent_peer_store_add(TorrentPeerStore* store, const char* ip, const char* port) {
+    if (torrent_peer_store_find(store, ip, port)) { return false; }
+
+    return torrent_peer_store_entry_add(store, ip, port) != NULL;
+}
+
+TorrentPeerStoreEntry* torrent_peer_store_find(TorrentPeerStore* store, const char* ip, const char* port) {
+    for (usize i = 0; i < store->entries_length; i++) {
+        if (strcmp(store->entries[i].ip, ip) == 0 && strcmp(store->entries[i].port, port) == 0) { return &store->entries[i]; }
+    }
+    return NULL;
+}
+
+/* the highest scoring entry that isn't in use or backing off, NULL if there is none */
+TorrentPeerStoreEntry* torrent_peer_store_best(TorrentPeerStore* store, i64 now) {
+    TorrentPeerStoreEntry* best = NULL;
+    i64 best_score = 0;
+
+    for (usize i = 0; i < store->entries_length; i++) {
+        TorrentPeerStoreEntry* entry = &store->entries[i];
+        if (entry->in_use || entry->next_attempt > now) { continue; }
+
+        i64 score = torrent_peer_store_score(entry);
+        if (!best || score > best_score) {
+            best = entry;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+void torrent_peer_store_connected(TorrentPeerStoreEntry* entry, u32 latency_ms) {
+    if (entry->connect_latency_ms == 0) {
+        entry->connect_latency_ms = latency_ms;
+    } else {
+        entry->connect_latency_ms = ((entry->connect_latency_ms * 3) + latency_ms) / 4;
+    }
+}
+
+void torrent_peer_store_handshaked(TorrentPeerStoreEntry* entry) {
+    entry->handshakes++;
+    entry->failures = 0;
+}
+
+/*
+ * a connection that never got through the handshake counts as a failure and doubles the
+ * backoff, a finished session only waits the base backoff so we don't redial at once
+ */
+void torrent_peer_store_closed(TorrentPeerStoreEntry* entry, bool handshaked, u64 bytes_downloaded, i64 duration_ms, i64 now) {
+    entry->in_use = false;
+
+    if (handshaked) {
+        entry->bytes_downloaded += bytes_downloaded;
+        entry->download_ms += (duration_ms > 0) ? duration_ms : 0;
+        entry->next_attempt = now + TORRENT_PEER_STORE_BACKOFF_MS;
+        return;
+    }
+
+    entry->failures++;
+    entry->next_attempt = now + torrent_peer_store_backoff(entry->failures);
+}
+
+/* writes the best TORRENT_PEER_STORE_SAVED_MAX entries, addresses that never worked and keep failing are forgotten */
+bool torrent_peer_store_save(TorrentPeerStore* store) {
+    TorrentPeerStoreEntry** sorted = (TorrentPeerStoreEntry**) malloc(sizeof(TorrentPeerStoreEntry*) * (store->entries_length + 1));
+    if (!sorted) {
+        log_error("PEER STORE", "Failed to allocate memory for sorted peers!");
+        return false;
+    }
+
+    usize sorted_length = 0;
+    for (usize i = 0; i < store->entries_length; i++) {
+        TorrentPeerStoreEntry* entry = &store->entries[i];
+        if (entry->handshakes == 0 && entry->failures >= TORRENT_PEER_STORE_FAILURES_MAX) { continue; }
+
+        sorted[sorted_length] = entry;
+        sorted_length++;
+    }
+
+    qsort(sorted, sorted_length, sizeof(TorrentPeerStoreEntry*), torrent_peer_store_compare);
+    if (sorted_length > TORRENT_PEER_STORE_SAVED_MAX) { sorted_length = TORRENT_PEER_STORE_SAVED_MAX; }
+
+    FILE* file = fopen(store->path, "wb");
+    if (!file) {
+        log_error("PEER STORE", "Failed to open peer store file for writing: %s", store->path);
+        free(sorted);
+        return false;
+    }
+
+    u8 header[8];
+    memcpy(header, TORRENT_PEER_STORE_MAGIC, 4);
+    buffer_write_big_endian(header + 4, sorted_length);
+
+    bool success = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+    for (usize i = 0; i < sorted_length && success; i++) {
+        TorrentPeerStoreEntry* entry = sorted[i];
+
+        u8 record[TORRENT_PEER_STORE_RECORD_LENGTH] = {0};
+        snprintf((char*) record, 32, "%s", entry->ip);
+        u16 port = strtol(entry->port, NULL, 10);
+        record[32] = (port >> 8) & 0xFF;
+        record[33] = port & 0xFF;
+        buffer_write_big_endian(record + 34, entry->connect_latency_ms);
+        buffer_write_big_endian(record + 38, entry->handshakes);
+        buffer_write_big_endian(record + 42, entry->failures);
+        buffer_write_big_endian(record + 46, entry->bytes_downloaded >> 32);
+        buffer_write_big_endian(record + 50, entry->bytes_downloaded & 0xFFFFFFFF);
+        buffer_write_big_endian(record + 54, entry->download_ms >> 32);
+        buffer_write_big_endian(record + 58, entry->download_ms & 0xFFFFFFFF);
+
+        success = fwrite(record, 1, sizeof(record), file) == sizeof(record);
+    }
+
+    fclose(file);
+    free(sorted);
+
+    if (!success) {
+        log_error("PEER STORE", "Failed to write peer store file: %s", store->path);
+    }
+    return success;
+}
+
+void torrent_peer_store_destroy(TorrentPeerStore* store) {
+    torrent_peer_store_save(store);
+    if (store->entries) { free(store->entries); }
+    free(store->path);
+    free(store);
+}
+
+static bool torrent_peer_store_load(TorrentPeerStore* store) {
+    FILE* file = fopen(store->path, "rb");
+    if (!file) { return false; } // first run for this torrent
+
+    u8 header[8];
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, TORRENT_PEER_STORE_MAGIC, 4) != 0) {
+        log_error("PEER STORE", "Peer store file is invalid: %s", store->path);
+        fclose(file);
+        return false;
+    }
+
+    u32 count = buffer_read_big_endian(header + 4);
+    i64 now = time_now_ms();
+
+    u8 record[TORRENT_PEER_STORE_RECORD_LENGTH];
+    for (u32 i = 0; i < count && fread(record, 1, sizeof(record), file) == sizeof(record); i++) {
+        record[31] = '\0';
+
+        char port[16];
+        snprintf(port, sizeof(port), "%u", ((u32) record[32] << 8) | record[33]);
+        if (record[0] == '\0' || torrent_peer_store_find(store, (char*) record, port)) { continue; }
+
+        TorrentPeerStoreEntry* entry = torrent_peer_store_entry_add(store, (char*) record, port);
+        if (!entry) { break; }
+
+        entry->connect_latency_ms = buffer_read_big_endian(record + 34);
+        entry->handshakes = buffer_read_big_endian(record + 38);
+        entry->failures = buffer_read_big_endian(record + 42);
+        entry->bytes_downloaded = ((u64) buffer_read_big_endian(record + 46) << 32) | buffer_read_big_endian(record + 50);
+        entry->download_ms = ((u64) buffer_read_big_endian(record + 54) << 32) | buffer_read_big_endian(record + 58);
+        entry->next_attempt = (entry->failures > 0) ? now + torrent_peer_store_backoff(entry->failures) : 0;
+    }
+
+    fclose(file);
+    return true;
+}
+
+static TorrentPeerStoreEntry* torrent_peer_store_entry_add(TorrentPeerStore* store, const char* ip, const char* port) {
+    if (store->entries_length == store->entries_capacity) {
+        usize capacity = (store->entries_capacity == 0) ? 64 : store->entries_capacity * 2;
+        TorrentPeerStoreEntry* temp = (TorrentPeerStoreEntry*) realloc(store->entries, sizeof(TorrentPeerStoreEntry) * capacity);
+        if (!temp) {
+            log_error("PEER STORE", "Failed to reallocate memory for peers!");
+            return NULL;
+        }
+
+        store->entries = temp;
+        store->entries_capacity = capacity;
+    }
+
+    TorrentPeerStoreEntry* entry = &store->entries[store->entries_length];
+    memset(entry, 0, sizeof(TorrentPeerStoreEntry));
+    snprintf(entry->ip, sizeof(entry->ip), "%s", ip);
+    snprintf(entry->port, sizeof(entry->port), "%s", port);
+    store->entries_length++;
+
+    return entry;
+}
+
+/* peers that handshook before come first, fastest and closest first, untried ones next, failing ones last */
+static i64 torrent_peer_store_score(const TorrentPeerStoreEntry* entry) {
+    i64 score = 0;
+    if (entry->handshakes > 0) {
+        score += 1000000;
+        if (entry->download_ms > 0) { score += entry->bytes_downloaded / entry->download_ms; } // about KB/s
+        score -= entry->connect_latency_ms;
+    }
+
+    score -= (i64) entry->failures * 100000;
+    return score;
+}
+
+static i32 torrent_peer_store_compare(const void* a, const void* b) {
+    i64 score_a = torrent_peer_store_score(*(const TorrentPeerStoreEntry**) a);
+    i64 score_b = torrent_peer_store_score(*(const TorrentPeerStoreEntry**) b);
+    return (score_a < score_b) - (score_a > score_b);
+}
+
+static i64 torrent_peer_store_backoff(u32 failures) {
+    if (failures == 0) { return 0; }
+
+    i64 backoff = TORRENT_PEER_STORE_BACKOFF_MS;
+    for (u32 i = 1; i < failures && backoff < TORRENT_PEER_STORE_BACKOFF_MAX_MS; i++) {
+        backoff *= 2;
+    }
+    return (backoff < TORRENT_PEER_STORE_BACKOFF_MAX_MS) ? backoff : TORRENT_PEER_STORE_BACKOFF_MAX_MS;
+}
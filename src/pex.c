@@ -0,0 +1,203 @@
+#include "pex.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bencode.h"
+#include "extension.h"
+#include "peer.h"
+#include "types.h"
+#include "utils/log.h"
+#include "utils/time.h"
+
+typedef struct TorrentPexMessage {
+    u8 (*added)[6];
+    const u8* added_flags;
+    usize added_length;
+    u8 (*dropped)[6];
+    usize dropped_length;
+} TorrentPexMessage;
+
+static void torrent_pex_message_write(BencodeWriter* writer, const void* context);
+static bool torrent_pex_compact_address(TorrentPeer* peer, u8 compact_address[6]);
+static bool torrent_pex_contains(u8 (*addresses)[6], usize addresses_length, const u8 address[6]);
+static bool torrent_pex_is_seed(TorrentPeer* peer, u32 pieces_length);
+
+/*
+ * sends the peers that connected or dropped since the last message, at most once per
+ * TORRENT_PEX_INTERVAL_MS. returns false only if the message could not be sent
+ */
+bool torrent_pex_send(TorrentPeer* peer, TorrentPeer** peers, usize peers_length, u32 pieces_length) {
+    if (peer->extensions.ut_pex == 0) { return true; }
+
+    i64 now = time_now_ms();
+    if (peer->pex.last_sent != 0 && now - peer->pex.last_sent < TORRENT_PEX_INTERVAL_MS) { return true; }
+    peer->pex.last_sent = now;
+
+    u8 (*current)[6] = (u8 (*)[6]) malloc(sizeof(u8[6]) * (peers_length + 1));
+    u8* current_flags = (u8*) malloc(sizeof(u8) * (peers_length + 1));
+    if (!current || !current_flags) {
+        log_error("PEX", "Failed to allocate memory for connected peers!");
+        free(current);
+        free(current_flags);
+        return true;
+    }
+
+    usize current_length = 0;
+    for (usize i = 0; i < peers_length; i++) {
+        TorrentPeer* other = peers[i];
+        if (other == peer || other->state != TORRENT_PEER_CONNECTED) { continue; }
+        if (!torrent_pex_compact_address(other, current[current_length])) { continue; }
+
+        current_flags[current_length] = TORRENT_PEX_FLAG_REACHABLE;
+        if (torrent_pex_is_seed(other, pieces_length)) { current_flags[current_length] |= TORRENT_PEX_FLAG_SEED; }
+        current_length++;
+    }
+
+    u8 added[TORRENT_PEX_ADDED_MAX][6];
+    u8 added_flags[TORRENT_PEX_ADDED_MAX];
+    usize added_length = 0;
+    for (usize i = 0; i < current_length && added_length < TORRENT_PEX_ADDED_MAX; i++) {
+        if (torrent_pex_contains(peer->pex.advertised, peer->pex.advertised_length, current[i])) { continue; }
+
+        memcpy(added[added_length], current[i], 6);
+        added_flags[added_length] = current_flags[i];
+        added_length++;
+    }
+
+    u8 dropped[TORRENT_PEX_DROPPED_MAX][6];
+    usize dropped_length = 0;
+    for (usize i = 0; i < peer->pex.advertised_length && dropped_length < TORRENT_PEX_DROPPED_MAX; i++) {
+        if (torrent_pex_contains(current, current_length, peer->pex.advertised[i])) { continue; }
+
+        memcpy(dropped[dropped_length], peer->pex.advertised[i], 6);
+        dropped_length++;
+    }
+
+    free(current);
+    free(current_flags);
+
+    if (added_length == 0 && dropped_length == 0) { return true; }
+
+    TorrentPexMessage message = {
+        .added = added, .added_flags = added_flags, .added_length = added_length,
+        .dropped = dropped, .dropped_length = dropped_length,
+    };
+    bool success = torrent_extension_message_encode(peer, peer->extensions.ut_pex, torrent_pex_message_write, &message, NULL, 0);
+    if (!success) { return false; }
+
+    // the peer now knows (advertised - dropped) + added
+    usize advertised_capacity = peer->pex.advertised_length + added_length;
+    u8 (*advertised)[6] = (u8 (*)[6]) malloc(sizeof(u8[6]) * (advertised_capacity > 0 ? advertised_capacity : 1));
+    if (!advertised) {
+        log_error("PEX", "Failed to allocate memory for advertised peers!");
+        return true;
+    }
+
+    usize advertised_length = 0;
+    for (usize i = 0; i < peer->pex.advertised_length; i++) {
+        if (torrent_pex_contains(dropped, dropped_length, peer->pex.advertised[i])) { continue; }
+        memcpy(advertised[advertised_length], peer->pex.advertised[i], 6);
+        advertised_length++;
+    }
+    for (usize i = 0; i < added_length; i++) {
+        memcpy(advertised[advertised_length], added[i], 6);
+        advertised_length++;
+    }
+
+    free(peer->pex.advertised);
+    peer->pex.advertised = advertised;
+    peer->pex.advertised_length = advertised_length;
+
+    return true;
+}
+
+/* writes up to peers_max of the peer's newly added addresses, messages that come too often are ignored */
+usize torrent_pex_parse(TorrentPeer* peer, const u8* payload, usize payload_length, TorrentTrackerPeer* peers, usize peers_max) {
+    i64 now = time_now_ms();
+    if (peer->pex.last_received != 0 && now - peer->pex.last_received < TORRENT_PEX_INTERVAL_MS / 2) {
+        log_peer_warn("PEX", peer->ip, peer->port, "Peer is sending pex messages too often!");
+        return 0;
+    }
+    peer->pex.last_received = now;
+
+    usize index = 0;
+    BencodeObject* message = bencode_object_parse((u8*) payload, payload_length, &index);
+    if (!message) {
+        log_peer_warn("PEX", peer->ip, peer->port, "Message is invalid!");
+        return 0;
+    }
+
+    usize peers_length = 0;
+    BencodeObject* added = bencode_object_dictionary_get(message, "added");
+    if (added && added->type == STRING) {
+        for (usize i = 0; i + 6 <= added->string_length && peers_length < peers_max; i += 6) {
+            struct in_addr ip;
+            memcpy(&ip.s_addr, added->string + i, 4);
+            u16 port = ((u16) added->string[i + 4] << 8) | added->string[i + 5];
+            if (port == 0 || ip.s_addr == 0) { continue; }
+
+            TorrentTrackerPeer* added_peer = &peers[peers_length];
+            memset(added_peer, 0, sizeof(TorrentTrackerPeer));
+            inet_ntop(AF_INET, &ip, added_peer->ip, sizeof(added_peer->ip));
+            snprintf(added_peer->port, sizeof(added_peer->port), "%u", port);
+            peers_length++;
+        }
+    }
+
+    bencode_object_destroy(message);
+    return peers_length;
+}
+
+void torrent_pex_state_destroy(TorrentPexState* state) {
+    if (state->advertised) { free(state->advertised); }
+    *state = (TorrentPexState) {0};
+}
+
+static void torrent_pex_message_write(BencodeWriter* writer, const void* context) {
+    const TorrentPexMessage* message = (const TorrentPexMessage*) context;
+
+    bencode_writer_dictionary_begin(writer);
+    bencode_writer_key(writer, "added");
+    bencode_writer_string(writer, message->added, message->added_length * 6);
+    bencode_writer_key(writer, "added.f");
+    bencode_writer_string(writer, message->added_flags, message->added_length);
+    bencode_writer_key(writer, "dropped");
+    bencode_writer_string(writer, message->dropped, message->dropped_length * 6);
+    bencode_writer_end(writer);
+}
+
+/*
+ * only IPv4 peers fit the "added" field, IPv6 would go in "added6". a peer that dialed us
+ * is only reachable on the listen port from its extension handshake, not the one it came from
+ */
+static bool torrent_pex_compact_address(TorrentPeer* peer, u8 compact_address[6]) {
+    struct in_addr ip;
+    if (inet_pton(AF_INET, peer->ip, &ip) != 1) { return false; }
+
+    i64 port = peer->incoming ? peer->extensions.listen_port : strtol(peer->port, NULL, 10);
+    if (port <= 0 || port > 65535) { return false; }
+
+    memcpy(compact_address, &ip.s_addr, 4);
+    compact_address[4] = (port >> 8) & 0xFF;
+    compact_address[5] = port & 0xFF;
+    return true;
+}
+
+static bool torrent_pex_contains(u8 (*addresses)[6], usize addresses_length, const u8 address[6]) {
+    for (usize i = 0; i < addresses_length; i++) {
+        if (memcmp(addresses[i], address, 6) == 0) { return true; }
+    }
+    return false;
+}
+
+static bool torrent_pex_is_seed(TorrentPeer* peer, u32 pieces_length) {
+    if (pieces_length == 0 || !peer->bitfield) { return false; }
+
+    for (u32 i = 0; i < pieces_length; i++) {
+        if (!torrent_peer_has_piece(peer, i)) { return false; }
+    }
+    return true;
+}
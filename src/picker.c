@@ -0,0 +1,405 @@
+#include "picker.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "peer.h"
+#include "types.h"
+#include "utils/log.h"
+
+static bool torrent_picker_piece_start(TorrentPicker* picker, u32 index);
+static bool torrent_picker_piece_block_pick(TorrentPicker* picker, u32 index, TorrentPickerBlock* block);
+static inline bool torrent_picker_bitfield_has(const u8* bitfield, usize bitfield_length, u32 index);
+
+TorrentPicker* torrent_picker_create(u32 pieces_length, usize piece_length, u64 length) {
+    TorrentPicker* picker = (TorrentPicker*) malloc(sizeof(TorrentPicker));
+    if (!picker) {
+        log_error("PICKER", "Failed to allocate memory for picker!");
+        return NULL;
+    }
+
+    picker->pieces_length = pieces_length;
+    picker->piece_length = piece_length;
+    picker->length = length;
+    picker->pieces_completed = 0;
+    picker->window_begin = 0;
+    picker->window_length = 0;
+
+    picker->pieces = (TorrentPiece*) calloc(pieces_length, sizeof(TorrentPiece));
+    if (!picker->pieces) {
+        log_error("PICKER", "Failed to allocate memory for pieces!");
+        free(picker);
+        return NULL;
+    }
+
+    picker->bitfield_length = (pieces_length + 7) / 8;
+    picker->bitfield = (u8*) calloc(picker->bitfield_length, sizeof(u8));
+    if (!picker->bitfield) {
+        log_error("PICKER", "Failed to allocate memory for bitfield!");
+        free(picker->pieces);
+        free(picker);
+        return NULL;
+    }
+
+    picker->partial_length = 0;
+    picker->partial = (u32*) malloc(sizeof(u32) * (pieces_length > 0 ? pieces_length : 1));
+    if (!picker->partial) {
+        log_error("PICKER", "Failed to allocate memory for partial pieces!");
+        free(picker->bitfield);
+        free(picker->pieces);
+        free(picker);
+        return NULL;
+    }
+
+    for (u32 i = 0; i < pieces_length; i++) {
+        picker->pieces[i].state = TORRENT_PIECE_MISSING;
+        picker->pieces[i].length = (i == pieces_length - 1) ? (u32) (length - ((u64) i * piece_length)) : (u32) piece_length;
+    }
+
+    return picker;
+}
+
+void torrent_picker_availability_add(TorrentPicker* picker, const u8* bitfield, usize bitfield_length) {
+    for (u32 i = 0; i < picker->pieces_length; i++) {
+        if (torrent_picker_bitfield_has(bitfield, bitfield_length, i)) { picker->pieces[i].availability++; }
+    }
+}
+
+void torrent_picker_availability_remove(TorrentPicker* picker, const u8* bitfield, usize bitfield_length) {
+    for (u32 i = 0; i < picker->pieces_length; i++) {
+        if (torrent_picker_bitfield_has(bitfield, bitfield_length, i) && picker->pieces[i].availability > 0) {
+            picker->pieces[i].availability--;
+        }
+    }
+}
+
+void torrent_picker_availability_have(TorrentPicker* picker, u32 index) {
+    if (index < picker->pieces_length) { picker->pieces[index].availability++; }
+}
+
+/*
+ * finishes partial pieces first so few piece buffers are alive at once, otherwise
+ * starts the rarest piece the peer has. the scan starts at a random piece so peers
+ * with the same pieces don't all pile onto the same one
+ */
+bool torrent_picker_block_pick(TorrentPicker* picker, const u8* bitfield, usize bitfield_length, TorrentPickerBlock* block) {
+    if (picker->pieces_length == 0) { return false; }
+
+    for (u32 i = 0; i < picker->partial_length; i++) {
+        u32 index = picker->partial[i];
+        if (!torrent_picker_bitfield_has(bitfield, bitfield_length, index)) { continue; }
+
+        if (torrent_picker_piece_block_pick(picker, index, block)) { return true; }
+    }
+
+    u32 start = rand() % picker->pieces_length;
+    u32 rarest = picker->pieces_length;
+    for (u32 i = 0; i < picker->pieces_length; i++) {
+        u32 index = (start + i) % picker->pieces_length;
+
+        TorrentPiece* piece = &picker->pieces[index];
+        if (piece->state != TORRENT_PIECE_MISSING) { continue; }
+        if (!torrent_picker_bitfield_has(bitfield, bitfield_length, index)) { continue; }
+
+        if (rarest == picker->pieces_length || piece->availability < picker->pieces[rarest].availability) {
+            rarest = index;
+        }
+    }
+
+    if (rarest == picker->pieces_length) { return false; }
+    if (!torrent_picker_piece_start(picker, rarest)) { return false; }
+
+    return torrent_picker_piece_block_pick(picker, rarest, block);
+}
+
+/* picks from one given piece, e.g. an allowed fast or suggested one, starting it if needed */
+bool torrent_picker_block_pick_piece(TorrentPicker* picker, u32 index, TorrentPickerBlock* block) {
+    if (index >= picker->pieces_length) { return false; }
+
+    TorrentPiece* piece = &picker->pieces[index];
+    if (piece->state == TORRENT_PIECE_COMPLETE) { return false; }
+    if (piece->state == TORRENT_PIECE_MISSING && !torrent_picker_piece_start(picker, index)) { return false; }
+
+    return torrent_picker_piece_block_pick(picker, index, block);
+}
+
+/* the first block of the streaming window nobody has been asked for yet, window pieces in order */
+bool torrent_picker_block_pick_critical(TorrentPicker* picker, const u8* bitfield, usize bitfield_length, TorrentPickerBlock* block) {
+    for (u32 i = 0; i < picker->window_length; i++) {
+        u32 index = picker->window_begin + i;
+        if (!torrent_picker_bitfield_has(bitfield, bitfield_length, index)) { continue; }
+
+        if (torrent_picker_block_pick_piece(picker, index, block)) { return true; }
+    }
+
+    return false;
+}
+
+/*
+ * a block of a window piece whose deadline already passed that is still out with some
+ * other peer, so it gets raced. blocks in requests were already asked of this peer
+ */
+bool torrent_picker_block_pick_late(TorrentPicker* picker, const u8* bitfield, usize bitfield_length, const TorrentPeerRequest* requests, usize requests_length, i64 now, TorrentPickerBlock* block) {
+    for (u32 i = 0; i < picker->window_length; i++) {
+        u32 index = picker->window_begin + i;
+        TorrentPiece* piece = &picker->pieces[index];
+        if (piece->state != TORRENT_PIECE_PARTIAL || piece->deadline == 0 || piece->deadline > now) { continue; }
+        if (!torrent_picker_bitfield_has(bitfield, bitfield_length, index)) { continue; }
+
+        for (u32 j = 0; j < piece->blocks_length; j++) {
+            if (piece->blocks[j] != TORRENT_BLOCK_REQUESTED) { continue; }
+
+            u32 begin = j * TORRENT_PEER_BLOCK_LENGTH;
+            bool requested = false;
+            for (usize k = 0; k < requests_length && !requested; k++) {
+                requested = requests[k].index == index && requests[k].begin == begin;
+            }
+            if (requested) { continue; }
+
+            block->index = index;
+            block->begin = begin;
+            block->length = (piece->length - begin < TORRENT_PEER_BLOCK_LENGTH) ? piece->length - begin : TORRENT_PEER_BLOCK_LENGTH;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* the block was never delivered (choke, disconnect or timeout), let someone else request it */
+void torrent_picker_block_release(TorrentPicker* picker, u32 index, u32 begin) {
+    if (index >= picker->pieces_length) { return; }
+
+    TorrentPiece* piece = &picker->pieces[index];
+    if (piece->state != TORRENT_PIECE_PARTIAL) { return; }
+
+    u32 block_index = begin / TORRENT_PEER_BLOCK_LENGTH;
+    if (block_index < piece->blocks_length && piece->blocks[block_index] == TORRENT_BLOCK_REQUESTED) {
+        piece->blocks[block_index] = TORRENT_BLOCK_MISSING;
+    }
+}
+
+/* the block arrived but failed its own hash, drop it so it is fetched again */
+void torrent_picker_block_reset(TorrentPicker* picker, u32 index, u32 begin) {
+    if (index >= picker->pieces_length) { return; }
+
+    TorrentPiece* piece = &picker->pieces[index];
+    if (piece->state != TORRENT_PIECE_PARTIAL) { return; }
+
+    u32 block_index = begin / TORRENT_PEER_BLOCK_LENGTH;
+    if (block_index < piece->blocks_length && piece->blocks[block_index] == TORRENT_BLOCK_RECEIVED) {
+        piece->blocks[block_index] = TORRENT_BLOCK_MISSING;
+        piece->blocks_received--;
+    }
+}
+
+/* returns false if the block doesn't belong to any piece we are downloading */
+bool torrent_picker_block_receive(TorrentPicker* picker, u32 index, u32 begin, const u8* data, u32 length, u32 source, bool* piece_finished) {
+    *piece_finished = false;
+    if (index >= picker->pieces_length) { return false; }
+
+    TorrentPiece* piece = &picker->pieces[index];
+    if (piece->state != TORRENT_PIECE_PARTIAL) { return false; }
+    if (begin % TORRENT_PEER_BLOCK_LENGTH != 0) { return false; }
+
+    u32 block_index = begin / TORRENT_PEER_BLOCK_LENGTH;
+    if (block_index >= piece->blocks_length) { return false; }
+
+    u32 expected_length = (piece->length - begin < TORRENT_PEER_BLOCK_LENGTH) ? piece->length - begin : TORRENT_PEER_BLOCK_LENGTH;
+    if (length != expected_length) { return false; }
+
+    // a late copy of a block that was re-requested elsewhere
+    if (piece->blocks[block_index] == TORRENT_BLOCK_RECEIVED) { return true; }
+
+    memcpy(piece->data + begin, data, length);
+    piece->blocks[block_index] = TORRENT_BLOCK_RECEIVED;
+    piece->sources[block_index] = source;
+    piece->blocks_received++;
+
+    *piece_finished = piece->blocks_received == piece->blocks_length;
+    return true;
+}
+
+/*
+ * where a web seed should start fetching pieces in order: the first missing piece of the
+ * streaming window, otherwise the longest run of missing pieces. a run something is already
+ * working its way into is split in the middle, so several web seeds and the peers each get a part
+ */
+bool torrent_picker_span_pick(TorrentPicker* picker, u32* begin) {
+    for (u32 i = 0; i < picker->window_length; i++) {
+        if (picker->pieces[picker->window_begin + i].state == TORRENT_PIECE_MISSING) {
+            *begin = picker->window_begin + i;
+            return true;
+        }
+    }
+
+    u32 run_begin = 0;
+    u32 run_length = 0;
+    for (u32 i = 0; i < picker->pieces_length;) {
+        if (picker->pieces[i].state != TORRENT_PIECE_MISSING) {
+            i++;
+            continue;
+        }
+
+        u32 length = 0;
+        while (i + length < picker->pieces_length && picker->pieces[i + length].state == TORRENT_PIECE_MISSING) { length++; }
+        if (length > run_length) {
+            run_begin = i;
+            run_length = length;
+        }
+        i += length;
+    }
+
+    if (run_length == 0) { return false; }
+
+    bool extended = run_begin > 0 && picker->pieces[run_begin - 1].state == TORRENT_PIECE_PARTIAL;
+    *begin = extended ? run_begin + (run_length / 2) : run_begin;
+    return true;
+}
+
+/* hands a whole missing piece to one source, every block of it counts as requested */
+bool torrent_picker_piece_claim(TorrentPicker* picker, u32 index) {
+    if (index >= picker->pieces_length || picker->pieces[index].state != TORRENT_PIECE_MISSING) { return false; }
+    if (!torrent_picker_piece_start(picker, index)) { return false; }
+
+    TorrentPiece* piece = &picker->pieces[index];
+    memset(piece->blocks, TORRENT_BLOCK_REQUESTED, piece->blocks_length);
+    return true;
+}
+
+/*
+ * moves the streaming window. pieces entering it are due at deadline plus deadline_step for
+ * every piece ahead of them, pieces already inside keep theirs and pieces left behind lose it
+ */
+void torrent_picker_window_set(TorrentPicker* picker, u32 begin, u32 length, i64 deadline, i64 deadline_step) {
+    if (begin > picker->pieces_length) { begin = picker->pieces_length; }
+    if (length > picker->pieces_length - begin) { length = picker->pieces_length - begin; }
+
+    for (u32 i = 0; i < picker->window_length; i++) {
+        u32 index = picker->window_begin + i;
+        if (index < begin || index >= begin + length) { picker->pieces[index].deadline = 0; }
+    }
+
+    for (u32 i = 0; i < length; i++) {
+        TorrentPiece* piece = &picker->pieces[begin + i];
+        if (piece->deadline == 0 && piece->state != TORRENT_PIECE_COMPLETE) { piece->deadline = deadline + (i * deadline_step); }
+    }
+
+    picker->window_begin = begin;
+    picker->window_length = length;
+}
+
+void torrent_picker_piece_complete(TorrentPicker* picker, u32 index) {
+    TorrentPiece* piece = &picker->pieces[index];
+    if (piece->state == TORRENT_PIECE_COMPLETE) { return; }
+
+    torrent_picker_piece_reset(picker, index);
+    piece->state = TORRENT_PIECE_COMPLETE;
+
+    picker->bitfield[index / 8] |= 1 << (7 - (index % 8));
+    picker->pieces_completed++;
+}
+
+void torrent_picker_piece_reset(TorrentPicker* picker, u32 index) {
+    TorrentPiece* piece = &picker->pieces[index];
+
+    if (piece->state == TORRENT_PIECE_PARTIAL) {
+        for (u32 i = 0; i < picker->partial_length; i++) {
+            if (picker->partial[i] == index) {
+                picker->partial[i] = picker->partial[picker->partial_length - 1];
+                picker->partial_length--;
+                break;
+            }
+        }
+    }
+
+    if (piece->blocks) { free(piece->blocks); }
+    if (piece->data) { free(piece->data); }
+    if (piece->sources) { free(piece->sources); }
+    piece->blocks = NULL;
+    piece->data = NULL;
+    piece->sources = NULL;
+    piece->blocks_length = 0;
+    piece->blocks_received = 0;
+    piece->state = TORRENT_PIECE_MISSING;
+}
+
+bool torrent_picker_has(TorrentPicker* picker, u32 index) {
+    return index < picker->pieces_length && picker->pieces[index].state == TORRENT_PIECE_COMPLETE;
+}
+
+/* true if the bitfield has a piece we haven't verified yet */
+bool torrent_picker_is_interesting(TorrentPicker* picker, const u8* bitfield, usize bitfield_length) {
+    if (!bitfield) { return false; }
+
+    usize length = bitfield_length < picker->bitfield_length ? bitfield_length : picker->bitfield_length;
+    for (usize i = 0; i < length; i++) {
+        u8 missing = bitfield[i] & ~picker->bitfield[i];
+        if (i == picker->bitfield_length - 1 && picker->pieces_length % 8 != 0) {
+            missing &= (u8) (0xFF << (8 - (picker->pieces_length % 8))); // spare bits past the last piece
+        }
+
+        if (missing) { return true; }
+    }
+    return false;
+}
+
+bool torrent_picker_finished(TorrentPicker* picker) {
+    return picker->pieces_completed == picker->pieces_length;
+}
+
+void torrent_picker_destroy(TorrentPicker* picker) {
+    for (u32 i = 0; i < picker->pieces_length; i++) {
+        if (picker->pieces[i].blocks) { free(picker->pieces[i].blocks); }
+        if (picker->pieces[i].data) { free(picker->pieces[i].data); }
+        if (picker->pieces[i].sources) { free(picker->pieces[i].sources); }
+    }
+    free(picker->pieces);
+    free(picker->bitfield);
+    free(picker->partial);
+    free(picker);
+}
+
+static bool torrent_picker_piece_start(TorrentPicker* picker, u32 index) {
+    TorrentPiece* piece = &picker->pieces[index];
+
+    piece->blocks_length = (piece->length + TORRENT_PEER_BLOCK_LENGTH - 1) / TORRENT_PEER_BLOCK_LENGTH;
+    piece->blocks = (u8*) calloc(piece->blocks_length, sizeof(u8));
+    piece->data = (u8*) malloc(sizeof(u8) * piece->length);
+    piece->sources = (u32*) calloc(piece->blocks_length, sizeof(u32));
+    if (!piece->blocks || !piece->data || !piece->sources) {
+        log_error("PICKER", "Failed to allocate memory for piece %u!", index);
+        torrent_picker_piece_reset(picker, index);
+        return false;
+    }
+
+    piece->blocks_received = 0;
+    piece->state = TORRENT_PIECE_PARTIAL;
+
+    picker->partial[picker->partial_length] = index;
+    picker->partial_length++;
+    return true;
+}
+
+static bool torrent_picker_piece_block_pick(TorrentPicker* picker, u32 index, TorrentPickerBlock* block) {
+    TorrentPiece* piece = &picker->pieces[index];
+
+    for (u32 i = 0; i < piece->blocks_length; i++) {
+        if (piece->blocks[i] != TORRENT_BLOCK_MISSING) { continue; }
+
+        piece->blocks[i] = TORRENT_BLOCK_REQUESTED;
+
+        block->index = index;
+        block->begin = i * TORRENT_PEER_BLOCK_LENGTH;
+        block->length = (piece->length - block->begin < TORRENT_PEER_BLOCK_LENGTH) ? piece->length - block->begin : TORRENT_PEER_BLOCK_LENGTH;
+        return true;
+    }
+
+    return false;
+}
+
+static inline bool torrent_picker_bitfield_has(const u8* bitfield, usize bitfield_length, u32 index) {
+    if (!bitfield || index / 8 >= bitfield_length) { return false; }
+    return (bitfield[index / 8] >> (7 - (index % 8))) & 1;
+}
@@ -0,0 +1,812 @@
+#include "replay.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "fast.h"
+#include "peer.h"
+#include "trace.h"
+#include "tracker.h"
+#include "types.h"
+#include "utils/buffer.h"
+#include "utils/log.h"
+#include "utils/time.h"
+
+#define TORRENT_REPLAY_POLL_MS 50
+
+static bool torrent_replay_connections_create(TorrentReplay* replay);
+static int torrent_replay_connection_index_compare(const void* a, const void* b);
+static TorrentReplayConnection* torrent_replay_connection_find(TorrentReplay* replay, const TorrentReplayConnectionIndex* index, u64 id);
+static bool torrent_replay_is_block(const TorrentTraceEvent* event);
+static int torrent_replay_block_compare(const void* a, const void* b);
+static void* torrent_replay_run(void* arg);
+static i64 torrent_replay_due(TorrentReplay* replay, i64 base_us, i64 offset_us);
+static i64 torrent_replay_block_due(TorrentReplay* replay, TorrentReplayConnection* connection);
+static usize torrent_replay_blocks_before(TorrentReplayConnection* connection, i64 time_us);
+static bool torrent_replay_open(TorrentReplay* replay, TorrentReplayConnection* connection, i32* other_socket);
+static i64 torrent_replay_advance(TorrentReplay* replay, TorrentReplayConnection* connection, i64 now);
+static bool torrent_replay_control_send(TorrentReplayConnection* connection, const TorrentTraceEvent* event);
+static bool torrent_replay_block_send(TorrentReplay* replay, TorrentReplayConnection* connection, const TorrentReplayRequest* request);
+static bool torrent_replay_flush(TorrentReplay* replay, TorrentReplayConnection* connection);
+static void torrent_replay_receive(TorrentReplay* replay, TorrentReplayConnection* connection);
+static void torrent_replay_message_handle(TorrentReplayConnection* connection, const u8* message, u32 length);
+static bool torrent_replay_buffer_append(TorrentReplayBuffer* buffer, const u8* data, usize length);
+static void torrent_replay_close(TorrentReplayConnection* connection);
+
+/* speed scales the recorded times, 2 plays twice as fast and 0 as fast as it goes */
+TorrentReplay* torrent_replay_create(const char* path, double speed) {
+    TorrentReplay* replay = (TorrentReplay*) malloc(sizeof(TorrentReplay));
+    if (!replay) {
+        log_error("REPLAY", "Failed to allocate memory for replay!");
+        return NULL;
+    }
+
+    memset(replay, 0, sizeof(TorrentReplay));
+    replay->speed = speed;
+    replay->wake[0] = replay->wake[1] = -1;
+    replay->incoming[0] = replay->incoming[1] = -1;
+    pthread_mutex_init(&replay->mutex, NULL);
+
+    replay->trace = torrent_trace_load(path);
+    if (!replay->trace || !torrent_replay_connections_create(replay)) {
+        torrent_replay_destroy(replay);
+        return NULL;
+    }
+
+    if (pipe(replay->wake) == -1 || pipe(replay->incoming) == -1) {
+        log_error("REPLAY", "Failed to create replay pipes!");
+        torrent_replay_destroy(replay);
+        return NULL;
+    }
+    for (i32 i = 0; i < 2; i++) {
+        fcntl(replay->wake[i], F_SETFL, fcntl(replay->wake[i], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(replay->incoming[i], F_SETFL, fcntl(replay->incoming[i], F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    log_info("REPLAY", "Loaded %zu events over %zu connections with %zu blocks from %s", replay->trace->events_length, replay->connections_length, replay->blocks_length, path);
+    return replay;
+}
+
+/* the recorded times count from here */
+bool torrent_replay_start(TorrentReplay* replay) {
+    replay->started_us = time_now_us();
+    replay->last_active_us = replay->started_us;
+    replay->running = true;
+
+    if (pthread_create(&replay->thread, NULL, torrent_replay_run, replay) != 0) {
+        log_error("REPLAY", "Failed to start the replay thread!");
+        replay->running = false;
+        return false;
+    }
+
+    return true;
+}
+
+/* the downloader's end of the next recorded connection to the address, -1 if the trace has none left */
+i32 torrent_replay_connect(TorrentReplay* replay, const char* ip, const char* port) {
+    i32 client_socket = -1;
+
+    pthread_mutex_lock(&replay->mutex);
+    for (usize i = 0; i < replay->connections_length; i++) {
+        TorrentReplayConnection* connection = &replay->connections[i];
+        if (connection->incoming || connection->opened) { continue; }
+        if (strcmp(connection->ip, ip) != 0 || strcmp(connection->port, port) != 0) { continue; }
+
+        if (!connection->connected) {
+            connection->opened = true;
+            connection->done = true;
+        } else if (torrent_replay_open(replay, connection, &client_socket)) {
+            connection->opened_us = time_now_us();
+        }
+        break;
+    }
+    pthread_mutex_unlock(&replay->mutex);
+
+    if (client_socket != -1) {
+        u8 wake = 0;
+        while (write(replay->wake[1], &wake, 1) == -1 && errno == EINTR) {}
+    }
+
+    return client_socket;
+}
+
+/* an incoming connection that is due, -1 once there are none waiting. poll incoming[0] for POLLIN */
+i32 torrent_replay_accept(TorrentReplay* replay, char ip[32], char port[16]) {
+    // drained before looking, so a connection opened after the look still wakes the next poll
+    u8 drain[64];
+    while (read(replay->incoming[0], drain, sizeof(drain)) > 0) {}
+
+    i32 client_socket = -1;
+
+    pthread_mutex_lock(&replay->mutex);
+    for (usize i = 0; i < replay->connections_length; i++) {
+        TorrentReplayConnection* connection = &replay->connections[i];
+        if (connection->client_socket == -1) { continue; }
+
+        client_socket = connection->client_socket;
+        connection->client_socket = -1;
+        snprintf(ip, 32, "%s", connection->ip);
+        snprintf(port, 16, "%s", connection->port);
+        break;
+    }
+    pthread_mutex_unlock(&replay->mutex);
+
+    return client_socket;
+}
+
+/*
+ * the addresses tracker and dht answers brought in up to now, at their recorded times.
+ * NULL when none are due, free the result otherwise
+ */
+TorrentTrackerPeer* torrent_replay_peers(TorrentReplay* replay, usize* peers_length) {
+    *peers_length = 0;
+
+    TorrentTraceFile* trace = replay->trace;
+    i64 now = time_now_us();
+    TorrentTrackerPeer* peers = NULL;
+    while (replay->peers_next < trace->events_length && *peers_length < TORRENT_REPLAY_PEERS_MAX) {
+        TorrentTraceEvent* event = &trace->events[replay->peers_next];
+        if (torrent_replay_due(replay, replay->started_us, event->time_us) > now) { break; }
+        replay->peers_next++;
+        if (event->type != TORRENT_TRACE_PEERS) { continue; }
+
+        if (!peers) {
+            peers = (TorrentTrackerPeer*) malloc(sizeof(TorrentTrackerPeer) * TORRENT_REPLAY_PEERS_MAX);
+            if (!peers) {
+                log_error("REPLAY", "Failed to allocate memory for replayed peers!");
+                return NULL;
+            }
+        }
+        *peers_length += torrent_trace_peers_parse(event, peers + *peers_length, TORRENT_REPLAY_PEERS_MAX - *peers_length);
+    }
+
+    return peers;
+}
+
+/* the trace has run out and nothing has been open for a while */
+bool torrent_replay_finished(TorrentReplay* replay) {
+    return __atomic_load_n(&replay->finished, __ATOMIC_ACQUIRE);
+}
+
+void torrent_replay_destroy(TorrentReplay* replay) {
+    if (__atomic_load_n(&replay->running, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&replay->running, false, __ATOMIC_RELEASE);
+        u8 wake = 0;
+        while (write(replay->wake[1], &wake, 1) == -1 && errno == EINTR) {}
+        pthread_join(replay->thread, NULL);
+        log_info("REPLAY", "Replayed %llu bytes, the downloader sent %llu", (unsigned long long) replay->bytes_replayed, (unsigned long long) replay->bytes_received);
+        if (replay->requests_missed > 0) {
+            log_warn("REPLAY", "%llu requests were for blocks the trace doesn't have", (unsigned long long) replay->requests_missed);
+        }
+    }
+
+    if (replay->connections) {
+        for (usize i = 0; i < replay->connections_length; i++) {
+            TorrentReplayConnection* connection = &replay->connections[i];
+            if (connection->socket != -1) { close(connection->socket); }
+            if (connection->client_socket != -1) { close(connection->client_socket); }
+            if (connection->events) { free(connection->events); }
+            if (connection->blocks) { free(connection->blocks); }
+            if (connection->requests) { free(connection->requests); }
+            if (connection->input.data) { free(connection->input.data); }
+            if (connection->output.data) { free(connection->output.data); }
+        }
+        free(replay->connections);
+    }
+    if (replay->blocks) { free(replay->blocks); }
+    for (i32 i = 0; i < 2; i++) {
+        if (replay->wake[i] != -1) { close(replay->wake[i]); }
+        if (replay->incoming[i] != -1) { close(replay->incoming[i]); }
+    }
+    if (replay->trace) { torrent_trace_file_destroy(replay->trace); }
+    pthread_mutex_destroy(&replay->mutex);
+    free(replay);
+}
+
+/*
+ * groups the trace's events by connection, the downloader hands out ids in order so they index
+ * an array. the blocks peers sent are pooled and sorted, each connection keeps only their times
+ */
+static bool torrent_replay_connections_create(TorrentReplay* replay) {
+    TorrentTraceFile* trace = replay->trace;
+
+    usize connects = 0;
+    for (usize i = 0; i < trace->events_length; i++) {
+        if (trace->events[i].type == TORRENT_TRACE_CONNECT && trace->events[i].length >= 3) { connects++; }
+    }
+    if (connects == 0) {
+        log_warn("REPLAY", "Trace has no connections to replay");
+        return true;
+    }
+
+    // ids come from the file, so they are looked up in a sorted copy rather than used as indices
+    replay->connections = (TorrentReplayConnection*) calloc(connects, sizeof(TorrentReplayConnection));
+    TorrentReplayConnectionIndex* connection_index = (TorrentReplayConnectionIndex*) malloc(sizeof(TorrentReplayConnectionIndex) * connects);
+    if (!replay->connections || !connection_index) {
+        log_error("REPLAY", "Failed to allocate memory for replay connections!");
+        if (connection_index) { free(connection_index); }
+        return false;
+    }
+
+    for (usize i = 0; i < trace->events_length; i++) {
+        TorrentTraceEvent* event = &trace->events[i];
+        if (event->type != TORRENT_TRACE_CONNECT || event->length < 3) { continue; }
+
+        TorrentReplayConnection* connection = &replay->connections[replay->connections_length];
+        connection->id = event->connection;
+        connection->incoming = event->data[0] != 0;
+        connection->socket = -1;
+        connection->client_socket = -1;
+        connection->recorded_us = event->time_us;
+        connection->closed_us = event->time_us;
+
+        // the ip and port are NUL-terminated, a truncated record leaves them empty
+        const char* ip = (const char*) event->data + 1;
+        usize ip_length = strnlen(ip, event->length - 1);
+        if (ip_length + 1 < event->length - 1) {
+            snprintf(connection->ip, sizeof(connection->ip), "%s", ip);
+            snprintf(connection->port, sizeof(connection->port), "%.*s", (int) (event->length - 2 - ip_length), ip + ip_length + 1);
+        }
+
+        connection_index[replay->connections_length] = (TorrentReplayConnectionIndex) { .id = event->connection, .connection = replay->connections_length };
+        replay->connections_length++;
+    }
+
+    qsort(connection_index, replay->connections_length, sizeof(TorrentReplayConnectionIndex), torrent_replay_connection_index_compare);
+    for (usize i = 0; i < replay->connections_length; i++) {
+        if (connection_index[i].id == 0 || (i > 0 && connection_index[i].id == connection_index[i - 1].id)) {
+            log_error("REPLAY", "Trace has a connection id of 0 or one used twice, it is corrupt!");
+            free(connection_index);
+            return false;
+        }
+    }
+
+    for (usize i = 0; i < trace->events_length; i++) {
+        TorrentTraceEvent* event = &trace->events[i];
+        if (event->type == TORRENT_TRACE_CONNECT) { continue; }
+
+        TorrentReplayConnection* connection = torrent_replay_connection_find(replay, connection_index, event->connection);
+        if (!connection) { continue; }
+        connection->closed_us = event->time_us;
+
+        if (event->type == TORRENT_TRACE_CONNECTED) { connection->connected = true; }
+        if (event->type != TORRENT_TRACE_INBOUND) { continue; }
+        if (torrent_replay_is_block(event)) {
+            connection->blocks_length++;
+            replay->blocks_length++;
+        } else {
+            connection->events_length++;
+        }
+    }
+
+    if (replay->blocks_length > 0) {
+        replay->blocks = (TorrentReplayBlock*) malloc(sizeof(TorrentReplayBlock) * replay->blocks_length);
+        if (!replay->blocks) {
+            log_error("REPLAY", "Failed to allocate memory for replay blocks!");
+            free(connection_index);
+            return false;
+        }
+        replay->blocks_length = 0;
+    }
+    for (usize i = 0; i < replay->connections_length; i++) {
+        TorrentReplayConnection* connection = &replay->connections[i];
+        if (connection->events_length > 0) {
+            connection->events = (usize*) malloc(sizeof(usize) * connection->events_length);
+        }
+        if (connection->blocks_length > 0) {
+            connection->blocks = (i64*) malloc(sizeof(i64) * connection->blocks_length);
+        }
+        if ((connection->events_length > 0 && !connection->events) || (connection->blocks_length > 0 && !connection->blocks)) {
+            log_error("REPLAY", "Failed to allocate memory for connection events!");
+            free(connection_index);
+            return false;
+        }
+        connection->events_length = 0;
+        connection->blocks_length = 0;
+    }
+
+    for (usize i = 0; i < trace->events_length; i++) {
+        TorrentTraceEvent* event = &trace->events[i];
+        if (event->type != TORRENT_TRACE_INBOUND) { continue; }
+
+        TorrentReplayConnection* connection = torrent_replay_connection_find(replay, connection_index, event->connection);
+        if (!connection) { continue; }
+        if (!torrent_replay_is_block(event)) {
+            connection->events[connection->events_length] = i;
+            connection->events_length++;
+            continue;
+        }
+
+        connection->blocks[connection->blocks_length] = event->time_us;
+        connection->blocks_length++;
+        if (event->time_us > replay->blocks_end_us) { replay->blocks_end_us = event->time_us; }
+
+        TorrentReplayBlock* block = &replay->blocks[replay->blocks_length];
+        block->index = buffer_read_big_endian(event->data + 5);
+        block->begin = buffer_read_big_endian(event->data + 9);
+        block->event = event;
+        replay->blocks_length++;
+    }
+
+    if (replay->blocks_length > 0) {
+        qsort(replay->blocks, replay->blocks_length, sizeof(TorrentReplayBlock), torrent_replay_block_compare);
+    }
+
+    free(connection_index);
+    return true;
+}
+
+static int torrent_replay_connection_index_compare(const void* a, const void* b) {
+    const TorrentReplayConnectionIndex* first = (const TorrentReplayConnectionIndex*) a;
+    const TorrentReplayConnectionIndex* second = (const TorrentReplayConnectionIndex*) b;
+    return (first->id > second->id) - (first->id < second->id);
+}
+
+/* NULL for events of a connection the trace never opened */
+static TorrentReplayConnection* torrent_replay_connection_find(TorrentReplay* replay, const TorrentReplayConnectionIndex* index, u64 id) {
+    TorrentReplayConnectionIndex key = { .id = id };
+    TorrentReplayConnectionIndex* found = (TorrentReplayConnectionIndex*) bsearch(&key, index, replay->connections_length, sizeof(TorrentReplayConnectionIndex), torrent_replay_connection_index_compare);
+    return found ? &replay->connections[found->connection] : NULL;
+}
+
+/* a piece message, the handshake is never mistaken for one since its first 4 bytes aren't its length */
+static bool torrent_replay_is_block(const TorrentTraceEvent* event) {
+    return event->length >= 13 && buffer_read_big_endian(event->data) == event->length - 4 && event->data[4] == TORRENT_PEER_MESSAGE_PIECE;
+}
+
+static int torrent_replay_block_compare(const void* a, const void* b) {
+    const TorrentReplayBlock* block_a = (const TorrentReplayBlock*) a;
+    const TorrentReplayBlock* block_b = (const TorrentReplayBlock*) b;
+
+    if (block_a->index != block_b->index) { return (block_a->index < block_b->index) ? -1 : 1; }
+    if (block_a->begin != block_b->begin) { return (block_a->begin < block_b->begin) ? -1 : 1; }
+    return 0;
+}
+
+static void* torrent_replay_run(void* arg) {
+    TorrentReplay* replay = (TorrentReplay*) arg;
+
+    char torrent[41];
+    for (usize i = 0; i < 20; i++) {
+        snprintf(torrent + (i * 2), 3, "%02x", replay->trace->info_hash[i]);
+    }
+    log_torrent_set(torrent);
+
+    struct pollfd* poll_sockets = (struct pollfd*) malloc(sizeof(struct pollfd) * (replay->connections_length + 1));
+    usize* poll_connections = (usize*) malloc(sizeof(usize) * (replay->connections_length + 1));
+    if (!poll_sockets || !poll_connections) {
+        log_error("REPLAY", "Failed to allocate memory for the replay's poll set!");
+        if (poll_sockets) { free(poll_sockets); }
+        if (poll_connections) { free(poll_connections); }
+        __atomic_store_n(&replay->finished, true, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    TorrentTraceFile* trace = replay->trace;
+    i64 trace_end_us = (trace->events_length > 0) ? torrent_replay_due(replay, replay->started_us, trace->events[trace->events_length - 1].time_us) : 0;
+
+    while (__atomic_load_n(&replay->running, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&replay->mutex);
+
+        i64 now = time_now_us();
+        i64 next_due = now + (TORRENT_REPLAY_POLL_MS * 1000);
+        bool active = false;
+
+        usize poll_sockets_length = 0;
+        poll_sockets[poll_sockets_length] = (struct pollfd) { .fd = replay->wake[0], .events = POLLIN };
+        poll_sockets_length++;
+
+        for (usize i = 0; i < replay->connections_length; i++) {
+            TorrentReplayConnection* connection = &replay->connections[i];
+
+            if (connection->incoming && !connection->opened) {
+                i64 due = torrent_replay_due(replay, replay->started_us, connection->recorded_us);
+                active = true;
+                if (now < due) {
+                    if (due < next_due) { next_due = due; }
+                    continue;
+                }
+
+                if (torrent_replay_open(replay, connection, &connection->client_socket)) {
+                    connection->opened_us = now;
+                    u8 wake = 0;
+                    while (write(replay->incoming[1], &wake, 1) == -1 && errno == EINTR) {}
+                }
+            }
+            if (!connection->opened || connection->done) { continue; }
+
+            i64 due = torrent_replay_advance(replay, connection, now);
+            if (connection->done) { continue; }
+
+            active = true;
+            poll_sockets[poll_sockets_length] = (struct pollfd) { .fd = connection->socket, .events = POLLIN };
+            if (due == -1) {
+                poll_sockets[poll_sockets_length].events |= POLLOUT;
+            } else if (due < next_due) {
+                next_due = due;
+            }
+            poll_connections[poll_sockets_length] = i;
+            poll_sockets_length++;
+        }
+
+        // a connection the downloader didn't dial by the time the trace ran out it won't dial anymore
+        if (active) {
+            replay->last_active_us = now;
+        } else if (now - replay->last_active_us >= TORRENT_REPLAY_IDLE_MS * 1000 && now >= trace_end_us) {
+            __atomic_store_n(&replay->finished, true, __ATOMIC_RELEASE);
+        }
+
+        pthread_mutex_unlock(&replay->mutex);
+
+        i32 timeout = (next_due > now) ? (next_due - now + 999) / 1000 : 0;
+        if (poll(poll_sockets, poll_sockets_length, timeout) == -1 && errno != EINTR) {
+            log_error("REPLAY", "Failed to poll replay sockets!");
+            break;
+        }
+
+        if (poll_sockets[0].revents & POLLIN) {
+            u8 drain[64];
+            while (read(replay->wake[0], drain, sizeof(drain)) > 0) {}
+        }
+
+        pthread_mutex_lock(&replay->mutex);
+        for (usize i = 1; i < poll_sockets_length; i++) {
+            if (poll_sockets[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                torrent_replay_receive(replay, &replay->connections[poll_connections[i]]);
+            }
+        }
+        pthread_mutex_unlock(&replay->mutex);
+    }
+
+    free(poll_sockets);
+    free(poll_connections);
+    return NULL;
+}
+
+static i64 torrent_replay_due(TorrentReplay* replay, i64 base_us, i64 offset_us) {
+    if (replay->speed <= 0) { return base_us; }
+    return base_us + (i64) (offset_us / replay->speed);
+}
+
+/*
+ * when the peer may send its next block, INT64_MAX if it never sent any. past the blocks it
+ * recorded it keeps its average pace, the downloader may ask it for more than it got last time
+ */
+static i64 torrent_replay_block_due(TorrentReplay* replay, TorrentReplayConnection* connection) {
+    usize blocks_length = connection->blocks_length;
+    if (blocks_length == 0) { return INT64_MAX; }
+
+    i64 recorded_us;
+    if (connection->blocks_next < blocks_length) {
+        recorded_us = connection->blocks[connection->blocks_next];
+    } else {
+        i64 gap = (blocks_length > 1) ? (connection->blocks[blocks_length - 1] - connection->blocks[0]) / (i64) (blocks_length - 1) : 0;
+        recorded_us = connection->blocks[blocks_length - 1] + (i64) (connection->blocks_next - blocks_length + 1) * gap;
+    }
+
+    return torrent_replay_due(replay, connection->opened_us, recorded_us - connection->recorded_us);
+}
+
+/* how many blocks the peer had sent when the trace saw something else from it */
+static usize torrent_replay_blocks_before(TorrentReplayConnection* connection, i64 time_us) {
+    usize low = 0;
+    usize high = connection->blocks_length;
+    while (low < high) {
+        usize middle = low + ((high - low) / 2);
+        if (connection->blocks[middle] < time_us) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+/* under the mutex, *other_socket gets the downloader's end */
+static bool torrent_replay_open(TorrentReplay* replay, TorrentReplayConnection* connection, i32* other_socket) {
+    connection->opened = true;
+
+    i32 sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) {
+        log_error("REPLAY", "Failed to create a socketpair for %s:%s!", connection->ip, connection->port);
+        connection->done = true;
+        return false;
+    }
+
+    fcntl(sockets[0], F_SETFL, fcntl(sockets[0], F_GETFL, 0) | O_NONBLOCK);
+    connection->socket = sockets[0];
+    *other_socket = sockets[1];
+    replay->last_active_us = time_now_us();
+    connection->last_request_us = replay->last_active_us;
+    return true;
+}
+
+/*
+ * queues what the peer had sent by now and every block the downloader asked for that the
+ * peer's pace allows, then sends. returns when the next thing is due or -1 while the socket
+ * is full. the peer's other messages keep their place among its blocks, and it closes when
+ * the trace did unless the downloader is still asking it for blocks
+ */
+static i64 torrent_replay_advance(TorrentReplay* replay, TorrentReplayConnection* connection, i64 now) {
+    TorrentTraceFile* trace = replay->trace;
+
+    while (true) {
+        i64 next_due = INT64_MAX;
+        bool closing = false;
+
+        while (connection->next < connection->events_length && connection->output.length < TORRENT_REPLAY_OUTPUT_MAX) {
+            TorrentTraceEvent* event = &trace->events[connection->events[connection->next]];
+            i64 due = torrent_replay_due(replay, connection->opened_us, event->time_us - connection->recorded_us);
+            if (now < due) {
+                next_due = due;
+                break;
+            }
+
+            // the blocks that came first go first, unless the downloader stopped asking for them.
+            // what came after the last block answered the recorded session finishing, e.g. a
+            // choke once we weren't interested, and waits until this one is done with the peer too
+            usize blocks_before = torrent_replay_blocks_before(connection, event->time_us);
+            bool after_blocks = connection->blocks_length > 0 && blocks_before == connection->blocks_length;
+            i64 idle_due = connection->last_request_us + (TORRENT_REPLAY_IDLE_MS * 1000);
+            if ((connection->blocks_next < blocks_before || (after_blocks && connection->requests_length > 0)) && now < idle_due) {
+                next_due = idle_due;
+                break;
+            }
+
+            if (!torrent_replay_control_send(connection, event)) {
+                torrent_replay_close(connection);
+                return INT64_MAX;
+            }
+            connection->next++;
+        }
+
+        // a peer that left while blocks were still coming leaves once it sent as many as it did.
+        // the ones still open after the last block only closed because the session was over,
+        // they stay for as long as this one still asks them for something
+        if (connection->next == connection->events_length) {
+            i64 due = torrent_replay_due(replay, connection->opened_us, connection->closed_us - connection->recorded_us);
+            i64 idle_due = connection->last_request_us + (TORRENT_REPLAY_IDLE_MS * 1000);
+            bool session_over = connection->closed_us > replay->blocks_end_us;
+            if ((session_over || connection->blocks_next < connection->blocks_length) && due < idle_due) {
+                due = idle_due;
+            }
+
+            if (now >= due && (!session_over || connection->requests_length == 0)) {
+                closing = true;
+            } else if (now < due && due < next_due) {
+                next_due = due;
+            }
+        }
+
+        while (!closing && connection->requests_length > 0 && connection->output.length < TORRENT_REPLAY_OUTPUT_MAX) {
+            i64 due = torrent_replay_block_due(replay, connection);
+            if (now < due) {
+                if (due < next_due) { next_due = due; }
+                break;
+            }
+
+            TorrentReplayRequest request = connection->requests[0];
+            connection->requests_length--;
+            memmove(connection->requests, connection->requests + 1, sizeof(TorrentReplayRequest) * connection->requests_length);
+
+            if (!torrent_replay_block_send(replay, connection, &request)) {
+                torrent_replay_close(connection);
+                return INT64_MAX;
+            }
+        }
+
+        bool full = connection->output.length >= TORRENT_REPLAY_OUTPUT_MAX;
+        if (!torrent_replay_flush(replay, connection)) {
+            torrent_replay_close(connection);
+            return INT64_MAX;
+        }
+        if (connection->output.length > 0) { return -1; }
+
+        // the downloader reads whatever is still buffered before it sees the hang up
+        if (closing) {
+            torrent_replay_close(connection);
+            return INT64_MAX;
+        }
+        if (!full) { return next_due; }
+    }
+}
+
+/* a recorded message, choking also throws away the requests the peer had, like the downloader does */
+static bool torrent_replay_control_send(TorrentReplayConnection* connection, const TorrentTraceEvent* event) {
+    if (connection->next == 0 && event->length == TORRENT_PEER_HANDSHAKE_LENGTH) {
+        connection->fast = (event->data[20 + 7] & TORRENT_FAST_RESERVED_BIT) != 0;
+    }
+
+    bool message = event->length >= 5 && buffer_read_big_endian(event->data) == event->length - 4;
+    if (message && event->data[4] == TORRENT_PEER_MESSAGE_REJECT_REQUEST) {
+        // they rejected what was asked last time, the requests that get rejected now are our own
+        return true;
+    }
+
+    if (!torrent_replay_buffer_append(&connection->output, event->data, event->length)) { return false; }
+    if (!message || event->data[4] != TORRENT_PEER_MESSAGE_CHOKE) { return true; }
+
+    // fast peers reject every request they drop on a choke
+    if (connection->fast && connection->fast_received) {
+        for (usize i = 0; i < connection->requests_length; i++) {
+            u8 reject[17];
+            buffer_write_big_endian(reject, 13);
+            reject[4] = TORRENT_PEER_MESSAGE_REJECT_REQUEST;
+            buffer_write_big_endian(reject + 5, connection->requests[i].index);
+            buffer_write_big_endian(reject + 9, connection->requests[i].begin);
+            buffer_write_big_endian(reject + 13, connection->requests[i].length);
+            if (!torrent_replay_buffer_append(&connection->output, reject, sizeof(reject))) { return false; }
+        }
+    }
+    connection->requests_length = 0;
+    return true;
+}
+
+/* answers a request with the block from the trace, whichever peer sent it */
+static bool torrent_replay_block_send(TorrentReplay* replay, TorrentReplayConnection* connection, const TorrentReplayRequest* request) {
+    TorrentReplayBlock key = { .index = request->index, .begin = request->begin, .event = NULL };
+    TorrentReplayBlock* block = (TorrentReplayBlock*) bsearch(&key, replay->blocks, replay->blocks_length, sizeof(TorrentReplayBlock), torrent_replay_block_compare);
+    if (!block || block->event->length - 13 < request->length) {
+        replay->requests_missed++;
+        return true;
+    }
+
+    u8 header[13];
+    buffer_write_big_endian(header, 9 + request->length);
+    header[4] = TORRENT_PEER_MESSAGE_PIECE;
+    buffer_write_big_endian(header + 5, request->index);
+    buffer_write_big_endian(header + 9, request->begin);
+
+    if (!torrent_replay_buffer_append(&connection->output, header, sizeof(header))) { return false; }
+    if (!torrent_replay_buffer_append(&connection->output, block->event->data + 13, request->length)) { return false; }
+
+    connection->blocks_next++;
+    return true;
+}
+
+/* false if the downloader hung up */
+static bool torrent_replay_flush(TorrentReplay* replay, TorrentReplayConnection* connection) {
+    TorrentReplayBuffer* output = &connection->output;
+
+    while (output->offset < output->length) {
+        ssize_t bytes_sent = send(connection->socket, output->data + output->offset, output->length - output->offset, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+            return false;
+        }
+
+        output->offset += bytes_sent;
+        replay->bytes_replayed += bytes_sent;
+    }
+
+    if (output->offset == output->length) {
+        output->offset = 0;
+        output->length = 0;
+    }
+    return true;
+}
+
+/* the downloader's side steers only which blocks are sent, everything else is counted and dropped */
+static void torrent_replay_receive(TorrentReplay* replay, TorrentReplayConnection* connection) {
+    if (connection->done) { return; }
+
+    TorrentReplayBuffer* input = &connection->input;
+    while (true) {
+        u8 data[65536];
+        ssize_t bytes_received = recv(connection->socket, data, sizeof(data), 0);
+        if (bytes_received > 0) {
+            replay->bytes_received += bytes_received;
+            if (!torrent_replay_buffer_append(input, data, bytes_received)) {
+                torrent_replay_close(connection);
+                return;
+            }
+            continue;
+        }
+        if (bytes_received == -1 && errno == EINTR) { continue; }
+        if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) { break; }
+
+        // the downloader hung up
+        torrent_replay_close(connection);
+        return;
+    }
+
+    if (!connection->handshake_received) {
+        if (input->length - input->offset < TORRENT_PEER_HANDSHAKE_LENGTH) { return; }
+        connection->fast_received = (input->data[input->offset + 20 + 7] & TORRENT_FAST_RESERVED_BIT) != 0;
+        connection->handshake_received = true;
+        input->offset += TORRENT_PEER_HANDSHAKE_LENGTH;
+    }
+
+    while (input->length - input->offset >= 4) {
+        u32 length = buffer_read_big_endian(input->data + input->offset);
+        if (input->length - input->offset - 4 < length) { break; }
+
+        torrent_replay_message_handle(connection, input->data + input->offset + 4, length);
+        input->offset += 4 + length;
+    }
+
+    if (input->offset == input->length) {
+        input->offset = 0;
+        input->length = 0;
+    }
+}
+
+static void torrent_replay_message_handle(TorrentReplayConnection* connection, const u8* message, u32 length) {
+    if (length != 13) { return; }
+
+    TorrentReplayRequest request = {
+        .index = buffer_read_big_endian(message + 1),
+        .begin = buffer_read_big_endian(message + 5),
+        .length = buffer_read_big_endian(message + 9),
+    };
+
+    if (message[0] == TORRENT_PEER_MESSAGE_REQUEST) {
+        if (connection->requests_length == connection->requests_capacity) {
+            usize capacity = (connection->requests_capacity == 0) ? TORRENT_PEER_REQUESTS_MAX : connection->requests_capacity * 2;
+            TorrentReplayRequest* temp = (TorrentReplayRequest*) realloc(connection->requests, sizeof(TorrentReplayRequest) * capacity);
+            if (!temp) {
+                log_error("REPLAY", "Failed to reallocate memory for replay requests!");
+                return;
+            }
+            connection->requests = temp;
+            connection->requests_capacity = capacity;
+        }
+
+        connection->requests[connection->requests_length] = request;
+        connection->requests_length++;
+        connection->last_request_us = time_now_us();
+    } else if (message[0] == TORRENT_PEER_MESSAGE_CANCEL) {
+        for (usize i = 0; i < connection->requests_length; i++) {
+            TorrentReplayRequest* pending = &connection->requests[i];
+            if (pending->index != request.index || pending->begin != request.begin || pending->length != request.length) { continue; }
+
+            connection->requests_length--;
+            memmove(pending, pending + 1, sizeof(TorrentReplayRequest) * (connection->requests_length - i));
+            break;
+        }
+    }
+}
+
+/* compacts before growing, what was already consumed is dropped */
+static bool torrent_replay_buffer_append(TorrentReplayBuffer* buffer, const u8* data, usize length) {
+    if (buffer->offset > 0 && buffer->length + length > buffer->capacity) {
+        memmove(buffer->data, buffer->data + buffer->offset, buffer->length - buffer->offset);
+        buffer->length -= buffer->offset;
+        buffer->offset = 0;
+    }
+
+    if (buffer->length + length > buffer->capacity) {
+        usize capacity = (buffer->capacity == 0) ? 65536 : buffer->capacity;
+        while (capacity < buffer->length + length) {
+            capacity *= 2;
+        }
+
+        u8* temp = (u8*) realloc(buffer->data, capacity);
+        if (!temp) {
+            log_error("REPLAY", "Failed to reallocate memory for a replay buffer!");
+            return false;
+        }
+        buffer->data = temp;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return true;
+}
+
+static void torrent_replay_close(TorrentReplayConnection* connection) {
+    if (connection->socket != -1) { close(connection->socket); }
+    connection->socket = -1;
+    connection->done = true;
+}
@@ -0,0 +1,470 @@
+#define _GNU_SOURCE // pthread_setaffinity_np
+
+#include "shard.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "peer.h"
+#include "types.h"
+#include "utils/buffer.h"
+#include "utils/log.h"
+#include "utils/mpsc.h"
+
+static void* torrent_shard_run(void* arg);
+static void torrent_shard_commands_handle(TorrentShard* shard);
+static void torrent_shard_connection_event(TorrentShard* shard, TorrentShardConnection* connection, i16 revents);
+static TorrentShardConnection* torrent_shard_connection_find(TorrentShard* shard, u64 id);
+static bool torrent_shard_connection_receive(TorrentShard* shard, TorrentShardConnection* connection);
+static bool torrent_shard_connection_flush(TorrentShard* shard, TorrentShardConnection* connection);
+static void torrent_shard_connection_fail(TorrentShard* shard, TorrentShardConnection* connection);
+static void torrent_shard_connections_sweep(TorrentShard* shard);
+static bool torrent_shard_post(TorrentShardMailbox* mailbox, TorrentShardMessageType type, u64 connection, i32 socket, u8* data, usize length);
+static bool torrent_shard_buffer_reserve(TorrentShardBuffer* buffer, usize length);
+
+bool torrent_shard_mailbox_init(TorrentShardMailbox* mailbox) {
+    mpsc_queue_init(&mailbox->queue);
+    mailbox->wake_pending = false;
+
+    if (pipe(mailbox->wake) == -1) {
+        log_error("SHARD", "Failed to create wake pipe!");
+        return false;
+    }
+
+    for (i32 i = 0; i < 2; i++) {
+        fcntl(mailbox->wake[i], F_SETFL, fcntl(mailbox->wake[i], F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    return true;
+}
+
+/* any thread, only the first post since the consumer last looked writes to the pipe */
+void torrent_shard_mailbox_post(TorrentShardMailbox* mailbox, TorrentShardMessage* message) {
+    mpsc_queue_push(&mailbox->queue, &message->node);
+
+    if (!__atomic_exchange_n(&mailbox->wake_pending, true, __ATOMIC_ACQ_REL)) {
+        u8 wake = 0;
+        while (write(mailbox->wake[1], &wake, 1) == -1 && errno == EINTR) {}
+    }
+}
+
+/* consumer only, poll wake[0] for POLLIN and take until NULL */
+TorrentShardMessage* torrent_shard_mailbox_take(TorrentShardMailbox* mailbox) {
+    MPSCNode* node = mpsc_queue_pop(&mailbox->queue);
+    if (node) { return (TorrentShardMessage*) node; }
+
+    // looks empty, rearm the wake-up before looking again so a post racing us still wakes the next poll
+    __atomic_store_n(&mailbox->wake_pending, false, __ATOMIC_SEQ_CST);
+    u8 drain[64];
+    while (read(mailbox->wake[0], drain, sizeof(drain)) > 0) {}
+
+    return (TorrentShardMessage*) mpsc_queue_pop(&mailbox->queue);
+}
+
+void torrent_shard_mailbox_destroy(TorrentShardMailbox* mailbox) {
+    TorrentShardMessage* message;
+    while ((message = torrent_shard_mailbox_take(mailbox))) {
+        if (message->type == TORRENT_SHARD_ADD) { close(message->socket); }
+        torrent_shard_message_destroy(message);
+    }
+
+    close(mailbox->wake[0]);
+    close(mailbox->wake[1]);
+}
+
+TorrentShard* torrent_shard_create(u32 index, TorrentShardMailbox* events, const char* torrent) {
+    TorrentShard* shard = (TorrentShard*) malloc(sizeof(TorrentShard));
+    if (!shard) {
+        log_error("SHARD", "Failed to allocate memory for shard!");
+        return NULL;
+    }
+
+    memset(shard, 0, sizeof(TorrentShard));
+    shard->index = index;
+    shard->events = events;
+    shard->running = true;
+    if (torrent) {
+        snprintf(shard->torrent, sizeof(shard->torrent), "%s", torrent);
+    }
+
+    if (!torrent_shard_mailbox_init(&shard->commands)) {
+        free(shard);
+        return NULL;
+    }
+
+    if (pthread_create(&shard->thread, NULL, torrent_shard_run, shard) != 0) {
+        log_error("SHARD", "Failed to start shard %u!", index);
+        torrent_shard_mailbox_destroy(&shard->commands);
+        free(shard);
+        return NULL;
+    }
+
+    return shard;
+}
+
+/* hands a socket that is still connecting over to the shard, which closes it from now on */
+bool torrent_shard_add(TorrentShard* shard, u64 connection, i32 socket) {
+    return torrent_shard_post(&shard->commands, TORRENT_SHARD_ADD, connection, socket, NULL, 0);
+}
+
+bool torrent_shard_send(TorrentShard* shard, u64 connection, const u8* data, usize length) {
+    u8* copy = (u8*) malloc(sizeof(u8) * length);
+    if (!copy) {
+        log_error("SHARD", "Failed to allocate memory for send!");
+        return false;
+    }
+
+    memcpy(copy, data, length);
+    return torrent_shard_post(&shard->commands, TORRENT_SHARD_SEND, connection, -1, copy, length);
+}
+
+/* no TORRENT_SHARD_CLOSED comes back for a connection closed this way */
+bool torrent_shard_close(TorrentShard* shard, u64 connection) {
+    return torrent_shard_post(&shard->commands, TORRENT_SHARD_CLOSE, connection, -1, NULL, 0);
+}
+
+void torrent_shard_message_destroy(TorrentShardMessage* message) {
+    if (message->data) { free(message->data); }
+    free(message);
+}
+
+void torrent_shard_destroy(TorrentShard* shard) {
+    while (!torrent_shard_post(&shard->commands, TORRENT_SHARD_STOP, 0, -1, NULL, 0)) {
+        sched_yield();
+    }
+    pthread_join(shard->thread, NULL);
+
+    for (usize i = 0; i < shard->connections_length; i++) {
+        TorrentShardConnection* connection = &shard->connections[i];
+        close(connection->socket);
+        if (connection->input.data) { free(connection->input.data); }
+        if (connection->output.data) { free(connection->output.data); }
+    }
+    if (shard->connections) { free(shard->connections); }
+
+    torrent_shard_mailbox_destroy(&shard->commands);
+    free(shard);
+}
+
+static void* torrent_shard_run(void* arg) {
+    TorrentShard* shard = (TorrentShard*) arg;
+    if (shard->torrent[0] != '\0') {
+        log_torrent_set(shard->torrent);
+    }
+
+    // shard i stays on core i so its connections' buffers stay in that core's cache
+    i64 cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > 1) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(shard->index % cores, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    struct pollfd* poll_fds = NULL;
+    usize poll_fds_capacity = 0;
+
+    while (shard->running) {
+        usize poll_fds_length = 1 + shard->connections_length;
+        if (poll_fds_length > poll_fds_capacity) {
+            struct pollfd* temp = (struct pollfd*) realloc(poll_fds, sizeof(struct pollfd) * poll_fds_length);
+            if (!temp) {
+                log_error("SHARD", "Failed to grow poll array!");
+                break;
+            }
+            poll_fds = temp;
+            poll_fds_capacity = poll_fds_length;
+        }
+
+        poll_fds[0] = (struct pollfd) { .fd = shard->commands.wake[0], .events = POLLIN };
+        for (usize i = 0; i < shard->connections_length; i++) {
+            TorrentShardConnection* connection = &shard->connections[i];
+            i16 events = connection->connecting ? POLLOUT : POLLIN;
+            if (connection->output.offset < connection->output.length) { events |= POLLOUT; }
+            poll_fds[1 + i] = (struct pollfd) { .fd = connection->socket, .events = events };
+        }
+
+        if (poll(poll_fds, poll_fds_length, -1) == -1) {
+            if (errno == EINTR) { continue; }
+            log_error("SHARD", "Failed to poll!");
+            break;
+        }
+
+        // connections first, while the array still lines up with poll_fds
+        for (usize i = 0; i < shard->connections_length; i++) {
+            if (poll_fds[1 + i].revents != 0) {
+                torrent_shard_connection_event(shard, &shard->connections[i], poll_fds[1 + i].revents);
+            }
+        }
+        torrent_shard_connections_sweep(shard);
+
+        torrent_shard_commands_handle(shard);
+        torrent_shard_connections_sweep(shard);
+    }
+
+    if (poll_fds) { free(poll_fds); }
+    return NULL;
+}
+
+static void torrent_shard_commands_handle(TorrentShard* shard) {
+    TorrentShardMessage* message;
+    while ((message = torrent_shard_mailbox_take(&shard->commands))) {
+        switch (message->type) {
+            case TORRENT_SHARD_ADD: {
+                if (shard->connections_length == shard->connections_capacity) {
+                    usize capacity = (shard->connections_capacity == 0) ? 16 : shard->connections_capacity * 2;
+                    TorrentShardConnection* temp = (TorrentShardConnection*) realloc(shard->connections, sizeof(TorrentShardConnection) * capacity);
+                    if (!temp) {
+                        log_error("SHARD", "Failed to grow connections!");
+                        close(message->socket);
+                        torrent_shard_post(shard->events, TORRENT_SHARD_CLOSED, message->connection, -1, NULL, 0);
+                        break;
+                    }
+                    shard->connections = temp;
+                    shard->connections_capacity = capacity;
+                }
+
+                shard->connections[shard->connections_length++] = (TorrentShardConnection) {
+                    .id = message->connection,
+                    .socket = message->socket,
+                    .connecting = true,
+                };
+                break;
+            }
+            case TORRENT_SHARD_SEND: {
+                TorrentShardConnection* connection = torrent_shard_connection_find(shard, message->connection);
+                if (!connection) { break; }
+
+                if (!torrent_shard_buffer_reserve(&connection->output, message->length)) {
+                    log_error("SHARD", "Failed to grow send buffer!");
+                    torrent_shard_connection_fail(shard, connection);
+                    break;
+                }
+                memcpy(connection->output.data + connection->output.length, message->data, message->length);
+                connection->output.length += message->length;
+
+                if (!connection->connecting && !torrent_shard_connection_flush(shard, connection)) {
+                    torrent_shard_connection_fail(shard, connection);
+                }
+                break;
+            }
+            case TORRENT_SHARD_CLOSE: {
+                TorrentShardConnection* connection = torrent_shard_connection_find(shard, message->connection);
+                if (connection) { connection->closed = true; }
+                break;
+            }
+            case TORRENT_SHARD_STOP: shard->running = false; break;
+            default: break;
+        }
+
+        torrent_shard_message_destroy(message);
+    }
+}
+
+static void torrent_shard_connection_event(TorrentShard* shard, TorrentShardConnection* connection, i16 revents) {
+    if (connection->closed) { return; }
+
+    if (connection->connecting) {
+        i32 error = 0;
+        socklen_t error_length = sizeof(error);
+        if (getsockopt(connection->socket, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1 || error != 0) {
+            torrent_shard_connection_fail(shard, connection);
+            return;
+        }
+
+        connection->connecting = false;
+        if (!torrent_shard_post(shard->events, TORRENT_SHARD_CONNECTED, connection->id, -1, NULL, 0)) {
+            connection->closed = true;
+            return;
+        }
+    }
+
+    if ((revents & POLLOUT) && !torrent_shard_connection_flush(shard, connection)) {
+        torrent_shard_connection_fail(shard, connection);
+        return;
+    }
+
+    if ((revents & (POLLIN | POLLERR | POLLHUP)) && !torrent_shard_connection_receive(shard, connection)) {
+        torrent_shard_connection_fail(shard, connection);
+        return;
+    }
+}
+
+static TorrentShardConnection* torrent_shard_connection_find(TorrentShard* shard, u64 id) {
+    for (usize i = 0; i < shard->connections_length; i++) {
+        if (shard->connections[i].id == id && !shard->connections[i].closed) {
+            return &shard->connections[i];
+        }
+    }
+    return NULL;
+}
+
+/* reads what the socket has and hands every whole message on, false once the connection is done */
+static bool torrent_shard_connection_receive(TorrentShard* shard, TorrentShardConnection* connection) {
+    TorrentShardBuffer* input = &connection->input;
+
+    bool open = true;
+    usize total_bytes = 0;
+    while (total_bytes < TORRENT_SHARD_RECEIVE_MAX_PER_CALL) {
+        if (!torrent_shard_buffer_reserve(input, TORRENT_SHARD_RECEIVE_CHUNK)) {
+            log_error("SHARD", "Failed to grow receive buffer!");
+            return false;
+        }
+
+        ssize_t bytes_received = recv(connection->socket, input->data + input->length, input->capacity - input->length, 0);
+        if (bytes_received == 0) {
+            open = false;
+            break;
+        } else if (bytes_received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+            if (errno == EINTR) { continue; }
+            open = false;
+            break;
+        }
+
+        input->length += bytes_received;
+        total_bytes += bytes_received;
+    }
+
+    // cut after the last whole message, the downloader never sees half of one
+    usize end = input->offset;
+    if (!connection->handshaked) {
+        if (input->length - end < TORRENT_PEER_HANDSHAKE_LENGTH) { return open; }
+        end += TORRENT_PEER_HANDSHAKE_LENGTH;
+        connection->handshaked = true;
+    }
+
+    while (input->length - end >= 4) {
+        u32 message_length = buffer_read_big_endian(input->data + end);
+        if (message_length > TORRENT_PEER_MESSAGE_MAX) {
+            log_warn("SHARD", "Message is too long (%u bytes)!", message_length);
+            return false;
+        }
+        if (input->length - end < 4 + (usize) message_length) { break; }
+        end += 4 + message_length;
+    }
+
+    if (end == input->offset) { return open; }
+
+    usize length = end - input->offset;
+    u8* data;
+    if (input->offset == 0 && end == input->length) {
+        // everything buffered is whole messages, hand the buffer itself over
+        data = input->data;
+        *input = (TorrentShardBuffer) {0};
+    } else {
+        data = (u8*) malloc(sizeof(u8) * length);
+        if (!data) {
+            log_error("SHARD", "Failed to allocate memory for received messages!");
+            return false;
+        }
+        memcpy(data, input->data + input->offset, length);
+        input->offset = end;
+        if (input->offset == input->length) {
+            input->offset = 0;
+            input->length = 0;
+        }
+    }
+
+    if (!torrent_shard_post(shard->events, TORRENT_SHARD_RECEIVED, connection->id, -1, data, length)) { return false; }
+
+    return open;
+}
+
+/* the downloader hears how much went out, it holds back uploads while too much is unsent */
+static bool torrent_shard_connection_flush(TorrentShard* shard, TorrentShardConnection* connection) {
+    TorrentShardBuffer* output = &connection->output;
+    usize offset = output->offset;
+    while (output->offset < output->length) {
+        ssize_t bytes_sent = send(connection->socket, output->data + output->offset, output->length - output->offset, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+            if (errno == EINTR) { continue; }
+            return false;
+        }
+
+        output->offset += bytes_sent;
+    }
+
+    usize sent = output->offset - offset;
+    if (output->offset == output->length) {
+        output->offset = 0;
+        output->length = 0;
+    }
+
+    return sent == 0 || torrent_shard_post(shard->events, TORRENT_SHARD_SENT, connection->id, -1, NULL, sent);
+}
+
+/* tells the downloader, the connection goes at the next sweep */
+static void torrent_shard_connection_fail(TorrentShard* shard, TorrentShardConnection* connection) {
+    connection->closed = true;
+    torrent_shard_post(shard->events, TORRENT_SHARD_CLOSED, connection->id, -1, NULL, 0);
+}
+
+static void torrent_shard_connections_sweep(TorrentShard* shard) {
+    usize kept = 0;
+    for (usize i = 0; i < shard->connections_length; i++) {
+        TorrentShardConnection* connection = &shard->connections[i];
+        if (!connection->closed) {
+            shard->connections[kept++] = *connection;
+            continue;
+        }
+
+        close(connection->socket);
+        if (connection->input.data) { free(connection->input.data); }
+        if (connection->output.data) { free(connection->output.data); }
+    }
+    shard->connections_length = kept;
+}
+
+static bool torrent_shard_post(TorrentShardMailbox* mailbox, TorrentShardMessageType type, u64 connection, i32 socket, u8* data, usize length) {
+    TorrentShardMessage* message = (TorrentShardMessage*) malloc(sizeof(TorrentShardMessage));
+    if (!message) {
+        log_error("SHARD", "Failed to allocate memory for message!");
+        if (data) { free(data); }
+        return false;
+    }
+
+    *message = (TorrentShardMessage) {
+        .type = type,
+        .connection = connection,
+        .socket = socket,
+        .data = data,
+        .length = length,
+    };
+    torrent_shard_mailbox_post(mailbox, message);
+    return true;
+}
+
+/* makes room for length more bytes after buffer->length */
+static bool torrent_shard_buffer_reserve(TorrentShardBuffer* buffer, usize length) {
+    if (buffer->length + length <= buffer->capacity) { return true; }
+
+    if (buffer->offset > 0) {
+        memmove(buffer->data, buffer->data + buffer->offset, buffer->length - buffer->offset);
+        buffer->length -= buffer->offset;
+        buffer->offset = 0;
+        if (buffer->length + length <= buffer->capacity) { return true; }
+    }
+
+    usize capacity = (buffer->capacity == 0) ? TORRENT_SHARD_RECEIVE_CHUNK : buffer->capacity;
+    while (capacity < buffer->length + length) {
+        capacity *= 2;
+    }
+
+    u8* temp = (u8*) realloc(buffer->data, sizeof(u8) * capacity);
+    if (!temp) { return false; }
+
+    buffer->data = temp;
+    buffer->capacity = capacity;
+    return true;
+}
@@ -0,0 +1,159 @@
+#include "smart_ban.h"
+
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "peer.h"
+#include "types.h"
+#include "utils/log.h"
+
+static void torrent_smart_ban_piece_trim(TorrentSmartBan* ban, u32 index, usize keep);
+static bool torrent_smart_ban_record_add(TorrentSmartBan* ban, const TorrentSmartBanRecord* record);
+
+TorrentSmartBan* torrent_smart_ban_create() {
+    TorrentSmartBan* ban = (TorrentSmartBan*) malloc(sizeof(TorrentSmartBan));
+    if (!ban) {
+        log_error("SMART BAN", "Failed to allocate memory for smart ban!");
+        return NULL;
+    }
+
+    memset(ban, 0, sizeof(TorrentSmartBan));
+    return ban;
+}
+
+/* the id of an address, the same one every time it connects. 0 if it couldn't be added */
+u32 torrent_smart_ban_source(TorrentSmartBan* ban, const char* ip) {
+    for (usize i = 0; i < ban->sources_length; i++) {
+        if (strcmp(ban->sources[i], ip) == 0) { return i + 1; }
+    }
+
+    if (ban->sources_length == ban->sources_capacity) {
+        usize capacity = (ban->sources_capacity == 0) ? 64 : ban->sources_capacity * 2;
+        char (*temp)[32] = realloc(ban->sources, sizeof(ban->sources[0]) * capacity);
+        if (!temp) {
+            log_error("SMART BAN", "Failed to reallocate memory for sources!");
+            return 0;
+        }
+        ban->sources = temp;
+        ban->sources_capacity = capacity;
+    }
+
+    snprintf(ban->sources[ban->sources_length], sizeof(ban->sources[0]), "%s", ip);
+    ban->sources_length++;
+    return ban->sources_length;
+}
+
+const char* torrent_smart_ban_source_ip(TorrentSmartBan* ban, u32 source) {
+    if (source == 0 || source > ban->sources_length) { return NULL; }
+    return ban->sources[source - 1];
+}
+
+/*
+ * remembers the failed copy's blocks. a piece that came entirely from one source can
+ * only be that source's fault, it is returned right away. otherwise 0. a piece that keeps
+ * failing only keeps its last few copies, so it can't push out every other piece's records
+ */
+u32 torrent_smart_ban_piece_failed(TorrentSmartBan* ban, u32 index, const u8* data, u32 length, const u32* sources, u32 blocks_length) {
+    u32 sole = sources[0];
+
+    torrent_smart_ban_piece_trim(ban, index, (usize) blocks_length * (TORRENT_SMART_BAN_COPIES_MAX - 1));
+
+    for (u32 i = 0; i < blocks_length; i++) {
+        if (sources[i] != sole) { sole = 0; }
+        if (sources[i] == 0) { continue; }
+
+        u32 begin = i * TORRENT_PEER_BLOCK_LENGTH;
+        u32 block_length = (length - begin < TORRENT_PEER_BLOCK_LENGTH) ? length - begin : TORRENT_PEER_BLOCK_LENGTH;
+
+        TorrentSmartBanRecord record = { .index = index, .begin = begin, .source = sources[i] };
+        SHA1(data + begin, block_length, record.hash);
+        if (!torrent_smart_ban_record_add(ban, &record)) { break; }
+    }
+
+    return sole;
+}
+
+/* compares what was remembered about the piece with a copy that passed and forgets it, returns how many culprits were found */
+usize torrent_smart_ban_piece_passed(TorrentSmartBan* ban, u32 index, const u8* data, u32 length, u32* culprits, usize culprits_max) {
+    usize culprits_length = 0;
+
+    usize kept = 0;
+    for (usize i = 0; i < ban->records_length; i++) {
+        TorrentSmartBanRecord* record = &ban->records[i];
+        if (record->index != index) {
+            ban->records[kept] = *record;
+            kept++;
+            continue;
+        }
+
+        u32 block_length = (length - record->begin < TORRENT_PEER_BLOCK_LENGTH) ? length - record->begin : TORRENT_PEER_BLOCK_LENGTH;
+        u8 hash[SHA_DIGEST_LENGTH];
+        SHA1(data + record->begin, block_length, hash);
+        if (memcmp(hash, record->hash, SHA_DIGEST_LENGTH) == 0) { continue; }
+
+        bool known = false;
+        for (usize j = 0; j < culprits_length; j++) {
+            if (culprits[j] == record->source) { known = true; }
+        }
+        if (!known && culprits_length < culprits_max) {
+            culprits[culprits_length] = record->source;
+            culprits_length++;
+        }
+    }
+    ban->records_length = kept;
+
+    return culprits_length;
+}
+
+void torrent_smart_ban_destroy(TorrentSmartBan* ban) {
+    if (ban->sources) { free(ban->sources); }
+    if (ban->records) { free(ban->records); }
+    free(ban);
+}
+
+/* forgets the piece's oldest records until at most keep are left */
+static void torrent_smart_ban_piece_trim(TorrentSmartBan* ban, u32 index, usize keep) {
+    usize count = 0;
+    for (usize i = 0; i < ban->records_length; i++) {
+        if (ban->records[i].index == index) { count++; }
+    }
+    if (count <= keep) { return; }
+
+    usize drop = count - keep;
+    usize kept = 0;
+    for (usize i = 0; i < ban->records_length; i++) {
+        if (ban->records[i].index == index && drop > 0) {
+            drop--;
+            continue;
+        }
+        ban->records[kept] = ban->records[i];
+        kept++;
+    }
+    ban->records_length = kept;
+}
+
+static bool torrent_smart_ban_record_add(TorrentSmartBan* ban, const TorrentSmartBanRecord* record) {
+    if (ban->records_length == ban->records_capacity) {
+        if (ban->records_capacity == TORRENT_SMART_BAN_RECORDS_MAX) {
+            log_warn("SMART BAN", "Too many failed blocks remembered, piece %u can't be attributed!", record->index);
+            return false;
+        }
+
+        usize capacity = (ban->records_capacity == 0) ? 256 : ban->records_capacity * 2;
+        if (capacity > TORRENT_SMART_BAN_RECORDS_MAX) { capacity = TORRENT_SMART_BAN_RECORDS_MAX; }
+
+        TorrentSmartBanRecord* temp = (TorrentSmartBanRecord*) realloc(ban->records, sizeof(TorrentSmartBanRecord) * capacity);
+        if (!temp) {
+            log_error("SMART BAN", "Failed to reallocate memory for records!");
+            return false;
+        }
+        ban->records = temp;
+        ban->records_capacity = capacity;
+    }
+
+    ban->records[ban->records_length] = *record;
+    ban->records_length++;
+    return true;
+}
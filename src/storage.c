@@ -0,0 +1,258 @@
+#include "storage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "metadata.h"
+#include "types.h"
+#include "utils/log.h"
+
+static TorrentStorage* torrent_storage_allocate(TorrentMetadata* metadata, const char* directory, bool create);
+static bool torrent_storage_file_open(TorrentStorageFile* file, const char* directory, const char* name, const char* path, bool create);
+static bool torrent_storage_directories_create(char* path);
+static bool torrent_storage_io(TorrentStorage* storage, u64 offset, u8* data, usize length, bool write);
+static bool torrent_storage_file_acquire(TorrentStorage* storage, TorrentStorageFile* file);
+static void torrent_storage_file_release(TorrentStorage* storage, TorrentStorageFile* file);
+
+TorrentStorage* torrent_storage_create(TorrentMetadata* metadata, const char* directory) {
+    return torrent_storage_allocate(metadata, directory, true);
+}
+
+/* reads files that already exist, e.g. to hash them into a new torrent. they are opened on first read */
+TorrentStorage* torrent_storage_open(TorrentMetadata* metadata, const char* directory) {
+    return torrent_storage_allocate(metadata, directory, false);
+}
+
+bool torrent_storage_write(TorrentStorage* storage, u32 index, u32 begin, const u8* data, usize length) {
+    return torrent_storage_io(storage, ((u64) index * storage->piece_length) + begin, (u8*) data, length, true);
+}
+
+bool torrent_storage_read(TorrentStorage* storage, u32 index, u32 begin, u8* data, usize length) {
+    return torrent_storage_io(storage, ((u64) index * storage->piece_length) + begin, data, length, false);
+}
+
+/* whether the files on disk are long enough to hold the range, so reading it can't come up short */
+bool torrent_storage_has(TorrentStorage* storage, u32 index, u32 begin, usize length) {
+    u64 offset = ((u64) index * storage->piece_length) + begin;
+    u64 end = offset + length;
+
+    for (usize i = 0; i < storage->files_length; i++) {
+        TorrentStorageFile* file = &storage->files[i];
+        if (file->padding || end <= file->offset || offset >= file->offset + file->length) { continue; }
+
+        struct stat file_stat;
+        if ((file->descriptor != -1 ? fstat(file->descriptor, &file_stat) : stat(file->path, &file_stat)) == -1) { return false; }
+
+        u64 needed = (end < file->offset + file->length) ? end - file->offset : file->length;
+        if ((u64) file_stat.st_size < needed) { return false; }
+    }
+
+    return true;
+}
+
+void torrent_storage_destroy(TorrentStorage* storage) {
+    for (usize i = 0; i < storage->files_length; i++) {
+        if (storage->files[i].descriptor != -1) { close(storage->files[i].descriptor); }
+        if (storage->files[i].path) { free(storage->files[i].path); }
+    }
+    free(storage->files);
+    pthread_mutex_destroy(&storage->mutex);
+    free(storage);
+}
+
+static TorrentStorage* torrent_storage_allocate(TorrentMetadata* metadata, const char* directory, bool create) {
+    TorrentStorage* storage = (TorrentStorage*) malloc(sizeof(TorrentStorage));
+    if (!storage) {
+        log_error("STORAGE", "Failed to allocate memory for storage!");
+        return NULL;
+    }
+
+    memset(storage, 0, sizeof(TorrentStorage));
+    pthread_mutex_init(&storage->mutex, NULL);
+    storage->read_only = !create;
+    storage->piece_length = metadata->info.piece_length;
+    storage->files_length = (metadata->info.type == SINGLE_FILE) ? 1 : metadata->info.files_length;
+    storage->files = (TorrentStorageFile*) calloc(storage->files_length, sizeof(TorrentStorageFile));
+    if (!storage->files) {
+        log_error("STORAGE", "Failed to allocate memory for files!");
+        pthread_mutex_destroy(&storage->mutex);
+        free(storage);
+        return NULL;
+    }
+
+    u64 offset = 0;
+    for (usize i = 0; i < storage->files_length; i++) {
+        TorrentStorageFile* file = &storage->files[i];
+        file->descriptor = -1;
+        file->offset = offset;
+
+        bool opened;
+        if (metadata->info.type == SINGLE_FILE) {
+            file->length = metadata->info.length;
+            opened = torrent_storage_file_open(file, directory, metadata->info.name, NULL, create);
+        } else {
+            file->length = metadata->info.files[i].length;
+            file->padding = metadata->info.files[i].padding;
+            opened = file->padding || torrent_storage_file_open(file, directory, metadata->info.name, metadata->info.files[i].path, create);
+        }
+
+        if (!opened) {
+            torrent_storage_destroy(storage);
+            return NULL;
+        }
+
+        offset += file->length;
+    }
+
+    return storage;
+}
+
+/*
+ * path is NULL for single file torrents, otherwise the file lives in a directory called name.
+ * without create the file must already exist and is only read, it is opened on first use
+ */
+static bool torrent_storage_file_open(TorrentStorageFile* file, const char* directory, const char* name, const char* path, bool create) {
+    // names come from the torrent, never let them climb out of the download directory
+    if (strstr(name, "..") || (path && strstr(path, "..")) || name[0] == '/' || (path && path[0] == '/')) {
+        log_error("STORAGE", "Refusing unsafe file path: %s/%s", name, path ? path : "");
+        return false;
+    }
+
+    usize path_length = strlen(directory) + strlen(name) + (path ? strlen(path) : 0) + 3;
+    file->path = (char*) malloc(sizeof(char) * path_length);
+    if (!file->path) {
+        log_error("STORAGE", "Failed to allocate memory for file path!");
+        return false;
+    }
+
+    if (path) {
+        snprintf(file->path, path_length, "%s/%s/%s", directory, name, path);
+    } else {
+        snprintf(file->path, path_length, "%s/%s", directory, name);
+    }
+
+    if (!create) {
+        if (access(file->path, R_OK) == -1) {
+            log_error("STORAGE", "Failed to open file: %s", file->path);
+            return false;
+        }
+        return true;
+    }
+
+    if (!torrent_storage_directories_create(file->path)) {
+        log_error("STORAGE", "Failed to create directories for: %s", file->path);
+        return false;
+    }
+
+    file->descriptor = open(file->path, O_RDWR | O_CREAT, 0644);
+    if (file->descriptor == -1) {
+        log_error("STORAGE", "Failed to open file: %s", file->path);
+        return false;
+    }
+
+    return true;
+}
+
+/* creates every parent directory of path */
+static bool torrent_storage_directories_create(char* path) {
+    for (char* separator = strchr(path + 1, '/'); separator; separator = strchr(separator + 1, '/')) {
+        *separator = '\0';
+        bool failed = mkdir(path, 0755) == -1 && errno != EEXIST;
+        *separator = '/';
+
+        if (failed) { return false; }
+    }
+
+    return true;
+}
+
+/* offset is in the concatenated byte stream, the range may span several files */
+static bool torrent_storage_io(TorrentStorage* storage, u64 offset, u8* data, usize length, bool write) {
+    for (usize i = 0; i < storage->files_length && length > 0; i++) {
+        TorrentStorageFile* file = &storage->files[i];
+        if (offset >= file->offset + file->length) { continue; }
+
+        u64 file_offset = offset - file->offset;
+        usize chunk_length = (file->length - file_offset < length) ? (usize) (file->length - file_offset) : length;
+
+        if (file->padding && !write) { memset(data, 0, chunk_length); }
+        if (!file->padding && !torrent_storage_file_acquire(storage, file)) { return false; }
+
+        usize done = file->padding ? chunk_length : 0;
+        while (done < chunk_length) {
+            ssize_t result = write
+                ? pwrite(file->descriptor, data + done, chunk_length - done, file_offset + done)
+                : pread(file->descriptor, data + done, chunk_length - done, file_offset + done);
+
+            if (result == -1 && errno == EINTR) { continue; }
+            if (result <= 0) {
+                log_error("STORAGE", "Failed to %s file: %s", write ? "write" : "read", file->path);
+                if (!file->padding) { torrent_storage_file_release(storage, file); }
+                return false;
+            }
+            done += result;
+        }
+        if (!file->padding) { torrent_storage_file_release(storage, file); }
+
+        data += chunk_length;
+        offset += chunk_length;
+        length -= chunk_length;
+    }
+
+    return length == 0;
+}
+
+/* opens a read only storage's file if it isn't, making room by closing the least recently used idle one */
+static bool torrent_storage_file_acquire(TorrentStorage* storage, TorrentStorageFile* file) {
+    if (!storage->read_only) { return true; }
+
+    pthread_mutex_lock(&storage->mutex);
+    if (file->descriptor == -1) {
+        // every reader holds one file at a time, so with fewer readers than slots one is idle
+        if (storage->open_length == TORRENT_STORAGE_OPEN_MAX) {
+            usize oldest = TORRENT_STORAGE_OPEN_MAX;
+            for (usize i = 0; i < storage->open_length; i++) {
+                TorrentStorageFile* candidate = &storage->files[storage->open[i]];
+                if (candidate->users == 0 && (oldest == TORRENT_STORAGE_OPEN_MAX || candidate->last_used < storage->files[storage->open[oldest]].last_used)) { oldest = i; }
+            }
+
+            if (oldest != TORRENT_STORAGE_OPEN_MAX) {
+                TorrentStorageFile* evicted = &storage->files[storage->open[oldest]];
+                close(evicted->descriptor);
+                evicted->descriptor = -1;
+                storage->open_length--;
+                storage->open[oldest] = storage->open[storage->open_length];
+            }
+        }
+
+        file->descriptor = (storage->open_length < TORRENT_STORAGE_OPEN_MAX) ? open(file->path, O_RDONLY) : -1;
+        if (file->descriptor == -1) {
+            pthread_mutex_unlock(&storage->mutex);
+            log_error("STORAGE", "Failed to open file: %s", file->path);
+            return false;
+        }
+
+        posix_fadvise(file->descriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+        storage->open[storage->open_length] = file - storage->files;
+        storage->open_length++;
+    }
+
+    file->users++;
+    storage->clock++;
+    file->last_used = storage->clock;
+    pthread_mutex_unlock(&storage->mutex);
+    return true;
+}
+
+static void torrent_storage_file_release(TorrentStorage* storage, TorrentStorageFile* file) {
+    if (!storage->read_only) { return; }
+
+    pthread_mutex_lock(&storage->mutex);
+    file->users--;
+    pthread_mutex_unlock(&storage->mutex);
+}
@@ -0,0 +1,145 @@
+#include "stream.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "storage.h"
+#include "types.h"
+#include "utils/log.h"
+#include "utils/time.h"
+
+static inline bool torrent_stream_has(TorrentStream* stream, u32 index);
+
+TorrentStream* torrent_stream_create() {
+    TorrentStream* stream = (TorrentStream*) malloc(sizeof(TorrentStream));
+    if (!stream) {
+        log_error("STREAM", "Failed to allocate memory for stream!");
+        return NULL;
+    }
+
+    memset(stream, 0, sizeof(TorrentStream));
+    pthread_mutex_init(&stream->mutex, NULL);
+    pthread_cond_init(&stream->changed, NULL);
+    stream->opened_at = time_now_ms();
+
+    return stream;
+}
+
+/* called by the downloader once it has storage, bitfield holds the pieces it already verified */
+bool torrent_stream_start(TorrentStream* stream, TorrentStorage* storage, usize piece_length, u64 length, const u8* bitfield, usize bitfield_length) {
+    u8* verified = (u8*) malloc(sizeof(u8) * (bitfield_length > 0 ? bitfield_length : 1));
+    if (!verified) {
+        log_error("STREAM", "Failed to allocate memory for verified pieces!");
+        return false;
+    }
+    memcpy(verified, bitfield, bitfield_length);
+
+    pthread_mutex_lock(&stream->mutex);
+    stream->storage = storage;
+    stream->piece_length = piece_length;
+    stream->length = length;
+    stream->verified = verified;
+    stream->started = true;
+    if (stream->cursor > length) { stream->cursor = length; }
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->mutex);
+
+    return true;
+}
+
+void torrent_stream_piece_verified(TorrentStream* stream, u32 index) {
+    pthread_mutex_lock(&stream->mutex);
+    stream->verified[index / 8] |= 1 << (7 - (index % 8));
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+/* the piece the reader is waiting for or will ask for next, false once it read everything */
+bool torrent_stream_cursor_piece(TorrentStream* stream, u32* index) {
+    pthread_mutex_lock(&stream->mutex);
+    bool reading = stream->started && stream->cursor < stream->length;
+    if (reading) { *index = stream->cursor / stream->piece_length; }
+    pthread_mutex_unlock(&stream->mutex);
+
+    return reading;
+}
+
+/*
+ * blocks until the bytes at the cursor are verified, then reads up to length of them without
+ * crossing a piece boundary. returns 0 at the end and -1 if the download stopped first
+ */
+ssize_t torrent_stream_read(TorrentStream* stream, u8* data, usize length) {
+    pthread_mutex_lock(&stream->mutex);
+
+    i64 waited_from = 0;
+    while (!stream->started || (stream->cursor < stream->length && !torrent_stream_has(stream, stream->cursor / stream->piece_length))) {
+        if (stream->closed) {
+            pthread_mutex_unlock(&stream->mutex);
+            return -1;
+        }
+
+        if (waited_from == 0) { waited_from = time_now_us(); }
+        pthread_cond_wait(&stream->changed, &stream->mutex);
+    }
+
+    if (stream->cursor >= stream->length) {
+        pthread_mutex_unlock(&stream->mutex);
+        return 0;
+    }
+
+    u64 cursor = stream->cursor;
+    u32 index = cursor / stream->piece_length;
+    u64 piece_end = (u64) (index + 1) * stream->piece_length;
+    if (piece_end > stream->length) { piece_end = stream->length; }
+    if (length > piece_end - cursor) { length = piece_end - cursor; }
+
+    pthread_mutex_unlock(&stream->mutex);
+
+    if (waited_from != 0) { torrent_metrics_record(TORRENT_METRICS_STREAM_STALL_TIME, time_now_us() - waited_from); }
+
+    // verified pieces are never written again, so the read needs no lock
+    if (!torrent_storage_read(stream->storage, index, cursor - ((u64) index * stream->piece_length), data, length)) {
+        log_error("STREAM", "Failed to read piece %u!", index);
+        return -1;
+    }
+
+    pthread_mutex_lock(&stream->mutex);
+    if (stream->cursor == cursor) { stream->cursor += length; } // a seek in between wins
+    if (!stream->first_byte_read) {
+        stream->first_byte_read = true;
+        log_info("STREAM", "First byte read after %lld ms", (long long) (time_now_ms() - stream->opened_at));
+    }
+    pthread_mutex_unlock(&stream->mutex);
+
+    return length;
+}
+
+/* before the metadata arrives any offset is accepted, it is clamped to the length later */
+bool torrent_stream_seek(TorrentStream* stream, u64 offset) {
+    pthread_mutex_lock(&stream->mutex);
+    bool valid = !stream->started || offset <= stream->length;
+    if (valid) { stream->cursor = offset; }
+    pthread_mutex_unlock(&stream->mutex);
+
+    return valid;
+}
+
+/* wakes the reader, anything already verified can still be read */
+void torrent_stream_close(TorrentStream* stream) {
+    pthread_mutex_lock(&stream->mutex);
+    stream->closed = true;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+void torrent_stream_destroy(TorrentStream* stream) {
+    pthread_mutex_destroy(&stream->mutex);
+    pthread_cond_destroy(&stream->changed);
+    if (stream->verified) { free(stream->verified); }
+    free(stream);
+}
+
+static inline bool torrent_stream_has(TorrentStream* stream, u32 index) {
+    return (stream->verified[index / 8] >> (7 - (index % 8))) & 1;
+}
@@ -0,0 +1,69 @@
+#include "super_seed.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "picker.h"
+#include "types.h"
+#include "utils/log.h"
+
+TorrentSuperSeed* torrent_super_seed_create(u32 pieces_length) {
+    TorrentSuperSeed* seed = (TorrentSuperSeed*) malloc(sizeof(TorrentSuperSeed));
+    if (!seed) {
+        log_error("SUPER SEED", "Failed to allocate memory for super seed!");
+        return NULL;
+    }
+
+    seed->pieces_length = pieces_length;
+    seed->offers = (u32*) calloc(pieces_length > 0 ? pieces_length : 1, sizeof(u32));
+    if (!seed->offers) {
+        log_error("SUPER SEED", "Failed to allocate memory for piece offers!");
+        free(seed);
+        return NULL;
+    }
+
+    return seed;
+}
+
+/*
+ * picks the next piece for a peer that has none, the one offered to the fewest peers and then
+ * held by the fewest. false when the peer already has everything
+ */
+bool torrent_super_seed_offer(TorrentSuperSeed* seed, TorrentSuperSeedPeer* state, TorrentPicker* picker, const u8* bitfield, usize bitfield_length) {
+    torrent_super_seed_release(seed, state);
+    if (seed->pieces_length == 0) { return false; }
+
+    // start somewhere random so peers arriving together don't all walk the same ties
+    u32 start = rand() % seed->pieces_length;
+    bool found = false;
+    u32 best = 0;
+    for (u32 i = 0; i < seed->pieces_length; i++) {
+        u32 index = (start + i) % seed->pieces_length;
+
+        bool has = index / 8 < bitfield_length && (bitfield[index / 8] >> (7 - (index % 8))) & 1;
+        if (has) { continue; }
+
+        if (!found || seed->offers[index] < seed->offers[best]
+            || (seed->offers[index] == seed->offers[best] && picker->pieces[index].availability < picker->pieces[best].availability)) {
+            best = index;
+            found = true;
+        }
+    }
+    if (!found) { return false; }
+
+    seed->offers[best]++;
+    *state = (TorrentSuperSeedPeer) { .offered = true, .piece = best };
+    return true;
+}
+
+void torrent_super_seed_release(TorrentSuperSeed* seed, TorrentSuperSeedPeer* state) {
+    if (state->offered && state->piece < seed->pieces_length && seed->offers[state->piece] > 0) {
+        seed->offers[state->piece]--;
+    }
+    *state = (TorrentSuperSeedPeer) {0};
+}
+
+void torrent_super_seed_destroy(TorrentSuperSeed* seed) {
+    free(seed->offers);
+    free(seed);
+}
@@ -0,0 +1,232 @@
+#include "trace.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tracker.h"
+#include "types.h"
+#include "utils/buffer.h"
+#include "utils/log.h"
+#include "utils/time.h"
+
+static void torrent_trace_write(TorrentTrace* trace, const u8* data, usize length);
+static bool torrent_trace_events_add(TorrentTraceFile* file, usize* events_capacity, const TorrentTraceEvent* event);
+
+TorrentTrace* torrent_trace_create(const char* path, const u8 info_hash[20]) {
+    TorrentTrace* trace = (TorrentTrace*) malloc(sizeof(TorrentTrace));
+    if (!trace) {
+        log_error("TRACE", "Failed to allocate memory for trace!");
+        return NULL;
+    }
+
+    memset(trace, 0, sizeof(TorrentTrace));
+
+    trace->file = fopen(path, "wb");
+    if (!trace->file) {
+        log_error("TRACE", "Failed to open trace file for writing: %s", path);
+        free(trace);
+        return NULL;
+    }
+
+    u8 header[TORRENT_TRACE_HEADER_LENGTH];
+    memcpy(header, TORRENT_TRACE_MAGIC, 4);
+    memcpy(header + 4, info_hash, 20);
+    torrent_trace_write(trace, header, sizeof(header));
+
+    trace->started_us = time_now_us();
+    return trace;
+}
+
+void torrent_trace_record(TorrentTrace* trace, TorrentTraceEventType type, u64 connection, const u8* data, usize length) {
+    if (trace->failed) { return; }
+
+    u64 time_us = time_now_us() - trace->started_us;
+
+    u8 record[TORRENT_TRACE_RECORD_LENGTH];
+    record[0] = type;
+    buffer_write_big_endian(record + 1, time_us >> 32);
+    buffer_write_big_endian(record + 5, time_us & 0xFFFFFFFF);
+    buffer_write_big_endian(record + 9, connection >> 32);
+    buffer_write_big_endian(record + 13, connection & 0xFFFFFFFF);
+    buffer_write_big_endian(record + 17, length);
+
+    torrent_trace_write(trace, record, sizeof(record));
+    if (length > 0) { torrent_trace_write(trace, data, length); }
+}
+
+void torrent_trace_connect(TorrentTrace* trace, u64 connection, const char* ip, const char* port, bool incoming) {
+    u8 data[1 + 32 + 16];
+    data[0] = incoming;
+    usize ip_length = strnlen(ip, 31) + 1;
+    usize port_length = strnlen(port, 15) + 1;
+    memcpy(data + 1, ip, ip_length - 1);
+    data[ip_length] = '\0';
+    memcpy(data + 1 + ip_length, port, port_length - 1);
+    data[ip_length + port_length] = '\0';
+
+    torrent_trace_record(trace, TORRENT_TRACE_CONNECT, connection, data, 1 + ip_length + port_length);
+}
+
+void torrent_trace_peers(TorrentTrace* trace, const TorrentTrackerPeer* peers, usize peers_length) {
+    if (peers_length == 0) { return; }
+
+    u8* data = (u8*) malloc(sizeof(u8) * peers_length * (sizeof(peers[0].ip) + sizeof(peers[0].port)));
+    if (!data) {
+        log_error("TRACE", "Failed to allocate memory for the peers event!");
+        return;
+    }
+
+    usize length = 0;
+    for (usize i = 0; i < peers_length; i++) {
+        usize ip_length = strnlen(peers[i].ip, sizeof(peers[i].ip) - 1);
+        memcpy(data + length, peers[i].ip, ip_length);
+        data[length + ip_length] = '\0';
+        length += ip_length + 1;
+
+        usize port_length = strnlen(peers[i].port, sizeof(peers[i].port) - 1);
+        memcpy(data + length, peers[i].port, port_length);
+        data[length + port_length] = '\0';
+        length += port_length + 1;
+    }
+
+    torrent_trace_record(trace, TORRENT_TRACE_PEERS, 0, data, length);
+    free(data);
+}
+
+void torrent_trace_destroy(TorrentTrace* trace) {
+    if (fclose(trace->file) != 0 && !trace->failed) {
+        log_error("TRACE", "Failed to finish writing the trace!");
+    }
+    free(trace);
+}
+
+/* maps the file, a trace holds every block of the session so it isn't read into memory. NULL if it's invalid */
+TorrentTraceFile* torrent_trace_load(const char* path) {
+    i32 descriptor = open(path, O_RDONLY);
+    if (descriptor == -1) {
+        log_error("TRACE", "Failed to open trace file: %s", path);
+        return NULL;
+    }
+
+    struct stat file_stat;
+    if (fstat(descriptor, &file_stat) == -1 || file_stat.st_size < TORRENT_TRACE_HEADER_LENGTH) {
+        log_error("TRACE", "Trace file is invalid: %s", path);
+        close(descriptor);
+        return NULL;
+    }
+    usize data_length = file_stat.st_size;
+
+    u8* data = (u8*) mmap(NULL, data_length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (data == MAP_FAILED) {
+        log_error("TRACE", "Failed to map trace file: %s", path);
+        return NULL;
+    }
+
+    if (memcmp(data, TORRENT_TRACE_MAGIC, 4) != 0) {
+        log_error("TRACE", "Trace file is invalid: %s", path);
+        munmap(data, data_length);
+        return NULL;
+    }
+
+    TorrentTraceFile* file = (TorrentTraceFile*) malloc(sizeof(TorrentTraceFile));
+    if (!file) {
+        log_error("TRACE", "Failed to allocate memory for trace file!");
+        munmap(data, data_length);
+        return NULL;
+    }
+
+    memset(file, 0, sizeof(TorrentTraceFile));
+    memcpy(file->info_hash, data + 4, 20);
+    file->data = data;
+    file->data_length = data_length;
+
+    // a session that was killed leaves a record cut short at the end, everything before it is kept
+    usize events_capacity = 0;
+    usize position = TORRENT_TRACE_HEADER_LENGTH;
+    while (data_length - position >= TORRENT_TRACE_RECORD_LENGTH) {
+        const u8* record = data + position;
+
+        TorrentTraceEvent event;
+        event.type = record[0];
+        event.time_us = ((u64) buffer_read_big_endian(record + 1) << 32) | buffer_read_big_endian(record + 5);
+        event.connection = ((u64) buffer_read_big_endian(record + 9) << 32) | buffer_read_big_endian(record + 13);
+        event.length = buffer_read_big_endian(record + 17);
+        event.data = record + TORRENT_TRACE_RECORD_LENGTH;
+
+        if (data_length - position - TORRENT_TRACE_RECORD_LENGTH < event.length) {
+            log_warn("TRACE", "Trace ends in the middle of an event, ignoring it");
+            break;
+        }
+
+        if (!torrent_trace_events_add(file, &events_capacity, &event)) {
+            torrent_trace_file_destroy(file);
+            return NULL;
+        }
+        position += TORRENT_TRACE_RECORD_LENGTH + event.length;
+    }
+
+    return file;
+}
+
+/* the addresses of a peers event, at most peers_max of them */
+usize torrent_trace_peers_parse(const TorrentTraceEvent* event, TorrentTrackerPeer* peers, usize peers_max) {
+    usize peers_length = 0;
+    usize position = 0;
+    while (position < event->length && peers_length < peers_max) {
+        const char* ip = (const char*) event->data + position;
+        usize ip_length = strnlen(ip, event->length - position);
+        if (position + ip_length + 1 >= event->length) { break; }
+
+        const char* port = ip + ip_length + 1;
+        usize port_length = strnlen(port, event->length - position - ip_length - 1);
+        if (position + ip_length + 1 + port_length >= event->length) { break; }
+
+        TorrentTrackerPeer* peer = &peers[peers_length];
+        memset(peer, 0, sizeof(TorrentTrackerPeer));
+        snprintf(peer->ip, sizeof(peer->ip), "%s", ip);
+        snprintf(peer->port, sizeof(peer->port), "%s", port);
+        peers_length++;
+
+        position += ip_length + 1 + port_length + 1;
+    }
+
+    return peers_length;
+}
+
+void torrent_trace_file_destroy(TorrentTraceFile* file) {
+    munmap(file->data, file->data_length);
+    if (file->events) { free(file->events); }
+    free(file);
+}
+
+static void torrent_trace_write(TorrentTrace* trace, const u8* data, usize length) {
+    if (trace->failed) { return; }
+
+    if (fwrite(data, 1, length, trace->file) != length) {
+        log_error("TRACE", "Failed to write to the trace, recording stops here!");
+        trace->failed = true;
+    }
+}
+
+static bool torrent_trace_events_add(TorrentTraceFile* file, usize* events_capacity, const TorrentTraceEvent* event) {
+    if (file->events_length == *events_capacity) {
+        usize capacity = (*events_capacity == 0) ? 1024 : *events_capacity * 2;
+        TorrentTraceEvent* temp = (TorrentTraceEvent*) realloc(file->events, sizeof(TorrentTraceEvent) * capacity);
+        if (!temp) {
+            log_error("TRACE", "Failed to reallocate memory for trace events!");
+            return false;
+        }
+        file->events = temp;
+        *events_capacity = capacity;
+    }
+
+    file->events[file->events_length] = *event;
+    file->events_length++;
+    return true;
+}
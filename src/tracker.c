@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // memmem
+
 #include "tracker.h"
 
 #include <stdbool.h>
@@ -8,14 +10,21 @@
 #include <string.h>
 
 #include "bencode.h"
+#include "utils/log.h"
 #include "utils/url.h"
 #include "types.h"
 
-/* returns an empty TorrentTrackerResult with .failed = true */
-TorrentTrackerResult torrent_tracker_get(TorrentMetadata* metadata, const char* peer_id) {
+/* returns an empty TorrentTrackerResult with .failed = true. port is where we accept peers, 0 when we don't */
+TorrentTrackerResult torrent_tracker_get(const char* announce, const u8 info_hash[20], const char* peer_id, u16 port) {
     TorrentTrackerResult result = {0};
 
-    URLSplitResult url = url_split(metadata->announce);
+    // magnet links commonly list udp trackers, only plain http is spoken here
+    if (strncmp(announce, "http://", 7) != 0) {
+        log_warn("TRACKER", "Unsupported tracker: %s", announce);
+        return (TorrentTrackerResult) { .failed = true };
+    }
+
+    URLSplitResult url = url_split(announce);
 
     struct addrinfo address_hints = {0};
     address_hints.ai_family = AF_UNSPEC; // allows for either IPv4 or IPv6, it doesnt matter to us
@@ -24,19 +33,19 @@ TorrentTrackerResult torrent_tracker_get(TorrentMetadata* metadata, const char*
     struct addrinfo* address_info;
     i32 status;
     if ((status = getaddrinfo(url.host, url.port, &address_hints, &address_info)) != 0) {
-        fprintf(stderr, "[ERROR] [TRACKER] Failed to get address infomation: %s\n", gai_strerror(status));
+        log_warn("TRACKER", "Failed to get address infomation: %s", gai_strerror(status));
         return (TorrentTrackerResult) { .failed = true };
     }
 
     i32 tracker_socket = socket(address_info->ai_family, address_info->ai_socktype, address_info->ai_protocol);
     if (tracker_socket == -1) {
         freeaddrinfo(address_info);
-        fprintf(stderr, "[ERROR] [TRACKER] Failed to create socket!\n");
+        log_error("TRACKER", "Failed to create socket!");
         return (TorrentTrackerResult) { .failed = true };
     }
 
     if (connect(tracker_socket, address_info->ai_addr, address_info->ai_addrlen) == -1) {
-        fprintf(stderr, "[ERROR] [TRACKER] Failed to connect: %s:%s%s!\n", url.host, url.port, url.path);
+        log_warn("TRACKER", "Failed to connect: %s:%s%s!", url.host, url.port, url.path);
         freeaddrinfo(address_info);
         close(tracker_socket);
         return (TorrentTrackerResult) { .failed = true };
@@ -44,15 +53,18 @@ TorrentTrackerResult torrent_tracker_get(TorrentMetadata* metadata, const char*
 
     freeaddrinfo(address_info);
 
-    char* info_hash_string = url_encode(metadata->info_sha1, sizeof(metadata->info_sha1));
+    char* info_hash_string = url_encode((u8*) info_hash, 20);
+
+    char port_parameter[16] = "";
+    if (port != 0) { snprintf(port_parameter, sizeof(port_parameter), "&port=%u", port); }
 
     char request[512];
-    snprintf(request, sizeof(request), "GET %s?info_hash=%s&peer_id=%s HTTP/1.1\r\n\r\n", url.path, info_hash_string, peer_id);
+    snprintf(request, sizeof(request), "GET %s?info_hash=%s&peer_id=%.20s%s HTTP/1.1\r\n\r\n", url.path, info_hash_string, peer_id, port_parameter);
 
     free(info_hash_string);
 
     if (send(tracker_socket, request, strlen(request), 0) == -1) {
-        fprintf(stderr, "[ERROR] [TRACKER] Failed to send request!\n");
+        log_warn("TRACKER", "Failed to send request!");
         close(tracker_socket);
         return (TorrentTrackerResult) { .failed = true };
     }
@@ -62,7 +74,7 @@ TorrentTrackerResult torrent_tracker_get(TorrentMetadata* metadata, const char*
     while (true) {
         i32 bytes_received = recv(tracker_socket, buffer + total_bytes, sizeof(buffer) - total_bytes, 0);
         if (bytes_received == -1) {
-            fprintf(stderr, "[ERROR] [TRACKER] Failed to receive response!\n");
+            log_warn("TRACKER", "Failed to receive response!");
             close(tracker_socket);
             return (TorrentTrackerResult) { .failed = true };
         } else if (bytes_received == 0) {
@@ -75,17 +87,14 @@ TorrentTrackerResult torrent_tracker_get(TorrentMetadata* metadata, const char*
     close(tracker_socket);
 
     if (total_bytes > sizeof(buffer)) {
-        fprintf(stderr, "[ERROR] [TRACKER] Response is too long!\n");
+        log_warn("TRACKER", "Response is too long!");
         return (TorrentTrackerResult) { .failed = true };
     }
 
     u8* bencode = memmem(buffer, total_bytes, "\r\n\r\n", 4);
     if (!bencode) {
-        fprintf(stderr, "[ERROR] [TRACKER] Response is invalid!\n");
-        for (usize i = 0; i < sizeof(buffer); i++) {
-            printf("%c", buffer[i]);
-        }
-        printf("\n");
+        log_warn("TRACKER", "Response is invalid!");
+        log_debug("TRACKER", "Response: %.*s", (int) total_bytes, buffer);
         return (TorrentTrackerResult) { .failed = true };
     }
 
@@ -95,29 +104,34 @@ TorrentTrackerResult torrent_tracker_get(TorrentMetadata* metadata, const char*
     usize bencoded_respone_index = 0;
     BencodeObject* bencoded_response = bencode_object_parse((u8*) bencode, bencode_length, &bencoded_respone_index);
     if (!bencoded_response) {
-        fprintf(stderr, "[ERROR] [TRACKER] Response's bencode is invalid!\n");
+        log_warn("TRACKER", "Response's bencode is invalid!");
         return (TorrentTrackerResult) { .failed = true };
     }
 
     BencodeObject* bencoded_interval = bencode_object_dictionary_get(bencoded_response, "interval");
-    result.interval = bencoded_interval->number;
-
     BencodeObject* bencoded_peers = bencode_object_dictionary_get(bencoded_response, "peers");
+    if (!bencoded_interval || bencoded_interval->type != INTEGER || !bencoded_peers || bencoded_peers->type != LIST) {
+        log_warn("TRACKER", "Response has no interval or peers!");
+        bencode_object_destroy(bencoded_response);
+        return (TorrentTrackerResult) { .failed = true };
+    }
+
+    result.interval = bencoded_interval->number;
     result.peers_length = bencoded_peers->list_length;
 
     result.peers = (TorrentTrackerPeer*) malloc(sizeof(TorrentTrackerPeer) * result.peers_length);
     if (!result.peers) {
-        fprintf(stderr, "[ERROR] [TRACKER] Failed to allocate memory for peers!\n");
+        log_error("TRACKER", "Failed to allocate memory for peers!");
         bencode_object_destroy(bencoded_response);
         return (TorrentTrackerResult) { .failed = true };
     }
 
     for (usize i = 0; i < result.peers_length; i++) {
         BencodeObject* bencoded_peer_ip = bencode_object_dictionary_get(bencoded_peers->list[i], "ip");
-        memcpy(result.peers[i].ip, bencoded_peer_ip->string, sizeof(result.peers[i].ip));
+        snprintf(result.peers[i].ip, sizeof(result.peers[i].ip), "%.*s", (int) bencoded_peer_ip->string_length, bencoded_peer_ip->string);
 
         BencodeObject* bencoded_peer_port = bencode_object_dictionary_get(bencoded_peers->list[i], "port");
-        snprintf(result.peers[i].port, sizeof(result.peers[i].port), "%i", bencoded_peer_port->number);
+        snprintf(result.peers[i].port, sizeof(result.peers[i].port), "%lld", (long long) bencoded_peer_port->number);
     }
 
     bencode_object_destroy(bencoded_response);
@@ -0,0 +1,14 @@
+#include "utils/buffer.h"
+
+#include "types.h"
+
+void buffer_write_big_endian(u8* buffer, u32 value) {
+    buffer[0] = (value >> 24) & 0xFF;
+    buffer[1] = (value >> 16) & 0xFF;
+    buffer[2] = (value >> 8) & 0xFF;
+    buffer[3] = (value) & 0xFF;
+}
+
+u32 buffer_read_big_endian(const u8* buffer) {
+    return ((u32) buffer[0] << 24) | ((u32) buffer[1] << 16) | ((u32) buffer[2] << 8) | buffer[3];
+}
@@ -5,11 +5,12 @@
 #include <string.h>
 
 #include "types.h"
+#include "utils/log.h"
 
 u8* file_to_byte_array(const char* path, usize* length) {
 	FILE* file = fopen(path, "rb");
   	if (!file) {
-  		fprintf(stderr, "[ERROR] [FILE] Failed to open file when converting file to byte array!\n");
+  		log_error("FILE", "Failed to open file when converting file to byte array!");
    		*length = 0;
     	return NULL;
    	}
@@ -20,7 +21,7 @@ u8* file_to_byte_array(const char* path, usize* length) {
 
     u8* array = (u8*) malloc(sizeof(u8) * (*length));
     if (!array) {
-    	fprintf(stderr, "[ERROR] [FILE] Failed to allocate memory for array when converting file to byte array!\n");
+    	log_error("FILE", "Failed to allocate memory for array when converting file to byte array!");
      	fclose(file);
       	*length = 0;
      	return NULL;
@@ -28,7 +29,7 @@ u8* file_to_byte_array(const char* path, usize* length) {
 
     u32 bytes_read = fread(array, 1, *length, file);
     if (bytes_read != *length) {
-    	fprintf(stderr, "[ERROR] [FILE} Failed to read entire file to array when converting file to byte array!\n");
+    	log_error("FILE", "Failed to read entire file to array when converting file to byte array!");
      	free(array);
      	fclose(file);
       *length = 0;
@@ -0,0 +1,228 @@
+#include "utils/log.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "types.h"
+#include "utils/time.h"
+
+#define LOG_WRITER_IDLE_MS 5
+#define LOG_BATCH_MAX 65536
+
+typedef struct LogRecord {
+    LogLevel level;
+    const char* module; // always a literal, so the pointer outlives the thread
+    u32 suppressed;
+    char peer[64];
+    char torrent[41];
+    char message[LOG_MESSAGE_MAX];
+} LogRecord;
+
+/*
+ * single producer (the owning thread), single consumer (whoever holds log_drain_mutex).
+ * head and tail only ever grow, the slot is the index modulo LOG_RING_LENGTH
+ */
+typedef struct LogRing {
+    LogRecord records[LOG_RING_LENGTH];
+    u32 head;
+    u32 tail;
+    u64 dropped;
+
+    struct LogRing* next;
+} LogRing;
+
+LogLevel log_level = LOG_LEVEL_INFO;
+
+static const char* log_level_names[] = {
+    [LOG_LEVEL_DEBUG] = "DEBUG",
+    [LOG_LEVEL_INFO] = "INFO",
+    [LOG_LEVEL_WARN] = "WARN",
+    [LOG_LEVEL_ERROR] = "ERROR",
+    [LOG_LEVEL_OFF] = "OFF",
+};
+
+static LogRing* log_rings; // every thread that ever logged, rings are never freed
+static pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_start_once = PTHREAD_ONCE_INIT;
+static bool log_writer_running;
+
+static __thread LogRing* log_ring;
+static __thread char log_torrent[41];
+
+static void log_start();
+static void* log_writer_run(void* argument);
+static LogRing* log_ring_get();
+static usize log_drain();
+static usize log_record_format(const LogRecord* record, char* line, usize line_length);
+
+/*
+ * formats the message on the calling thread and hands it to the writer, the caller never
+ * touches stderr. without a writer thread (it failed to start) the message is written here
+ */
+void log_write(LogSite* site, LogLevel level, const char* module, const char* ip, const char* port, const char* format, ...) {
+    pthread_once(&log_start_once, log_start);
+
+    i64 now = time_now_ms();
+    if (now - __atomic_load_n(&site->window_start, __ATOMIC_RELAXED) >= 1000) {
+        __atomic_store_n(&site->window_start, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) >= LOG_SITE_BURST) {
+        __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogRecord local;
+    LogRecord* record = &local;
+
+    LogRing* ring = log_writer_running ? log_ring_get() : NULL;
+    u32 head = 0;
+    if (ring) {
+        head = ring->head;
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_LENGTH) {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        record = &ring->records[head % LOG_RING_LENGTH];
+    }
+
+    record->level = level;
+    record->module = module;
+    record->suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+    record->peer[0] = '\0';
+    if (ip) { snprintf(record->peer, sizeof(record->peer), "%s:%s", ip, port ? port : "?"); }
+    memcpy(record->torrent, log_torrent, sizeof(record->torrent));
+
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(record->message, sizeof(record->message), format, arguments);
+    va_end(arguments);
+
+    if (ring) {
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    char line[LOG_MESSAGE_MAX + 256];
+    usize line_length = log_record_format(record, line, sizeof(line));
+    fwrite(line, 1, line_length, stderr);
+}
+
+void log_level_set(LogLevel level) {
+    log_level = level;
+}
+
+/* debug, info, warn, error or off */
+bool log_level_parse(const char* name, LogLevel* level) {
+    for (usize i = 0; i < sizeof(log_level_names) / sizeof(log_level_names[0]); i++) {
+        if (strcasecmp(name, log_level_names[i]) == 0) {
+            *level = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* the torrent every later message from this thread is about, NULL clears it */
+void log_torrent_set(const char* torrent) {
+    snprintf(log_torrent, sizeof(log_torrent), "%s", torrent ? torrent : "");
+}
+
+/* writes out everything queued so far, runs at exit so nothing is lost */
+void log_flush() {
+    pthread_mutex_lock(&log_drain_mutex);
+    while (log_drain() > 0) {}
+    pthread_mutex_unlock(&log_drain_mutex);
+}
+
+static void log_start() {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, log_writer_run, NULL) != 0) { return; }
+
+    pthread_detach(thread);
+    atexit(log_flush);
+    log_writer_running = true;
+}
+
+static void* log_writer_run(void* argument) {
+    (void) argument;
+
+    struct timespec idle = { .tv_sec = 0, .tv_nsec = LOG_WRITER_IDLE_MS * 1000000L };
+    while (true) {
+        pthread_mutex_lock(&log_drain_mutex);
+        usize drained = log_drain();
+        pthread_mutex_unlock(&log_drain_mutex);
+
+        if (drained == 0) { nanosleep(&idle, NULL); }
+    }
+
+    return NULL;
+}
+
+/* registered once per thread, pushed onto the list without a lock */
+static LogRing* log_ring_get() {
+    if (log_ring) { return log_ring; }
+
+    LogRing* ring = (LogRing*) calloc(1, sizeof(LogRing));
+    if (!ring) { return NULL; }
+
+    ring->next = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {}
+
+    log_ring = ring;
+    return ring;
+}
+
+/* every ring's queued records in one write, the caller holds log_drain_mutex */
+static usize log_drain() {
+    static char batch[LOG_BATCH_MAX];
+    usize batch_length = 0;
+    usize drained = 0;
+
+    for (LogRing* ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        u64 dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped > 0 && batch_length + 128 < sizeof(batch)) {
+            batch_length += snprintf(batch + batch_length, sizeof(batch) - batch_length, "[WARN] [LOG] %llu messages dropped, the log can't keep up!\n", (unsigned long long) dropped);
+        }
+
+        u32 tail = ring->tail;
+        u32 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail != head && batch_length + LOG_MESSAGE_MAX + 256 <= sizeof(batch)) {
+            batch_length += log_record_format(&ring->records[tail % LOG_RING_LENGTH], batch + batch_length, sizeof(batch) - batch_length);
+            tail++;
+            drained++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    if (batch_length > 0) {
+        fwrite(batch, 1, batch_length, stderr);
+        fflush(stderr);
+    }
+    return drained;
+}
+
+/* [LEVEL] [MODULE] message peer=ip:port torrent=hash (n similar suppressed) */
+static usize log_record_format(const LogRecord* record, char* line, usize line_length) {
+    usize length = snprintf(line, line_length, "[%s] [%s] %s", log_level_names[record->level], record->module, record->message);
+    if (length >= line_length) { length = line_length - 1; }
+
+    if (record->peer[0] != '\0' && length < line_length) {
+        length += snprintf(line + length, line_length - length, " peer=%s", record->peer);
+    }
+    if (record->torrent[0] != '\0' && length < line_length) {
+        length += snprintf(line + length, line_length - length, " torrent=%s", record->torrent);
+    }
+    if (record->suppressed > 0 && length < line_length) {
+        length += snprintf(line + length, line_length - length, " (%u similar suppressed)", record->suppressed);
+    }
+    if (length >= line_length - 1) { length = line_length - 2; }
+
+    line[length] = '\n';
+    return length + 1;
+}
@@ -0,0 +1,49 @@
+#include "utils/mpsc.h"
+
+#include <stddef.h>
+
+#include "types.h"
+
+void mpsc_queue_init(MPSCQueue* queue) {
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+void mpsc_queue_push(MPSCQueue* queue, MPSCNode* node) {
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+    MPSCNode* previous = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&previous->next, node, __ATOMIC_RELEASE);
+}
+
+/* consumer only, NULL when empty or when the next node isn't linked in yet */
+MPSCNode* mpsc_queue_pop(MPSCQueue* queue) {
+    MPSCNode* tail = queue->tail;
+    MPSCNode* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    // the stub only marks the end, skip over it
+    if (tail == &queue->stub) {
+        if (!next) { return NULL; }
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        queue->tail = next;
+        return tail;
+    }
+
+    // tail is the last node, unless a producer already swapped head and hasn't linked it yet
+    if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) { return NULL; }
+
+    // put the stub back behind tail so tail can be handed out
+    mpsc_queue_push(queue, &queue->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        queue->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,18 @@
+#include "utils/time.h"
+
+#include <time.h>
+
+#include "types.h"
+
+/* monotonic, only meaningful for measuring intervals */
+i64 time_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((i64) now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+i64 time_now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((i64) now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
@@ -1,9 +1,12 @@
 #include "utils/url.h"
 
+#include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "utils/log.h"
+
 URLSplitResult url_split(const char* url) {
 	URLSplitResult result = {0};
 
@@ -52,7 +55,7 @@ char* url_encode(u8* bytes, usize bytes_length) {
     usize string_length = (bytes_length * (sizeof(char) * 3));
     char* string = (char*) malloc(sizeof(char) * (string_length + 1));
     if (!string) {
-        fprintf(stderr, "[ERROR] [URL] Failed to allocate memory for string!\n");
+        log_error("URL", "Failed to allocate memory for string!");
         return NULL;
     }
 
@@ -64,3 +67,53 @@ char* url_encode(u8* bytes, usize bytes_length) {
     *position = '\0';
     return string;
 }
+
+/* MUST BE FREED, '+' becomes a space and invalid escapes are copied as is */
+char* url_decode(const char* string, usize string_length) {
+    char* decoded = (char*) malloc(sizeof(char) * (string_length + 1));
+    if (!decoded) {
+        log_error("URL", "Failed to allocate memory for string!");
+        return NULL;
+    }
+
+    usize decoded_length = 0;
+    for (usize i = 0; i < string_length; i++) {
+        if (string[i] == '%' && i + 2 < string_length && isxdigit((u8) string[i + 1]) && isxdigit((u8) string[i + 2])) {
+            char hex[3] = { string[i + 1], string[i + 2], '\0' };
+            decoded[decoded_length] = (char) strtol(hex, NULL, 16);
+            i += 2;
+        } else if (string[i] == '+') {
+            decoded[decoded_length] = ' ';
+        } else {
+            decoded[decoded_length] = string[i];
+        }
+        decoded_length++;
+    }
+
+    decoded[decoded_length] = '\0';
+    return decoded;
+}
+
+/* MUST BE FREED, escapes everything but unreserved characters and the '/' between segments */
+char* url_path_encode(const char* path) {
+    usize path_length = strlen(path);
+    char* encoded = (char*) malloc(sizeof(char) * ((path_length * 3) + 1));
+    if (!encoded) {
+        log_error("URL", "Failed to allocate memory for string!");
+        return NULL;
+    }
+
+    usize encoded_length = 0;
+    for (usize i = 0; i < path_length; i++) {
+        u8 character = (u8) path[i];
+        if (isalnum(character) || strchr("-._~/", character)) {
+            encoded[encoded_length] = (char) character;
+            encoded_length++;
+        } else {
+            encoded_length += snprintf(encoded + encoded_length, 4, "%%%02X", character);
+        }
+    }
+
+    encoded[encoded_length] = '\0';
+    return encoded;
+}
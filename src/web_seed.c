@@ -0,0 +1,552 @@
+#define _GNU_SOURCE // memmem
+
+#include "web_seed.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "metadata.h"
+#include "picker.h"
+#include "types.h"
+#include "utils/log.h"
+#include "utils/url.h"
+
+#define TORRENT_WEB_SEED_RECEIVE_CHUNK 65536
+#define TORRENT_WEB_SEED_RECEIVE_MAX_PER_CALL (4 * TORRENT_WEB_SEED_RECEIVE_CHUNK)
+#define TORRENT_WEB_SEED_SPAN_RETRY_MS 1000 // how often an idle seed looks for a new run
+
+static char* torrent_web_seed_path_build(TorrentWebSeed* seed, usize file);
+static bool torrent_web_seed_connect(TorrentWebSeed* seed);
+static bool torrent_web_seed_requests_send(TorrentWebSeed* seed);
+static bool torrent_web_seed_request_write(TorrentWebSeed* seed, const TorrentWebSeedRequest* request);
+static bool torrent_web_seed_headers_parse(TorrentWebSeed* seed, const TorrentWebSeedRequest* request, bool* failed);
+static usize torrent_web_seed_file_find(TorrentWebSeed* seed, u64 offset);
+static u32 torrent_web_seed_block_expected(TorrentWebSeed* seed, u64 offset, u32* index, u32* begin);
+static bool torrent_web_seed_buffer_reserve(TorrentWebSeedBuffer* buffer, usize length);
+
+/* only plain http is spoken, NULL for anything else */
+TorrentWebSeed* torrent_web_seed_create(const char* url, TorrentMetadata* metadata, TorrentPicker* picker) {
+    if (strncmp(url, "http://", 7) != 0) {
+        log_warn("WEB SEED", "Unsupported web seed: %s", url);
+        return NULL;
+    }
+
+    TorrentWebSeed* seed = (TorrentWebSeed*) malloc(sizeof(TorrentWebSeed));
+    if (!seed) {
+        log_error("WEB SEED", "Failed to allocate memory for web seed!");
+        return NULL;
+    }
+
+    memset(seed, 0, sizeof(TorrentWebSeed));
+    seed->socket = -1;
+    seed->metadata = metadata;
+    seed->picker = picker;
+
+    seed->address = url_split(url);
+    if (seed->address.port[0] == '\0') { snprintf(seed->address.port, sizeof(seed->address.port), "80"); }
+    if (seed->address.path[0] == '\0') { snprintf(seed->address.path, sizeof(seed->address.path), "/"); }
+
+    TorrentMetadataInfo* info = &metadata->info;
+    seed->files_length = (info->type == SINGLE_FILE) ? 1 : info->files_length;
+
+    seed->url = strdup(url);
+    seed->file_paths = (char**) calloc(seed->files_length, sizeof(char*));
+    seed->file_offsets = (u64*) malloc(sizeof(u64) * (seed->files_length + 1));
+    if (!seed->url || !seed->file_paths || !seed->file_offsets) {
+        log_error("WEB SEED", "Failed to allocate memory for web seed files!");
+        torrent_web_seed_destroy(seed);
+        return NULL;
+    }
+
+    u64 offset = 0;
+    for (usize i = 0; i < seed->files_length; i++) {
+        seed->file_offsets[i] = offset;
+        offset += (info->type == SINGLE_FILE) ? info->length : info->files[i].length;
+
+        if (info->type == MULTIPLE_FILES && info->files[i].padding) { continue; }
+
+        seed->file_paths[i] = torrent_web_seed_path_build(seed, i);
+        if (!seed->file_paths[i]) {
+            torrent_web_seed_destroy(seed);
+            return NULL;
+        }
+    }
+    seed->file_offsets[seed->files_length] = offset;
+
+    return seed;
+}
+
+/*
+ * starts a new run of pieces once the last one is done, connecting first if needed,
+ * and keeps the pipeline full. false means the connection failed
+ */
+bool torrent_web_seed_update(TorrentWebSeed* seed, i64 now) {
+    if (seed->state == TORRENT_WEB_SEED_CONNECTING) { return true; }
+
+    if (!seed->span_open && seed->requests_length == 0) {
+        if (now < seed->retry_at) { return true; }
+
+        u32 begin;
+        if (!torrent_picker_span_pick(seed->picker, &begin)) {
+            seed->retry_at = now + TORRENT_WEB_SEED_SPAN_RETRY_MS;
+            return true;
+        }
+
+        seed->span_open = true;
+        seed->span_next = begin;
+        seed->claimed = (u64) begin * seed->picker->piece_length;
+        seed->queued = seed->claimed;
+        seed->received = seed->claimed;
+        seed->block_length = 0;
+    }
+
+    if (seed->state == TORRENT_WEB_SEED_IDLE) { return torrent_web_seed_connect(seed); }
+
+    return torrent_web_seed_requests_send(seed) && torrent_web_seed_flush(seed);
+}
+
+bool torrent_web_seed_connect_finish(TorrentWebSeed* seed) {
+    i32 error = 0;
+    socklen_t error_length = sizeof(error);
+    if (getsockopt(seed->socket, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1 || error != 0) {
+        log_warn("WEB SEED", "Failed to connect to %s: %s!", seed->url, strerror(error));
+        return false;
+    }
+
+    seed->state = TORRENT_WEB_SEED_CONNECTED;
+    seed->bytes_connected = seed->bytes_downloaded;
+    return true;
+}
+
+bool torrent_web_seed_flush(TorrentWebSeed* seed) {
+    while (seed->output.offset < seed->output.length) {
+        ssize_t bytes_sent = send(seed->socket, seed->output.data + seed->output.offset, seed->output.length - seed->output.offset, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+            if (errno == EINTR) { continue; }
+            return false;
+        }
+
+        seed->output.offset += bytes_sent;
+    }
+
+    if (seed->output.offset == seed->output.length) {
+        seed->output.offset = 0;
+        seed->output.length = 0;
+    }
+
+    return true;
+}
+
+/* reads whatever the socket has, the server hanging up only sets closed */
+bool torrent_web_seed_receive(TorrentWebSeed* seed) {
+    usize total_bytes = 0;
+    while (total_bytes < TORRENT_WEB_SEED_RECEIVE_MAX_PER_CALL) {
+        if (!torrent_web_seed_buffer_reserve(&seed->input, TORRENT_WEB_SEED_RECEIVE_CHUNK)) {
+            log_error("WEB SEED", "Failed to grow receive buffer!");
+            return false;
+        }
+
+        ssize_t bytes_received = recv(seed->socket, seed->input.data + seed->input.length, seed->input.capacity - seed->input.length, 0);
+        if (bytes_received == 0) {
+            seed->closed = true;
+            break;
+        } else if (bytes_received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+            if (errno == EINTR) { continue; }
+            return false;
+        }
+
+        seed->input.length += bytes_received;
+        total_bytes += bytes_received;
+    }
+
+    return true;
+}
+
+/*
+ * parses what has arrived into the next block, padding is filled in without asking.
+ * false once no complete block is buffered, *failed is set if the server answered wrongly
+ */
+bool torrent_web_seed_block_next(TorrentWebSeed* seed, TorrentPickerBlock* block, const u8** data, bool* failed) {
+    *failed = false;
+
+    while (seed->requests_length > 0) {
+        TorrentWebSeedRequest* request = &seed->requests[seed->requests_start];
+        bool padding = seed->file_paths[request->file] == NULL;
+
+        if (!padding && !seed->headers_parsed && !torrent_web_seed_headers_parse(seed, request, failed)) { return false; }
+
+        u32 index;
+        u32 begin;
+        u32 block_expected = torrent_web_seed_block_expected(seed, seed->received - seed->block_length, &index, &begin);
+
+        u64 length = block_expected - seed->block_length;
+        u64 request_remaining = request->offset + request->length - seed->received;
+        if (request_remaining < length) { length = request_remaining; }
+
+        if (padding) {
+            memset(seed->block + seed->block_length, 0, length);
+        } else {
+            usize available = seed->input.length - seed->input.offset;
+            if (available < length) { length = available; }
+            if (length == 0) { return false; }
+
+            memcpy(seed->block + seed->block_length, seed->input.data + seed->input.offset, length);
+            seed->input.offset += length;
+            seed->bytes_downloaded += length;
+        }
+
+        seed->block_length += length;
+        seed->received += length;
+
+        if (seed->received == request->offset + request->length) {
+            seed->requests_start = (seed->requests_start + 1) % TORRENT_WEB_SEED_REQUESTS_MAX;
+            seed->requests_length--;
+            seed->headers_parsed = false;
+        }
+
+        if (seed->block_length == block_expected) {
+            block->index = index;
+            block->begin = begin;
+            block->length = block_expected;
+            *data = seed->block;
+            seed->block_length = 0;
+
+            // finishing the piece is up to the downloader now
+            if (begin + block_expected == seed->picker->pieces[index].length) { torrent_web_seed_piece_forget(seed, index); }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * drops the connection and gives back to the picker every claimed piece that isn't complete.
+ * a connection that delivered something is tried again right away, e.g. after the server
+ * closed a keep-alive connection, otherwise the seed backs off for longer every time
+ */
+void torrent_web_seed_fail(TorrentWebSeed* seed, i64 now) {
+    // an idle keep-alive connection timing out isn't the server's fault
+    bool idle = seed->state == TORRENT_WEB_SEED_CONNECTED && seed->requests_length == 0 && seed->claimed == seed->received;
+
+    if (seed->socket != -1) { close(seed->socket); }
+    seed->socket = -1;
+    seed->state = TORRENT_WEB_SEED_IDLE;
+    seed->closed = false;
+    seed->input.offset = seed->input.length = 0;
+    seed->output.offset = seed->output.length = 0;
+
+    // our pieces are fetched again from their start, whoever gets to them
+    for (usize i = 0; i < seed->pieces_length; i++) {
+        if (seed->picker->pieces[seed->pieces[i]].state == TORRENT_PIECE_PARTIAL) { torrent_picker_piece_reset(seed->picker, seed->pieces[i]); }
+    }
+    seed->pieces_length = 0;
+
+    seed->span_open = false;
+    seed->claimed = seed->queued = seed->received = 0;
+    seed->requests_start = 0;
+    seed->requests_length = 0;
+    seed->headers_parsed = false;
+    seed->block_length = 0;
+
+    if (idle || seed->bytes_downloaded > seed->bytes_connected) {
+        seed->failures = 0;
+        seed->retry_at = now;
+        return;
+    }
+
+    i64 delay = TORRENT_WEB_SEED_RETRY_MS << (seed->failures < 6 ? seed->failures : 6);
+    if (delay > TORRENT_WEB_SEED_RETRY_MAX_MS) { delay = TORRENT_WEB_SEED_RETRY_MAX_MS; }
+    seed->failures++;
+    seed->retry_at = now + delay;
+    log_warn("WEB SEED", "%s failed, trying again in %lld seconds", seed->url, (long long) (delay / 1000));
+}
+
+void torrent_web_seed_destroy(TorrentWebSeed* seed) {
+    if (seed->socket != -1) { close(seed->socket); }
+    if (seed->file_paths) {
+        for (usize i = 0; i < seed->files_length; i++) {
+            if (seed->file_paths[i]) { free(seed->file_paths[i]); }
+        }
+        free(seed->file_paths);
+    }
+    if (seed->file_offsets) { free(seed->file_offsets); }
+    if (seed->pieces) { free(seed->pieces); }
+    if (seed->input.data) { free(seed->input.data); }
+    if (seed->output.data) { free(seed->output.data); }
+    if (seed->url) { free(seed->url); }
+    free(seed);
+}
+
+/*
+ * MUST BE FREED. a single file torrent's url names the file itself unless it ends in a
+ * slash, otherwise the torrent's name and the file's path are appended to it
+ */
+static char* torrent_web_seed_path_build(TorrentWebSeed* seed, usize file) {
+    TorrentMetadataInfo* info = &seed->metadata->info;
+    const char* base = seed->address.path;
+    usize base_length = strlen(base);
+    bool directory = base[base_length - 1] == '/';
+
+    if (info->type == SINGLE_FILE && !directory) { return strdup(base); }
+
+    char* name = url_path_encode(info->name);
+    char* path = (info->type == MULTIPLE_FILES && info->files[file].path) ? url_path_encode(info->files[file].path) : NULL;
+    if (!name || (info->type == MULTIPLE_FILES && info->files[file].path && !path)) {
+        if (name) { free(name); }
+        return NULL;
+    }
+
+    usize result_length = base_length + strlen(name) + (path ? strlen(path) : 0) + 3;
+    char* result = (char*) malloc(sizeof(char) * result_length);
+    if (result) {
+        snprintf(result, result_length, "%s%s%s%s%s", base, directory ? "" : "/", name, path ? "/" : "", path ? path : "");
+    } else {
+        log_error("WEB SEED", "Failed to allocate memory for file path!");
+    }
+
+    free(name);
+    if (path) { free(path); }
+    return result;
+}
+
+/* starts a non-blocking connect, the downloader polls for POLLOUT and calls torrent_web_seed_connect_finish() */
+static bool torrent_web_seed_connect(TorrentWebSeed* seed) {
+    struct addrinfo address_hints = {0};
+    address_hints.ai_family = AF_UNSPEC;
+    address_hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* address_info;
+    i32 status;
+    if ((status = getaddrinfo(seed->address.host, seed->address.port, &address_hints, &address_info)) != 0) {
+        log_warn("WEB SEED", "Failed to get address infomation for %s: %s", seed->url, gai_strerror(status));
+        return false;
+    }
+
+    seed->socket = socket(address_info->ai_family, address_info->ai_socktype, address_info->ai_protocol);
+    if (seed->socket == -1) {
+        log_error("WEB SEED", "Failed to create socket!");
+        freeaddrinfo(address_info);
+        return false;
+    }
+
+    if (fcntl(seed->socket, F_SETFL, fcntl(seed->socket, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        log_error("WEB SEED", "Failed to make socket non-blocking!");
+        freeaddrinfo(address_info);
+        return false;
+    }
+
+    if (connect(seed->socket, address_info->ai_addr, address_info->ai_addrlen) == -1 && errno != EINPROGRESS) {
+        log_warn("WEB SEED", "Failed to connect to %s!", seed->url);
+        freeaddrinfo(address_info);
+        return false;
+    }
+
+    freeaddrinfo(address_info);
+    seed->state = TORRENT_WEB_SEED_CONNECTING;
+    return true;
+}
+
+/*
+ * claims the run's next pieces a GET's worth at a time while the pipeline has room, then
+ * asks for them with one GET per file they touch. the run ends at the first piece someone
+ * else has started
+ */
+static bool torrent_web_seed_requests_send(TorrentWebSeed* seed) {
+    TorrentPicker* picker = seed->picker;
+
+    while (seed->span_open && seed->claimed - seed->received + TORRENT_WEB_SEED_REQUEST_LENGTH <= TORRENT_WEB_SEED_PIPELINE_LENGTH) {
+        u64 target = seed->claimed + TORRENT_WEB_SEED_REQUEST_LENGTH;
+        while (seed->claimed < target) {
+            if (seed->pieces_length == seed->pieces_capacity) {
+                usize capacity = (seed->pieces_capacity == 0) ? 16 : seed->pieces_capacity * 2;
+                u32* pieces = (u32*) realloc(seed->pieces, sizeof(u32) * capacity);
+                if (!pieces) {
+                    log_error("WEB SEED", "Failed to allocate memory for claimed pieces!");
+                    return false;
+                }
+                seed->pieces = pieces;
+                seed->pieces_capacity = capacity;
+            }
+
+            if (!torrent_picker_piece_claim(picker, seed->span_next)) {
+                seed->span_open = false;
+                break;
+            }
+
+            seed->pieces[seed->pieces_length] = seed->span_next;
+            seed->pieces_length++;
+            seed->claimed += picker->pieces[seed->span_next].length;
+            seed->span_next++;
+        }
+    }
+
+    while (seed->queued < seed->claimed && seed->requests_length < TORRENT_WEB_SEED_REQUESTS_MAX) {
+        usize file = torrent_web_seed_file_find(seed, seed->queued);
+
+        u64 end = seed->claimed;
+        if (seed->file_offsets[file + 1] < end) { end = seed->file_offsets[file + 1]; }
+        if (seed->queued + TORRENT_WEB_SEED_REQUEST_LENGTH < end) { end = seed->queued + TORRENT_WEB_SEED_REQUEST_LENGTH; }
+
+        TorrentWebSeedRequest* request = &seed->requests[(seed->requests_start + seed->requests_length) % TORRENT_WEB_SEED_REQUESTS_MAX];
+        *request = (TorrentWebSeedRequest) { seed->queued, end - seed->queued, file };
+        seed->requests_length++;
+        seed->queued = end;
+
+        if (seed->file_paths[file] && !torrent_web_seed_request_write(seed, request)) { return false; }
+    }
+
+    return true;
+}
+
+static bool torrent_web_seed_request_write(TorrentWebSeed* seed, const TorrentWebSeedRequest* request) {
+    u64 first = request->offset - seed->file_offsets[request->file];
+    u64 last = first + request->length - 1;
+
+    char text[1024];
+    i32 text_length = snprintf(text, sizeof(text), "GET %s HTTP/1.1\r\nHost: %s:%s\r\nRange: bytes=%llu-%llu\r\nConnection: keep-alive\r\n\r\n",
+        seed->file_paths[request->file], seed->address.host, seed->address.port, (unsigned long long) first, (unsigned long long) last);
+
+    // paths too long for the buffer would be cut off mid request
+    if (text_length < 0 || (usize) text_length >= sizeof(text)) {
+        log_warn("WEB SEED", "Request path is too long: %s", seed->file_paths[request->file]);
+        return false;
+    }
+
+    if (!torrent_web_seed_buffer_reserve(&seed->output, text_length)) {
+        log_error("WEB SEED", "Failed to queue request!");
+        return false;
+    }
+
+    memcpy(seed->output.data + seed->output.length, text, text_length);
+    seed->output.length += text_length;
+    return true;
+}
+
+/*
+ * only a 206 for exactly the requested range is taken, or a 200 when the whole file was
+ * asked for. redirects, errors and chunked bodies fail the seed
+ */
+static bool torrent_web_seed_headers_parse(TorrentWebSeed* seed, const TorrentWebSeedRequest* request, bool* failed) {
+    u8* data = seed->input.data + seed->input.offset;
+    usize available = seed->input.length - seed->input.offset;
+
+    u8* end = memmem(data, available, "\r\n\r\n", 4);
+    if (!end || (usize) (end - data) + 4 > TORRENT_WEB_SEED_HEADERS_MAX) {
+        if (end || available > TORRENT_WEB_SEED_HEADERS_MAX) {
+            log_warn("WEB SEED", "Response headers from %s are too long!", seed->url);
+            *failed = true;
+        }
+        return false;
+    }
+
+    usize headers_length = (end - data) + 4;
+    char headers[TORRENT_WEB_SEED_HEADERS_MAX + 1];
+    memcpy(headers, data, headers_length);
+    headers[headers_length] = '\0';
+
+    i32 status = 0;
+    if (strncmp(headers, "HTTP/1.", 7) != 0 || sscanf(headers + 8, " %d", &status) != 1) {
+        log_warn("WEB SEED", "Response from %s is invalid!", seed->url);
+        *failed = true;
+        return false;
+    }
+
+    bool has_length = false;
+    u64 content_length = 0;
+    u64 range_first = 0;
+    bool has_range = false;
+    for (char* line = strstr(headers, "\r\n"); line && line[2] != '\r'; line = strstr(line + 2, "\r\n")) {
+        char* field = line + 2;
+        if (strncasecmp(field, "Content-Length:", 15) == 0) {
+            has_length = sscanf(field + 15, " %llu", (unsigned long long*) &content_length) == 1;
+        } else if (strncasecmp(field, "Content-Range:", 14) == 0) {
+            has_range = sscanf(field + 14, " bytes %llu", (unsigned long long*) &range_first) == 1;
+        }
+    }
+
+    u64 file_offset = request->offset - seed->file_offsets[request->file];
+    u64 file_length = seed->file_offsets[request->file + 1] - seed->file_offsets[request->file];
+    bool whole_file = file_offset == 0 && request->length == file_length;
+
+    bool valid = (status == 206 && (!has_range || range_first == file_offset)) || (status == 200 && whole_file);
+    if (!valid || !has_length || content_length != request->length) {
+        log_warn("WEB SEED", "%s answered %d for %s bytes %llu-%llu", seed->url, status, seed->file_paths[request->file],
+            (unsigned long long) file_offset, (unsigned long long) (file_offset + request->length - 1));
+        *failed = true;
+        return false;
+    }
+
+    seed->input.offset += headers_length;
+    seed->headers_parsed = true;
+    return true;
+}
+
+/* the file holding the byte at offset, empty files never do */
+static usize torrent_web_seed_file_find(TorrentWebSeed* seed, u64 offset) {
+    usize low = 0;
+    usize high = seed->files_length - 1;
+    while (low < high) {
+        usize middle = (low + high) / 2;
+        if (seed->file_offsets[middle + 1] <= offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/* the piece was finished by whoever sent its last block, so it isn't ours to give back any more */
+void torrent_web_seed_piece_forget(TorrentWebSeed* seed, u32 index) {
+    for (usize i = 0; i < seed->pieces_length; i++) {
+        if (seed->pieces[i] != index) { continue; }
+
+        seed->pieces_length--;
+        memmove(&seed->pieces[i], &seed->pieces[i + 1], sizeof(u32) * (seed->pieces_length - i));
+        return;
+    }
+}
+
+/* blocks follow the picker's, 16 KiB from the start of each piece with a shorter last one */
+static u32 torrent_web_seed_block_expected(TorrentWebSeed* seed, u64 offset, u32* index, u32* begin) {
+    TorrentPicker* picker = seed->picker;
+    *index = offset / picker->piece_length;
+    *begin = offset - ((u64) *index * picker->piece_length);
+
+    u32 remaining = picker->pieces[*index].length - *begin;
+    return (remaining < TORRENT_WEB_SEED_BLOCK_LENGTH) ? remaining : TORRENT_WEB_SEED_BLOCK_LENGTH;
+}
+
+static bool torrent_web_seed_buffer_reserve(TorrentWebSeedBuffer* buffer, usize length) {
+    if (buffer->length + length <= buffer->capacity) { return true; }
+
+    // reuse the space in front of data that was already consumed before growing
+    if (buffer->offset > 0) {
+        memmove(buffer->data, buffer->data + buffer->offset, buffer->length - buffer->offset);
+        buffer->length -= buffer->offset;
+        buffer->offset = 0;
+        if (buffer->length + length <= buffer->capacity) { return true; }
+    }
+
+    usize capacity = (buffer->capacity == 0) ? TORRENT_WEB_SEED_RECEIVE_CHUNK : buffer->capacity;
+    while (capacity < buffer->length + length) {
+        capacity *= 2;
+    }
+
+    u8* temp = (u8*) realloc(buffer->data, sizeof(u8) * capacity);
+    if (!temp) { return false; }
+
+    buffer->data = temp;
+    buffer->capacity = capacity;
+    return true;
+}